@@ -1477,10 +1477,70 @@ void h2o_file_register_configurator(h2o_globalconf_t *conf);
 void h2o_tile_register_configurator(h2o_globalconf_t *conf);
  #ifdef H2O_TILE_PROXY
 typedef struct st_h2o_tile_proxy_handler_t h2o_tile_proxy_handler_t;
-h2o_tile_proxy_handler_t *h2o_tile_proxy_register(h2o_pathconf_t *pathconf, const char *base_path, const char *proxy);
+typedef enum en_h2o_tile_proxy_balance_t {
+    H2O_TILE_PROXY_BALANCE_LEAST_OUTSTANDING, /* the upstream with the fewest requests in flight */
+    H2O_TILE_PROXY_BALANCE_LATENCY            /* ... weighted by its EWMA of the response time */
+} h2o_tile_proxy_balance_t;
+typedef struct st_h2o_tile_proxy_config_vars_t {
+    uint64_t io_timeout;        /* in milliseconds */
+    uint64_t keepalive_timeout; /* in milliseconds; set to zero to disable keepalive */
+    h2o_tile_proxy_balance_t balance;
+    unsigned max_fails;         /* consecutive 5xx (incl. timeouts & connection failures) to eject an upstream */
+    uint64_t fail_timeout;      /* in milliseconds; how long an upstream stays ejected */
+    uint64_t cache_size;        /* in bytes; max. size of the tiles stored (cf. tile-disk-cache.h), 0 for unbounded */
+    uint64_t ttl[21];           /* in seconds, per zoom (0 - 20); a tile stored longer is revalidated, 0 to keep it as is */
+    struct {
+        const char *host; /* of the memcached shared by the proxies, as the 2nd level (cf. tile-proxy.c); NULL to disable */
+        uint16_t port;
+        size_t num_threads;
+        const char *prefix;
+        uint32_t expiration; /* in seconds; 0 to use ttl of the zoom (or to let memcached evict the tiles, lacking it) */
+    } memcached;
+    struct {
+        const char **urls; /* of the proxies in the group sharing their disks (cf. tile-proxy.c), incl. this; NULL if alone */
+        size_t num_urls;
+        const char *self; /* of this proxy, one of urls */
+    } peers;
+} h2o_tile_proxy_config_vars_t;
+/**
+ * registers the tile proxy, which serves the tiles under base_path, and fetches (& stores) the missing ones from the
+ * upstreams (URLs), balanced as configured
+ */
+h2o_tile_proxy_handler_t *h2o_tile_proxy_register(h2o_pathconf_t *pathconf, const char *base_path, const char **upstreams,
+                                                  size_t num_upstreams, h2o_tile_proxy_config_vars_t *config);
  #else
 typedef struct st_h2o_tile_handler_t h2o_tile_handler_t;
-h2o_tile_handler_t *h2o_tile_register(h2o_pathconf_t *pathconf, const char *base_path, const char* style_file_path);
+typedef struct st_h2o_tile_config_vars_t {
+    uint64_t render_timeout;   /* in milliseconds; set to zero to wait for the renderer indefinitely */
+    uint64_t fallback_max_age; /* in seconds; max-age of a stale or upscaled tile sent in place of a late render */
+    int negotiate_webp;        /* whether to answer .png requests in webp to the clients that accept it */
+    unsigned push_neighbors;   /* max. number of neighboring tiles at hand to push (or hint to preload), 0 to disable */
+    const char *url_template;  /* URL scheme of the tiles (cf. tile-url-template.h), NULL for the default */
+    size_t max_renders;        /* max. number of concurrent renders per style, 0 for unlimited */
+    int expire_on_style_change; /* whether the tiles older than the style file (as last loaded) are stale */
+    struct {
+        int enabled;
+        unsigned min_zoom, max_zoom;
+        double bbox[4]; /* lon1, lat1, lon2, lat2 */
+    } prerender; /* missing tiles to be seeded in the background */
+    struct {
+        int from_style;     /* use the maximum-extent of the style */
+        double *polygon;    /* or a polygon of num_points (lon, lat) pairs */
+        size_t num_points;
+    } coverage; /* tiles out of it are answered by a blank tile; disabled if neither is set */
+    struct {
+        const char *path; /* of the file shared by the processes (cf. tile-hot-cache.h), e.g. on /dev/shm; NULL to disable */
+        uint64_t size;    /* in bytes */
+        uint64_t max_age; /* in seconds; how long a tile is served from it w/o looking into the disk, 0 for as long as cached */
+    } hot_cache;
+} h2o_tile_config_vars_t;
+typedef struct st_h2o_tile_style_config_t {
+    const char *name;      /* what {style} matches, and the subdirectory of the tiles; NULL for the tiles right under base_path */
+    const char *file_path; /* path to a Mapnik's style file */
+    size_t max_renders;    /* overrides h2o_tile_config_vars_t::max_renders if non-zero */
+} h2o_tile_style_config_t;
+h2o_tile_handler_t *h2o_tile_register(h2o_pathconf_t *pathconf, const char *base_path, h2o_tile_style_config_t *styles,
+                                      size_t num_styles, h2o_tile_config_vars_t *config);
  #endif
 #endif
 
@@ -60,7 +60,13 @@ h2o_filecache_t *h2o_filecache_create(size_t capacity);
 void h2o_filecache_destroy(h2o_filecache_t *cache);
 void h2o_filecache_clear(h2o_filecache_t *cache);
 
+typedef int (*h2o_filecache_open_cb)(const char *path, int oflag);
+
 h2o_filecache_ref_t *h2o_filecache_open_file(h2o_filecache_t *cache, const char *path, int oflag);
+/**
+ * same as h2o_filecache_open_file, but opens the file (if not cached) by open_cb instead of open(2)
+ */
+h2o_filecache_ref_t *h2o_filecache_open_file_by(h2o_filecache_t *cache, const char *path, int oflag, h2o_filecache_open_cb open_cb);
 void h2o_filecache_close_file(h2o_filecache_ref_t *ref);
 struct tm *h2o_filecache_get_last_modified(h2o_filecache_ref_t *ref, char *outbuf);
 size_t h2o_filecache_get_etag(h2o_filecache_ref_t *ref, char *outbuf);
@@ -28,6 +28,7 @@
 
 #define H2O_MEMCACHED_ENCODE_KEY 0x1
 #define H2O_MEMCACHED_ENCODE_VALUE 0x2
+#define H2O_MEMCACHED_MOVE_VALUE 0x4 /* the callback of a get takes the value, to be freed by free(3) */
 
 typedef struct st_h2o_memcached_context_t h2o_memcached_context_t;
 typedef struct st_h2o_memcached_req_t h2o_memcached_req_t;
@@ -1,21 +1,116 @@
 #ifndef MAPNIK_BRIDGE_H
 #define MAPNIK_BRIDGE_H
 
+#include <time.h>
+#include "path-mapper.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* implemented by mapnik-bridge.cpp, or by the synthetic mapnik-stub.c if built with -DWITH_MAPNIK=OFF */
 #define MAPNIK_MAP_PTR void*
 void init_mapnik_datasource(const char* datasource);
+/*
+Reads a style, to be parsed later by load_mapnik_async() or by the first use (which blocks until parsed); the map is
+shared (refcounted) among the callers of the same style (by its contents), and is released by dispose_mapnik().
+N.B. Mapnik pools the connections to PostGIS by the connection parameters (host, port, dbname, user, ...), so the styles
+over the same database share a pool as long as they declare the same parameters.
+*/
 MAPNIK_MAP_PTR alloc_mapnik(const char* style_path);
-void dispose_mapnik(void* m);
+/*
+Parses the style on a thread of its own (unless already done), and calls cb(data) on that thread once parsed.
+*/
+void load_mapnik_async(MAPNIK_MAP_PTR map, void (*cb)(void*), void* data);
+/*
+Reloads the styles whose files have been modified since (re)loaded, or all of them if forced, on a thread of their own.
+The new map replaces the old atomically once parsed; the renders in flight finish on the old one. A style failing to
+parse keeps the old map.
+*/
+/* the interval (in seconds) to check the style files for modification, 0 to disable; set by "mapnik-style-watch" */
+extern unsigned mapnik_style_watch_interval;
+/* forces reloading all the styles; async-signal-safe (called on SIGUSR1) */
+void reload_mapnik_styles(void);
+/*
+The png tiles are encoded by tile-png.h (unless mapnik_png_builtin is cleared by "mapnik-png-encoder: mapnik"), deflated
+at the zlib level of their zoom, set by "mapnik-png-compression" (0 for TILE_PNG_DEFAULT_LEVEL).
+*/
+extern int mapnik_png_compression[TILE_MAX_ZOOM + 1];
+extern int mapnik_png_builtin;
+/* the (canonical) path to the style file */
+const char* get_map_path(MAPNIK_MAP_PTR map);
+/* the mtime of the style file the current map was parsed from */
+time_t get_map_mtime(MAPNIK_MAP_PTR map);
+/*
+Waits for the loads in flight, and releases the map.
+*/
+void dispose_mapnik(MAPNIK_MAP_PTR m);
+/*
+Starts looking for the fonts (*.ttf) under font_dir in the background; they are registered by the first parse of a style.
+*/
 void load_fonts(const char *font_dir);
 
-typedef void (*tile_rendered_callback)(h2o_req_t *req, const char* content, size_t content_length, const char* physical_tile_path, const char* mime_type, size_t mime_type_len, int flags);
-void render_tile(h2o_req_t* req, MAPNIK_MAP_PTR map, const char* tile_path, uint32_t zoom, uint32_t x, uint32_t y, const char* mime_type, size_t mime_type_len, int flags, tile_rendered_callback callback);
+/* scale 1 or 2 (@2x), times suffix */
+#define TILE_NUM_CONTENTS (2 * TILE_NUM_SUFFIXES)
+#define TILE_CONTENT_INDEX(scale, suffix) (((scale)-1) * TILE_NUM_SUFFIXES + (suffix))
+#define TILE_FORMAT_BIT(scale, suffix) (1u << TILE_CONTENT_INDEX(scale, suffix))
+#define TILE_FORMATS_OF_SCALE(scale) (((1u << TILE_NUM_SUFFIXES) - 1) << TILE_CONTENT_INDEX(scale, 0))
+/*
+Renders the tile (zoom, x, y) once, and encodes it in each of the formats (a set of TILE_FORMAT_BIT(scale, suffix))
+into contents[TILE_CONTENT_INDEX(scale, suffix)] (malloc'ed, to be free'd by the caller); the entries for the formats
+must be zero-initialized. If any @2x format is requested, the pass is made at the scale factor 2, and the 1x tiles are
+downsampled from it.
+Thread-safe; called by render threads, NOT on the event loop.
+Returns 0 on success, or -1 with a message in errbuf.
+*/
+int render_tile(MAPNIK_MAP_PTR map, uint32_t zoom, uint32_t x, uint32_t y, unsigned formats, h2o_iovec_t* contents, char* errbuf, size_t errbuf_len);
+/*
+What renders the tiles for the render threads: Mapnik in-process by render_tile() (tile_renderer_mapnik, the default),
+the worker processes (cf. render-worker.h), or the remote render daemons (cf. render-remote.h).
+A renderer is given a batch of the tiles of a map within a metatile (TILE_METATILE x TILE_METATILE tiles of a zoom),
+up to its max_batch; it may render them at once, or one by one.
+*/
+#define TILE_METATILE 8
+typedef struct st_tile_render_request_t {
+    uint32_t zoom, x, y;
+    unsigned formats;                        /* cf. render_tile() */
+    h2o_iovec_t contents[TILE_NUM_CONTENTS]; /* out; zero-initialized by the caller */
+    int ret;                                 /* out; 0 on success, or -1 with a message in errstr */
+    char errstr[256];
+} tile_render_request_t;
+typedef struct st_tile_renderer_t {
+    void (*render)(MAPNIK_MAP_PTR map, tile_render_request_t* reqs, size_t num_reqs);
+    size_t max_batch;
+    int owns_contents; /* if set, the contents are valid until the next call by the thread; otherwise malloc'ed */
+} tile_renderer_t;
+extern const tile_renderer_t tile_renderer_mapnik;
+/*
+Atomically writes a tile to tile_path (via a tmp file + rename(2)), creating parent directories as needed.
+The etag (if not NULL) is persisted along with the tile, cf. tile-etag.h.
+Returns 0 on success, or -1 (errors are logged to stderr).
+*/
+int save_tile(const char* tile_path, const char* data, size_t len, const char* etag);
+/*
+Builds a substitute for the tile (zoom, x, y) at scale (1 or 2) by upscaling the nearest 1x ancestor found on disk
+under base_path, searching up to max_levels zooms above, encoded in the format of suffix.
+Thread-safe; called by the fallback thread of the render queue (cf. render-queue.h), NOT on the event loop.
+Returns 0 with *content (malloc'ed) on success, or -1 if no ancestor is available.
+*/
+int render_fallback_tile(const char* base_path, size_t base_path_len, uint32_t zoom, uint32_t x, uint32_t y, uint32_t scale, enum TILE_SUFFIX suffix, uint32_t max_levels, h2o_iovec_t* content);
+/*
+Renders a png tile at scale (1 or 2) of the style's background alone (i.e. what the tiles out of the data look like)
+into *content (malloc'ed).
+Returns 0 on success, or -1 with a message in errbuf.
+*/
+int render_blank_tile(MAPNIK_MAP_PTR map, uint32_t scale, h2o_iovec_t* content, char* errbuf, size_t errbuf_len);
+/*
+Stores the maximum-extent of the style into lonlat_box as {lon1, lat1, lon2, lat2} (north-west, south-east).
+Returns -1 if the style doesn't declare one.
+*/
+int get_map_extent(MAPNIK_MAP_PTR map, double* lonlat_box);
 
 #ifdef __cplusplus
 }
 #endif
 
-#endif
\ No newline at end of file
+#endif
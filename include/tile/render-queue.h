@@ -0,0 +1,147 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include "h2o.h"
+#include "h2o/multithread.h"
+#include "tile/mapnik-bridge.h"
+#include "path-mapper.h"
+#include "tile/tile-etag.h"
+#include "tile/tile-coverage.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Renders are run off the event loop by a pool of render threads, in the same fashion as lib/common/hostinfo.c does
+for getaddrinfo(3):
+  - the event loop enqueues a job by tile_render_dispatch(), and returns immediately,
+  - a render thread picks it up, renders & encodes the tile, persists it by save_tile(), and
+  - the result is sent back to the loop (that owns the receiver) through h2o_multithread_send_message().
+The requester may detach itself from a job by tile_render_detach() at any time on the loop thread, e.g. when the
+client has gone away or a substitute has been sent:
+  - a queued job is either dropped, or kept to be run (only when no one is waiting for other tiles) just to persist it,
+  - a running job cannot be stopped halfway; it is demoted to "persist only", i.e. saved but not sent back.
+The substitutes of the tiles late to render (upscaled ancestors, cf. render_fallback_tile()) are built off the loop
+as well, by fallback jobs (see tile_render_dispatch_fallback()), which are sent back the same way.
+
+Jobs are scheduled by their classes (see tile_render_class_t), either in the strict priority order or in the
+weighted fair manner, subject to the per-class and per-zoom concurrency limits of tile_render_scheduler_config, as well
+as to the quota of the style (if any), so that the styles served by a process share the same pool of threads.
+A thread takes the runnable jobs of the same map & metatile along with the one picked, as many as the renderer (see
+tile_renderer_t) accepts at once.
+Bulk seeding (i.e. what yield-tiles does offline) is fed lazily into the lowest class from the ranges registered
+by tile_render_add_prerender(), so that it never holds more threads than allowed.
+*/
+typedef struct st_tile_render_job_t tile_render_job_t;
+typedef void (*tile_render_job_cb)(tile_render_job_t *job);
+
+typedef enum en_tile_render_class_t {
+    TILE_RENDER_CLASS_INTERACTIVE, /* a client is waiting for the tile */
+    TILE_RENDER_CLASS_REVALIDATE,  /* re-rendering of a tile whose stale copy or substitute has been sent */
+    TILE_RENDER_CLASS_PRERENDER,   /* bulk seeding */
+    TILE_RENDER_NUM_CLASSES
+} tile_render_class_t;
+
+typedef enum en_tile_render_policy_t {
+    TILE_RENDER_POLICY_STRICT,  /* a class is served only when no higher class has a runnable job */
+    TILE_RENDER_POLICY_WEIGHTED /* the classes share the threads in proportion to their weights */
+} tile_render_policy_t;
+
+typedef struct st_tile_render_scheduler_config_t {
+    tile_render_policy_t policy;
+    unsigned weights[TILE_RENDER_NUM_CLASSES];
+    size_t prerender_threads;              /* max. number of threads seeding at the same time */
+    size_t zoom_limits[TILE_MAX_ZOOM + 1]; /* max. number of concurrent renders per zoom, 0 for unlimited */
+} tile_render_scheduler_config_t;
+
+typedef struct st_tile_prerender_t tile_prerender_t;
+
+/* a cap of concurrent renders shared by the jobs pointing to it, e.g. those of a style */
+typedef struct st_tile_render_quota_t {
+    size_t limit; /* 0 for unlimited */
+    size_t num_running; /* guarded by the queue's mutex */
+} tile_render_quota_t;
+
+enum en_tile_render_job_state_t { TILE_RENDER_JOB_QUEUED, TILE_RENDER_JOB_RUNNING, TILE_RENDER_JOB_DONE };
+
+struct st_tile_render_job_t {
+    /* input */
+    MAPNIK_MAP_PTR map;
+    uint32_t zoom, x, y;
+    uint32_t scale;          /* 1, or 2 for @2x */
+    enum TILE_SUFFIX suffix; /* the format to respond with */
+    char *tile_path;         /* physical path to persist the tile, NUL-terminated */
+    tile_render_quota_t *quota; /* NULL by default; to be set before dispatched */
+    time_t stale_before;        /* the variants modified at or before this are re-rendered; TILE_STALE_MTIME by default */
+    uint32_t fallback_levels;   /* of a fallback job, the max. number of zooms to look up for an ancestor */
+    size_t base_path_len;       /* of a fallback job, the length of the base path tile_path starts with */
+    /* output */
+    h2o_iovec_t content; /* encoded tile, malloc'ed; NULL on failure */
+    char etag[TILE_ETAG_LEN + 1];
+    char errstr[256];
+    /* completion callback, called on the loop that owns the receiver unless detached */
+    tile_render_job_cb cb;
+    void *data;
+    /* internal */
+    h2o_multithread_receiver_t *_receiver;
+    h2o_linklist_t _pending;
+    h2o_multithread_message_t _message;
+    /* guarded by the queue's mutex */
+    enum en_tile_render_job_state_t _state;
+    tile_render_class_t _class;
+    int _persist_only;
+};
+
+/* the max. number of render threads, set by "mapnik-render-threads" */
+extern size_t tile_render_max_threads;
+/* set by "mapnik-render-policy", "mapnik-render-weights", "mapnik-prerender-threads" and "mapnik-render-zoom-limits" */
+extern tile_render_scheduler_config_t tile_render_scheduler_config;
+/* tile_renderer_mapnik by default; set by "mapnik-render-processes" or "mapnik-render-daemons" */
+extern const tile_renderer_t *tile_renderer;
+
+/**
+ * creates a render job for the tile (zoom, x, y) at scale (1 or 2) in the format of suffix, to be saved at tile_path;
+ * the 1x png variant (the source of substitutes), as well as the 1x one of a @2x tile, is saved alongside from the same
+ * pass if missing or stale
+ */
+tile_render_job_t *tile_render_job_create(h2o_multithread_receiver_t *receiver, MAPNIK_MAP_PTR map, uint32_t zoom, uint32_t x,
+                                          uint32_t y, uint32_t scale, enum TILE_SUFFIX suffix, const char *tile_path,
+                                          tile_render_job_cb cb, void *data);
+/**
+ * queues the job in the given class
+ */
+void tile_render_dispatch(tile_render_job_t *job, tile_render_class_t cls);
+/**
+ * queues the job as a fallback job, which builds a substitute for the tile into content, out of its nearest ancestor
+ * found under the first base_path_len bytes of tile_path, up to max_levels zooms above (content is NULL if none); it
+ * is run by a thread of its own, ahead of the renders that the threads of the pool may be stuck with
+ */
+void tile_render_dispatch_fallback(tile_render_job_t *job, size_t base_path_len, uint32_t max_levels);
+/**
+ * detaches the requester from the job; cb is never called afterwards
+ * @param persist whether a queued job should still be run to persist the tile (otherwise dropped); ignored by a fallback
+ *                job, which has nothing to persist
+ */
+void tile_render_detach(tile_render_job_t *job, int persist);
+/**
+ * registers the tiles of zoom [min_zoom, max_zoom] within the bbox (lon1, lat1) - (lon2, lat2) to be seeded, if missing
+ * @param coverage NULL, or where the coverage of the style is set (once the map is loaded); the tiles out of it are skipped
+ */
+void tile_render_add_prerender(MAPNIK_MAP_PTR map, tile_render_quota_t *quota, tile_coverage_t *const *coverage,
+                               const char *base_path, size_t base_path_len, uint32_t min_zoom, uint32_t max_zoom, double lon1,
+                               double lat1, double lon2, double lat2);
+/**
+ * starts seeding the registered ranges; to be called once the server is up (i.e. threads survive)
+ */
+void tile_render_start_prerender(void);
+/**
+ * receives the rendered jobs and calls back (to be registered to h2o_context_t::queue)
+ */
+void tile_render_receiver(h2o_multithread_receiver_t *receiver, h2o_linklist_t *messages);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef RENDER_REMOTE_H
+#define RENDER_REMOTE_H
+
+#include <stdint.h>
+#include "h2o.h"
+#include "tile/mapnik-bridge.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Renders may be delegated to a pool of render daemons ("mapnik-render-daemons"), so that the rendering tier scales apart
+from the serving one. A daemon is h2o-tile run in the render-daemon mode (see tile_render_daemon_main()), listening on
+a unix socket or TCP, and speaks a protocol in the fashion of mod_tile's renderd: fixed-size binary requests naming the
+style (by the basename of its file w/o the extension, like renderd's xmlname) and the tile, answered by the encoded
+contents, in order.
+  - Each render thread keeps a connection to a daemon, and pipelines the tiles of a metatile over it at once.
+  - A daemon serves as many connections as its --max-connections, and answers BUSY to the rest (back-pressure);
+    the thread then moves on to the next daemon, as it does when a daemon fails.
+  - A daemon that keeps the thread waiting for longer than tile_render_remote_timeout (in connecting, sending, or
+    rendering a tile), or that answers a response not matching the request, counts as failed: the connection is
+    closed, and the tiles are rendered all over again by the next daemon.
+*/
+#define TILE_REMOTE_PROTO_VERSION 1
+#define TILE_REMOTE_STYLE_MAXLEN 64
+
+enum en_tile_remote_cmd_t {
+    TILE_REMOTE_CMD_RENDER = 1, /* request */
+    TILE_REMOTE_CMD_DONE,       /* followed by the contents */
+    TILE_REMOTE_CMD_NOT_DONE,   /* with errstr */
+    TILE_REMOTE_CMD_BUSY        /* the connection is closed right after */
+};
+
+/* all in the network byte order */
+typedef struct st_tile_remote_request_t {
+    uint32_t ver, cmd;
+    uint32_t zoom, x, y;
+    uint32_t formats;
+    char style[TILE_REMOTE_STYLE_MAXLEN]; /* NUL-terminated */
+} tile_remote_request_t;
+
+typedef struct st_tile_remote_response_t {
+    uint32_t ver, cmd;
+    uint32_t zoom, x, y;
+    uint32_t lengths[TILE_NUM_CONTENTS]; /* the contents follow in the order of the index */
+    char errstr[256];
+} tile_remote_response_t;
+
+/* the seconds a daemon may keep the thread waiting, 0 for no limit; set by "mapnik-render-daemon-timeout" */
+extern unsigned tile_render_remote_timeout;
+/* the renderer by the daemons; max_batch is a metatile */
+extern const tile_renderer_t tile_renderer_remote;
+
+/**
+ * adds a daemon at addr, either "unix:/path/to/socket" or "host:port"
+ * @return 0 if successful, or -1 if addr is malformed
+ */
+int tile_render_remote_add_daemon(const char *addr);
+/**
+ * the entry point of a daemon, i.e. h2o-tile --render-daemon --listen addr --style [name=]path ... [--datasource dir]
+ * [--fonts dir ...] [--max-connections n] [--style-watch seconds] [--png-encoder builtin|mapnik]
+ * [--png-compression zoom[-zoom]=level ...]
+ */
+int tile_render_daemon_main(int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
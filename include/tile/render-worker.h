@@ -0,0 +1,53 @@
+#ifndef RENDER_WORKER_H
+#define RENDER_WORKER_H
+
+#include <stdint.h>
+#include <signal.h>
+#include "h2o.h"
+#include "tile/mapnik-bridge.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Renders may be run out of the server process ("mapnik-render-processes: ON"), so that a crash or a memory blowup of
+Mapnik (e.g. in a datasource plugin) takes down a worker, not the server. Each render thread owns a worker process,
+a fresh h2o executed in the render-worker mode (forking the threaded server isn't safe), and talks to it over a unix
+socket in the fashion of deps/neverbleed:
+  - a request carries the path to the style, the tile and the formats to render,
+  - the worker renders & encodes the tile into a shared memory (memfd) mapped by both, and answers the offsets and
+    lengths of the contents,
+  - the thread persists the tiles right out of the shared memory, copying only the one to respond with.
+A worker found dead, or taking longer than tile_render_worker_timeout to answer, is killed, reaped and respawned by its
+thread; the job at hand fails. A worker is limited in its address space (RLIMIT_AS) as well, so that a blowup fails the
+render at hand rather than the host.
+*/
+
+/* the seconds a worker may take to render a tile, 0 for no limit; set by "mapnik-render-process-timeout" */
+extern unsigned tile_render_worker_timeout;
+/* the address space of a worker in megabytes, 0 for no limit; set by "mapnik-render-process-memory" */
+extern size_t tile_render_worker_memory_limit;
+
+/* the renderer by the workers; the contents point into the shared memory */
+extern const tile_renderer_t tile_renderer_process;
+
+/**
+ * records what the workers are to be initialized with, i.e. the same as the server's "mapnik-datasource" & "mapnik-fonts";
+ * to be called once the configuration is loaded
+ */
+void tile_render_worker_setup(const char *datasource, const char **font_dirs, size_t num_font_dirs);
+/**
+ * sends the signal to the workers alive; async-signal-safe
+ */
+void tile_render_worker_kill(int signo);
+/**
+ * the entry point of a worker process, i.e. h2o --render-worker ...
+ */
+int tile_render_worker_main(int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
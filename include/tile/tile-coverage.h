@@ -0,0 +1,38 @@
+#ifndef TILE_COVERAGE_H
+#define TILE_COVERAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+A coverage is the set of tiles that may have any data to render, i.e. the others are known to be blank.
+It is a per-zoom bitmap of the tiles up to TILE_COVERAGE_MAX_ZOOM (1024x1024 bits, or 128KB, at the finest),
+built once at startup by rasterizing a polygon; a tile of a higher zoom is covered iff its ancestor at
+TILE_COVERAGE_MAX_ZOOM is. The test is conservative: a tile partially covered is covered.
+*/
+#define TILE_COVERAGE_MAX_ZOOM 10
+
+typedef struct st_tile_coverage_t tile_coverage_t;
+
+/**
+ * creates a coverage of the polygon given as num_points pairs of (lon, lat)
+ */
+tile_coverage_t *tile_coverage_create(const double *lonlat, size_t num_points);
+/**
+ * disposes the coverage
+ */
+void tile_coverage_destroy(tile_coverage_t *coverage);
+/**
+ * tests if the tile (zoom, x, y) is covered
+ */
+int tile_coverage_contains(const tile_coverage_t *coverage, uint32_t zoom, uint32_t x, uint32_t y);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef TILE_DIRFD_CACHE_H
+#define TILE_DIRFD_CACHE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+The tiles live 6 directories deep (cf. to_physical_path_scaled()), so that each open(2) of a tile walks 7 components
+(plus the base path) in the kernel, and each save used to mkdir(2) every one of them (mostly failing by EEXIST).
+Instead, each thread keeps an LRU of the fds of the directories (up to TILE_DIRFD_CACHE_CAPACITY), and the tiles are
+opened, stat'ed, renamed & unlinked by the *at(2) calls relative to their directories; the missing directories are
+created by mkdirat(2), relative to the nearest one at hand.
+A directory removed behind the cache (e.g. by hand) is noticed by st_nlink == 0 on ENOENT, reopened & retried once.
+The paths are absolute or relative to the cwd, as of open(2); those w/o a slash are just passed to the plain calls.
+*/
+#define TILE_DIRFD_CACHE_CAPACITY 256
+
+/**
+ * as open(2); the missing directories are created if oflag has O_CREAT
+ */
+int tile_dirfd_open(const char *path, int oflag, mode_t mode);
+/**
+ * as stat(2)
+ */
+int tile_dirfd_stat(const char *path, struct stat *st);
+/**
+ * as rename(2)
+ */
+int tile_dirfd_rename(const char *from, const char *to);
+/**
+ * as unlink(2)
+ */
+int tile_dirfd_unlink(const char *path);
+/**
+ * closes the fds cached by the calling thread
+ */
+void tile_dirfd_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
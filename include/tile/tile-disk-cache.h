@@ -0,0 +1,50 @@
+#ifndef TILE_DISK_CACHE_H
+#define TILE_DISK_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "path-mapper.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+A disk cache bounds the bytes of the tiles stored under a directory (cf. to_physical_path_scaled()) by evicting the
+cold ones. It indexes the tiles in memory by (zoom, x, y, scale, suffix) with their sizes (in blocks on disk) & the
+times of their last accesses, kept up to date by the callers on every store & hit.
+  - The index is rebuilt at start by walking the directory in the background, a thread per zoom; the evictions wait
+    for the walk to end, while the tiles are served meanwhile.
+  - An evictor thread checks the total once a second (or on being over it): it evicts the least recently accessed
+    tiles (the larger first among the ones accessed in the same minute) down to 95% of the capacity, unlinking them
+    by directory (openat(2) once, then unlinkat(2) for each). LRU is approximated by passes over samples of the
+    index (windows sweeping over it), each evicting the coldest of its sample, with a pause in between; so the cost of
+    a pass is bounded whatever the number of the tiles.
+Thread-safe.
+*/
+typedef struct st_tile_disk_cache_t tile_disk_cache_t;
+
+/**
+ * creates a cache of the tiles under base_path (with a trailing slash), holding up to capacity bytes
+ */
+tile_disk_cache_t *tile_disk_cache_create(const char *base_path, uint64_t capacity);
+/**
+ * starts indexing & evicting on threads of their own (unless started); to be called once daemonized
+ */
+void tile_disk_cache_start(tile_disk_cache_t *cache);
+/**
+ * records a tile of size bytes stored (or replaced)
+ */
+void tile_disk_cache_add(tile_disk_cache_t *cache, uint32_t zoom, uint32_t x, uint32_t y, uint32_t scale, enum TILE_SUFFIX suffix,
+                         uint64_t size);
+/**
+ * records an access to the tile
+ */
+void tile_disk_cache_touch(tile_disk_cache_t *cache, uint32_t zoom, uint32_t x, uint32_t y, uint32_t scale,
+                           enum TILE_SUFFIX suffix);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef TILE_ETAG_H
+#define TILE_ETAG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Tiles are validated by a hash of their contents, rather than by mtime & size as h2o does for static files:
+the same bytes get the same ETag whenever, and on whichever node, they are rendered.
+The hash is XXH64 (https://github.com/Cyan4973/xxHash), computed once at render time and persisted with the tile
+as an extended attribute, so that disk hits don't have to read the whole file.
+*/
+#define TILE_ETAG_XATTR "user.h2o.etag"
+#define TILE_ETAG_LEN (sizeof("\"deadbeefdeadbeef\"") - 1)
+
+#define TILE_XXH_PRIME64_1 11400714785074694791ULL
+#define TILE_XXH_PRIME64_2 14029467366897019727ULL
+#define TILE_XXH_PRIME64_3 1609587929392839161ULL
+#define TILE_XXH_PRIME64_4 9650029242287828579ULL
+#define TILE_XXH_PRIME64_5 2870177450012600261ULL
+
+static inline uint64_t tile_xxh_rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t tile_xxh_read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v)); /* little-endian hosts only, as are the tile servers we know */
+    return v;
+}
+
+static inline uint32_t tile_xxh_read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t tile_xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * TILE_XXH_PRIME64_2;
+    acc = tile_xxh_rotl64(acc, 31);
+    return acc * TILE_XXH_PRIME64_1;
+}
+
+static inline uint64_t tile_xxh_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= tile_xxh_round(0, val);
+    return acc * TILE_XXH_PRIME64_1 + TILE_XXH_PRIME64_4;
+}
+
+static inline uint64_t tile_xxh64(const void *input, size_t len, uint64_t seed)
+{
+    const unsigned char *p = (const unsigned char *)input, *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        const unsigned char *limit = end - 32;
+        uint64_t v1 = seed + TILE_XXH_PRIME64_1 + TILE_XXH_PRIME64_2, v2 = seed + TILE_XXH_PRIME64_2, v3 = seed,
+                 v4 = seed - TILE_XXH_PRIME64_1;
+        do {
+            v1 = tile_xxh_round(v1, tile_xxh_read64(p));
+            v2 = tile_xxh_round(v2, tile_xxh_read64(p + 8));
+            v3 = tile_xxh_round(v3, tile_xxh_read64(p + 16));
+            v4 = tile_xxh_round(v4, tile_xxh_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = tile_xxh_rotl64(v1, 1) + tile_xxh_rotl64(v2, 7) + tile_xxh_rotl64(v3, 12) + tile_xxh_rotl64(v4, 18);
+        h = tile_xxh_merge_round(h, v1);
+        h = tile_xxh_merge_round(h, v2);
+        h = tile_xxh_merge_round(h, v3);
+        h = tile_xxh_merge_round(h, v4);
+    } else {
+        h = seed + TILE_XXH_PRIME64_5;
+    }
+    h += (uint64_t)len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= tile_xxh_round(0, tile_xxh_read64(p));
+        h = tile_xxh_rotl64(h, 27) * TILE_XXH_PRIME64_1 + TILE_XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)tile_xxh_read32(p) * TILE_XXH_PRIME64_1;
+        h = tile_xxh_rotl64(h, 23) * TILE_XXH_PRIME64_2 + TILE_XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= (*p) * TILE_XXH_PRIME64_5;
+        h = tile_xxh_rotl64(h, 11) * TILE_XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= TILE_XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= TILE_XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+Writes the ETag of the tile into buf (of TILE_ETAG_LEN + 1 bytes at least), returns its length.
+*/
+static inline size_t tile_etag(char *buf, const char *content, size_t content_len)
+{
+    return sprintf(buf, "\"%016" PRIx64 "\"", tile_xxh64(content, content_len, 0));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef TILE_HOT_CACHE_H
+#define TILE_HOT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "h2o/memory.h"
+#include "path-mapper.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+A hot cache holds the recently served tiles in memory shared by the processes of h2o-tile (e.g. the generations under
+Server::Starter, or the servers started side by side): a file mmap'd by all of them, typically on tmpfs (/dev/shm), so
+that a process started later, including the one replacing another on a graceful restart, serves the warm tiles from
+the first request on.
+  - The tiles are appended to a ring (the arena) in the file, wrapping around to overwrite the oldest ones; a tile is
+    valid as long as the ring has not wrapped over it since, which the readers check before & after copying it out.
+  - The index is a table of slots (a tag & the offset in the ring each), set by compare-and-swap in a probe window of
+    the hash of the tile: neither the readers nor the writers take locks, which don't survive a crashing process anyway.
+  - The file is laid out by the first process, and attached as is by the later ones with the same size.
+Being a cache, a tile may get lost on a race among the writers, and is looked up on the disk then.
+*/
+typedef struct st_tile_hot_cache_t tile_hot_cache_t;
+
+#define TILE_HOT_CACHE_ETAG_MAXLEN 31
+
+typedef struct st_tile_hot_cache_hit_t {
+    h2o_iovec_t content; /* allocated from the pool */
+    time_t mtime;        /* of the tile on the disk, or when rendered */
+    time_t stored_at;    /* when it was cached */
+    char etag[TILE_HOT_CACHE_ETAG_MAXLEN + 1];
+    size_t etag_len;
+} tile_hot_cache_hit_t;
+
+/* the tile as (zoom:8, 2x:1, unused:1, suffix:2, unused:12, x:20, y:20), as tile-disk-cache.c keys them */
+static inline uint64_t tile_hot_cache_key(uint32_t zoom, uint32_t x, uint32_t y, uint32_t scale, enum TILE_SUFFIX suffix)
+{
+    return ((uint64_t)zoom << 56) | ((uint64_t)(scale == 2) << 55) | ((uint64_t)suffix << 52) | ((uint64_t)(x & 0xfffff) << 20) |
+           (y & 0xfffff);
+}
+
+/**
+ * attaches the cache in the file at path (of size bytes), laying it out unless laid out already with the same size
+ * @return the cache, or NULL on error (logged)
+ */
+tile_hot_cache_t *tile_hot_cache_open(const char *path, uint64_t size);
+/**
+ * looks up the tile of the key in the namespace ns (e.g. a hash of the directory of the style), copying it into pool
+ * @return 0 if found, or -1
+ */
+int tile_hot_cache_get(tile_hot_cache_t *cache, uint64_t ns, uint64_t key, h2o_mem_pool_t *pool, tile_hot_cache_hit_t *hit);
+/**
+ * stores (or replaces) the tile; ignored if too large (1/16 of the ring or more)
+ */
+void tile_hot_cache_set(tile_hot_cache_t *cache, uint64_t ns, uint64_t key, const void *content, size_t len, time_t mtime,
+                        const char *etag, size_t etag_len);
+/**
+ * same as above, but reads len bytes of the content from fd (e.g. of the tile on the disk)
+ */
+void tile_hot_cache_set_fd(tile_hot_cache_t *cache, uint64_t ns, uint64_t key, int fd, size_t len, time_t mtime,
+                           const char *etag, size_t etag_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
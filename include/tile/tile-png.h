@@ -0,0 +1,53 @@
+#ifndef TILE_PNG_H
+#define TILE_PNG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+A paletted (png256-like) PNG encoder for the rendered tiles, in place of Mapnik's save_to_string(), which quantizes &
+deflates every tile on its own. An encoder collects the colors of one or more rasters (e.g. the @2x tile & the 1x one
+downsampled from it, or all the tiles of a metatile), builds one palette out of them, and encodes each raster with it:
+  - The colors are counted exactly in a hash table; the rows are hashed in a branch-free loop (that compilers
+    vectorize), and the runs of the same color (most of a map) are counted by one probe.
+  - Up to 256 colors make the palette as is; more are reduced by a median cut weighted by the counts, and the colors
+    are mapped to their nearest entries (a vectorized scan of the palette, once per color).
+  - The palette is ordered translucent colors first, so that tRNS is as short as it can be; the pixels are packed in
+    1, 2 or 4 bits if the palette is small enough (e.g. the sea), and deflated by zlib at the level given (e.g. per
+    zoom, as the low zooms are rendered once and served many times).
+Not thread-safe; to be owned by a thread (it reuses its buffers & deflate state across tiles).
+The pixels are RGBA (R in the lowest byte of a uint32_t, as in mapnik::image_rgba8), not premultiplied.
+*/
+typedef struct st_tile_png_encoder_t tile_png_encoder_t;
+
+#define TILE_PNG_DEFAULT_LEVEL 6
+
+tile_png_encoder_t *tile_png_encoder_create(void);
+void tile_png_encoder_destroy(tile_png_encoder_t *enc);
+/**
+ * forgets the colors collected (and the palette), to start over for the next tile or metatile
+ */
+void tile_png_reset(tile_png_encoder_t *enc);
+/**
+ * collects the colors of the raster of w x h pixels, stride pixels apart row to row
+ * @return 0, or -1 on allocation failure
+ */
+int tile_png_add(tile_png_encoder_t *enc, const uint32_t *pixels, uint32_t w, uint32_t h, size_t stride);
+/**
+ * encodes the raster with the palette of the colors collected since the last reset (built by the first call), or of
+ * its own colors if none were collected; the colors not collected are mapped to the nearest ones of the palette
+ * @param level zlib's compression level (0-9)
+ * @return 0 with *out (malloc'ed) & *len, or -1 on allocation failure
+ */
+int tile_png_encode(tile_png_encoder_t *enc, const uint32_t *pixels, uint32_t w, uint32_t h, size_t stride, int level, char **out,
+                    size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,4 +1,5 @@
 #pragma once
+#include <assert.h>
 #include <ctype.h>
 #include "path-mapper.h"
 
@@ -14,29 +15,31 @@
 extern "C" {
 #endif
 
-static inline int tile_parse_path(const char* path, size_t base_len, uint32_t* pzoom, uint32_t* px, uint32_t* py, enum TILE_SUFFIX* psuffix) {
+static inline int tile_parse_path(const char* path, size_t base_len, uint32_t* pzoom, uint32_t* px, uint32_t* py, uint32_t* pscale, enum TILE_SUFFIX* psuffix) {
     /*
     rpath: abs. path to the tile, as resolved by h2o.
     */
     const char* tile_path_head = path + base_len;
     /*
-    match tile_path_head with ($zoom)/($x)/($y).(png|jpg), where:
+    match tile_path_head (NUL-terminated) with ($zoom)/($x)/($y)(@[12]x)?.(png|jpg|webp|pbf)$, where:
         $zoom  = \d{1,2}
         $x, $y = \d{1,9}
+        @2x    = the HiDPI variant, i.e. 512x512 pixels rendered with Mapnik's scale_factor 2 (@1x being the default)
     non-match will immediately return 0 (failure).
+    This must agree with the compiled TILE_URL_TEMPLATE_DEFAULT (cf. tile-url-template.h), which it stands for.
 
     No "overflow check" is performed, so $x, $y in [2^32 ... 9,999,999,999] will
     result in an unexpected (but still "defined") behavior.
 
-    The suffix (png|jpg) is case-sensitive & accepts lowers only.
+    The suffix (png|jpg|webp|pbf) is case-sensitive & accepts lowers only.
     I don't think any common tile clients intentionally query capital filenames.
     */
     const char* hd = tile_path_head;  // points to the next char to scan.
-    uint32_t zoom = 0, x = 0, y = 0;
+    uint32_t zoom = 0, x = 0, y = 0, scale = 1;
     enum TILE_SUFFIX suffix = PNG;
 
     /*
-    Follows a hard-coded matcher for (\d{1,2})/(\d{1,9})/(\d{1,9}).(png|jpg)
+    Follows a hard-coded matcher for (\d{1,2})/(\d{1,9})/(\d{1,9})(@[12]x)?.(png|jpg|webp|pbf)$
     */
 #define LEX_DIGIT(v) if (likely(isdigit(*hd))) {\
     v = 10*v + (*hd - '0'); \
@@ -50,6 +53,19 @@ static inline int tile_parse_path(const char* path, size_t base_len, uint32_t* p
 /*
 Let us exploit good old gotos to simulate state-transitions
 */
+#define LEX_DIGIT_OR_GOTO_ON_Y_END(v) if (likely(isdigit(*hd))) { \
+    v = 10*v + (*hd - '0'); \
+    ++hd; \
+} else if (*hd == '.') { \
+    ++hd; \
+    goto ParseSuffix; \
+} else if (*hd == '@') { \
+    ++hd; \
+    goto ParseScale; \
+} else { \
+    return 0; \
+}
+
 #define LEX_DIGIT_OR_GOTO_ON_DELIM(v, c, label) if (likely(isdigit(*hd))) { \
     v = 10*v + (*hd - '0'); \
     ++hd; \
@@ -82,23 +98,48 @@ ParseX:
 ParseY:
     /* y = hd.match \d{1,9} */
     LEX_DIGIT(y)
-    LEX_DIGIT_OR_GOTO_ON_DELIM(y, '.', ParseSuffix)
-    LEX_DIGIT_OR_GOTO_ON_DELIM(y, '.', ParseSuffix)
-    LEX_DIGIT_OR_GOTO_ON_DELIM(y, '.', ParseSuffix)
-    LEX_DIGIT_OR_GOTO_ON_DELIM(y, '.', ParseSuffix)
-    LEX_DIGIT_OR_GOTO_ON_DELIM(y, '.', ParseSuffix)
-    LEX_DIGIT_OR_GOTO_ON_DELIM(y, '.', ParseSuffix)
-    LEX_DIGIT_OR_GOTO_ON_DELIM(y, '.', ParseSuffix)
-    LEX_DIGIT_OR_GOTO_ON_DELIM(y, '.', ParseSuffix)
+    LEX_DIGIT_OR_GOTO_ON_Y_END(y)
+    LEX_DIGIT_OR_GOTO_ON_Y_END(y)
+    LEX_DIGIT_OR_GOTO_ON_Y_END(y)
+    LEX_DIGIT_OR_GOTO_ON_Y_END(y)
+    LEX_DIGIT_OR_GOTO_ON_Y_END(y)
+    LEX_DIGIT_OR_GOTO_ON_Y_END(y)
+    LEX_DIGIT_OR_GOTO_ON_Y_END(y)
+    LEX_DIGIT_OR_GOTO_ON_Y_END(y)
+    if (*hd == '@') {
+        ++hd;
+        goto ParseScale;
+    }
+    EXPECT('.')
+    goto ParseSuffix;
+ParseScale:
+    /* @2x, or @1x (the same as none) */
+    if (*hd == '1' || *hd == '2') {
+        scale = *hd - '0';
+        ++hd;
+    } else {
+        return 0;
+    }
+    EXPECT('x')
     EXPECT('.')
 ParseSuffix:
     if (likely(hd[0] == 'p' && hd[1] == 'n' && hd[2] == 'g')) {
         suffix = PNG; 
+        hd += 3;
     } else if (hd[0] == 'j' && hd[1] == 'p' && hd[2] == 'g') {
         suffix = JPG;
+        hd += 3;
+    } else if (hd[0] == 'w' && hd[1] == 'e' && hd[2] == 'b' && hd[3] == 'p') {
+        suffix = WEBP;
+        hd += 4;
+    } else if (hd[0] == 'p' && hd[1] == 'b' && hd[2] == 'f') {
+        suffix = PBF;
+        hd += 3;
     } else {
         return 0;
     }
+    /* nothing may follow, e.g. "/1/2/3.pngfoo" is not a tile */
+    EXPECT('\0')
 /* 
 Done: // <- the "final state" 
 */
@@ -111,20 +152,21 @@ Done: // <- the "final state"
     *pzoom = zoom;
     *px    = x;
     *py    = y;
+    *pscale = scale;
     *psuffix = suffix;
     /* fprintf(stderr, "***%d %d %d %d ==> %s ***\n", zoom, x, y, suffix, path_buf); */
 
     return 1;
 }
 
-static inline int tile_rewrite_path(const char* rpath, const char* base, size_t base_len, char *path_buf, size_t path_buf_len, uint32_t* pzoom, uint32_t* px, uint32_t* py) {
-    enum TILE_SUFFIX suffix = PNG;
-    assert(path_buf_len >= base_len + 27);
-    if (unlikely( !tile_parse_path(rpath, base_len, pzoom, px, py, &suffix) )) {
+/* the scale & suffix parsed are returned as well, telling the variant (e.g. to account it to tile-disk-cache) */
+static inline int tile_rewrite_path(const char* rpath, const char* base, size_t base_len, char *path_buf, size_t path_buf_len, uint32_t* pzoom, uint32_t* px, uint32_t* py, uint32_t* pscale, enum TILE_SUFFIX* psuffix) {
+    assert(path_buf_len >= base_len + TILE_PHYSPATH_BUFLEN);
+    if (unlikely( !tile_parse_path(rpath, base_len, pzoom, px, py, pscale, psuffix) )) {
         return 0;
     } 
     memcpy(path_buf, base, base_len);
-    to_physical_path(path_buf + base_len, *pzoom, *px, *py, suffix);
+    to_physical_path_scaled(path_buf + base_len, *pzoom, *px, *py, *pscale, *psuffix);
 
     return 1;
 
@@ -0,0 +1,83 @@
+#ifndef TILE_URL_TEMPLATE_H
+#define TILE_URL_TEMPLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "path-mapper.h"
+#include "tile/tile-rewrite-path.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+URL schemes of tiles, given as templates relative to the tile path, e.g. "{z}/{x}/{y}@{scale}.{ext}" (the default), where:
+    {z}      = the zoom, \d{1,2}
+    {x}, {y} = the column & row, \d{1,9}
+    {-y}     = the row counted from the south, as TMS does
+    {q}      = the Bing quadkey, [0-3]{1,31}; stands for {z}, {x} and {y} at once
+    {style}  = the name of a style, [^/]+; must be followed by a '/'
+    @{scale} = an optional "@2x" (or "@1x") for HiDPI
+    {ext}    = png|jpg|webp|pbf; the tile is taken as png without it
+and the others are matched literally.
+
+A template is compiled into either a specialized matcher (the default scheme is matched by the hand-written
+tile_parse_path(), inlined), or a table of ops run by a generic one. Either way, matching allocates nothing.
+*/
+typedef struct st_tile_url_match_t {
+    uint32_t zoom, x, y, scale;
+    enum TILE_SUFFIX suffix;
+    const char *style; /* points into the matched path, NULL if the template has no {style} */
+    size_t style_len;
+} tile_url_match_t;
+
+typedef struct st_tile_url_template_t tile_url_template_t;
+struct st_tile_url_template_t {
+    /* NULL for the default scheme */
+    int (*match)(const tile_url_template_t *t, const char *path, tile_url_match_t *m);
+};
+
+#define TILE_URL_TEMPLATE_DEFAULT "{z}/{x}/{y}@{scale}.{ext}"
+
+/**
+ * compiles the template
+ * @return the compiled template, or NULL with a message in errbuf
+ */
+tile_url_template_t *tile_url_template_compile(const char *tmpl, char *errbuf, size_t errbuf_len);
+/**
+ * disposes the compiled template
+ */
+void tile_url_template_destroy(tile_url_template_t *t);
+/**
+ * matches a NUL-terminated path (relative to the tile path) against the template
+ * @return 1 if matched (with the result stored to *m), or 0
+ */
+static int tile_url_template_match(const tile_url_template_t *t, const char *path, tile_url_match_t *m);
+/**
+ * the max. length of the URLs built by tile_url_template_format(), excluding the NUL terminator
+ */
+size_t tile_url_template_max_len(const tile_url_template_t *t, size_t style_len);
+/**
+ * builds the URL of a tile (the reverse of tile_url_template_match()) into buf, which must have
+ * tile_url_template_max_len() + 1 bytes at least
+ * @return the length of the URL
+ */
+size_t tile_url_template_format(const tile_url_template_t *t, char *buf, const tile_url_match_t *m);
+
+/* inline definitions */
+
+inline int tile_url_template_match(const tile_url_template_t *t, const char *path, tile_url_match_t *m)
+{
+    if (likely(t->match == NULL)) {
+        m->style = NULL;
+        m->style_len = 0;
+        return tile_parse_path(path, 0, &m->zoom, &m->x, &m->y, &m->scale, &m->suffix);
+    }
+    return t->match(t, path, m);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
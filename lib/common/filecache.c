@@ -80,7 +80,17 @@ void h2o_filecache_clear(h2o_filecache_t *cache)
     assert(kh_size(cache->hash) == 0);
 }
 
+static int open_file(const char *path, int oflag)
+{
+    return open(path, oflag);
+}
+
 h2o_filecache_ref_t *h2o_filecache_open_file(h2o_filecache_t *cache, const char *path, int oflag)
+{
+    return h2o_filecache_open_file_by(cache, path, oflag, open_file);
+}
+
+h2o_filecache_ref_t *h2o_filecache_open_file_by(h2o_filecache_t *cache, const char *path, int oflag, h2o_filecache_open_cb open_cb)
 {
     khiter_t iter = kh_get(opencache_set, cache->hash, path);
     h2o_filecache_ref_t *ref;
@@ -115,7 +125,7 @@ h2o_filecache_ref_t *h2o_filecache_open_file(h2o_filecache_t *cache, const char
     }
 
     /* open the file, or memoize the error */
-    if ((ref->fd = open(path, oflag)) != -1 && fstat(ref->fd, &ref->st) == 0) {
+    if ((ref->fd = open_cb(path, oflag)) != -1 && fstat(ref->fd, &ref->st) == 0) {
         ref->_last_modified.str[0] = '\0';
         ref->_etag.len = 0;
     } else {
@@ -58,6 +58,7 @@ struct st_h2o_memcached_req_t {
             h2o_memcached_get_cb cb;
             void *cb_data;
             int value_is_encoded;
+            int value_is_moved;
             h2o_iovec_t value;
             uint32_t serial;
         } get;
@@ -325,6 +326,8 @@ void h2o_memcached_receiver(h2o_multithread_receiver_t *receiver, h2o_linklist_t
                 req->data.get.value = decoded;
             }
             req->data.get.cb(req->data.get.value, req->data.get.cb_data);
+            if (req->data.get.value_is_moved)
+                req->data.get.value = h2o_iovec_init(NULL, 0);
         }
         free_req(req);
     }
@@ -338,6 +341,7 @@ h2o_memcached_req_t *h2o_memcached_get(h2o_memcached_context_t *ctx, h2o_multith
     req->data.get.cb = cb;
     req->data.get.cb_data = cb_data;
     req->data.get.value_is_encoded = (flags & H2O_MEMCACHED_ENCODE_VALUE) != 0;
+    req->data.get.value_is_moved = (flags & H2O_MEMCACHED_MOVE_VALUE) != 0;
     dispatch(ctx, req);
     return req;
 }
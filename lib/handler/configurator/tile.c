@@ -1,22 +1,29 @@
+#include <inttypes.h>
 #include "h2o.h"
 #include "h2o/configurator.h"
+#include "path-mapper.h"
+#if H2O_TILE && (!H2O_TILE_PROXY)
+#include "tile/tile-url-template.h"
+#endif
 
 #if H2O_TILE && (!H2O_TILE_PROXY)
-struct st_h2o_tile_config_vars_t {
+struct st_h2o_tile_configurator_vars_t {
     const char* base_path;
-    const char* style_file_path;
+    H2O_VECTOR(h2o_tile_style_config_t) styles;
+    h2o_tile_config_vars_t conf;
 };
 #else
-struct st_h2o_tile_config_vars_t {
+struct st_h2o_tile_configurator_vars_t {
     const char* base_path;
-    const char* upstream;
+    H2O_VECTOR(const char *) upstreams;
+    h2o_tile_proxy_config_vars_t conf;
 };
 #endif
 
 struct st_h2o_tile_configurator_t {
     h2o_configurator_t super;
-    struct st_h2o_tile_config_vars_t *vars;
-    struct st_h2o_tile_config_vars_t _vars_stack[H2O_CONFIGURATOR_NUM_LEVELS + 1];
+    struct st_h2o_tile_configurator_vars_t *vars;
+    struct st_h2o_tile_configurator_vars_t _vars_stack[H2O_CONFIGURATOR_NUM_LEVELS + 1];
 };
 
 static int on_config_dir(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
@@ -31,31 +38,544 @@ static int on_config_dir(h2o_configurator_command_t *cmd, h2o_configurator_conte
     return 0;
 }
 
+/* bytes, or with a unit: K, M, G or T (binary) */
+static int scan_size(h2o_configurator_command_t *cmd, yoml_t *node, uint64_t *size)
+{
+    char unit = '\0';
+
+    if (node->type != YOML_TYPE_SCALAR || sscanf(node->data.scalar, "%" SCNu64 "%c", size, &unit) < 1) {
+        h2o_configurator_errprintf(cmd, node, "%s must be a size, e.g. 100G", cmd->name);
+        return -1;
+    }
+    switch (unit) {
+    case 'T':
+        *size <<= 10;
+    /* fallthru */
+    case 'G':
+        *size <<= 10;
+    /* fallthru */
+    case 'M':
+        *size <<= 10;
+    /* fallthru */
+    case 'K':
+        *size <<= 10;
+    /* fallthru */
+    case '\0':
+        break;
+    default:
+        h2o_configurator_errprintf(cmd, node, "unit of %s must be one of: K, M, G, T", cmd->name);
+        return -1;
+    }
+    return 0;
+}
+
 #if H2O_TILE && (!H2O_TILE_PROXY)
+static h2o_tile_style_config_t *add_style(struct st_h2o_tile_configurator_t *self, const char *name, const char *file_path)
+{
+    h2o_tile_style_config_t *style;
+
+    h2o_vector_reserve(NULL, &self->vars->styles, self->vars->styles.size + 1);
+    style = self->vars->styles.entries + self->vars->styles.size++;
+    style->name = name;
+    style->file_path = file_path;
+    style->max_renders = 0;
+    return style;
+}
+
 static int on_config_style(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
 {
     struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
-    if (self->vars->style_file_path != NULL) {
-        // Only one base path can be mapped.
-        h2o_configurator_errprintf(cmd, node, "duplicate style path %s: another file %s is already specified", node->data.scalar, self->vars->style_file_path);
+    size_t i, j;
+
+    if (self->vars->styles.size != 0) {
+        h2o_configurator_errprintf(cmd, node, "duplicate tile.style: another %s is already specified",
+                                   self->vars->styles.entries[0].file_path);
+        return -1;
+    }
+
+    switch (node->type) {
+    case YOML_TYPE_SCALAR:
+        /* a style, whose tiles are right under tile.dir */
+        add_style(self, NULL, node->data.scalar);
+        break;
+    case YOML_TYPE_MAPPING:
+        /* named styles, each under tile.dir/name/: `name: path`, or `name: {file: path, max-renders: N}` */
+        for (i = 0; i != node->data.mapping.size; ++i) {
+            yoml_t *key = node->data.mapping.elements[i].key;
+            yoml_t *value = node->data.mapping.elements[i].value;
+            h2o_tile_style_config_t *style;
+            if (key->type != YOML_TYPE_SCALAR || key->data.scalar[0] == '\0' || strchr(key->data.scalar, '/') != NULL ||
+                key->data.scalar[0] == '.') {
+                h2o_configurator_errprintf(cmd, key, "name of a style must be a non-empty string without `/`, not starting with `.`");
+                return -1;
+            }
+            for (j = 0; j != self->vars->styles.size; ++j) {
+                if (strcmp(self->vars->styles.entries[j].name, key->data.scalar) == 0) {
+                    h2o_configurator_errprintf(cmd, key, "duplicate style name %s", key->data.scalar);
+                    return -1;
+                }
+            }
+            switch (value->type) {
+            case YOML_TYPE_SCALAR:
+                add_style(self, key->data.scalar, value->data.scalar);
+                break;
+            case YOML_TYPE_MAPPING:
+                style = add_style(self, key->data.scalar, NULL);
+                for (j = 0; j != value->data.mapping.size; ++j) {
+                    yoml_t *k = value->data.mapping.elements[j].key;
+                    yoml_t *v = value->data.mapping.elements[j].value;
+                    if (k->type == YOML_TYPE_SCALAR && strcmp(k->data.scalar, "file") == 0 && v->type == YOML_TYPE_SCALAR) {
+                        style->file_path = v->data.scalar;
+                    } else if (k->type == YOML_TYPE_SCALAR && strcmp(k->data.scalar, "max-renders") == 0) {
+                        if (h2o_configurator_scanf(cmd, v, "%zu", &style->max_renders) != 0)
+                            return -1;
+                    } else {
+                        h2o_configurator_errprintf(cmd, k, "key must be either of: `file`, `max-renders`");
+                        return -1;
+                    }
+                }
+                if (style->file_path == NULL) {
+                    h2o_configurator_errprintf(cmd, value, "mandatory key `file` is missing");
+                    return -1;
+                }
+                break;
+            default:
+                h2o_configurator_errprintf(cmd, value, "a style must be either a path, or a mapping of `file` & `max-renders`");
+                return -1;
+            }
+        }
+        if (self->vars->styles.size == 0) {
+            h2o_configurator_errprintf(cmd, node, "no styles are given");
+            return -1;
+        }
+        break;
+    default:
+        h2o_configurator_errprintf(cmd, node, "argument must be either a path to a style, or a mapping of named styles");
         return -1;
     }
-    self->vars->style_file_path = node->data.scalar;
 
     return 0;
 }
+
+static int on_config_expire_on_style_change(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    ssize_t ret = h2o_configurator_get_one_of(cmd, node, "OFF,ON");
+    if (ret == -1)
+        return -1;
+    self->vars->conf.expire_on_style_change = (int)ret;
+    return 0;
+}
+
+static int on_config_max_renders(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    return h2o_configurator_scanf(cmd, node, "%zu", &self->vars->conf.max_renders);
+}
+
+static int on_config_render_timeout(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    return h2o_configurator_scanf(cmd, node, "%" PRIu64, &self->vars->conf.render_timeout);
+}
+
+static int on_config_fallback_max_age(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    return h2o_configurator_scanf(cmd, node, "%" PRIu64, &self->vars->conf.fallback_max_age);
+}
+
+static int on_config_webp(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    ssize_t ret = h2o_configurator_get_one_of(cmd, node, "OFF,ON");
+    if (ret == -1)
+        return -1;
+    self->vars->conf.negotiate_webp = (int)ret;
+    return 0;
+}
+
+static int on_config_push_neighbors(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    if (h2o_configurator_scanf(cmd, node, "%u", &self->vars->conf.push_neighbors) != 0)
+        return -1;
+    if (self->vars->conf.push_neighbors > 9) {
+        h2o_configurator_errprintf(cmd, node, "a tile has 9 neighbors at most (the ring of 8, and the parent)");
+        return -1;
+    }
+    return 0;
+}
+
+static int on_config_url_template(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    tile_url_template_t *t;
+    char errbuf[256];
+
+    /* just to validate; each handler compiles its own */
+    if ((t = tile_url_template_compile(node->data.scalar, errbuf, sizeof(errbuf))) == NULL) {
+        h2o_configurator_errprintf(cmd, node, "%s", errbuf);
+        return -1;
+    }
+    tile_url_template_destroy(t);
+    self->vars->conf.url_template = node->data.scalar;
+    return 0;
+}
+
+static int on_config_prerender(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    h2o_tile_config_vars_t *conf = &self->vars->conf;
+    size_t i, j;
+
+    conf->prerender.min_zoom = 0;
+    conf->prerender.max_zoom = 0;
+    conf->prerender.bbox[0] = -180;
+    conf->prerender.bbox[1] = 90;
+    conf->prerender.bbox[2] = 180;
+    conf->prerender.bbox[3] = -90;
+    for (i = 0; i != node->data.mapping.size; ++i) {
+        yoml_t *key = node->data.mapping.elements[i].key;
+        yoml_t *value = node->data.mapping.elements[i].value;
+        if (key->type == YOML_TYPE_SCALAR && strcmp(key->data.scalar, "min-zoom") == 0) {
+            if (h2o_configurator_scanf(cmd, value, "%u", &conf->prerender.min_zoom) != 0)
+                return -1;
+        } else if (key->type == YOML_TYPE_SCALAR && strcmp(key->data.scalar, "max-zoom") == 0) {
+            if (h2o_configurator_scanf(cmd, value, "%u", &conf->prerender.max_zoom) != 0)
+                return -1;
+        } else if (key->type == YOML_TYPE_SCALAR && strcmp(key->data.scalar, "bbox") == 0) {
+            if (value->type != YOML_TYPE_SEQUENCE || value->data.sequence.size != 4) {
+                h2o_configurator_errprintf(cmd, value, "bbox must be a sequence of 4 numbers: [lon1, lat1, lon2, lat2]");
+                return -1;
+            }
+            for (j = 0; j != 4; ++j)
+                if (h2o_configurator_scanf(cmd, value->data.sequence.elements[j], "%lf", conf->prerender.bbox + j) != 0)
+                    return -1;
+        } else {
+            h2o_configurator_errprintf(cmd, key, "key must be either of: `min-zoom`, `max-zoom`, `bbox`");
+            return -1;
+        }
+    }
+    if (conf->prerender.min_zoom > conf->prerender.max_zoom || conf->prerender.max_zoom > TILE_MAX_ZOOM) {
+        h2o_configurator_errprintf(cmd, node, "zoom range must be within [0, %d] with min-zoom <= max-zoom", TILE_MAX_ZOOM);
+        return -1;
+    }
+    conf->prerender.enabled = 1;
+
+    return 0;
+}
+
+static int on_config_coverage(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    h2o_tile_config_vars_t *conf = &self->vars->conf;
+    size_t i, j;
+
+    conf->coverage.from_style = 0;
+    conf->coverage.polygon = NULL;
+    conf->coverage.num_points = 0;
+
+    switch (node->type) {
+    case YOML_TYPE_SCALAR:
+        switch (h2o_configurator_get_one_of(cmd, node, "OFF,style")) {
+        case 0:
+            break;
+        case 1:
+            conf->coverage.from_style = 1;
+            break;
+        default:
+            return -1;
+        }
+        break;
+    case YOML_TYPE_SEQUENCE:
+        if (node->data.sequence.size < 3) {
+            h2o_configurator_errprintf(cmd, node, "a polygon needs at least 3 points");
+            return -1;
+        }
+        conf->coverage.polygon = h2o_mem_alloc(sizeof(double) * 2 * node->data.sequence.size);
+        for (i = 0; i != node->data.sequence.size; ++i) {
+            yoml_t *point = node->data.sequence.elements[i];
+            if (point->type != YOML_TYPE_SEQUENCE || point->data.sequence.size != 2) {
+                h2o_configurator_errprintf(cmd, point, "a point must be a pair of numbers: [lon, lat]");
+                return -1;
+            }
+            for (j = 0; j != 2; ++j)
+                if (h2o_configurator_scanf(cmd, point->data.sequence.elements[j], "%lf", conf->coverage.polygon + 2 * i + j) != 0)
+                    return -1;
+        }
+        conf->coverage.num_points = node->data.sequence.size;
+        break;
+    default:
+        h2o_configurator_errprintf(cmd, node, "argument must be either of: `OFF`, `style`, or a sequence of [lon, lat]");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int on_config_hot_cache(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    h2o_tile_config_vars_t *conf = &self->vars->conf;
+    size_t i;
+
+    conf->hot_cache.path = NULL;
+    conf->hot_cache.size = 256 << 20;
+    conf->hot_cache.max_age = 60;
+    for (i = 0; i != node->data.mapping.size; ++i) {
+        yoml_t *key = node->data.mapping.elements[i].key;
+        yoml_t *value = node->data.mapping.elements[i].value;
+        if (key->type == YOML_TYPE_SCALAR && strcmp(key->data.scalar, "path") == 0 && value->type == YOML_TYPE_SCALAR) {
+            conf->hot_cache.path = h2o_strdup(NULL, value->data.scalar, SIZE_MAX).base;
+        } else if (key->type == YOML_TYPE_SCALAR && strcmp(key->data.scalar, "size") == 0) {
+            if (scan_size(cmd, value, &conf->hot_cache.size) != 0)
+                return -1;
+        } else if (key->type == YOML_TYPE_SCALAR && strcmp(key->data.scalar, "max-age") == 0) {
+            if (h2o_configurator_scanf(cmd, value, "%" PRIu64, &conf->hot_cache.max_age) != 0)
+                return -1;
+        } else {
+            h2o_configurator_errprintf(cmd, key, "key must be either of: `path`, `size`, `max-age`");
+            return -1;
+        }
+    }
+    if (conf->hot_cache.path == NULL) {
+        h2o_configurator_errprintf(cmd, node, "mandatory key `path` is missing");
+        return -1;
+    }
+    if (conf->hot_cache.size < (1 << 20)) {
+        h2o_configurator_errprintf(cmd, node, "`size` must be 1M or larger");
+        return -1;
+    }
+    return 0;
+}
 #else
+static int add_upstream(h2o_configurator_command_t *cmd, struct st_h2o_tile_configurator_t *self, yoml_t *node)
+{
+    h2o_url_t parsed;
+
+    if (node->type != YOML_TYPE_SCALAR || h2o_url_parse(node->data.scalar, SIZE_MAX, &parsed) != 0) {
+        h2o_configurator_errprintf(cmd, node, "upstream must be an absolute URL, e.g. http://render1:8080/tiles/");
+        return -1;
+    }
+    h2o_vector_reserve(NULL, &self->vars->upstreams, self->vars->upstreams.size + 1);
+    self->vars->upstreams.entries[self->vars->upstreams.size++] = node->data.scalar;
+    return 0;
+}
+
 static int on_config_upstream(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
 {
-//    self->vars->style_file_path = node->data.scalar;
     struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
-    if (self->vars->upstream != NULL) {
-        // Only one base path can be mapped.
-        h2o_configurator_errprintf(cmd, node, "duplicate upstream %s: another host %s is already specified", node->data.scalar, self->vars->upstream);
+    size_t i;
+
+    if (self->vars->upstreams.size != 0) {
+        h2o_configurator_errprintf(cmd, node, "duplicate tile.upstream: another host %s is already specified", self->vars->upstreams.entries[0]);
+        return -1;
+    }
+    switch (node->type) {
+    case YOML_TYPE_SEQUENCE:
+        /* render servers to balance the misses over */
+        if (node->data.sequence.size == 0) {
+            h2o_configurator_errprintf(cmd, node, "tile.upstream must not be empty");
+            return -1;
+        }
+        for (i = 0; i != node->data.sequence.size; ++i)
+            if (add_upstream(cmd, self, node->data.sequence.elements[i]) != 0)
+                return -1;
+        return 0;
+    default:
+        return add_upstream(cmd, self, node);
+    }
+}
+
+static int validate_peer(h2o_configurator_command_t *cmd, yoml_t *node)
+{
+    h2o_url_t parsed;
+
+    if (node->type != YOML_TYPE_SCALAR || h2o_url_parse(node->data.scalar, SIZE_MAX, &parsed) != 0) {
+        h2o_configurator_errprintf(cmd, node, "peer must be an absolute URL, e.g. http://proxy1:8080/tiles/");
+        return -1;
+    }
+    return 0;
+}
+
+static int on_config_peers(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    yoml_t *self_node, *members;
+    size_t i;
+
+    /* self: URL of this proxy, members: URLs of all the proxies in the group (incl. this), the same on every peer */
+    if ((self_node = yoml_get(node, "self")) == NULL || (members = yoml_get(node, "members")) == NULL) {
+        h2o_configurator_errprintf(cmd, node, "tile.peers must have `self` and `members`");
+        return -1;
+    }
+    if (validate_peer(cmd, self_node) != 0)
+        return -1;
+    if (members->type != YOML_TYPE_SEQUENCE || members->data.sequence.size == 0) {
+        h2o_configurator_errprintf(cmd, members, "`members` must be a sequence of URLs");
+        return -1;
+    }
+    self->vars->conf.peers.self = h2o_strdup(NULL, self_node->data.scalar, SIZE_MAX).base;
+    self->vars->conf.peers.urls = h2o_mem_alloc(sizeof(const char *) * members->data.sequence.size);
+    self->vars->conf.peers.num_urls = members->data.sequence.size;
+    for (i = 0; i != members->data.sequence.size; ++i) {
+        yoml_t *member = members->data.sequence.elements[i];
+        if (validate_peer(cmd, member) != 0)
+            return -1;
+        self->vars->conf.peers.urls[i] = h2o_strdup(NULL, member->data.scalar, SIZE_MAX).base;
+        if (strcmp(member->data.scalar, self_node->data.scalar) == 0)
+            self_node = NULL;
+    }
+    if (self_node != NULL) {
+        h2o_configurator_errprintf(cmd, self_node, "`self` must be one of `members`");
+        return -1;
+    }
+    return 0;
+}
+
+static int on_config_upstream_balance(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    ssize_t ret = h2o_configurator_get_one_of(cmd, node, "least-outstanding,latency");
+    if (ret == -1)
+        return -1;
+    self->vars->conf.balance = (h2o_tile_proxy_balance_t)ret;
+    return 0;
+}
+
+static int on_config_upstream_io_timeout(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    return h2o_configurator_scanf(cmd, node, "%" PRIu64, &self->vars->conf.io_timeout);
+}
+
+static int on_config_upstream_keepalive_timeout(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    return h2o_configurator_scanf(cmd, node, "%" PRIu64, &self->vars->conf.keepalive_timeout);
+}
+
+static int on_config_upstream_max_fails(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    if (h2o_configurator_scanf(cmd, node, "%u", &self->vars->conf.max_fails) != 0)
+        return -1;
+    if (self->vars->conf.max_fails == 0) {
+        h2o_configurator_errprintf(cmd, node, "tile.upstream-max-fails must be >=1");
+        return -1;
+    }
+    return 0;
+}
+
+static int on_config_cache_size(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    return scan_size(cmd, node, &self->vars->conf.cache_size);
+}
+
+static int on_config_upstream_fail_timeout(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    return h2o_configurator_scanf(cmd, node, "%" PRIu64, &self->vars->conf.fail_timeout);
+}
+
+static int on_config_memcached(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    size_t i;
+
+    self->vars->conf.memcached.host = NULL;
+    for (i = 0; i != node->data.mapping.size; ++i) {
+        yoml_t *key = node->data.mapping.elements[i].key, *value = node->data.mapping.elements[i].value;
+        if (key->type != YOML_TYPE_SCALAR) {
+            h2o_configurator_errprintf(cmd, key, "attribute must be a string");
+            return -1;
+        }
+        if (value->type != YOML_TYPE_SCALAR) {
+            h2o_configurator_errprintf(cmd, value, "`%s` must be a scalar", key->data.scalar);
+            return -1;
+        }
+        if (strcmp(key->data.scalar, "host") == 0) {
+            self->vars->conf.memcached.host = h2o_strdup(NULL, value->data.scalar, SIZE_MAX).base;
+        } else if (strcmp(key->data.scalar, "port") == 0) {
+            if (sscanf(value->data.scalar, "%" SCNu16, &self->vars->conf.memcached.port) != 1) {
+                h2o_configurator_errprintf(cmd, value, "`port` must be a number");
+                return -1;
+            }
+        } else if (strcmp(key->data.scalar, "num-threads") == 0) {
+            if (!(sscanf(value->data.scalar, "%zu", &self->vars->conf.memcached.num_threads) == 1 &&
+                  self->vars->conf.memcached.num_threads != 0)) {
+                h2o_configurator_errprintf(cmd, value, "`num-threads` must be a positive number");
+                return -1;
+            }
+        } else if (strcmp(key->data.scalar, "prefix") == 0) {
+            self->vars->conf.memcached.prefix = h2o_strdup(NULL, value->data.scalar, SIZE_MAX).base;
+        } else if (strcmp(key->data.scalar, "expiration") == 0) {
+            if (sscanf(value->data.scalar, "%" SCNu32, &self->vars->conf.memcached.expiration) != 1) {
+                h2o_configurator_errprintf(cmd, value, "`expiration` must be a number");
+                return -1;
+            }
+        } else {
+            h2o_configurator_errprintf(cmd, key, "unknown attribute: %s", key->data.scalar);
+            return -1;
+        }
+    }
+    if (self->vars->conf.memcached.host == NULL) {
+        h2o_configurator_errprintf(cmd, node, "mandatory attribute `host` is missing");
+        return -1;
+    }
+    return 0;
+}
+
+static int on_config_ttl(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    struct st_h2o_tile_configurator_t *self = (void *)cmd->configurator;
+    size_t i;
+    uint64_t ttl;
+
+    switch (node->type) {
+    case YOML_TYPE_SCALAR:
+        /* for all the zooms */
+        if (h2o_configurator_scanf(cmd, node, "%" PRIu64, &ttl) != 0)
+            return -1;
+        for (i = 0; i <= TILE_MAX_ZOOM; ++i)
+            self->vars->conf.ttl[i] = ttl;
+        return 0;
+    case YOML_TYPE_MAPPING:
+        break;
+    default:
+        h2o_configurator_errprintf(cmd, node, "tile.ttl must be a scalar or a mapping");
         return -1;
     }
-    self->vars->upstream = node->data.scalar;
 
+    /* zoom (or a range of zooms like "0-8") => ttl */
+    for (i = 0; i != node->data.mapping.size; ++i) {
+        yoml_t *key = node->data.mapping.elements[i].key, *value = node->data.mapping.elements[i].value;
+        unsigned z1, z2;
+        if (key->type != YOML_TYPE_SCALAR) {
+            h2o_configurator_errprintf(cmd, key, "key must be a zoom or a range of zooms");
+            return -1;
+        }
+        switch (sscanf(key->data.scalar, "%u-%u", &z1, &z2)) {
+        case 1:
+            z2 = z1;
+            break;
+        case 2:
+            break;
+        default:
+            h2o_configurator_errprintf(cmd, key, "key must be a zoom or a range of zooms");
+            return -1;
+        }
+        if (z1 > z2 || z2 > TILE_MAX_ZOOM) {
+            h2o_configurator_errprintf(cmd, key, "zooms must be within [0, %d]", TILE_MAX_ZOOM);
+            return -1;
+        }
+        if (h2o_configurator_scanf(cmd, value, "%" PRIu64, &ttl) != 0)
+            return -1;
+        for (; z1 <= z2; ++z1)
+            self->vars->conf.ttl[z1] = ttl;
+    }
     return 0;
 }
 #endif
@@ -64,12 +584,19 @@ static int on_config_upstream(h2o_configurator_command_t *cmd, h2o_configurator_
 static int on_config_enter(h2o_configurator_t *_self, h2o_configurator_context_t *ctx, yoml_t *node)
 {
     struct st_h2o_tile_configurator_t *self = (void *)_self;
+    memcpy(self->vars + 1, self->vars, sizeof(*self->vars));
     ++self->vars;
     self->vars[0].base_path = NULL;
 #if H2O_TILE && (!H2O_TILE_PROXY)
-    self->vars[0].style_file_path = NULL;
+    memset(&self->vars[0].styles, 0, sizeof(self->vars[0].styles));
+    self->vars[0].conf.prerender.enabled = 0;
+    self->vars[0].conf.coverage.from_style = 0;
+    self->vars[0].conf.coverage.polygon = NULL;
+    self->vars[0].conf.coverage.num_points = 0;
+    self->vars[0].conf.hot_cache.path = NULL;
 #else
-    self->vars[0].upstream = NULL;
+    memset(&self->vars[0].upstreams, 0, sizeof(self->vars[0].upstreams));
+    memset(&self->vars[0].conf.peers, 0, sizeof(self->vars[0].conf.peers));
 #endif
     return 0;
 }
@@ -78,13 +605,17 @@ static int on_config_exit(h2o_configurator_t *_self, h2o_configurator_context_t
 {
     struct st_h2o_tile_configurator_t *self = (void *)_self;
 #if H2O_TILE && (!H2O_TILE_PROXY)
-    if (self->vars->base_path && self->vars->style_file_path) {
-        h2o_tile_register(ctx->pathconf, self->vars->base_path, self->vars->style_file_path);
+    if (self->vars->base_path && self->vars->styles.size != 0) {
+        h2o_tile_register(ctx->pathconf, self->vars->base_path, self->vars->styles.entries, self->vars->styles.size,
+                          &self->vars->conf);
     }
+    free(self->vars->styles.entries);
 #else
-    if (self->vars->base_path && self->vars->upstream) {
-        h2o_tile_proxy_register(ctx->pathconf, self->vars->base_path, self->vars->upstream);
+    if (self->vars->base_path && self->vars->upstreams.size != 0) {
+        h2o_tile_proxy_register(ctx->pathconf, self->vars->base_path, self->vars->upstreams.entries, self->vars->upstreams.size,
+                                &self->vars->conf);
     }
+    free(self->vars->upstreams.entries);
 #endif
     --self->vars;
     return 0;
@@ -98,17 +629,80 @@ void h2o_tile_register_configurator(h2o_globalconf_t *globalconf)
     self->vars = self->_vars_stack;
     self->vars->base_path = NULL;
 #if H2O_TILE && (!H2O_TILE_PROXY)
-    self->vars->style_file_path = NULL;
+    memset(&self->vars->styles, 0, sizeof(self->vars->styles));
+    self->vars->conf.render_timeout = 0; /* wait for the renderer, as ever */
+    self->vars->conf.fallback_max_age = 60;
+    self->vars->conf.negotiate_webp = 0;
+    self->vars->conf.push_neighbors = 0;
+    self->vars->conf.url_template = NULL;
+    self->vars->conf.max_renders = 0;
+    self->vars->conf.expire_on_style_change = 0;
+    self->vars->conf.prerender.enabled = 0;
+    self->vars->conf.coverage.from_style = 0;
+    self->vars->conf.coverage.polygon = NULL;
+    self->vars->conf.coverage.num_points = 0;
+    self->vars->conf.hot_cache.path = NULL;
 #else
-    self->vars->upstream = NULL;
+    memset(&self->vars->upstreams, 0, sizeof(self->vars->upstreams));
+    self->vars->conf.io_timeout = 10 * 1000;
+    self->vars->conf.keepalive_timeout = 2000;
+    self->vars->conf.balance = H2O_TILE_PROXY_BALANCE_LEAST_OUTSTANDING;
+    self->vars->conf.max_fails = 3;
+    self->vars->conf.fail_timeout = 10 * 1000;
+    self->vars->conf.cache_size = 0;
+    memset(self->vars->conf.ttl, 0, sizeof(self->vars->conf.ttl));
+    self->vars->conf.memcached.host = NULL;
+    self->vars->conf.memcached.port = 11211;
+    self->vars->conf.memcached.num_threads = 1;
+    self->vars->conf.memcached.prefix = "h2o:tile:";
+    self->vars->conf.memcached.expiration = 0;
+    memset(&self->vars->conf.peers, 0, sizeof(self->vars->conf.peers));
 #endif
     h2o_configurator_define_command(&self->super, "tile.dir", H2O_CONFIGURATOR_FLAG_PATH | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR | H2O_CONFIGURATOR_FLAG_DEFERRED,
                                     on_config_dir); /* "directory under which to serve the target path" */
 #if H2O_TILE && (!H2O_TILE_PROXY)
-    h2o_configurator_define_command(&self->super, "tile.style", H2O_CONFIGURATOR_FLAG_PATH | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR,
-                                    on_config_style); /* "path to a Mapnik's style file" */
+    h2o_configurator_define_command(&self->super, "tile.style", H2O_CONFIGURATOR_FLAG_PATH,
+                                    on_config_style); /* "path to a Mapnik's style file, or a mapping of named ones" */
+    h2o_configurator_define_command(&self->super, "tile.max-renders", H2O_CONFIGURATOR_FLAG_ALL_LEVELS | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR,
+                                    on_config_max_renders); /* "max. number of concurrent renders per style, 0 for unlimited" */
+    h2o_configurator_define_command(&self->super, "tile.expire-on-style-change", H2O_CONFIGURATOR_FLAG_ALL_LEVELS | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR,
+                                    on_config_expire_on_style_change); /* "whether the tiles older than the style file are re-rendered (soft-expired)" */
+    h2o_configurator_define_command(&self->super, "tile.render-timeout", H2O_CONFIGURATOR_FLAG_ALL_LEVELS | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR,
+                                    on_config_render_timeout); /* "milliseconds to wait for a render before sending a substitute, 0 to wait forever" */
+    h2o_configurator_define_command(&self->super, "tile.fallback-max-age", H2O_CONFIGURATOR_FLAG_ALL_LEVELS | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR,
+                                    on_config_fallback_max_age); /* "max-age (in seconds) of a substitute tile" */
+    h2o_configurator_define_command(&self->super, "tile.webp", H2O_CONFIGURATOR_FLAG_ALL_LEVELS | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR,
+                                    on_config_webp); /* "whether to send .png tiles in webp to the clients accepting it" */
+    h2o_configurator_define_command(&self->super, "tile.push-neighbors", H2O_CONFIGURATOR_FLAG_ALL_LEVELS | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR,
+                                    on_config_push_neighbors); /* "number of neighboring tiles to push or preload, if at hand" */
+    h2o_configurator_define_command(&self->super, "tile.url-template", H2O_CONFIGURATOR_FLAG_ALL_LEVELS | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR,
+                                    on_config_url_template); /* "URL scheme of the tiles, e.g. {z}/{x}/{-y}.png for TMS" */
+    h2o_configurator_define_command(&self->super, "tile.prerender", H2O_CONFIGURATOR_FLAG_PATH | H2O_CONFIGURATOR_FLAG_EXPECT_MAPPING,
+                                    on_config_prerender); /* "zoom range & bbox of the missing tiles to be rendered in the background" */
+    h2o_configurator_define_command(&self->super, "tile.coverage", H2O_CONFIGURATOR_FLAG_PATH,
+                                    on_config_coverage); /* "extent of the data; tiles out of it are answered by a blank tile" */
+    h2o_configurator_define_command(&self->super, "tile.hot-cache", H2O_CONFIGURATOR_FLAG_PATH | H2O_CONFIGURATOR_FLAG_EXPECT_MAPPING,
+                                    on_config_hot_cache); /* "file (e.g. on /dev/shm) holding the hot tiles for all the processes & restarts: path, size & max-age" */
 #else
-    h2o_configurator_define_command(&self->super, "tile.upstream", H2O_CONFIGURATOR_FLAG_PATH | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR,
-                                    on_config_upstream); /* "path to a Mapnik's style file" */
+    h2o_configurator_define_command(&self->super, "tile.upstream", H2O_CONFIGURATOR_FLAG_PATH,
+                                    on_config_upstream); /* "URL of the render server, or a sequence of them to balance over" */
+    h2o_configurator_define_command(&self->super, "tile.upstream-balance", H2O_CONFIGURATOR_FLAG_ALL_LEVELS | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR,
+                                    on_config_upstream_balance); /* "least-outstanding, or latency (weighted by the EWMA of the response time)" */
+    h2o_configurator_define_command(&self->super, "tile.upstream-io-timeout", H2O_CONFIGURATOR_FLAG_ALL_LEVELS | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR,
+                                    on_config_upstream_io_timeout); /* "I/O timeout (in milliseconds) of the upstream connections" */
+    h2o_configurator_define_command(&self->super, "tile.upstream-keepalive-timeout", H2O_CONFIGURATOR_FLAG_ALL_LEVELS | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR,
+                                    on_config_upstream_keepalive_timeout); /* "how long (in milliseconds) to pool the idle upstream connections, 0 to disable" */
+    h2o_configurator_define_command(&self->super, "tile.upstream-max-fails", H2O_CONFIGURATOR_FLAG_ALL_LEVELS | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR,
+                                    on_config_upstream_max_fails); /* "consecutive 5xx or timeouts to eject an upstream" */
+    h2o_configurator_define_command(&self->super, "tile.upstream-fail-timeout", H2O_CONFIGURATOR_FLAG_ALL_LEVELS | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR,
+                                    on_config_upstream_fail_timeout); /* "how long (in milliseconds) an upstream stays ejected" */
+    h2o_configurator_define_command(&self->super, "tile.cache-size", H2O_CONFIGURATOR_FLAG_ALL_LEVELS | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR,
+                                    on_config_cache_size); /* "max. size of the tiles stored (e.g. 100G), evicting the cold ones; 0 for unbounded" */
+    h2o_configurator_define_command(&self->super, "tile.ttl", H2O_CONFIGURATOR_FLAG_ALL_LEVELS,
+                                    on_config_ttl); /* "seconds before a stored tile is revalidated against the upstream, or a mapping of zooms to them; 0 to keep it as is" */
+    h2o_configurator_define_command(&self->super, "tile.memcached", H2O_CONFIGURATOR_FLAG_ALL_LEVELS | H2O_CONFIGURATOR_FLAG_EXPECT_MAPPING,
+                                    on_config_memcached); /* "memcached shared by the proxies between the disk & the upstreams: host, port, num-threads, prefix & expiration" */
+    h2o_configurator_define_command(&self->super, "tile.peers", H2O_CONFIGURATOR_FLAG_PATH | H2O_CONFIGURATOR_FLAG_EXPECT_MAPPING,
+                                    on_config_peers); /* "self & members (URLs of the proxies sharing their disks, each owning a part of the tiles by consistent hashing)" */
 #endif
 }
@@ -223,8 +223,15 @@ static int do_pull(h2o_generator_t *_self, h2o_req_t *req, h2o_iovec_t *buf)
     return 1;
 }
 
-static struct st_h2o_sendfile_generator_t *create_generator(h2o_req_t *req, const char *path, size_t path_len, int *is_dir,
-                                                            int flags)
+static h2o_filecache_ref_t *open_file(h2o_req_t *req, const char *path, h2o_filecache_open_cb open_cb)
+{
+    return open_cb != NULL ? h2o_filecache_open_file_by(req->conn->ctx->filecache, path, O_RDONLY | O_CLOEXEC, open_cb)
+                           : h2o_filecache_open_file(req->conn->ctx->filecache, path, O_RDONLY | O_CLOEXEC);
+}
+
+/* open_cb opens the file in place of open(2), if non-NULL */
+static struct st_h2o_sendfile_generator_t *create_generator_by(h2o_req_t *req, const char *path, size_t path_len, int *is_dir,
+                                                               int flags, h2o_filecache_open_cb open_cb)
 {
     struct st_h2o_sendfile_generator_t *self;
     h2o_filecache_ref_t *fileref;
@@ -240,7 +247,7 @@ static struct st_h2o_sendfile_generator_t *create_generator(h2o_req_t *req, cons
 #define TRY_VARIANT(mask, enc, ext)                                                                                                \
     if ((compressible_types & mask) != 0) {                                                                                        \
         strcpy(variant_path + path_len, ext);                                                                                      \
-        if ((fileref = h2o_filecache_open_file(req->conn->ctx->filecache, variant_path, O_RDONLY | O_CLOEXEC)) != NULL) {          \
+        if ((fileref = open_file(req, variant_path, open_cb)) != NULL) {                                                           \
             content_encoding = h2o_iovec_init(enc, sizeof(enc) - 1);                                                               \
             goto Opened;                                                                                                           \
         }                                                                                                                          \
@@ -250,7 +257,7 @@ static struct st_h2o_sendfile_generator_t *create_generator(h2o_req_t *req, cons
 #undef TRY_VARIANT
         }
     }
-    if ((fileref = h2o_filecache_open_file(req->conn->ctx->filecache, path, O_RDONLY | O_CLOEXEC)) == NULL)
+    if ((fileref = open_file(req, path, open_cb)) == NULL)
         return NULL;
     content_encoding = (h2o_iovec_t){};
 
@@ -277,6 +284,12 @@ Opened:
     return self;
 }
 
+static struct st_h2o_sendfile_generator_t *create_generator(h2o_req_t *req, const char *path, size_t path_len, int *is_dir,
+                                                            int flags)
+{
+    return create_generator_by(req, path, path_len, is_dir, flags, NULL);
+}
+
 static void add_headers_unconditional(struct st_h2o_sendfile_generator_t *self, h2o_req_t *req)
 {
     /* RFC 7232 4.1: The server generating a 304 response MUST generate any of the following header fields that would have been sent
@@ -15,6 +15,7 @@
  #include <mapnik/graphics.hpp>
 #endif
 #include <mapnik/image_util.hpp>
+#include <mapnik/image_reader.hpp>
 #include <mapnik/image_view.hpp>
 #include <mapnik/config_error.hpp>
 #include <mapnik/load_map.hpp>
@@ -23,12 +24,25 @@
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <sstream>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <cstdint>
 #include <cstring>
 #include <cstdio>
+#include <memory>
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -37,54 +51,299 @@
 #include "proj.hpp"
 #include "path-mapper.h"
 #include "tile/mapnik-bridge.h"
+#include "tile/tile-etag.h"
+#include "tile/tile-png.h"
 #include "tile/mkdir-p.h"
 
+#if MAPNIK_MAJOR_VERSION >= 3
+typedef mapnik::image_rgba8 raster_t;
+#else
+typedef mapnik::image_data_32 raster_t;
+#endif
+
+/*
+Maps are read-only once loaded (render threads work on clones), so the handlers of the same style share one; keyed by
+the directory of the style file (against which the relative paths in it are resolved) & the XXH64 of its contents, so
+that copies of a style are parsed once as well. Refcounted.
+Parsing a large style (e.g. openstreetmap-carto) takes seconds; maps are thus loaded lazily, either in the background
+by load_mapnik_async() or by the first render, so that the server starts serving the tiles on disk right away.
+Fonts are registered by the first load as well (see load_fonts()).
+A map may be replaced by reloading its style (see watch_styles()): the current instance is swapped atomically, and
+the renders in flight finish on (their clones of) the old one, which is freed by the last of its holders.
+*/
+struct style_file_t {
+    std::string path; /* canonical */
+    time_t mtime;     /* as of the last (re)load */
+};
+struct loaded_map_t {
+    std::string key;
+    std::string path;     /* of the first style file given */
+    std::string xml;      /* the contents of the style file, dropped once parsed */
+    std::string base_dir; /* where the style file resides */
+    std::vector<style_file_t> files; /* more than one if copies of the style are given; guarded by loaded_maps_mutex */
+    std::shared_ptr<const mapnik::Map> current; /* accessed by std::atomic_load/store */
+    std::atomic<time_t> loaded_mtime; /* the mtime of the style file the current map was parsed from */
+    size_t refcnt;
+    std::once_flag once;
+    std::vector<std::thread> loaders;
+};
+static std::map<std::string, loaded_map_t*> loaded_maps;
+static std::mutex loaded_maps_mutex;
+
+/* the walks of the font directories started by load_fonts(), whose findings are registered by the first load */
+static std::vector<std::future<std::vector<std::string> > > font_walks;
+static std::once_flag fonts_once;
+
+static void register_pending_fonts() {
+    for (auto& walk : font_walks) {
+        /* N.B. freetype_engine serializes the registrations by its own lock, thus no point in registering in parallel */
+        for (const std::string& path : walk.get()) {
+#if DEBUG
+            fprintf(stderr, "DEBUG: Loading font: %s\n", path.c_str());
+#endif
+            mapnik::freetype_engine::register_font(path);
+        }
+    }
+    font_walks.clear();
+}
+
+static std::shared_ptr<const mapnik::Map> parse_style(const std::string& xml, const std::string& base_dir) {
+    // To avoid label scattering, we render a 2x2 larger area and then clip the center.
+    std::shared_ptr<mapnik::Map> m = std::make_shared<mapnik::Map>(TILE_SIZE*2, TILE_SIZE*2);
+    mapnik::load_map_string(*m, xml, false, base_dir);
+    return m;
+}
+
+/* the current instance of the map; to be held no longer than needed (e.g. to clone), so that a reload can free the old one */
+static std::shared_ptr<const mapnik::Map> map_of(void* map_ptr) {
+    loaded_map_t* loaded = (loaded_map_t*)map_ptr;
+    /* concurrent callers wait for the one loading */
+    std::call_once(loaded->once, [loaded] {
+        std::call_once(fonts_once, register_pending_fonts);
+        // Any failure in parsing the style file will immediately cause abortion by an unhandled exception, this is intended.
+        std::atomic_store(&loaded->current, parse_style(loaded->xml, loaded->base_dir));
+        std::string().swap(loaded->xml);
+    });
+    return std::atomic_load(&loaded->current);
+}
+
+static bool read_style(const std::string& path, std::string& contents) {
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    std::ostringstream xml;
+    xml << in.rdbuf();
+    if (!in) {
+        return false;
+    }
+    contents = xml.str();
+    return true;
+}
+
+static std::string key_of(const std::string& contents, const std::string& base_dir) {
+    return str(boost::format("%016x %s") % tile_xxh64(contents.data(), contents.size(), 0) % base_dir);
+}
+
+static time_t mtime_of(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_mtime : 0;
+}
+
+/*
+Styles are reloaded by a thread, either when their files are modified (checked every mapnik_style_watch_interval
+seconds), or when requested by reload_mapnik_styles(); the parse takes place on the thread, while the renders go on.
+*/
+unsigned mapnik_style_watch_interval = 0;
+static int reload_pipe[2] = {-1, -1};
+static std::once_flag watcher_once;
+
+static void reload_style(loaded_map_t* loaded, bool forced) {
+    std::string path, contents;
+    time_t mtime;
+
+    {
+        std::lock_guard<std::mutex> lock(loaded_maps_mutex);
+        auto changed = loaded->files.end();
+        for (auto it = loaded->files.begin(); it != loaded->files.end(); ++it) {
+            if (mtime_of(it->path) != it->mtime) {
+                changed = it;
+            }
+        }
+        if (changed == loaded->files.end() && !forced) {
+            return;
+        }
+        if (loaded->files.size() != 1) {
+            /* the copies have diverged; their handlers can't share the map any more */
+            fprintf(stderr, "[lib/handler/mapnik-bridge.cpp] %s has copies sharing the map; restart to reload it\n",
+                    loaded->files[0].path.c_str());
+            for (auto& f : loaded->files) {
+                f.mtime = mtime_of(f.path);
+            }
+            return;
+        }
+        path = loaded->files[0].path;
+        loaded->files[0].mtime = mtime = mtime_of(path);
+    }
+    /* not loaded yet; the load in flight (if any) will do */
+    if (!std::atomic_load(&loaded->current)) {
+        return;
+    }
+    if (!read_style(path, contents)) {
+        fprintf(stderr, "[lib/handler/mapnik-bridge.cpp] failed to read %s; keeping the current map\n", path.c_str());
+        return;
+    }
+    try {
+        std::atomic_store(&loaded->current, parse_style(contents, loaded->base_dir));
+        loaded->loaded_mtime = mtime;
+        fprintf(stderr, "[lib/handler/mapnik-bridge.cpp] reloaded %s\n", path.c_str());
+    } catch (const std::exception& e) {
+        /* unlike at startup, a broken style must not take the server down */
+        fprintf(stderr, "[lib/handler/mapnik-bridge.cpp] failed to reload %s: %s; keeping the current map\n", path.c_str(),
+                e.what());
+    }
+}
+
+static void watch_styles() {
+    while (1) {
+        struct pollfd pfd = {reload_pipe[0], POLLIN, 0};
+        bool forced = false;
+        int ret = poll(&pfd, 1, mapnik_style_watch_interval != 0 ? (int)mapnik_style_watch_interval * 1000 : -1);
+        if (ret == -1 && errno != EINTR) {
+            return;
+        }
+        if (ret > 0) {
+            char buf[64];
+            while (read(reload_pipe[0], buf, sizeof(buf)) > 0)
+                ;
+            forced = true;
+        }
+        std::vector<loaded_map_t*> maps;
+        {
+            std::lock_guard<std::mutex> lock(loaded_maps_mutex);
+            for (auto& entry : loaded_maps) {
+                maps.push_back(entry.second);
+            }
+        }
+        /* N.B. the maps live as long as the server does, as do their handlers */
+        for (loaded_map_t* loaded : maps) {
+            reload_style(loaded, forced);
+        }
+    }
+}
+
+static void start_watching_styles() {
+    if (pipe2(reload_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        perror("[lib/handler/mapnik-bridge.cpp] pipe2");
+        return;
+    }
+    std::thread(watch_styles).detach();
+}
+
 extern "C" {
 
-void save_tile(h2o_req_t* req, const char* tile_path, const char* data, size_t len, const char* mime_type, size_t mime_type_len, int flags, tile_rendered_callback callback) {
-    /* write to the filesystem */
-    /* 
-    As the rendered image was already h2o_send_inline'ed in the callback, 
-    any errors in saving it to a file will be just error-logged: 
-    response to the client is NOT affected: no such thing as "500 Internal Server Error."
-    */
-    callback(req, data, len, tile_path, mime_type, mime_type_len, flags);
+static h2o_iovec_t to_malloced_iovec(const std::string& buf) {
+    h2o_iovec_t v;
+    v.base = static_cast<char*>(h2o_mem_alloc(buf.length()));
+    v.len = buf.length();
+    memcpy(v.base, buf.data(), v.len);
+    return v;
+}
+
+/* Mapnik's format string to encode a tile with */
+static const char* format_of(enum TILE_SUFFIX suffix) {
+    switch (suffix) {
+    case JPG:
+        return "jpeg85";
+    case WEBP:
+        return "webp";
+    default:
+#if MAPNIK_MAJOR_VERSION >= 3
+        return "png256:e=miniz";
+#else
+        return "png256";
+#endif
+    }
+}
+
+int mapnik_png_compression[TILE_MAX_ZOOM + 1];
+int mapnik_png_builtin = 1;
+
+/* the encoder of the render thread, reused tile to tile */
+struct png_encoder_holder_t {
+    tile_png_encoder_t* encoder = nullptr;
+    ~png_encoder_holder_t() {
+        tile_png_encoder_destroy(encoder);
+    }
+};
+static thread_local png_encoder_holder_t png_encoder_holder;
+
+static tile_png_encoder_t* png_encoder() {
+    if (png_encoder_holder.encoder == nullptr && (png_encoder_holder.encoder = tile_png_encoder_create()) == nullptr) {
+        throw std::bad_alloc();
+    }
+    return png_encoder_holder.encoder;
+}
+
+/* collects the colors of the raster into the palette of the png tiles to encode next, cf. tile-png.h */
+static void collect_png(const raster_t& raster) {
+    if (tile_png_add(png_encoder(), &raster(0, 0), raster.width(), raster.height(), raster.width()) != 0) {
+        throw std::bad_alloc();
+    }
+}
+
+/* the raster in the format of suffix; a png with the colors collected since the last tile_png_reset() */
+static h2o_iovec_t encode_as(const raster_t& raster, uint32_t zoom, enum TILE_SUFFIX suffix) {
+    if (suffix != PNG || !mapnik_png_builtin) {
+        return to_malloced_iovec(mapnik::save_to_string(raster, format_of(suffix)));
+    }
+    const int level = zoom <= TILE_MAX_ZOOM && mapnik_png_compression[zoom] != 0 ? mapnik_png_compression[zoom] : TILE_PNG_DEFAULT_LEVEL;
+    char* buf;
+    size_t len;
+    if (tile_png_encode(png_encoder(), &raster(0, 0), raster.width(), raster.height(), raster.width(), level, &buf, &len) != 0) {
+        throw std::bad_alloc();
+    }
+    return h2o_iovec_init(buf, len);
+}
 
-    size_t tmp_path_len = strlen(tile_path)+18;
-    char *tmp_tile_path = static_cast<char*>(alloca(tmp_path_len));
-    snprintf(tmp_tile_path, tmp_path_len, "%s.%x", tile_path, pthread_self());
-    mkdir_p_parent(tmp_tile_path);
-    int fd = open(tmp_tile_path, O_WRONLY | O_TRUNC | O_CREAT, 0666);
-    if (fd < 0) {
-        h2o_req_log_error(req, "lib/handler/mapnik-bridge.cpp", "Could not open file %s: %s\n", tmp_tile_path, strerror(errno));
+/* 2x2 box filter; the 1x tile out of the 2x one */
+static void downsample(const raster_t& src, raster_t& dst) {
+    for (unsigned j = 0; j < dst.height(); ++j) {
+        for (unsigned i = 0; i < dst.width(); ++i) {
+            const uint32_t p[4] = { src(2*i, 2*j), src(2*i+1, 2*j), src(2*i, 2*j+1), src(2*i+1, 2*j+1) };
+            uint32_t v = 0;
+            for (unsigned shift = 0; shift < 32; shift += 8) {
+                uint32_t sum = 2;   /* rounding */
+                for (int k = 0; k < 4; ++k) {
+                    sum += (p[k] >> shift) & 0xff;
+                }
+                v |= (sum >> 2) << shift;
+            }
+            dst(i, j) = v;
+        }
     }
-    int v = write(fd, data, len);
-    if (v != len) {
-        h2o_req_log_error(req, "lib/handler/mapnik-bridge.cpp", "Failed to write to file %s: %s\n", tmp_tile_path, strerror(errno));
-        close(fd);
-        unlink(tmp_tile_path);
+}
+
+static void encode(const raster_t& tile, uint32_t zoom, uint32_t scale, unsigned formats, h2o_iovec_t* contents) {
+    for (int s = 0; s < TILE_NUM_SUFFIXES; ++s) {
+        if ((formats & TILE_FORMAT_BIT(scale, s)) != 0) {
+            contents[TILE_CONTENT_INDEX(scale, s)] = encode_as(tile, zoom, (enum TILE_SUFFIX)s);
+        }
     }
-    close(fd);
-    rename(tmp_tile_path, tile_path);
 }
 
-void render_tile(h2o_req_t* req, void* map_ptr, const char* tile_path, uint32_t zoom, uint32_t x, uint32_t y, const char* mime_type, size_t mime_type_len, int flags, tile_rendered_callback callback) {
+int render_tile(void* map_ptr, uint32_t zoom, uint32_t x, uint32_t y, unsigned formats, h2o_iovec_t* contents, char* errbuf, size_t errbuf_len) {
 
     try {
         using namespace mapnik;
-//        boost::filesystem::path path(tile_path);
 
-        const Map _map = *(Map*)map_ptr;
-        Map m(_map);    // clone
+        Map m(*map_of(map_ptr));    // clone, as render threads share the same map
+
+        /* A single pass at scale_factor 2 makes both 2x & 1x (by downsampling) tiles, if any 2x is wanted */
+        const uint32_t scale = (formats & TILE_FORMATS_OF_SCALE(2)) != 0 ? 2 : 1;
+        const uint32_t size = TILE_SIZE * scale;
+        m.resize(m.width() * scale, m.height() * scale);
 
         /* (left, top)-(right, bottom) in Mercator projection. */ 
         double l, t, r, b; 
         image_32 image(m.width(),m.height()); 
-#if MAPNIK_MAJOR_VERSION >= 3
-        image_view_rgba8 vw(TILE_SIZE/2, TILE_SIZE/2, TILE_SIZE, TILE_SIZE, image); 
-#else
-        image_view<mapnik::image_data_32> vw(TILE_SIZE/2, TILE_SIZE/2, TILE_SIZE, TILE_SIZE, image.data()); 
-#endif
         tile_to_merc_box(zoom, x, y, l, t, r, b); 
         box2d<double> bbox(l, t, r, b); 
         /* Double the bbox */ 
@@ -92,35 +351,229 @@ void render_tile(h2o_req_t* req, void* map_ptr, const char* tile_path, uint32_t
         bbox.height(bbox.height() * 2); 
         /* Render */ 
         m.zoom_to_box(bbox); 
-        agg_renderer<image_32> ren(m,image); 
+        agg_renderer<image_32> ren(m, image, scale); 
         ren.apply(); 
-        /* Clip the center 256x256 into vw */ 
+        /* Clip the center size x size */ 
+#if MAPNIK_MAJOR_VERSION >= 3
+        const raster_t& canvas = image;
+#else
+        const raster_t& canvas = image.data();
+#endif
+        raster_t tile(size, size);
+        for (uint32_t j = 0; j < size; ++j) {
+            for (uint32_t i = 0; i < size; ++i) {
+                tile(i, j) = canvas(size/2 + i, size/2 + j);
+            }
+        }
+        std::unique_ptr<raster_t> half;
+        if (scale == 2 && (formats & TILE_FORMATS_OF_SCALE(1)) != 0) {
+            half.reset(new raster_t(TILE_SIZE, TILE_SIZE));
+            downsample(tile, *half);
+        }
+        /* the png tiles of both scales share a palette (their colors are mostly the same) */
+        if (mapnik_png_builtin && (formats & (TILE_FORMAT_BIT(1, PNG) | TILE_FORMAT_BIT(2, PNG))) != 0) {
+            tile_png_reset(png_encoder());
+            if ((formats & TILE_FORMAT_BIT(scale, PNG)) != 0) {
+                collect_png(tile);
+            }
+            if (half && (formats & TILE_FORMAT_BIT(1, PNG)) != 0) {
+                collect_png(*half);
+            }
+        }
+        /* ... and encode it in each format from the same raster */ 
+        encode(tile, zoom, scale, formats, contents);
+        if (half) {
+            encode(*half, zoom, 1, formats, contents);
+        }
+        return 0;
+    } catch (std::exception& e) {
+        for (int i = 0; i < TILE_NUM_CONTENTS; ++i) {
+            if ((formats & (1u << i)) != 0) {
+                free(contents[i].base);
+                contents[i] = h2o_iovec_t();
+            }
+        }
+        snprintf(errbuf, errbuf_len, "%s", e.what());
+        return -1;
+    }
+
+}
+
+static void render_tiles(void* map_ptr, tile_render_request_t* reqs, size_t num_reqs) {
+    for (size_t i = 0; i != num_reqs; ++i) {
+        reqs[i].ret = render_tile(map_ptr, reqs[i].zoom, reqs[i].x, reqs[i].y, reqs[i].formats, reqs[i].contents, reqs[i].errstr, sizeof(reqs[i].errstr));
+    }
+}
+
+const tile_renderer_t tile_renderer_mapnik = {render_tiles, 1, 0};
+
+int render_fallback_tile(const char* base_path, size_t base_path_len, uint32_t zoom, uint32_t x, uint32_t y, uint32_t scale, enum TILE_SUFFIX suffix, uint32_t max_levels, h2o_iovec_t* content) {
+    char* path = static_cast<char*>(alloca(base_path_len + TILE_PHYSPATH_BUFLEN));
+    memcpy(path, base_path, base_path_len);
+    const uint32_t out = TILE_SIZE * scale;
+
+    /* For @2x, even the 1x tile of the same (zoom, x, y) makes a (blurry) substitute */
+    for (uint32_t k = scale == 2 ? 0 : 1; k <= max_levels && k <= zoom; ++k) {
+        to_physical_path(path + base_path_len, zoom - k, x >> k, y >> k, PNG);
+        if (access(path, R_OK) != 0) {
+            continue;
+        }
+        try {
+            /* The ancestor covers 2^k x 2^k tiles; ours is the (x mod 2^k, y mod 2^k)-th of them */
+            const uint32_t sub = TILE_SIZE >> k;
+            const uint32_t mask = (1u << k) - 1;
+            if (sub == 0) {
+                break;
+            }
+            std::unique_ptr<mapnik::image_reader> reader(mapnik::get_image_reader(path, "png"));
+            if (!reader || reader->width() != TILE_SIZE || reader->height() != TILE_SIZE) {
+                continue;
+            }
+            raster_t src(sub, sub);
+            reader->read((x & mask) * sub, (y & mask) * sub, src);
+            /* Nearest-neighbor is just enough for a short-lived placeholder */
+            raster_t dst(out, out);
+            for (uint32_t j = 0; j < out; ++j) {
+                for (uint32_t i = 0; i < out; ++i) {
+                    dst(i, j) = src(i * sub / out, j * sub / out);
+                }
+            }
+            if (suffix == PNG && mapnik_png_builtin) {
+                tile_png_reset(png_encoder());
+            }
+            *content = encode_as(dst, zoom, suffix);
+            return 0;
+        } catch (std::exception& e) {
+            fprintf(stderr, "[lib/handler/mapnik-bridge.cpp] Failed to upscale %s: %s\n", path, e.what());
+        }
+    }
+    return -1;
+}
+
+int render_blank_tile(void* map_ptr, uint32_t scale, h2o_iovec_t* content, char* errbuf, size_t errbuf_len) {
+    try {
+        using namespace mapnik;
+
+        /* Nothing but the background of the style */
+        Map m(*map_of(map_ptr));
+        m.remove_all();
+        m.resize(TILE_SIZE * scale, TILE_SIZE * scale);
+        double l, t, r, b;
+        tile_to_merc_box(0, 0, 0, l, t, r, b);
+        m.zoom_to_box(box2d<double>(l, t, r, b));
+        image_32 image(TILE_SIZE * scale, TILE_SIZE * scale);
+        agg_renderer<image_32> ren(m, image, scale);
+        ren.apply();
+        if (mapnik_png_builtin) {
+            tile_png_reset(png_encoder());
+        }
 #if MAPNIK_MAJOR_VERSION >= 3
-        std::string buf = save_to_string(image_view_any(vw), "png256:e=miniz");
+        *content = encode_as(image, 0, PNG);
 #else
-        std::string buf = save_to_string(vw, "png256");
+        *content = encode_as(image.data(), 0, PNG);
 #endif
-        save_tile(req, tile_path, buf.c_str(), buf.length(), H2O_STRLIT("image/png"), 0, callback);
+        return 0;
     } catch (std::exception& e) {
-        h2o_req_log_error(req, "lib/handler/mapnik-bridge.cpp", "%s", e.what());
-        req->res.status = 500;
-        req->res.reason = "internal server error";
-        h2o_send_inline(req, NULL, 0);
+        snprintf(errbuf, errbuf_len, "%s", e.what());
+        return -1;
     }
+}
 
+int get_map_extent(void* map_ptr, double* lonlat_box) {
+    /* The maximum-extent of the style, in Mercator like the tiles */
+    std::shared_ptr<const mapnik::Map> m = map_of(map_ptr);
+    const boost::optional<mapnik::box2d<double> >& extent = m->maximum_extent();
+    if (!extent) {
+        return -1;
+    }
+    merc_to_lonlat(extent->minx(), extent->maxy(), lonlat_box[0], lonlat_box[1]);
+    merc_to_lonlat(extent->maxx(), extent->miny(), lonlat_box[2], lonlat_box[3]);
+    return 0;
 }
 
 void* alloc_mapnik(const char* style_path) {
-    // To avoid label scattering, we render a 2x2 larger area and then clip the center.
-    mapnik::Map* m = new mapnik::Map(TILE_SIZE*2, TILE_SIZE*2);    
-    // Any failure in parsing the style file will immediately cause abortion by an unhandled exception, this is intended.
-    mapnik::load_map(*m, style_path);
-    return m;
+    std::string path = boost::filesystem::canonical(style_path).string();
+    std::string contents;
+    time_t mtime = mtime_of(path);
+    if (!read_style(path, contents)) {
+        throw std::runtime_error(str(boost::format("Error: failed to read the style file %1%") % path));
+    }
+    std::string base_dir = boost::filesystem::path(path).parent_path().string();
+    std::string key = key_of(contents, base_dir);
+    std::lock_guard<std::mutex> lock(loaded_maps_mutex);
+
+    auto found = loaded_maps.find(key);
+    if (found != loaded_maps.end()) {
+        loaded_map_t* loaded = found->second;
+        ++loaded->refcnt;
+        if (std::find_if(loaded->files.begin(), loaded->files.end(), [&path](const style_file_t& f) { return f.path == path; }) ==
+            loaded->files.end()) {
+            loaded->files.push_back(style_file_t{path, mtime});
+        }
+        return loaded;
+    }
+    loaded_map_t* loaded = new loaded_map_t;
+    loaded->key = key;
+    loaded->path = path;
+    loaded->xml.swap(contents);
+    loaded->base_dir = base_dir;
+    loaded->files.push_back(style_file_t{path, mtime});
+    loaded->loaded_mtime = mtime;
+    loaded->refcnt = 1;
+    loaded_maps[key] = loaded;
+    return loaded;
 }
 
-void dispose_mapnik(void* m) {
-    mapnik::Map* map = (mapnik::Map*)m;
-    delete map;
+void load_mapnik_async(void* map_ptr, void (*cb)(void*), void* data) {
+    loaded_map_t* loaded = (loaded_map_t*)map_ptr;
+
+    /* the server is up by now, thus so will be the watcher */
+    std::call_once(watcher_once, start_watching_styles);
+
+    std::lock_guard<std::mutex> lock(loaded_maps_mutex);
+    loaded->loaders.emplace_back([map_ptr, cb, data] {
+        map_of(map_ptr);
+        if (cb != NULL) {
+            cb(data);
+        }
+    });
+}
+
+void reload_mapnik_styles(void) {
+    /* async-signal-safe */
+    int saved_errno = errno;
+    if (reload_pipe[1] != -1) {
+        (void)!write(reload_pipe[1], "r", 1);
+    }
+    errno = saved_errno;
+}
+
+const char* get_map_path(void* map_ptr) {
+    return ((loaded_map_t*)map_ptr)->path.c_str();
+}
+
+time_t get_map_mtime(void* map_ptr) {
+    return ((loaded_map_t*)map_ptr)->loaded_mtime;
+}
+
+void dispose_mapnik(void* map_ptr) {
+    loaded_map_t* loaded = (loaded_map_t*)map_ptr;
+    std::vector<std::thread> loaders;
+
+    {
+        std::lock_guard<std::mutex> lock(loaded_maps_mutex);
+        loaders.swap(loaded->loaders);
+    }
+    /* the callbacks of the loads in flight may refer to what the caller is about to free */
+    for (std::thread& t : loaders) {
+        t.join();
+    }
+
+    std::lock_guard<std::mutex> lock(loaded_maps_mutex);
+    if (--loaded->refcnt == 0) {
+        loaded_maps.erase(loaded->key);
+        delete loaded;
+    }
 }
 
 void init_mapnik_datasource(const char* datasource) {
@@ -143,38 +596,47 @@ void init_mapnik_datasource(const char* datasource) {
     mapnik::datasource_cache::instance().register_datasources(datasource);
 }
 
-void load_fonts(const char *font_dir) {
-    DIR *fonts = opendir(font_dir);
+static void find_fonts(const std::string& font_dir, std::vector<std::string>& found) {
+    DIR *fonts = opendir(font_dir.c_str());
     struct dirent *entry;
-    char path[PATH_MAX]; // FIXME: Eats lots of stack space when recursive
 
     if (!fonts) {
-        fprintf(stderr, "Unable to open font directory: %s\n", font_dir);
+        fprintf(stderr, "Unable to open font directory: %s\n", font_dir.c_str());
         return;
     }
 
     while ((entry = readdir(fonts))) {
-        struct stat b;
-        char *p;
-
         if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
             continue;
-        snprintf(path, sizeof(path), "%s/%s", font_dir, entry->d_name);
-        if (stat(path, &b))
-            continue;
-        if (S_ISDIR(b.st_mode)) {
-            load_fonts(path);
+        std::string path = font_dir + "/" + entry->d_name;
+        bool is_dir = entry->d_type == DT_DIR;
+        /* stat(2) only if the filesystem doesn't tell the type, or to follow a symlink */
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            struct stat b;
+            if (stat(path.c_str(), &b))
+                continue;
+            is_dir = S_ISDIR(b.st_mode);
+        }
+        if (is_dir) {
+            find_fonts(path, found);
             continue;
         }
-        p = strrchr(path, '.');
+        const char *p = strrchr(entry->d_name, '.');
         if (p && !strcmp(p, ".ttf")) {
-#if DEBUG            
-            fprintf(stderr, "DEBUG: Loading font: %s\n", path);
-#endif
-            mapnik::freetype_engine::register_font(path);
+            found.push_back(path);
         }
     }
     closedir(fonts);
 }
 
+void load_fonts(const char *font_dir) {
+    /* just starts walking the tree, in parallel with the others; the fonts found are registered by the first load of a map */
+    std::string dir(font_dir);
+    font_walks.push_back(std::async(std::launch::async, [dir] {
+        std::vector<std::string> found;
+        find_fonts(dir, found);
+        return found;
+    }));
+}
+
 }
@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+/*
+ * A synthetic stand-in for mapnik-bridge.cpp, built by -DWITH_MAPNIK=OFF, to benchmark the serving path without Mapnik
+ * nor a database. A tile is a flat PNG of a color hashed from (zoom, x, y) with a border, i.e. deterministic (as are
+ * its ETag), and costs as much as given by the environment:
+ *   H2O_TILE_STUB_LATENCY_MS: the time spent sleeping per tile, as if waiting for the database (default: 0)
+ *   H2O_TILE_STUB_CPU_MS:     the time spent spinning per tile, as if drawing (default: 0)
+ * Every format (jpg, webp as well) is served the PNG.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "h2o.h"
+#include "tile/mapnik-bridge.h"
+
+struct st_stub_map_t {
+    char *path;
+    time_t mtime;
+};
+
+unsigned mapnik_style_watch_interval = 0;
+/* the flat tiles are deflated at Z_BEST_SPEED anyway */
+int mapnik_png_compression[TILE_MAX_ZOOM + 1];
+int mapnik_png_builtin = 1;
+
+static struct {
+    pthread_once_t once;
+    unsigned latency_ms;
+    unsigned cpu_ms;
+} stub_cost = {PTHREAD_ONCE_INIT};
+
+static unsigned getenv_ms(const char *name)
+{
+    const char *v = getenv(name);
+    return v != NULL ? (unsigned)strtoul(v, NULL, 10) : 0;
+}
+
+static void init_stub_cost(void)
+{
+    stub_cost.latency_ms = getenv_ms("H2O_TILE_STUB_LATENCY_MS");
+    stub_cost.cpu_ms = getenv_ms("H2O_TILE_STUB_CPU_MS");
+}
+
+static uint64_t now_ns(int clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void spend_cost(void)
+{
+    pthread_once(&stub_cost.once, init_stub_cost);
+    if (stub_cost.latency_ms != 0) {
+        struct timespec ts = {stub_cost.latency_ms / 1000, (stub_cost.latency_ms % 1000) * 1000000L};
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+            ;
+    }
+    if (stub_cost.cpu_ms != 0) {
+        /* of the thread, so that the cost stays the same however many threads contend for the cores */
+        uint64_t until = now_ns(CLOCK_THREAD_CPUTIME_ID) + (uint64_t)stub_cost.cpu_ms * 1000000;
+        while (now_ns(CLOCK_THREAD_CPUTIME_ID) < until)
+            ;
+    }
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static unsigned char *put_chunk(unsigned char *p, const char *type, const unsigned char *data, uint32_t len)
+{
+    put_be32(p, len);
+    memcpy(p + 4, type, 4);
+    memcpy(p + 8, data, len);
+    put_be32(p + 8 + len, (uint32_t)crc32(crc32(0, NULL, 0), p + 4, len + 4));
+    return p + 12 + len;
+}
+
+/* an RGB PNG of size x size pixels filled with rgb, framed in a darker shade */
+static int encode_png(uint32_t size, const unsigned char *rgb, h2o_iovec_t *content)
+{
+    static const unsigned char signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    size_t row_len = 1 + size * 3, raw_len = row_len * size, i;
+    unsigned char *raw = h2o_mem_alloc(raw_len), ihdr[13], *p;
+    uLongf deflated_len = compressBound(raw_len);
+    unsigned char *deflated = h2o_mem_alloc(deflated_len);
+    uint32_t x, y;
+
+    for (y = 0; y != size; ++y) {
+        unsigned char *row = raw + y * row_len;
+        row[0] = 0; /* filter: none */
+        for (x = 0; x != size; ++x) {
+            int edge = x == 0 || y == 0 || x == size - 1 || y == size - 1;
+            for (i = 0; i != 3; ++i)
+                row[1 + x * 3 + i] = edge ? rgb[i] / 2 : rgb[i];
+        }
+    }
+    if (compress2(deflated, &deflated_len, raw, raw_len, Z_BEST_SPEED) != Z_OK) {
+        free(raw);
+        free(deflated);
+        return -1;
+    }
+    free(raw);
+
+    put_be32(ihdr, size);
+    put_be32(ihdr + 4, size);
+    ihdr[8] = 8;  /* bit depth */
+    ihdr[9] = 2;  /* color type: RGB */
+    ihdr[10] = 0; /* compression */
+    ihdr[11] = 0; /* filter */
+    ihdr[12] = 0; /* interlace */
+    content->base = h2o_mem_alloc(sizeof(signature) + 12 + sizeof(ihdr) + 12 + deflated_len + 12);
+    memcpy(content->base, signature, sizeof(signature));
+    p = (unsigned char *)content->base + sizeof(signature);
+    p = put_chunk(p, "IHDR", ihdr, sizeof(ihdr));
+    p = put_chunk(p, "IDAT", deflated, (uint32_t)deflated_len);
+    p = put_chunk(p, "IEND", NULL, 0);
+    content->len = p - (unsigned char *)content->base;
+    free(deflated);
+    return 0;
+}
+
+void init_mapnik_datasource(const char *datasource)
+{
+    pthread_once(&stub_cost.once, init_stub_cost);
+}
+
+void *alloc_mapnik(const char *style_path)
+{
+    struct st_stub_map_t *map = h2o_mem_alloc(sizeof(*map));
+    char resolved[PATH_MAX];
+    struct stat st;
+
+    /* the style needn't exist */
+    map->path = h2o_strdup(NULL, realpath(style_path, resolved) != NULL ? resolved : style_path, SIZE_MAX).base;
+    map->mtime = stat(map->path, &st) == 0 ? st.st_mtime : 0;
+    return map;
+}
+
+void load_mapnik_async(void *map, void (*cb)(void *), void *data)
+{
+    /* nothing to parse */
+    if (cb != NULL)
+        cb(data);
+}
+
+void reload_mapnik_styles(void)
+{
+}
+
+const char *get_map_path(void *map)
+{
+    return ((struct st_stub_map_t *)map)->path;
+}
+
+time_t get_map_mtime(void *map)
+{
+    return ((struct st_stub_map_t *)map)->mtime;
+}
+
+void dispose_mapnik(void *_map)
+{
+    struct st_stub_map_t *map = _map;
+    free(map->path);
+    free(map);
+}
+
+void load_fonts(const char *font_dir)
+{
+}
+
+int render_tile(void *map, uint32_t zoom, uint32_t x, uint32_t y, unsigned formats, h2o_iovec_t *contents, char *errbuf,
+                size_t errbuf_len)
+{
+    uint64_t h = ((uint64_t)zoom << 58) ^ ((uint64_t)x << 29) ^ y;
+    unsigned char rgb[3];
+    uint32_t scale;
+    size_t i;
+
+    spend_cost();
+
+    /* splitmix64, for the neighbors to differ */
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    rgb[0] = 64 + (h & 0x7f);
+    rgb[1] = 64 + ((h >> 8) & 0x7f);
+    rgb[2] = 64 + ((h >> 16) & 0x7f);
+
+    for (scale = 1; scale <= 2; ++scale) {
+        h2o_iovec_t png;
+        if ((formats & TILE_FORMATS_OF_SCALE(scale)) == 0)
+            continue;
+        if (encode_png(256 * scale, rgb, &png) != 0) {
+            snprintf(errbuf, errbuf_len, "failed to encode a png");
+            return -1;
+        }
+        for (i = 0; i != TILE_NUM_SUFFIXES; ++i) {
+            h2o_iovec_t *content = contents + TILE_CONTENT_INDEX(scale, i);
+            if ((formats & TILE_FORMAT_BIT(scale, i)) == 0)
+                continue;
+            content->base = h2o_mem_alloc(png.len);
+            memcpy(content->base, png.base, png.len);
+            content->len = png.len;
+        }
+        free(png.base);
+    }
+    return 0;
+}
+
+static void render_tiles(void *map, tile_render_request_t *reqs, size_t num_reqs)
+{
+    size_t i;
+    for (i = 0; i != num_reqs; ++i)
+        reqs[i].ret = render_tile(map, reqs[i].zoom, reqs[i].x, reqs[i].y, reqs[i].formats, reqs[i].contents, reqs[i].errstr,
+                                  sizeof(reqs[i].errstr));
+}
+
+const tile_renderer_t tile_renderer_mapnik = {render_tiles, 1, 0};
+
+int render_fallback_tile(const char *base_path, size_t base_path_len, uint32_t zoom, uint32_t x, uint32_t y, uint32_t scale,
+                         enum TILE_SUFFIX suffix, uint32_t max_levels, h2o_iovec_t *content)
+{
+    /* no upscaling; the misses wait for their renders */
+    return -1;
+}
+
+int render_blank_tile(void *map, uint32_t scale, h2o_iovec_t *content, char *errbuf, size_t errbuf_len)
+{
+    static const unsigned char rgb[] = {0xf2, 0xef, 0xe9};
+    if (encode_png(256 * scale, rgb, content) != 0) {
+        snprintf(errbuf, errbuf_len, "failed to encode a png");
+        return -1;
+    }
+    return 0;
+}
+
+int get_map_extent(void *map, double *lonlat_box)
+{
+    return -1;
+}
@@ -0,0 +1,629 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "h2o.h"
+#include "tile/render-queue.h"
+#include "tile/render-worker.h"
+#include "tile/tile-dirfd-cache.h"
+#include "path-mapper.h"
+
+/* the unit of the virtual time of the weighted fair scheduling; a pick of a class advances its pass by STRIDE / weight */
+#define STRIDE 1048576
+
+struct st_tile_prerender_t {
+    MAPNIK_MAP_PTR map;
+    tile_render_quota_t *quota;
+    tile_coverage_t *const *coverage; /* NULL, or where the coverage is set once known */
+    h2o_iovec_t base_path; /* slashed */
+    uint32_t max_zoom;
+    double lon1, lat1, lon2, lat2;
+    /* cursor, pointing to the next tile to render */
+    uint32_t zoom, x, y;
+    uint32_t x_min, x_max, y_max;
+    h2o_linklist_t _link;
+};
+
+struct st_render_class_t {
+    h2o_linklist_t pending; /* anchor of tile_render_job_t::_pending */
+    size_t num_running;
+    uint64_t pass; /* virtual time of the class, for the weighted fair scheduling */
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct st_render_class_t classes[TILE_RENDER_NUM_CLASSES];
+    size_t num_running_by_zoom[TILE_MAX_ZOOM + 1];
+    uint64_t vtime;            /* pass of the class last picked */
+    h2o_linklist_t prerenders; /* anchor of tile_prerender_t::_link */
+    size_t num_threads;
+    size_t num_threads_idle;
+    h2o_linklist_t fallbacks; /* anchor of tile_render_job_t::_pending of the fallback jobs */
+    pthread_cond_t fallback_cond;
+    int fallback_thread_started;
+} queue = {PTHREAD_MUTEX_INITIALIZER,
+           PTHREAD_COND_INITIALIZER,
+           {{{&queue.classes[0].pending, &queue.classes[0].pending}},
+            {{&queue.classes[1].pending, &queue.classes[1].pending}},
+            {{&queue.classes[2].pending, &queue.classes[2].pending}}},
+           {},
+           0,
+           {&queue.prerenders, &queue.prerenders},
+           0,
+           0,
+           {&queue.fallbacks, &queue.fallbacks},
+           PTHREAD_COND_INITIALIZER,
+           0};
+
+size_t tile_render_max_threads = 1;
+const tile_renderer_t *tile_renderer = &tile_renderer_mapnik;
+tile_render_scheduler_config_t tile_render_scheduler_config = {TILE_RENDER_POLICY_STRICT, {16, 4, 1}, 1, {}};
+
+/* sets up the request of the job; returns 0 if there's nothing to render */
+static int prepare_job(tile_render_job_t *job, tile_render_request_t *req, char *paths, size_t path_len)
+{
+    struct stat st;
+    size_t i;
+    /* the raster is there anyway; keep the png variant fresh as well, since substitutes are made out of it, and so is
+       the 1x one of a @2x tile, which costs no more than downsampling */
+    const struct {
+        uint32_t scale;
+        enum TILE_SUFFIX suffix;
+    } variants[] = {{1, job->suffix}, {1, PNG}};
+
+    job->content = (h2o_iovec_t){};
+    job->errstr[0] = '\0';
+    /* a seeding job skips the tiles that are already there (e.g. rendered on demand meanwhile) */
+    if (job->_class == TILE_RENDER_CLASS_PRERENDER && tile_dirfd_stat(job->tile_path, &st) == 0)
+        return 0;
+    memset(req, 0, sizeof(*req));
+    req->zoom = job->zoom;
+    req->x = job->x;
+    req->y = job->y;
+    req->formats = 1u << TILE_CONTENT_INDEX(job->scale, job->suffix);
+    for (i = 0; i != sizeof(variants) / sizeof(variants[0]); ++i) {
+        size_t index = TILE_CONTENT_INDEX(variants[i].scale, variants[i].suffix);
+        if ((req->formats & (1u << index)) != 0)
+            continue;
+        tile_variant_path(paths + index * path_len, job->tile_path, variants[i].scale, variants[i].suffix);
+        if (tile_dirfd_stat(paths + index * path_len, &st) != 0 || st.st_mtime <= job->stale_before)
+            req->formats |= 1u << index;
+    }
+    return 1;
+}
+
+/* persists the tiles rendered, and keeps the requested one as the content of the job */
+static void complete_job(tile_render_job_t *job, tile_render_request_t *req, const char *paths, size_t path_len)
+{
+    size_t requested = TILE_CONTENT_INDEX(job->scale, job->suffix), i;
+
+    if (req->ret != 0) {
+        snprintf(job->errstr, sizeof(job->errstr), "%s", req->errstr);
+        if (job->_class == TILE_RENDER_CLASS_PRERENDER) {
+            /* no one to report to */
+            fprintf(stderr, "[lib/handler/render-queue.c] failed to render %s: %s\n", job->tile_path, job->errstr);
+        }
+        return;
+    }
+    /* contents owned by the renderer (e.g. in a shared memory) are persisted as they are; only the one sent back is copied */
+    job->content = tile_renderer->owns_contents ? h2o_strdup(NULL, req->contents[requested].base, req->contents[requested].len)
+                                                : req->contents[requested];
+    tile_etag(job->etag, job->content.base, job->content.len);
+    /* a failure in saving the tile does not affect the response, just error-logged */
+    save_tile(job->tile_path, job->content.base, job->content.len, job->etag);
+    for (i = 0; i != TILE_NUM_CONTENTS; ++i) {
+        char etag[TILE_ETAG_LEN + 1];
+        if (i == requested || req->contents[i].base == NULL)
+            continue;
+        tile_etag(etag, req->contents[i].base, req->contents[i].len);
+        save_tile(paths + i * path_len, req->contents[i].base, req->contents[i].len, etag);
+        if (!tile_renderer->owns_contents)
+            free(req->contents[i].base);
+    }
+}
+
+/* renders the jobs (of the same map) at once */
+static void render_jobs(tile_render_job_t **jobs, size_t num_jobs)
+{
+    tile_render_request_t *reqs = alloca(sizeof(*reqs) * num_jobs);
+    tile_render_job_t **rendered = alloca(sizeof(*rendered) * num_jobs);
+    char **paths = alloca(sizeof(*paths) * num_jobs);
+    size_t path_len[TILE_METATILE * TILE_METATILE], num_reqs = 0, i;
+
+    for (i = 0; i != num_jobs; ++i) {
+        path_len[num_reqs] = strlen(jobs[i]->tile_path) + 5;
+        paths[num_reqs] = alloca(TILE_NUM_CONTENTS * path_len[num_reqs]);
+        if (prepare_job(jobs[i], reqs + num_reqs, paths[num_reqs], path_len[num_reqs]))
+            rendered[num_reqs++] = jobs[i];
+    }
+    if (num_reqs == 0)
+        return;
+    tile_renderer->render(jobs[0]->map, reqs, num_reqs);
+    for (i = 0; i != num_reqs; ++i)
+        complete_job(rendered[i], reqs + i, paths[i], path_len[i]);
+}
+
+static void lonlat_to_tile(double lon, double lat, uint32_t zoom, uint32_t *tx, uint32_t *ty)
+{
+    /* Mercator projection limits the lat value to this, cf. http://wiki.openstreetmap.org/wiki/Slippy_map_tilenames#X_and_Y */
+    const double LAT_LIMIT = 85.0511;
+    const double res = (1 << zoom);
+
+    /* the same as lonlat_to_tile() of proj.hpp, with the inputs fit into the actual ranges (as yield-tiles does) */
+    lon = lon < 180.0 - 0.0000001 ? lon : 180.0 - 0.0000001;
+    lat = lat < -LAT_LIMIT ? -LAT_LIMIT : lat > LAT_LIMIT ? LAT_LIMIT : lat;
+    lat = lat * M_PI / 180.0;
+    *tx = (uint32_t)((lon + 180.0) / 360.0 * res);
+    *ty = (uint32_t)floor((1.0 - log(tan(lat) + 1.0 / cos(lat)) / M_PI) / 2.0 * res);
+}
+
+static void rewind_prerender(tile_prerender_t *p)
+{
+    uint32_t y_min;
+    lonlat_to_tile(p->lon1, p->lat1, p->zoom, &p->x_min, &y_min);
+    lonlat_to_tile(p->lon2, p->lat2, p->zoom, &p->x_max, &p->y_max);
+    p->x = p->x_min;
+    p->y = y_min;
+}
+
+/* advances the cursor of the range by step tiles in x (wrapping to the next row, then to the next zoom; lower zooms first);
+   returns 0 past the end, having freed the range */
+static int advance_prerender(tile_prerender_t *p, uint32_t step)
+{
+    if (p->x_max - p->x >= step) {
+        p->x += step;
+    } else if (p->y < p->y_max) {
+        p->x = p->x_min;
+        ++p->y;
+    } else if (p->zoom < p->max_zoom) {
+        ++p->zoom;
+        rewind_prerender(p);
+    } else {
+        h2o_linklist_unlink(&p->_link);
+        free(p->base_path.base);
+        free(p);
+        return 0;
+    }
+    return 1;
+}
+
+/* the first tile of the range at or after the cursor that may have data; returns 0 (having freed the range) if none */
+static int skip_blank_prerender(tile_prerender_t *p)
+{
+    const tile_coverage_t *coverage;
+
+    /* the tiles out of the coverage are known to be blank (and are served as such); a run of the tiles under the same
+       ancestor at TILE_COVERAGE_MAX_ZOOM is skipped at once */
+    while (p->coverage != NULL && (coverage = *p->coverage) != NULL && !tile_coverage_contains(coverage, p->zoom, p->x, p->y)) {
+        uint32_t run = p->zoom > TILE_COVERAGE_MAX_ZOOM ? 1u << (p->zoom - TILE_COVERAGE_MAX_ZOOM) : 1;
+        if (!advance_prerender(p, run - (p->x & (run - 1))))
+            return 0;
+    }
+    return 1;
+}
+
+/* pulls the next tile out of the seeding ranges into the prerender class; returns 0 if nothing remains */
+static int pull_prerender(void)
+{
+    tile_prerender_t *p;
+    tile_render_job_t *job;
+    char *tile_path;
+
+    do {
+        if (h2o_linklist_is_empty(&queue.prerenders))
+            return 0;
+        p = H2O_STRUCT_FROM_MEMBER(tile_prerender_t, _link, queue.prerenders.next);
+    } while (!skip_blank_prerender(p));
+
+    tile_path = alloca(p->base_path.len + TILE_PHYSPATH_BUFLEN);
+    memcpy(tile_path, p->base_path.base, p->base_path.len);
+    to_physical_path(tile_path + p->base_path.len, p->zoom, p->x, p->y, PNG);
+    job = tile_render_job_create(NULL, p->map, p->zoom, p->x, p->y, 1, PNG, tile_path, NULL, NULL);
+    job->quota = p->quota;
+    job->_class = TILE_RENDER_CLASS_PRERENDER;
+    job->_persist_only = 1;
+    h2o_linklist_insert(&queue.classes[TILE_RENDER_CLASS_PRERENDER].pending, &job->_pending);
+
+    advance_prerender(p, 1);
+    return 1;
+}
+
+static int zoom_is_available(uint32_t zoom)
+{
+    size_t limit = zoom <= TILE_MAX_ZOOM ? tile_render_scheduler_config.zoom_limits[zoom] : 0;
+    return limit == 0 || queue.num_running_by_zoom[zoom] < limit;
+}
+
+static int quota_is_available(tile_render_quota_t *quota)
+{
+    return quota == NULL || quota->limit == 0 || quota->num_running < quota->limit;
+}
+
+/* returns the first job of the class that can be run right now, or NULL */
+static tile_render_job_t *find_runnable(tile_render_class_t cls)
+{
+    struct st_render_class_t *c = queue.classes + cls;
+    h2o_linklist_t *node;
+
+    if (cls == TILE_RENDER_CLASS_PRERENDER) {
+        if (c->num_running >= tile_render_scheduler_config.prerender_threads)
+            return NULL;
+        if (h2o_linklist_is_empty(&c->pending) && !pull_prerender())
+            return NULL;
+    }
+    for (node = c->pending.next; node != &c->pending; node = node->next) {
+        tile_render_job_t *job = H2O_STRUCT_FROM_MEMBER(tile_render_job_t, _pending, node);
+        if (zoom_is_available(job->zoom) && quota_is_available(job->quota))
+            return job;
+    }
+    return NULL;
+}
+
+static void start_job(tile_render_job_t *job)
+{
+    h2o_linklist_unlink(&job->_pending);
+    job->_state = TILE_RENDER_JOB_RUNNING;
+    ++queue.classes[job->_class].num_running;
+    if (job->zoom <= TILE_MAX_ZOOM)
+        ++queue.num_running_by_zoom[job->zoom];
+    if (job->quota != NULL)
+        ++job->quota->num_running;
+}
+
+static tile_render_job_t *pop_job(void)
+{
+    tile_render_job_t *job = NULL;
+    size_t cls;
+
+    if (tile_render_scheduler_config.policy == TILE_RENDER_POLICY_STRICT) {
+        for (cls = 0; cls != TILE_RENDER_NUM_CLASSES; ++cls)
+            if ((job = find_runnable(cls)) != NULL)
+                break;
+    } else {
+        /* stride scheduling: pick the runnable class of the least pass */
+        size_t i;
+        for (i = 0; i != TILE_RENDER_NUM_CLASSES; ++i) {
+            tile_render_job_t *j;
+            if ((j = find_runnable(i)) != NULL && (job == NULL || queue.classes[i].pass < queue.classes[cls].pass)) {
+                job = j;
+                cls = i;
+            }
+        }
+        if (job != NULL) {
+            unsigned weight = tile_render_scheduler_config.weights[cls];
+            queue.vtime = queue.classes[cls].pass;
+            queue.classes[cls].pass += STRIDE / (weight != 0 ? weight : 1);
+        }
+    }
+    if (job != NULL)
+        start_job(job);
+    return job;
+}
+
+/* pops the runnable jobs of the same class, map & metatile as the first, up to max_jobs, to be rendered along */
+static size_t pop_mates(tile_render_job_t *first, tile_render_job_t **jobs, size_t max_jobs)
+{
+    struct st_render_class_t *c = queue.classes + first->_class;
+    h2o_linklist_t *node, *next;
+    size_t num_jobs = 0;
+
+    for (node = c->pending.next; node != &c->pending && num_jobs != max_jobs; node = next) {
+        tile_render_job_t *job = H2O_STRUCT_FROM_MEMBER(tile_render_job_t, _pending, node);
+        next = node->next;
+        if (job->map == first->map && job->zoom == first->zoom && job->x / TILE_METATILE == first->x / TILE_METATILE &&
+            job->y / TILE_METATILE == first->y / TILE_METATILE && zoom_is_available(job->zoom) && quota_is_available(job->quota)) {
+            start_job(job);
+            jobs[num_jobs++] = job;
+        }
+    }
+    return num_jobs;
+}
+
+static void enqueue(tile_render_job_t *job, tile_render_class_t cls)
+{
+    struct st_render_class_t *c = queue.classes + cls;
+
+    /* a class that has been idle must not claim the virtual time it has missed */
+    if (h2o_linklist_is_empty(&c->pending) && c->pass < queue.vtime)
+        c->pass = queue.vtime;
+    job->_class = cls;
+    h2o_linklist_insert(&c->pending, &job->_pending);
+}
+
+static void *render_thread_main(void *_unused)
+{
+    tile_render_job_t *jobs[TILE_METATILE * TILE_METATILE];
+    int persist_only[TILE_METATILE * TILE_METATILE];
+
+    pthread_mutex_lock(&queue.mutex);
+
+    while (1) {
+        while ((jobs[0] = pop_job()) != NULL) {
+            size_t max_batch = tile_renderer->max_batch < TILE_METATILE * TILE_METATILE ? tile_renderer->max_batch
+                                                                                         : TILE_METATILE * TILE_METATILE,
+                   num_jobs = 1 + (max_batch > 1 ? pop_mates(jobs[0], jobs + 1, max_batch - 1) : 0), i;
+            --queue.num_threads_idle;
+            pthread_mutex_unlock(&queue.mutex);
+            render_jobs(jobs, num_jobs);
+            pthread_mutex_lock(&queue.mutex);
+            ++queue.num_threads_idle;
+            for (i = 0; i != num_jobs; ++i) {
+                tile_render_job_t *job = jobs[i];
+                --queue.classes[job->_class].num_running;
+                if (job->zoom <= TILE_MAX_ZOOM)
+                    --queue.num_running_by_zoom[job->zoom];
+                if (job->quota != NULL)
+                    --job->quota->num_running;
+                /* the requester may have gone away while rendering; if so, nobody is there to receive the result */
+                if (!(persist_only[i] = job->_persist_only))
+                    job->_state = TILE_RENDER_JOB_DONE;
+            }
+            /* other threads may be waiting for the limits to be released */
+            pthread_cond_broadcast(&queue.cond);
+            pthread_mutex_unlock(&queue.mutex);
+            for (i = 0; i != num_jobs; ++i) {
+                if (persist_only[i]) {
+                    free(jobs[i]->content.base);
+                    free(jobs[i]);
+                } else {
+                    jobs[i]->_message = (h2o_multithread_message_t){};
+                    h2o_multithread_send_message(jobs[i]->_receiver, &jobs[i]->_message);
+                }
+            }
+            pthread_mutex_lock(&queue.mutex);
+        }
+        pthread_cond_wait(&queue.cond, &queue.mutex);
+    }
+
+    pthread_mutex_unlock(&queue.mutex);
+
+    return NULL;
+}
+
+static void create_render_thread(void)
+{
+    pthread_t tid;
+    pthread_attr_t attr;
+    int ret;
+
+    /* Mapnik eats lots of stack, so the default stack size is kept (unlike the getaddrinfo threads) */
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if ((ret = pthread_create(&tid, &attr, render_thread_main, NULL)) != 0) {
+        if (queue.num_threads == 0) {
+            fprintf(stderr, "failed to start first thread for rendering tiles:%s\n", strerror(ret));
+            abort();
+        } else {
+            perror("pthread_create(for rendering tiles)");
+        }
+        return;
+    }
+
+    ++queue.num_threads;
+    ++queue.num_threads_idle;
+}
+
+/*
+Fallback jobs are run by a thread of their own rather than by the pool: they are wanted exactly when the pool is busy
+(i.e. renders are late), and they take a few milliseconds each (decoding, scaling & encoding a tile), so one is enough.
+*/
+static void *fallback_thread_main(void *_unused)
+{
+    pthread_mutex_lock(&queue.mutex);
+
+    while (1) {
+        while (!h2o_linklist_is_empty(&queue.fallbacks)) {
+            tile_render_job_t *job = H2O_STRUCT_FROM_MEMBER(tile_render_job_t, _pending, queue.fallbacks.next);
+            int persist_only;
+            h2o_linklist_unlink(&job->_pending);
+            job->_state = TILE_RENDER_JOB_RUNNING;
+            pthread_mutex_unlock(&queue.mutex);
+            if (render_fallback_tile(job->tile_path, job->base_path_len, job->zoom, job->x, job->y, job->scale, job->suffix,
+                                     job->fallback_levels, &job->content) != 0)
+                job->content = (h2o_iovec_t){};
+            pthread_mutex_lock(&queue.mutex);
+            /* the requester may have gone away (or got the tile rendered) meanwhile */
+            if (!(persist_only = job->_persist_only))
+                job->_state = TILE_RENDER_JOB_DONE;
+            pthread_mutex_unlock(&queue.mutex);
+            if (persist_only) {
+                free(job->content.base);
+                free(job);
+            } else {
+                job->_message = (h2o_multithread_message_t){};
+                h2o_multithread_send_message(job->_receiver, &job->_message);
+            }
+            pthread_mutex_lock(&queue.mutex);
+        }
+        pthread_cond_wait(&queue.fallback_cond, &queue.mutex);
+    }
+
+    pthread_mutex_unlock(&queue.mutex);
+
+    return NULL;
+}
+
+static void start_fallback_thread(void)
+{
+    pthread_t tid;
+    pthread_attr_t attr;
+    int ret;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if ((ret = pthread_create(&tid, &attr, fallback_thread_main, NULL)) != 0) {
+        fprintf(stderr, "failed to start the thread for the fallback tiles:%s\n", strerror(ret));
+        abort();
+    }
+    queue.fallback_thread_started = 1;
+}
+
+tile_render_job_t *tile_render_job_create(h2o_multithread_receiver_t *receiver, MAPNIK_MAP_PTR map, uint32_t zoom, uint32_t x,
+                                          uint32_t y, uint32_t scale, enum TILE_SUFFIX suffix, const char *tile_path,
+                                          tile_render_job_cb cb, void *data)
+{
+    size_t tile_path_len = strlen(tile_path);
+    tile_render_job_t *job = h2o_mem_alloc(sizeof(*job) + tile_path_len + 1);
+
+    job->map = map;
+    job->zoom = zoom;
+    job->x = x;
+    job->y = y;
+    job->scale = scale;
+    job->suffix = suffix;
+    job->tile_path = (char *)job + sizeof(*job);
+    memcpy(job->tile_path, tile_path, tile_path_len + 1);
+    job->quota = NULL;
+    job->stale_before = TILE_STALE_MTIME;
+    job->fallback_levels = 0;
+    job->base_path_len = 0;
+    job->content = (h2o_iovec_t){};
+    job->errstr[0] = '\0';
+    job->cb = cb;
+    job->data = data;
+    job->_receiver = receiver;
+    job->_pending = (h2o_linklist_t){};
+    job->_state = TILE_RENDER_JOB_QUEUED;
+    job->_class = TILE_RENDER_CLASS_INTERACTIVE;
+    job->_persist_only = 0;
+
+    return job;
+}
+
+void tile_render_dispatch(tile_render_job_t *job, tile_render_class_t cls)
+{
+    pthread_mutex_lock(&queue.mutex);
+
+    enqueue(job, cls);
+
+    if (queue.num_threads_idle == 0 && queue.num_threads < tile_render_max_threads)
+        create_render_thread();
+
+    pthread_cond_signal(&queue.cond);
+    pthread_mutex_unlock(&queue.mutex);
+}
+
+void tile_render_dispatch_fallback(tile_render_job_t *job, size_t base_path_len, uint32_t max_levels)
+{
+    job->base_path_len = base_path_len;
+    job->fallback_levels = max_levels;
+
+    pthread_mutex_lock(&queue.mutex);
+
+    h2o_linklist_insert(&queue.fallbacks, &job->_pending);
+    if (!queue.fallback_thread_started)
+        start_fallback_thread();
+    pthread_cond_signal(&queue.fallback_cond);
+
+    pthread_mutex_unlock(&queue.mutex);
+}
+
+void tile_render_detach(tile_render_job_t *job, int persist)
+{
+    tile_render_job_t *to_free = NULL;
+
+    pthread_mutex_lock(&queue.mutex);
+
+    job->cb = NULL;
+    job->data = NULL;
+    switch (job->_state) {
+    case TILE_RENDER_JOB_QUEUED:
+        h2o_linklist_unlink(&job->_pending);
+        if (persist && job->fallback_levels == 0) {
+            /* nobody waits for it anymore, but the tile is still wanted soon */
+            job->_persist_only = 1;
+            enqueue(job, TILE_RENDER_CLASS_REVALIDATE);
+        } else {
+            to_free = job;
+        }
+        break;
+    case TILE_RENDER_JOB_RUNNING:
+        /* cannot be stopped halfway; let the thread save the tile and discard the result */
+        job->_persist_only = 1;
+        break;
+    case TILE_RENDER_JOB_DONE:
+        /* the result is on its way to the receiver, which discards it since cb is NULL */
+        break;
+    }
+
+    pthread_mutex_unlock(&queue.mutex);
+
+    free(to_free);
+}
+
+void tile_render_add_prerender(MAPNIK_MAP_PTR map, tile_render_quota_t *quota, tile_coverage_t *const *coverage,
+                               const char *base_path, size_t base_path_len, uint32_t min_zoom, uint32_t max_zoom, double lon1, double lat1, double lon2, double lat2)
+{
+    tile_prerender_t *p = h2o_mem_alloc(sizeof(*p));
+
+    p->map = map;
+    p->quota = quota;
+    p->coverage = coverage;
+    p->base_path = h2o_strdup_slashed(NULL, base_path, base_path_len);
+    p->max_zoom = max_zoom;
+    /* (lon1, lat1) is the north-west corner, (lon2, lat2) the south-east */
+    p->lon1 = lon1 < lon2 ? lon1 : lon2;
+    p->lon2 = lon1 < lon2 ? lon2 : lon1;
+    p->lat1 = lat1 > lat2 ? lat1 : lat2;
+    p->lat2 = lat1 > lat2 ? lat2 : lat1;
+    p->zoom = min_zoom;
+    rewind_prerender(p);
+    p->_link = (h2o_linklist_t){};
+
+    pthread_mutex_lock(&queue.mutex);
+    h2o_linklist_insert(&queue.prerenders, &p->_link);
+    pthread_mutex_unlock(&queue.mutex);
+}
+
+void tile_render_start_prerender(void)
+{
+    pthread_mutex_lock(&queue.mutex);
+
+    if (!h2o_linklist_is_empty(&queue.prerenders)) {
+        while (queue.num_threads < tile_render_max_threads && queue.num_threads < tile_render_scheduler_config.prerender_threads)
+            create_render_thread();
+        pthread_cond_broadcast(&queue.cond);
+    }
+
+    pthread_mutex_unlock(&queue.mutex);
+}
+
+void tile_render_receiver(h2o_multithread_receiver_t *receiver, h2o_linklist_t *messages)
+{
+    while (!h2o_linklist_is_empty(messages)) {
+        tile_render_job_t *job = H2O_STRUCT_FROM_MEMBER(tile_render_job_t, _message.link, messages->next);
+        h2o_linklist_unlink(&job->_message.link);
+        tile_render_job_cb cb = job->cb;
+        if (cb != NULL) {
+            job->cb = NULL;
+            cb(job);
+        }
+        free(job->content.base);
+        free(job);
+    }
+}
@@ -0,0 +1,532 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "h2o.h"
+#include "h2o/serverutil.h"
+#include "tile/render-remote.h"
+
+struct st_render_daemon_t {
+    char *addr; /* as given */
+    struct sockaddr_storage sa; /* of a unix socket; AF_UNSPEC for host:port, which is resolved on connecting */
+    char *host, *port;
+};
+
+static H2O_VECTOR(struct st_render_daemon_t) daemons;
+
+/* the largest content accepted from a daemon; a tile, even @2x, is orders of magnitude smaller */
+#define MAX_CONTENT_LEN (64 * 1024 * 1024)
+
+unsigned tile_render_remote_timeout = 300;
+
+/* the connection of the render thread */
+static __thread int thread_sock = -1;
+static __thread size_t thread_daemon = SIZE_MAX;
+
+static int write_fully(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len != 0) {
+        ssize_t r;
+        while ((r = write(fd, p, len)) == -1 && errno == EINTR)
+            ;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int read_fully(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len != 0) {
+        ssize_t r;
+        while ((r = read(fd, p, len)) == -1 && errno == EINTR)
+            ;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int parse_addr(const char *addr, struct sockaddr_storage *sa, char **host, char **port)
+{
+    memset(sa, 0, sizeof(*sa));
+    *host = *port = NULL;
+    if (strncmp(addr, "unix:", 5) == 0) {
+        struct sockaddr_un *sun = (void *)sa;
+        if (strlen(addr + 5) >= sizeof(sun->sun_path))
+            return -1;
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, addr + 5);
+    } else {
+        const char *colon = strrchr(addr, ':');
+        if (colon == NULL || colon == addr || colon[1] == '\0')
+            return -1;
+        sa->ss_family = AF_UNSPEC;
+        *host = h2o_strdup(NULL, addr, colon - addr).base;
+        *port = h2o_strdup(NULL, colon + 1, SIZE_MAX).base;
+    }
+    return 0;
+}
+
+int tile_render_remote_add_daemon(const char *addr)
+{
+    struct st_render_daemon_t *d;
+
+    h2o_vector_reserve(NULL, &daemons, daemons.size + 1);
+    d = daemons.entries + daemons.size;
+    if (parse_addr(addr, &d->sa, &d->host, &d->port) != 0)
+        return -1;
+    d->addr = h2o_strdup(NULL, addr, SIZE_MAX).base;
+    ++daemons.size;
+    return 0;
+}
+
+/* a read or a write (or a connect) blocking longer than tile_render_remote_timeout fails with EAGAIN */
+static void set_timeout(int fd)
+{
+    struct timeval tv = {tile_render_remote_timeout, 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int connect_to(struct st_render_daemon_t *d)
+{
+    int fd = -1;
+
+    if (d->sa.ss_family == AF_UNIX) {
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+            return -1;
+        set_timeout(fd);
+        if (connect(fd, (struct sockaddr *)&d->sa, sizeof(struct sockaddr_un)) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct addrinfo hints = {}, *res, *ai;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(d->host, d->port, &hints, &res) != 0)
+            return -1;
+        for (ai = res; ai != NULL; ai = ai->ai_next) {
+            if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) == -1)
+                continue;
+            set_timeout(fd);
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                int on = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                break;
+            }
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+    }
+    return fd;
+}
+
+static void disconnect(void)
+{
+    close(thread_sock);
+    thread_sock = -1;
+}
+
+/* pipelines the requests over the connection; returns 0 if answered (even by NOT_DONE), 1 if BUSY, or -1 on I/O errors
+   (including timeouts) and on malformed responses, after which the connection is not to be used any more */
+static int render_over(const char *style, tile_render_request_t *reqs, size_t num_reqs)
+{
+    tile_remote_request_t *wire = alloca(sizeof(*wire) * num_reqs);
+    size_t i, j;
+
+    for (i = 0; i != num_reqs; ++i) {
+        memset(wire + i, 0, sizeof(wire[i]));
+        wire[i].ver = htonl(TILE_REMOTE_PROTO_VERSION);
+        wire[i].cmd = htonl(TILE_REMOTE_CMD_RENDER);
+        wire[i].zoom = htonl(reqs[i].zoom);
+        wire[i].x = htonl(reqs[i].x);
+        wire[i].y = htonl(reqs[i].y);
+        wire[i].formats = htonl(reqs[i].formats);
+        snprintf(wire[i].style, sizeof(wire[i].style), "%s", style);
+    }
+    if (write_fully(thread_sock, wire, sizeof(*wire) * num_reqs) != 0)
+        return -1;
+
+    /* answered in order */
+    for (i = 0; i != num_reqs; ++i) {
+        tile_remote_response_t res;
+        uint32_t cmd;
+        if (read_fully(thread_sock, &res, sizeof(res)) != 0 || ntohl(res.ver) != TILE_REMOTE_PROTO_VERSION)
+            return -1;
+        /* an answer to another tile means the stream is out of sync */
+        if ((cmd = ntohl(res.cmd)) != TILE_REMOTE_CMD_BUSY &&
+            (ntohl(res.zoom) != reqs[i].zoom || ntohl(res.x) != reqs[i].x || ntohl(res.y) != reqs[i].y)) {
+            fprintf(stderr, "[lib/handler/render-remote.c] %s answered %u/%u/%u for %u/%u/%u\n", daemons.entries[thread_daemon].addr,
+                    ntohl(res.zoom), ntohl(res.x), ntohl(res.y), reqs[i].zoom, reqs[i].x, reqs[i].y);
+            return -1;
+        }
+        switch (cmd) {
+        case TILE_REMOTE_CMD_DONE:
+            reqs[i].ret = 0;
+            for (j = 0; j != TILE_NUM_CONTENTS; ++j) {
+                size_t len = ntohl(res.lengths[j]);
+                if (len == 0)
+                    continue;
+                if (len > MAX_CONTENT_LEN || (reqs[i].formats & (1u << j)) == 0) {
+                    fprintf(stderr, "[lib/handler/render-remote.c] %s answered a malformed content of %zu bytes\n",
+                            daemons.entries[thread_daemon].addr, len);
+                    return -1;
+                }
+                reqs[i].contents[j] = h2o_iovec_init(h2o_mem_alloc(len), len);
+                if (read_fully(thread_sock, reqs[i].contents[j].base, len) != 0)
+                    return -1;
+            }
+            break;
+        case TILE_REMOTE_CMD_NOT_DONE:
+            reqs[i].ret = -1;
+            res.errstr[sizeof(res.errstr) - 1] = '\0';
+            snprintf(reqs[i].errstr, sizeof(reqs[i].errstr), "%s", res.errstr);
+            break;
+        case TILE_REMOTE_CMD_BUSY:
+            if (i == 0)
+                return 1;
+        /* fallthru */
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void render_tiles(MAPNIK_MAP_PTR map, tile_render_request_t *reqs, size_t num_reqs)
+{
+    char style[TILE_REMOTE_STYLE_MAXLEN];
+    size_t i, j, num_tried;
+
+    do { /* the style goes by the basename of its file w/o the extension */
+        const char *path = get_map_path(map), *name = strrchr(path, '/'), *ext;
+        name = name != NULL ? name + 1 : path;
+        ext = strrchr(name, '.');
+        snprintf(style, sizeof(style), "%.*s", (int)(ext != NULL ? ext - name : strlen(name)), name);
+    } while (0);
+
+    for (num_tried = 0; num_tried != daemons.size; ++num_tried) {
+        int ret;
+        if (thread_sock == -1) {
+            /* spread the threads over the daemons, and move on to the next on failures */
+            thread_daemon = thread_daemon == SIZE_MAX ? (size_t)rand() % daemons.size : (thread_daemon + 1) % daemons.size;
+            if ((thread_sock = connect_to(daemons.entries + thread_daemon)) == -1) {
+                fprintf(stderr, "[lib/handler/render-remote.c] failed to connect to %s\n", daemons.entries[thread_daemon].addr);
+                continue;
+            }
+        }
+        errno = 0;
+        if ((ret = render_over(style, reqs, num_reqs)) == 0)
+            return;
+        if (ret == -1)
+            fprintf(stderr, "[lib/handler/render-remote.c] %s the connection to %s\n",
+                    errno == EAGAIN || errno == EWOULDBLOCK ? "timed out" : "lost", daemons.entries[thread_daemon].addr);
+        disconnect();
+        /* drop what has been read, to render all over again */
+        for (i = 0; i != num_reqs; ++i) {
+            for (j = 0; j != TILE_NUM_CONTENTS; ++j) {
+                free(reqs[i].contents[j].base);
+                reqs[i].contents[j] = (h2o_iovec_t){};
+            }
+        }
+    }
+
+    for (i = 0; i != num_reqs; ++i) {
+        reqs[i].ret = -1;
+        snprintf(reqs[i].errstr, sizeof(reqs[i].errstr), "no render daemon is available");
+    }
+}
+
+const tile_renderer_t tile_renderer_remote = {render_tiles, TILE_METATILE * TILE_METATILE, 0};
+
+/* the daemon */
+
+struct st_daemon_style_t {
+    char *name;
+    MAPNIK_MAP_PTR map;
+};
+
+static struct {
+    H2O_VECTOR(struct st_daemon_style_t) styles;
+    size_t max_connections;
+    size_t num_connections;
+} daemon_conf;
+
+static void respond_busy(int fd)
+{
+    tile_remote_response_t res = {};
+
+    res.ver = htonl(TILE_REMOTE_PROTO_VERSION);
+    res.cmd = htonl(TILE_REMOTE_CMD_BUSY);
+    write_fully(fd, &res, sizeof(res));
+}
+
+static void *serve_connection(void *_fd)
+{
+    int fd = (int)(intptr_t)_fd;
+    tile_remote_request_t req;
+
+    /* one by one in order, as the requests are pipelined */
+    while (read_fully(fd, &req, sizeof(req)) == 0 && ntohl(req.ver) == TILE_REMOTE_PROTO_VERSION &&
+           ntohl(req.cmd) == TILE_REMOTE_CMD_RENDER) {
+        tile_remote_response_t res = {};
+        h2o_iovec_t contents[TILE_NUM_CONTENTS] = {};
+        MAPNIK_MAP_PTR map = NULL;
+        size_t i;
+        int ok = 1;
+
+        req.style[sizeof(req.style) - 1] = '\0';
+        for (i = 0; i != daemon_conf.styles.size; ++i)
+            if (strcmp(daemon_conf.styles.entries[i].name, req.style) == 0)
+                map = daemon_conf.styles.entries[i].map;
+        res.ver = htonl(TILE_REMOTE_PROTO_VERSION);
+        res.zoom = req.zoom;
+        res.x = req.x;
+        res.y = req.y;
+        if (map == NULL) {
+            snprintf(res.errstr, sizeof(res.errstr), "unknown style: %s", req.style);
+            res.cmd = htonl(TILE_REMOTE_CMD_NOT_DONE);
+        } else if (render_tile(map, ntohl(req.zoom), ntohl(req.x), ntohl(req.y), ntohl(req.formats) & ((1u << TILE_NUM_CONTENTS) - 1),
+                               contents, res.errstr, sizeof(res.errstr)) != 0) {
+            res.cmd = htonl(TILE_REMOTE_CMD_NOT_DONE);
+        } else {
+            res.cmd = htonl(TILE_REMOTE_CMD_DONE);
+            for (i = 0; i != TILE_NUM_CONTENTS; ++i)
+                res.lengths[i] = htonl((uint32_t)contents[i].len);
+        }
+        if (write_fully(fd, &res, sizeof(res)) != 0)
+            ok = 0;
+        for (i = 0; i != TILE_NUM_CONTENTS; ++i) {
+            if (ok && contents[i].len != 0 && write_fully(fd, contents[i].base, contents[i].len) != 0)
+                ok = 0;
+            free(contents[i].base);
+        }
+        if (!ok)
+            break;
+    }
+
+    close(fd);
+    __sync_sub_and_fetch(&daemon_conf.num_connections, 1);
+    return NULL;
+}
+
+static void on_sigusr1(int signo)
+{
+    reload_mapnik_styles();
+}
+
+static int listen_at(const char *addr)
+{
+    struct sockaddr_storage sa;
+    char *host, *port;
+    int fd = -1, on = 1;
+
+    if (parse_addr(addr, &sa, &host, &port) != 0) {
+        fprintf(stderr, "malformed address: %s\n", addr);
+        return -1;
+    }
+    if (sa.ss_family == AF_UNIX) {
+        unlink(((struct sockaddr_un *)&sa)->sun_path);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ||
+            bind(fd, (struct sockaddr *)&sa, sizeof(struct sockaddr_un)) != 0)
+            goto Error;
+    } else {
+        struct addrinfo hints = {}, *res;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(strcmp(host, "*") == 0 ? NULL : host, port, &hints, &res) != 0) {
+            fprintf(stderr, "failed to resolve the address: %s\n", addr);
+            return -1;
+        }
+        if ((fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol)) == -1 ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 || bind(fd, res->ai_addr, res->ai_addrlen) != 0) {
+            freeaddrinfo(res);
+            goto Error;
+        }
+        freeaddrinfo(res);
+    }
+    if (listen(fd, H2O_SOMAXCONN) != 0)
+        goto Error;
+    return fd;
+
+Error:
+    perror(addr);
+    if (fd != -1)
+        close(fd);
+    return -1;
+}
+
+int tile_render_daemon_main(int argc, char **argv)
+{
+    static struct option longopts[] = {{"listen", required_argument, NULL, 'l'},
+                                       {"style", required_argument, NULL, 's'},
+                                       {"datasource", required_argument, NULL, 'd'},
+                                       {"fonts", required_argument, NULL, 'f'},
+                                       {"max-connections", required_argument, NULL, 'c'},
+                                       {"style-watch", required_argument, NULL, 'w'},
+                                       {"png-encoder", required_argument, NULL, 'e'},
+                                       {"png-compression", required_argument, NULL, 'z'},
+                                       {NULL, 0, NULL, 0}};
+    const char *listen_addr = NULL, *datasource = NULL;
+    H2O_VECTOR(const char *) style_args = {};
+    size_t i;
+    int ch, listen_fd;
+
+    daemon_conf.max_connections = h2o_numproc();
+    /* argv[0] is "--render-daemon" */
+    while ((ch = getopt_long(argc, argv, "l:s:d:f:c:w:e:z:", longopts, NULL)) != -1) {
+        switch (ch) {
+        case 'l':
+            listen_addr = optarg;
+            break;
+        case 's':
+            h2o_vector_reserve(NULL, &style_args, style_args.size + 1);
+            style_args.entries[style_args.size++] = optarg;
+            break;
+        case 'd':
+            datasource = optarg;
+            break;
+        case 'f':
+            load_fonts(optarg);
+            break;
+        case 'c':
+            if (sscanf(optarg, "%zu", &daemon_conf.max_connections) != 1 || daemon_conf.max_connections == 0) {
+                fprintf(stderr, "--max-connections must be >=1\n");
+                return EX_USAGE;
+            }
+            break;
+        case 'w':
+            mapnik_style_watch_interval = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'e':
+            if (strcmp(optarg, "builtin") != 0 && strcmp(optarg, "mapnik") != 0) {
+                fprintf(stderr, "--png-encoder must be either builtin or mapnik\n");
+                return EX_USAGE;
+            }
+            mapnik_png_builtin = strcmp(optarg, "builtin") == 0;
+            break;
+        case 'z': {
+            /* zoom[-zoom]=level, as the mapping of mapnik-png-compression */
+            unsigned z1, z2;
+            int level;
+            if (sscanf(optarg, "%u-%u=%d", &z1, &z2, &level) != 3) {
+                if (sscanf(optarg, "%u=%d", &z1, &level) != 2) {
+                    fprintf(stderr, "--png-compression must be zoom[-zoom]=level\n");
+                    return EX_USAGE;
+                }
+                z2 = z1;
+            }
+            if (z1 > z2 || z2 > TILE_MAX_ZOOM || level < 1 || level > 9) {
+                fprintf(stderr, "--png-compression must be of zooms within [0, %d] and a level within [1, 9]\n", TILE_MAX_ZOOM);
+                return EX_USAGE;
+            }
+            for (; z1 <= z2; ++z1)
+                mapnik_png_compression[z1] = level;
+        } break;
+        default:
+            return EX_USAGE;
+        }
+    }
+    if (listen_addr == NULL || style_args.size == 0) {
+        fprintf(stderr, "usage: h2o-tile --render-daemon --listen (unix:/path|host:port) --style [name=]path ... [--datasource dir]\n"
+                        "                [--fonts dir ...] [--max-connections n] [--style-watch seconds]\n"
+                        "                [--png-encoder builtin|mapnik] [--png-compression zoom[-zoom]=level ...]\n");
+        return EX_USAGE;
+    }
+
+    init_mapnik_datasource(datasource);
+    for (i = 0; i != style_args.size; ++i) {
+        const char *arg = style_args.entries[i], *eq = strchr(arg, '='), *path, *name, *ext;
+        struct st_daemon_style_t *style;
+        h2o_vector_reserve(NULL, &daemon_conf.styles, daemon_conf.styles.size + 1);
+        style = daemon_conf.styles.entries + daemon_conf.styles.size++;
+        if (eq != NULL) {
+            style->name = h2o_strdup(NULL, arg, eq - arg).base;
+            path = eq + 1;
+        } else {
+            path = arg;
+            name = strrchr(path, '/');
+            name = name != NULL ? name + 1 : path;
+            ext = strrchr(name, '.');
+            style->name = h2o_strdup(NULL, name, ext != NULL ? (size_t)(ext - name) : SIZE_MAX).base;
+        }
+        style->map = alloc_mapnik(path);
+        load_mapnik_async(style->map, NULL, NULL);
+    }
+
+    if ((listen_fd = listen_at(listen_addr)) == -1)
+        return EX_OSERR;
+    h2o_set_signal_handler(SIGPIPE, SIG_IGN);
+    h2o_set_signal_handler(SIGUSR1, on_sigusr1);
+
+    while (1) {
+        pthread_t tid;
+        pthread_attr_t attr;
+        int fd;
+        if ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("accept");
+            continue;
+        }
+        if (__sync_add_and_fetch(&daemon_conf.num_connections, 1) > daemon_conf.max_connections) {
+            respond_busy(fd);
+            close(fd);
+            __sync_sub_and_fetch(&daemon_conf.num_connections, 1);
+            continue;
+        }
+        /* Mapnik eats lots of stack, so the default stack size is kept */
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&tid, &attr, serve_connection, (void *)(intptr_t)fd) != 0) {
+            perror("pthread_create");
+            close(fd);
+            __sync_sub_and_fetch(&daemon_conf.num_connections, 1);
+        }
+    }
+
+    return 0;
+}
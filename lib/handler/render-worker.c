@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "h2o.h"
+#include "h2o/serverutil.h"
+#include "tile/render-worker.h"
+#include "tile/render-queue.h"
+
+/* the fds of a worker, as mapped by the spawner */
+#define WORKER_SOCK_FD 3
+#define WORKER_SHM_FD 4
+/* enough for the largest set of contents (@2x & 1x, in every format) of a tile; the pages are allocated as touched.
+   A tile that doesn't fit fails to render (the worker answers an error) */
+#define WORKER_SHM_SIZE (64 * 1024 * 1024)
+
+struct st_render_worker_request_t {
+    uint32_t zoom, x, y;
+    uint32_t formats;
+    uint32_t style_path_len; /* followed by the path, w/o NUL */
+};
+
+struct st_render_worker_response_t {
+    int32_t ret;
+    uint32_t offsets[TILE_NUM_CONTENTS], lengths[TILE_NUM_CONTENTS]; /* into the shared memory */
+    char errstr[256];
+};
+
+struct st_render_worker_t {
+    pid_t pid;
+    int sock;
+    int shm_fd;
+    char *shm;
+    size_t slot; /* index into workers.pids, kept by the thread across respawns */
+};
+
+static struct {
+    char exe_path[PATH_MAX];
+    H2O_VECTOR(char *) args; /* passed to the workers after "--render-worker" */
+    pid_t *pids;             /* of the workers alive, read by the signal handler */
+    size_t num_slots;
+    size_t next_slot;
+} workers;
+
+unsigned tile_render_worker_timeout = 300;
+size_t tile_render_worker_memory_limit = 4096;
+
+static __thread struct st_render_worker_t *thread_worker;
+static __thread size_t thread_slot = SIZE_MAX;
+
+static int write_fully(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len != 0) {
+        ssize_t r;
+        while ((r = write(fd, p, len)) == -1 && errno == EINTR)
+            ;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int read_fully(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len != 0) {
+        ssize_t r;
+        while ((r = read(fd, p, len)) == -1 && errno == EINTR)
+            ;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static uint64_t now_msec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* waits for the events on fd until the deadline (0 for none); returns 0, or -1 with errno set to ETIMEDOUT */
+static int wait_until(int fd, short events, uint64_t deadline)
+{
+    while (1) {
+        struct pollfd pfd = {fd, events, 0};
+        int timeout = -1, ret;
+        if (deadline != 0) {
+            uint64_t now = now_msec();
+            if (now >= deadline) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            timeout = (int)(deadline - now);
+        }
+        if ((ret = poll(&pfd, 1, timeout)) > 0)
+            return 0;
+        if (ret == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (errno != EINTR)
+            return -1;
+    }
+}
+
+/* write_fully() & read_fully() on a non-blocking fd, giving up at the deadline */
+static int write_until(int fd, const void *buf, size_t len, uint64_t deadline)
+{
+    const char *p = buf;
+    while (len != 0) {
+        ssize_t r;
+        while ((r = write(fd, p, len)) == -1 && errno == EINTR)
+            ;
+        if (r == -1 && errno == EAGAIN) {
+            if (wait_until(fd, POLLOUT, deadline) != 0)
+                return -1;
+            continue;
+        }
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int read_until(int fd, void *buf, size_t len, uint64_t deadline)
+{
+    char *p = buf;
+    while (len != 0) {
+        ssize_t r;
+        while ((r = read(fd, p, len)) == -1 && errno == EINTR)
+            ;
+        if (r == -1 && errno == EAGAIN) {
+            if (wait_until(fd, POLLIN, deadline) != 0)
+                return -1;
+            continue;
+        }
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+void tile_render_worker_setup(const char *datasource, const char **font_dirs, size_t num_font_dirs)
+{
+    char buf[32];
+    ssize_t len;
+    size_t i;
+
+    if ((len = readlink("/proc/self/exe", workers.exe_path, sizeof(workers.exe_path) - 1)) == -1) {
+        perror("[lib/handler/render-worker.c] readlink(/proc/self/exe)");
+        abort();
+    }
+    workers.exe_path[len] = '\0';
+
+    h2o_vector_reserve(NULL, &workers.args, num_font_dirs + 7);
+    workers.args.entries[workers.args.size++] = workers.exe_path;
+    workers.args.entries[workers.args.size++] = (char *)"--render-worker";
+    sprintf(buf, "%u", mapnik_style_watch_interval);
+    workers.args.entries[workers.args.size++] = h2o_strdup(NULL, buf, SIZE_MAX).base;
+    /* the png encoder & the levels by zoom, as "builtin:level,level,..." */
+    {
+        char png[sizeof("builtin:") + 2 * (TILE_MAX_ZOOM + 1)], *p = png;
+        p += sprintf(p, "%s:", mapnik_png_builtin ? "builtin" : "mapnik");
+        for (i = 0; i <= TILE_MAX_ZOOM; ++i)
+            p += sprintf(p, i == 0 ? "%d" : ",%d", mapnik_png_compression[i]);
+        workers.args.entries[workers.args.size++] = h2o_strdup(NULL, png, SIZE_MAX).base;
+    }
+    sprintf(buf, "%zu", tile_render_worker_memory_limit);
+    workers.args.entries[workers.args.size++] = h2o_strdup(NULL, buf, SIZE_MAX).base;
+    workers.args.entries[workers.args.size++] = h2o_strdup(NULL, datasource != NULL ? datasource : "", SIZE_MAX).base;
+    for (i = 0; i != num_font_dirs; ++i) {
+        h2o_vector_reserve(NULL, &workers.args, workers.args.size + 2);
+        workers.args.entries[workers.args.size++] = h2o_strdup(NULL, font_dirs[i], SIZE_MAX).base;
+    }
+    workers.args.entries[workers.args.size] = NULL;
+
+    workers.num_slots = tile_render_max_threads;
+    workers.pids = h2o_mem_alloc(sizeof(*workers.pids) * workers.num_slots);
+    for (i = 0; i != workers.num_slots; ++i)
+        workers.pids[i] = 0;
+}
+
+static struct st_render_worker_t *spawn_worker(size_t slot)
+{
+    struct st_render_worker_t *worker = h2o_mem_alloc(sizeof(*worker));
+    int fds[2];
+
+    worker->slot = slot;
+    worker->sock = -1;
+    worker->shm = MAP_FAILED;
+    if ((worker->shm_fd = memfd_create("h2o-tile-render-worker", MFD_CLOEXEC)) == -1 ||
+        ftruncate(worker->shm_fd, WORKER_SHM_SIZE) != 0) {
+        perror("[lib/handler/render-worker.c] memfd");
+        goto Error;
+    }
+    if ((worker->shm = mmap(NULL, WORKER_SHM_SIZE, PROT_READ, MAP_SHARED, worker->shm_fd, 0)) == MAP_FAILED) {
+        perror("[lib/handler/render-worker.c] mmap");
+        goto Error;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+        perror("[lib/handler/render-worker.c] socketpair");
+        goto Error;
+    }
+    worker->sock = fds[0];
+    /* the thread waits for the worker no longer than tile_render_worker_timeout */
+    fcntl(worker->sock, F_SETFL, O_NONBLOCK);
+    do { /* scoping */
+        int mapped_fds[] = {fds[1], WORKER_SOCK_FD, worker->shm_fd, WORKER_SHM_FD, -1};
+        worker->pid = h2o_spawnp(workers.exe_path, workers.args.entries, mapped_fds, 0);
+    } while (0);
+    close(fds[1]);
+    if (worker->pid == -1) {
+        perror("[lib/handler/render-worker.c] failed to spawn a render worker");
+        goto Error;
+    }
+    workers.pids[slot] = worker->pid;
+    return worker;
+
+Error:
+    if (worker->sock != -1)
+        close(worker->sock);
+    if (worker->shm != MAP_FAILED)
+        munmap(worker->shm, WORKER_SHM_SIZE);
+    if (worker->shm_fd != -1)
+        close(worker->shm_fd);
+    free(worker);
+    return NULL;
+}
+
+static void reap_worker(struct st_render_worker_t *worker)
+{
+    int status = 0;
+
+    workers.pids[worker->slot] = 0;
+    close(worker->sock);
+    kill(worker->pid, SIGKILL);
+    while (waitpid(worker->pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    if (WIFSIGNALED(status))
+        fprintf(stderr, "[lib/handler/render-worker.c] render worker %d was killed by signal %d; respawning\n", (int)worker->pid,
+                WTERMSIG(status));
+    munmap(worker->shm, WORKER_SHM_SIZE);
+    close(worker->shm_fd);
+    free(worker);
+}
+
+/* renders the tile by the worker of the calling (render) thread, spawning it if not yet */
+static int render_by_worker(const char *style_path, uint32_t zoom, uint32_t x, uint32_t y, unsigned formats,
+                            h2o_iovec_t *contents, char *errbuf, size_t errbuf_len)
+{
+    struct st_render_worker_request_t req = {zoom, x, y, formats, (uint32_t)strlen(style_path)};
+    struct st_render_worker_response_t res;
+    uint64_t deadline = tile_render_worker_timeout != 0 ? now_msec() + tile_render_worker_timeout * (uint64_t)1000 : 0;
+    size_t i;
+
+    if (thread_worker == NULL) {
+        if (thread_slot == SIZE_MAX)
+            thread_slot = __sync_fetch_and_add(&workers.next_slot, 1);
+        if ((thread_worker = spawn_worker(thread_slot)) == NULL) {
+            snprintf(errbuf, errbuf_len, "failed to spawn a render worker");
+            return -1;
+        }
+    }
+
+    if (write_until(thread_worker->sock, &req, sizeof(req), deadline) != 0 ||
+        write_until(thread_worker->sock, style_path, req.style_path_len, deadline) != 0 ||
+        read_until(thread_worker->sock, &res, sizeof(res), deadline) != 0) {
+        /* the worker is gone (most likely by the job at hand), or stuck; it is killed, and the next job gets a new one */
+        if (errno == ETIMEDOUT) {
+            snprintf(errbuf, errbuf_len, "render worker %d timed out after %u seconds", (int)thread_worker->pid,
+                     tile_render_worker_timeout);
+        } else {
+            snprintf(errbuf, errbuf_len, "render worker %d died while rendering", (int)thread_worker->pid);
+        }
+        goto Reap;
+    }
+    if (res.ret != 0) {
+        snprintf(errbuf, errbuf_len, "%s", res.errstr);
+        return -1;
+    }
+    for (i = 0; i != TILE_NUM_CONTENTS; ++i) {
+        if ((formats & (1u << i)) == 0)
+            continue;
+        if (res.offsets[i] > WORKER_SHM_SIZE || res.lengths[i] > WORKER_SHM_SIZE - res.offsets[i]) {
+            snprintf(errbuf, errbuf_len, "render worker %d answered a content out of the shared memory", (int)thread_worker->pid);
+            goto Reap;
+        }
+        contents[i] = h2o_iovec_init(thread_worker->shm + res.offsets[i], res.lengths[i]);
+    }
+    return 0;
+
+Reap:
+    for (i = 0; i != TILE_NUM_CONTENTS; ++i)
+        contents[i] = (h2o_iovec_t){};
+    reap_worker(thread_worker);
+    thread_worker = NULL;
+    return -1;
+}
+
+static void render_tiles(MAPNIK_MAP_PTR map, tile_render_request_t *reqs, size_t num_reqs)
+{
+    size_t i;
+
+    /* one by one, as the contents of a tile take the whole shared memory */
+    for (i = 0; i != num_reqs; ++i)
+        reqs[i].ret = render_by_worker(get_map_path(map), reqs[i].zoom, reqs[i].x, reqs[i].y, reqs[i].formats, reqs[i].contents,
+                                       reqs[i].errstr, sizeof(reqs[i].errstr));
+}
+
+const tile_renderer_t tile_renderer_process = {render_tiles, 1, 1};
+
+void tile_render_worker_kill(int signo)
+{
+    size_t i;
+
+    for (i = 0; i != workers.num_slots; ++i)
+        if (workers.pids[i] > 0)
+            kill(workers.pids[i], signo);
+}
+
+/* the maps loaded by a worker, by the path of the style */
+static H2O_VECTOR(struct {
+    char *style_path;
+    MAPNIK_MAP_PTR map;
+}) worker_maps;
+
+static MAPNIK_MAP_PTR get_worker_map(const char *style_path)
+{
+    size_t i;
+
+    for (i = 0; i != worker_maps.size; ++i)
+        if (strcmp(worker_maps.entries[i].style_path, style_path) == 0)
+            return worker_maps.entries[i].map;
+    h2o_vector_reserve(NULL, &worker_maps, worker_maps.size + 1);
+    worker_maps.entries[worker_maps.size].style_path = h2o_strdup(NULL, style_path, SIZE_MAX).base;
+    worker_maps.entries[worker_maps.size].map = alloc_mapnik(style_path);
+    /* parses it, and keeps watching it as the server does */
+    load_mapnik_async(worker_maps.entries[worker_maps.size].map, NULL, NULL);
+    return worker_maps.entries[worker_maps.size++].map;
+}
+
+static void on_worker_sigusr1(int signo)
+{
+    reload_mapnik_styles();
+}
+
+int tile_render_worker_main(int argc, char **argv)
+{
+    char *shm, style_path[PATH_MAX];
+    unsigned long long limit;
+    int i;
+
+    /* argv: --render-worker style-watch-interval png-encoder memory-limit datasource [font-dir ...] */
+    if (argc < 6) {
+        fprintf(stderr, "[lib/handler/render-worker.c] missing arguments; not to be run by hand\n");
+        return EX_USAGE;
+    }
+    if ((shm = mmap(NULL, WORKER_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, WORKER_SHM_FD, 0)) == MAP_FAILED) {
+        perror("[lib/handler/render-worker.c] mmap");
+        return EX_OSERR;
+    }
+    /* a blowup of Mapnik fails the render at hand (by std::bad_alloc), instead of dragging the host into swapping */
+    if ((limit = strtoull(argv[4], NULL, 10)) != 0) {
+        struct rlimit rl = {(rlim_t)limit * 1024 * 1024, (rlim_t)limit * 1024 * 1024};
+        if (setrlimit(RLIMIT_AS, &rl) != 0)
+            perror("[lib/handler/render-worker.c] setrlimit(RLIMIT_AS)");
+    }
+    mapnik_style_watch_interval = (unsigned)strtoul(argv[2], NULL, 10);
+    {
+        const char *p = strchr(argv[3], ':');
+        mapnik_png_builtin = strncmp(argv[3], "builtin:", sizeof("builtin:") - 1) == 0;
+        for (i = 0; i <= TILE_MAX_ZOOM && p != NULL; ++i, p = strchr(p + 1, ','))
+            mapnik_png_compression[i] = (int)strtol(p + 1, NULL, 10);
+    }
+    init_mapnik_datasource(argv[5][0] != '\0' ? argv[5] : NULL);
+    for (i = 6; i < argc; ++i)
+        load_fonts(argv[i]);
+    h2o_set_signal_handler(SIGUSR1, on_worker_sigusr1);
+    h2o_set_signal_handler(SIGPIPE, SIG_IGN);
+
+    /* serves until the server closes the socket */
+    while (1) {
+        struct st_render_worker_request_t req;
+        struct st_render_worker_response_t res = {};
+        h2o_iovec_t contents[TILE_NUM_CONTENTS] = {};
+        size_t offset = 0, j;
+
+        if (read_fully(WORKER_SOCK_FD, &req, sizeof(req)) != 0 || req.style_path_len >= sizeof(style_path) ||
+            read_fully(WORKER_SOCK_FD, style_path, req.style_path_len) != 0)
+            break;
+        style_path[req.style_path_len] = '\0';
+
+        res.ret = render_tile(get_worker_map(style_path), req.zoom, req.x, req.y, req.formats, contents, res.errstr,
+                              sizeof(res.errstr));
+        for (j = 0; j != TILE_NUM_CONTENTS; ++j) {
+            if (contents[j].base == NULL)
+                continue;
+            if (res.ret == 0 && offset + contents[j].len <= WORKER_SHM_SIZE) {
+                memcpy(shm + offset, contents[j].base, contents[j].len);
+                res.offsets[j] = (uint32_t)offset;
+                res.lengths[j] = (uint32_t)contents[j].len;
+                offset += contents[j].len;
+            } else if (res.ret == 0) {
+                res.ret = -1;
+                snprintf(res.errstr, sizeof(res.errstr), "the tile exceeds the shared memory of %d bytes", WORKER_SHM_SIZE);
+            }
+            free(contents[j].base);
+        }
+        if (write_fully(WORKER_SOCK_FD, &res, sizeof(res)) != 0)
+            break;
+    }
+
+    return 0;
+}
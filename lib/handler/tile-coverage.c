@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "h2o/memory.h"
+#include "tile/tile-coverage.h"
+
+struct st_tile_coverage_t {
+    uint8_t *bits[TILE_COVERAGE_MAX_ZOOM + 1]; /* row-major, (1 << zoom) x (1 << zoom) bits per zoom */
+};
+
+#define NUM_TILES (1u << TILE_COVERAGE_MAX_ZOOM)
+
+static inline void set_bit(uint8_t *bits, uint32_t zoom, uint32_t x, uint32_t y)
+{
+    size_t i = ((size_t)y << zoom) + x;
+    bits[i >> 3] |= 1 << (i & 7);
+}
+
+static inline int get_bit(const uint8_t *bits, uint32_t zoom, uint32_t x, uint32_t y)
+{
+    size_t i = ((size_t)y << zoom) + x;
+    return (bits[i >> 3] >> (i & 7)) & 1;
+}
+
+/* (lon, lat) => fractional tile coordinates at TILE_COVERAGE_MAX_ZOOM, cf. lonlat_to_tile() of proj.hpp */
+static void to_tile_coords(double lon, double lat, double *tx, double *ty)
+{
+    const double LAT_LIMIT = 85.0511;
+
+    lat = lat < -LAT_LIMIT ? -LAT_LIMIT : lat > LAT_LIMIT ? LAT_LIMIT : lat;
+    lat = lat * M_PI / 180.0;
+    *tx = (lon + 180.0) / 360.0 * NUM_TILES;
+    *ty = (1.0 - log(tan(lat) + 1.0 / cos(lat)) / M_PI) / 2.0 * NUM_TILES;
+}
+
+static inline uint32_t clamp_tile(double v)
+{
+    return v < 0 ? 0 : v >= NUM_TILES ? NUM_TILES - 1 : (uint32_t)v;
+}
+
+static void rasterize(uint8_t *bits, const double *pts, size_t n)
+{
+    double *xs = alloca(n * sizeof(double));
+    size_t i, j;
+    uint32_t y;
+
+    /* the boundary: walk each edge by a quarter of a tile, so that every tile it passes through is marked */
+    for (i = 0; i != n; ++i) {
+        const double *a = pts + 2 * i, *b = pts + 2 * ((i + 1) % n);
+        double dx = b[0] - a[0], dy = b[1] - a[1];
+        size_t steps = (size_t)(4 * (fabs(dx) > fabs(dy) ? fabs(dx) : fabs(dy))) + 1, k;
+        for (k = 0; k <= steps; ++k)
+            set_bit(bits, TILE_COVERAGE_MAX_ZOOM, clamp_tile(a[0] + dx * k / steps), clamp_tile(a[1] + dy * k / steps));
+    }
+
+    /* the interior: even-odd scanline at the center of each row */
+    for (y = 0; y != NUM_TILES; ++y) {
+        double yc = y + 0.5;
+        size_t num_xs = 0;
+        for (i = 0, j = n - 1; i != n; j = i++) {
+            const double *a = pts + 2 * i, *b = pts + 2 * j;
+            if ((a[1] > yc) != (b[1] > yc))
+                xs[num_xs++] = a[0] + (yc - a[1]) * (b[0] - a[0]) / (b[1] - a[1]);
+        }
+        /* insertion sort; polygons have few crossings per row */
+        for (i = 1; i < num_xs; ++i) {
+            double v = xs[i];
+            for (j = i; j != 0 && xs[j - 1] > v; --j)
+                xs[j] = xs[j - 1];
+            xs[j] = v;
+        }
+        for (i = 0; i + 1 < num_xs; i += 2) {
+            uint32_t x, x1 = clamp_tile(xs[i]), x2 = clamp_tile(xs[i + 1]);
+            for (x = x1; x <= x2; ++x)
+                set_bit(bits, TILE_COVERAGE_MAX_ZOOM, x, y);
+        }
+    }
+}
+
+tile_coverage_t *tile_coverage_create(const double *lonlat, size_t num_points)
+{
+    tile_coverage_t *coverage = h2o_mem_alloc(sizeof(*coverage));
+    double *pts = h2o_mem_alloc(sizeof(double) * 2 * num_points);
+    uint32_t zoom, x, y;
+    size_t i;
+
+    for (zoom = 0; zoom <= TILE_COVERAGE_MAX_ZOOM; ++zoom) {
+        size_t num_bytes = (((size_t)1 << (2 * zoom)) + 7) / 8;
+        coverage->bits[zoom] = h2o_mem_alloc(num_bytes);
+        memset(coverage->bits[zoom], 0, num_bytes);
+    }
+
+    for (i = 0; i != num_points; ++i)
+        to_tile_coords(lonlat[2 * i], lonlat[2 * i + 1], pts + 2 * i, pts + 2 * i + 1);
+    rasterize(coverage->bits[TILE_COVERAGE_MAX_ZOOM], pts, num_points);
+    free(pts);
+
+    /* the lower zooms: a tile is covered iff any of its 4 children is */
+    for (zoom = TILE_COVERAGE_MAX_ZOOM; zoom != 0; --zoom)
+        for (y = 0; y != (1u << zoom); ++y)
+            for (x = 0; x != (1u << zoom); ++x)
+                if (get_bit(coverage->bits[zoom], zoom, x, y))
+                    set_bit(coverage->bits[zoom - 1], zoom - 1, x >> 1, y >> 1);
+
+    return coverage;
+}
+
+void tile_coverage_destroy(tile_coverage_t *coverage)
+{
+    uint32_t zoom;
+
+    for (zoom = 0; zoom <= TILE_COVERAGE_MAX_ZOOM; ++zoom)
+        free(coverage->bits[zoom]);
+    free(coverage);
+}
+
+int tile_coverage_contains(const tile_coverage_t *coverage, uint32_t zoom, uint32_t x, uint32_t y)
+{
+    if (zoom > TILE_COVERAGE_MAX_ZOOM) {
+        /* zoom may be up to 99 (cf. tile_parse_path()), which must not be shifted by */
+        if (zoom >= 32 || (x >> zoom) != 0 || (y >> zoom) != 0)
+            return 0;
+        x >>= zoom - TILE_COVERAGE_MAX_ZOOM;
+        y >>= zoom - TILE_COVERAGE_MAX_ZOOM;
+        zoom = TILE_COVERAGE_MAX_ZOOM;
+    } else if ((x >> zoom) != 0 || (y >> zoom) != 0) {
+        return 0;
+    }
+    return get_bit(coverage->bits[zoom], zoom, x, y);
+}
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "khash.h"
+#include "h2o/linklist.h"
+#include "h2o/memory.h"
+#include "tile/tile-dirfd-cache.h"
+
+struct st_tile_dirfd_t {
+    int fd;
+    h2o_linklist_t lru;
+    char path[1];
+};
+
+KHASH_MAP_INIT_STR(tile_dirfds, struct st_tile_dirfd_t *)
+
+struct st_tile_dirfd_cache_t {
+    khash_t(tile_dirfds) * hash;
+    h2o_linklist_t lru; /* the most recent first */
+};
+
+static __thread struct st_tile_dirfd_cache_t *thread_cache;
+
+static struct st_tile_dirfd_cache_t *get_cache(void)
+{
+    if (thread_cache == NULL) {
+        thread_cache = h2o_mem_alloc(sizeof(*thread_cache));
+        thread_cache->hash = kh_init(tile_dirfds);
+        h2o_linklist_init_anchor(&thread_cache->lru);
+    }
+    return thread_cache;
+}
+
+static void release_dirfd(struct st_tile_dirfd_cache_t *cache, khiter_t iter)
+{
+    struct st_tile_dirfd_t *entry = kh_val(cache->hash, iter);
+
+    kh_del(tile_dirfds, cache->hash, iter);
+    h2o_linklist_unlink(&entry->lru);
+    close(entry->fd);
+    free(entry);
+}
+
+static int open_dir(int parent_fd, const char *name, int create)
+{
+    int fd;
+
+    if ((fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 && errno == ENOENT && create) {
+        if (mkdirat(parent_fd, name, S_IRWXU) != 0 && errno != EEXIST)
+            return -1;
+        fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    return fd;
+}
+
+static int drop_if_removed(const char *dir, size_t len, int fd);
+
+/* the fd of dir[0 .. len) (not to be closed by the caller), or -1 */
+static int get_dirfd(const char *dir, size_t len, int create)
+{
+    struct st_tile_dirfd_cache_t *cache = get_cache();
+    struct st_tile_dirfd_t *entry;
+    khiter_t iter;
+    char *path = alloca(len + 1), *slash;
+    int fd, ret;
+
+    memcpy(path, dir, len);
+    path[len] = '\0';
+    if ((iter = kh_get(tile_dirfds, cache->hash, path)) != kh_end(cache->hash)) {
+        entry = kh_val(cache->hash, iter);
+        h2o_linklist_unlink(&entry->lru);
+        h2o_linklist_insert(cache->lru.next, &entry->lru);
+        return entry->fd;
+    }
+
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        int parent_fd, retry;
+        if (!(errno == ENOENT && create && (slash = strrchr(path, '/')) != NULL && slash != path))
+            return -1;
+        /* create it under the parent, (recursively) opened or created; the parent at hand may have been removed as well */
+        for (retry = 0;; ++retry) {
+            if ((parent_fd = get_dirfd(path, slash - path, create)) == -1)
+                return -1;
+            if ((fd = open_dir(parent_fd, slash + 1, create)) != -1)
+                break;
+            if (errno != ENOENT || retry != 0 || !drop_if_removed(path, slash - path, parent_fd))
+                return -1;
+        }
+    }
+
+    /* purge the least recent one if full */
+    if (kh_size(cache->hash) == TILE_DIRFD_CACHE_CAPACITY) {
+        struct st_tile_dirfd_t *purge = H2O_STRUCT_FROM_MEMBER(struct st_tile_dirfd_t, lru, cache->lru.prev);
+        release_dirfd(cache, kh_get(tile_dirfds, cache->hash, purge->path));
+    }
+    entry = h2o_mem_alloc(offsetof(struct st_tile_dirfd_t, path) + len + 1);
+    entry->fd = fd;
+    entry->lru = (h2o_linklist_t){};
+    memcpy(entry->path, path, len + 1);
+    iter = kh_put(tile_dirfds, cache->hash, entry->path, &ret);
+    kh_val(cache->hash, iter) = entry;
+    h2o_linklist_insert(cache->lru.next, &entry->lru);
+    return fd;
+}
+
+/* drops the fd of the directory if it has been removed, so as to be retried */
+static int drop_if_removed(const char *dir, size_t len, int fd)
+{
+    struct st_tile_dirfd_cache_t *cache = get_cache();
+    struct stat st;
+    char *path;
+    int saved_errno = errno, dropped = 0;
+
+    if (fstat(fd, &st) == 0 && st.st_nlink == 0) {
+        khiter_t iter;
+        path = alloca(len + 1);
+        memcpy(path, dir, len);
+        path[len] = '\0';
+        if ((iter = kh_get(tile_dirfds, cache->hash, path)) != kh_end(cache->hash)) {
+            release_dirfd(cache, iter);
+            dropped = 1;
+        }
+    }
+    errno = saved_errno;
+    return dropped;
+}
+
+/* calls op on dirfd & name (the basename of path) in the caller; returns -2 if path has no slash */
+#define WITH_DIRFD(path, create, op)                                                                                               \
+    do {                                                                                                                           \
+        const char *name = strrchr((path), '/');                                                                                   \
+        int dirfd, ret, retry;                                                                                                     \
+        if (name == NULL || name == (path))                                                                                        \
+            return -2;                                                                                                             \
+        ++name;                                                                                                                    \
+        for (retry = 0;; ++retry) {                                                                                                \
+            if ((dirfd = get_dirfd((path), name - 1 - (path), (create))) == -1)                                                     \
+                return -1;                                                                                                         \
+            if ((ret = (op)) != -1 || errno != ENOENT || retry != 0 || !drop_if_removed((path), name - 1 - (path), dirfd))        \
+                return ret;                                                                                                        \
+        }                                                                                                                          \
+    } while (0)
+
+static int do_open(const char *path, int oflag, mode_t mode)
+{
+    WITH_DIRFD(path, (oflag & O_CREAT) != 0, openat(dirfd, name, oflag, mode));
+}
+
+int tile_dirfd_open(const char *path, int oflag, mode_t mode)
+{
+    int fd = do_open(path, oflag, mode);
+    return fd != -2 ? fd : open(path, oflag, mode);
+}
+
+static int do_stat(const char *path, struct stat *st)
+{
+    WITH_DIRFD(path, 0, fstatat(dirfd, name, st, 0));
+}
+
+int tile_dirfd_stat(const char *path, struct stat *st)
+{
+    int ret = do_stat(path, st);
+    return ret != -2 ? ret : stat(path, st);
+}
+
+static int do_unlink(const char *path)
+{
+    WITH_DIRFD(path, 0, unlinkat(dirfd, name, 0));
+}
+
+int tile_dirfd_unlink(const char *path)
+{
+    int ret = do_unlink(path);
+    return ret != -2 ? ret : unlink(path);
+}
+
+int tile_dirfd_rename(const char *from, const char *to)
+{
+    const char *from_name = strrchr(from, '/'), *to_name = strrchr(to, '/');
+    int from_fd, to_fd, ret, retry;
+
+    if (from_name == NULL || from_name == from || to_name == NULL || to_name == to)
+        return rename(from, to);
+    for (retry = 0;; ++retry) {
+        /* the destination first, as the latest is never purged by looking up another */
+        if ((to_fd = get_dirfd(to, to_name - to, 1)) == -1 || (from_fd = get_dirfd(from, from_name - from, 0)) == -1)
+            return -1;
+        if ((ret = renameat(from_fd, from_name + 1, to_fd, to_name + 1)) != -1 || errno != ENOENT || retry != 0 ||
+            !(drop_if_removed(from, from_name - from, from_fd) | drop_if_removed(to, to_name - to, to_fd)))
+            return ret;
+    }
+}
+
+void tile_dirfd_clear(void)
+{
+    struct st_tile_dirfd_cache_t *cache = thread_cache;
+    khiter_t iter;
+
+    if (cache == NULL)
+        return;
+    for (iter = kh_begin(cache->hash); iter != kh_end(cache->hash); ++iter)
+        if (kh_exist(cache->hash, iter))
+            release_dirfd(cache, iter);
+}
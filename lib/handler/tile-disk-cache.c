@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "khash.h"
+#include "h2o.h"
+#include "tile/tile-disk-cache.h"
+
+/* the tile as (zoom:8, 2x:1, unused:1, suffix:2, unused:12, x:20, y:20), which covers the domain of the paths */
+#define KEY_OF(zoom, x, y, scale, suffix)                                                                                  \
+    (((uint64_t)(zoom) << 56) | ((uint64_t)((scale) == 2) << 55) | ((uint64_t)(suffix) << 52) | ((uint64_t)((x)&0xfffff) << 20) | \
+     ((y)&0xfffff))
+#define KEY_ZOOM(key) ((uint32_t)((key) >> 56))
+#define KEY_SCALE(key) (((key) >> 55 & 1) + 1)
+#define KEY_SUFFIX(key) ((enum TILE_SUFFIX)((key) >> 52 & 3))
+#define KEY_X(key) ((uint32_t)((key) >> 20 & 0xfffff))
+#define KEY_Y(key) ((uint32_t)((key)&0xfffff))
+/* tiles of a directory share all but the lowest 4 bits of x & y (cf. to_physical_path_scaled()) */
+#define KEY_DIR(key) ((key) & ~((uint64_t)0xf << 20 | 0xf) & ~((uint64_t)0xf << 52))
+
+#define LOW_WATERMARK(capacity) ((capacity) / 20 * 19)
+#define BLOCK_SIZE 4096
+/* the entries an eviction pass takes out of the index (the coldest quarter of which are evicted at most), and the
+   buckets it scans for them at most, so that a pass holds the mutex for a bounded time whatever the size of the index */
+#define EVICT_SAMPLES 16384
+#define EVICT_MAX_SCAN (4 * EVICT_SAMPLES)
+/* the pause between the passes (in milliseconds), doubled while the passes free nothing */
+#define EVICT_MIN_BACKOFF 10
+#define EVICT_MAX_BACKOFF 1000
+
+struct st_tile_entry_t {
+    uint32_t size;  /* in bytes, rounded up to blocks */
+    uint32_t atime; /* in seconds since TILE_STALE_MTIME */
+};
+
+KHASH_MAP_INIT_INT64(tile_entries, struct st_tile_entry_t)
+
+struct st_tile_disk_cache_t {
+    char *base_path;
+    uint64_t capacity;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; /* signaled when over the capacity */
+    khash_t(tile_entries) * entries;
+    uint64_t total;
+    khiter_t cursor; /* the bucket the next eviction pass starts sampling at */
+    int started;
+};
+
+struct st_tile_victim_t {
+    uint64_t key;
+    struct st_tile_entry_t entry;
+};
+
+struct st_walk_t {
+    tile_disk_cache_t *cache;
+    int dirfd; /* of the zoom */
+    uint32_t zoom;
+    struct st_tile_victim_t *found; /* flushed into the index by batches */
+    size_t num_found;
+    uint64_t num_tiles, num_bytes;
+};
+
+#define WALK_BATCH 4096
+
+static uint32_t now_atime(void)
+{
+    return (uint32_t)(time(NULL) - TILE_STALE_MTIME);
+}
+
+static uint32_t to_blocks(uint64_t size)
+{
+    return (uint32_t)((size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE);
+}
+
+tile_disk_cache_t *tile_disk_cache_create(const char *base_path, uint64_t capacity)
+{
+    tile_disk_cache_t *cache = h2o_mem_alloc(sizeof(*cache));
+
+    cache->base_path = h2o_strdup(NULL, base_path, SIZE_MAX).base;
+    cache->capacity = capacity;
+    pthread_mutex_init(&cache->mutex, NULL);
+    pthread_cond_init(&cache->cond, NULL);
+    cache->entries = kh_init(tile_entries);
+    cache->total = 0;
+    cache->cursor = 0;
+    cache->started = 0;
+    return cache;
+}
+
+/* N.B. with the mutex held */
+static void put_entry(tile_disk_cache_t *cache, uint64_t key, struct st_tile_entry_t entry, int replace)
+{
+    int ret;
+    khiter_t iter = kh_put(tile_entries, cache->entries, key, &ret);
+
+    if (ret == 0) {
+        if (!replace)
+            return;
+        cache->total -= kh_val(cache->entries, iter).size;
+    }
+    kh_val(cache->entries, iter) = entry;
+    cache->total += entry.size;
+}
+
+void tile_disk_cache_add(tile_disk_cache_t *cache, uint32_t zoom, uint32_t x, uint32_t y, uint32_t scale, enum TILE_SUFFIX suffix,
+                         uint64_t size)
+{
+    struct st_tile_entry_t entry = {to_blocks(size), now_atime()};
+
+    pthread_mutex_lock(&cache->mutex);
+    put_entry(cache, KEY_OF(zoom, x, y, scale, suffix), entry, 1);
+    if (cache->total > cache->capacity)
+        pthread_cond_signal(&cache->cond);
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void tile_disk_cache_touch(tile_disk_cache_t *cache, uint32_t zoom, uint32_t x, uint32_t y, uint32_t scale, enum TILE_SUFFIX suffix)
+{
+    khiter_t iter;
+
+    pthread_mutex_lock(&cache->mutex);
+    /* a tile not indexed yet (i.e. while walking) gets its atime by the walk */
+    if ((iter = kh_get(tile_entries, cache->entries, KEY_OF(zoom, x, y, scale, suffix))) != kh_end(cache->entries))
+        kh_val(cache->entries, iter).atime = now_atime();
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+/* the walk */
+
+static void flush_found(struct st_walk_t *walk)
+{
+    size_t i;
+
+    pthread_mutex_lock(&walk->cache->mutex);
+    /* the ones stored meanwhile are newer */
+    for (i = 0; i != walk->num_found; ++i)
+        put_entry(walk->cache, walk->found[i].key, walk->found[i].entry, 0);
+    pthread_mutex_unlock(&walk->cache->mutex);
+    walk->num_found = 0;
+}
+
+/* parses h0(@2x)?.(png|jpg|webp|pbf) */
+static int parse_file_name(const char *name, uint32_t *h0, uint32_t *scale, enum TILE_SUFFIX *suffix)
+{
+    static const char *suffixes[] = {"png", "jpg", "webp", "pbf"};
+    char *end;
+    size_t i;
+
+    if (!('0' <= name[0] && name[0] <= '9'))
+        return -1;
+    *h0 = (uint32_t)strtoul(name, &end, 10);
+    *scale = 1;
+    if (strncmp(end, "@2x", 3) == 0) {
+        *scale = 2;
+        end += 3;
+    }
+    if (*end++ != '.')
+        return -1;
+    for (i = 0; i != sizeof(suffixes) / sizeof(suffixes[0]); ++i) {
+        if (strcmp(end, suffixes[i]) == 0) {
+            *suffix = (enum TILE_SUFFIX)i;
+            return *h0 < 256 ? 0 : -1;
+        }
+    }
+    return -1; /* e.g. the tmp files */
+}
+
+/* walks zz/h4/h3/h2/h1/, where the tiles h0(@2x)?.ext reside */
+static void walk_dir(struct st_walk_t *walk, int dirfd, unsigned depth, uint32_t *hashes)
+{
+    DIR *dir;
+    struct dirent *ent;
+
+    if ((dir = fdopendir(dirfd)) == NULL) {
+        close(dirfd);
+        return;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        unsigned char type = ent->d_type;
+        struct stat st;
+        if (ent->d_name[0] == '.')
+            continue;
+        if (type == DT_UNKNOWN || depth == 5) {
+            if (fstatat(dirfd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (depth < 5) {
+            int fd;
+            if (type != DT_DIR || !('0' <= ent->d_name[0] && ent->d_name[0] <= '9'))
+                continue;
+            hashes[depth] = (uint32_t)strtoul(ent->d_name, NULL, 10);
+            if ((fd = openat(dirfd, ent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1)
+                walk_dir(walk, fd, depth + 1, hashes);
+        } else if (type == DT_REG) {
+            uint32_t x = 0, y = 0, scale;
+            enum TILE_SUFFIX suffix;
+            struct st_tile_victim_t *found;
+            unsigned i;
+            if (parse_file_name(ent->d_name, hashes + 5, &scale, &suffix) != 0)
+                continue;
+            /* hashes[1..5] are h4..h0, each of a nibble of x (high) & one of y (low) */
+            for (i = 1; i <= 5; ++i) {
+                x = (x << 4) | (hashes[i] >> 4);
+                y = (y << 4) | (hashes[i] & 0xf);
+            }
+            found = walk->found + walk->num_found++;
+            found->key = KEY_OF(walk->zoom, x, y, scale, suffix);
+            found->entry.size = to_blocks((uint64_t)st.st_blocks * 512);
+            found->entry.atime = (uint32_t)((st.st_atime > st.st_mtime ? st.st_atime : st.st_mtime) - TILE_STALE_MTIME);
+            ++walk->num_tiles;
+            walk->num_bytes += found->entry.size;
+            if (walk->num_found == WALK_BATCH)
+                flush_found(walk);
+        }
+    }
+    closedir(dir);
+}
+
+static void *walk_zoom(void *_walk)
+{
+    struct st_walk_t *walk = _walk;
+    uint32_t hashes[6];
+
+    walk->found = h2o_mem_alloc(sizeof(*walk->found) * WALK_BATCH);
+    walk->num_found = 0;
+    walk_dir(walk, walk->dirfd, 1, hashes);
+    flush_found(walk);
+    free(walk->found);
+    return NULL;
+}
+
+static void build_index(tile_disk_cache_t *cache)
+{
+    struct st_walk_t walks[TILE_MAX_ZOOM + 1];
+    pthread_t tids[TILE_MAX_ZOOM + 1];
+    char path[16];
+    uint32_t zoom;
+    uint64_t num_tiles = 0, num_bytes = 0;
+    time_t start = time(NULL);
+    int basefd;
+
+    if ((basefd = open(cache->base_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+        return;
+    /* a thread per zoom; the high zooms dominate, but the disks don't go faster with more anyway */
+    for (zoom = 0; zoom <= TILE_MAX_ZOOM; ++zoom) {
+        walks[zoom] = (struct st_walk_t){cache, -1, zoom};
+        sprintf(path, "%" PRIu32, zoom);
+        if ((walks[zoom].dirfd = openat(basefd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+            continue;
+        if (pthread_create(tids + zoom, NULL, walk_zoom, walks + zoom) != 0) {
+            walk_zoom(walks + zoom);
+            walks[zoom].dirfd = -1;
+        }
+    }
+    for (zoom = 0; zoom <= TILE_MAX_ZOOM; ++zoom) {
+        if (walks[zoom].dirfd != -1)
+            pthread_join(tids[zoom], NULL);
+        num_tiles += walks[zoom].num_tiles;
+        num_bytes += walks[zoom].num_bytes;
+    }
+    close(basefd);
+    fprintf(stderr, "[lib/handler/tile-disk-cache.c] indexed %" PRIu64 " tiles (%" PRIu64 " bytes) under %s in %d sec.\n", num_tiles,
+            num_bytes, cache->base_path, (int)(time(NULL) - start));
+}
+
+/* the eviction */
+
+static int cmp_coldness(const void *_x, const void *_y)
+{
+    const struct st_tile_victim_t *x = _x, *y = _y;
+    uint32_t xmin = x->entry.atime / 60, ymin = y->entry.atime / 60;
+
+    if (xmin != ymin)
+        return xmin < ymin ? -1 : 1;
+    return x->entry.size > y->entry.size ? -1 : x->entry.size < y->entry.size;
+}
+
+static int cmp_dir(const void *_x, const void *_y)
+{
+    uint64_t x = KEY_DIR(((const struct st_tile_victim_t *)_x)->key), y = KEY_DIR(((const struct st_tile_victim_t *)_y)->key);
+    return x < y ? -1 : x > y;
+}
+
+/* unlinks the victims of a directory, unless accessed since chosen; returns the bytes taken out of the index */
+static uint64_t evict_dir(tile_disk_cache_t *cache, struct st_tile_victim_t *victims, size_t num_victims)
+{
+    char path[TILE_PHYSPATH_BUFLEN], dir_path[PATH_MAX];
+    size_t i, num_unlinks = 0;
+    uint64_t freed = 0;
+    int dirfd;
+
+    pthread_mutex_lock(&cache->mutex);
+    for (i = 0; i != num_victims; ++i) {
+        khiter_t iter = kh_get(tile_entries, cache->entries, victims[i].key);
+        if (iter == kh_end(cache->entries) || kh_val(cache->entries, iter).atime != victims[i].entry.atime)
+            continue;
+        freed += kh_val(cache->entries, iter).size;
+        cache->total -= kh_val(cache->entries, iter).size;
+        kh_del(tile_entries, cache->entries, iter);
+        victims[num_unlinks++] = victims[i];
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    if (num_unlinks == 0)
+        return 0;
+
+    to_physical_path_scaled(path, KEY_ZOOM(victims[0].key), KEY_X(victims[0].key), KEY_Y(victims[0].key), 1, PNG);
+    *strrchr(path, '/') = '\0';
+    snprintf(dir_path, sizeof(dir_path), "%s%s", cache->base_path, path);
+    if ((dirfd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+        return freed;
+    for (i = 0; i != num_unlinks; ++i) {
+        uint64_t key = victims[i].key;
+        to_physical_path_scaled(path, KEY_ZOOM(key), KEY_X(key), KEY_Y(key), KEY_SCALE(key), KEY_SUFFIX(key));
+        if (unlinkat(dirfd, strrchr(path, '/') + 1, 0) != 0 && errno != ENOENT)
+            fprintf(stderr, "[lib/handler/tile-disk-cache.c] failed to unlink %s%s: %s\n", cache->base_path, path, strerror(errno));
+    }
+    close(dirfd);
+    return freed;
+}
+
+/* evicts the coldest of a sample of the index; returns the bytes freed */
+static uint64_t evict(tile_disk_cache_t *cache)
+{
+    struct st_tile_victim_t *victims = h2o_mem_alloc(sizeof(*victims) * EVICT_SAMPLES);
+    size_t num_victims = 0, num_scanned, i, j;
+    uint64_t excess, freed;
+    khiter_t iter;
+    int is_whole;
+
+    /* a window of the index, sweeping over the buckets pass by pass (as CLOCK does); the keys are hashed, thus the window
+       is as good as a random sample */
+    pthread_mutex_lock(&cache->mutex);
+    excess = cache->total > LOW_WATERMARK(cache->capacity) ? cache->total - LOW_WATERMARK(cache->capacity) : 0;
+    iter = cache->cursor < kh_end(cache->entries) ? cache->cursor : 0;
+    for (num_scanned = 0; num_scanned != kh_end(cache->entries) && num_scanned != EVICT_MAX_SCAN && num_victims != EVICT_SAMPLES;
+         ++num_scanned) {
+        if (kh_exist(cache->entries, iter)) {
+            victims[num_victims].key = kh_key(cache->entries, iter);
+            victims[num_victims].entry = kh_val(cache->entries, iter);
+            ++num_victims;
+        }
+        if (++iter == kh_end(cache->entries))
+            iter = 0;
+    }
+    cache->cursor = iter;
+    is_whole = num_scanned == kh_end(cache->entries);
+    pthread_mutex_unlock(&cache->mutex);
+
+    /* the coldest quarter of the sample at most (or all of a small index), as much as to free the excess, by directory */
+    qsort(victims, num_victims, sizeof(*victims), cmp_coldness);
+    for (i = 0, freed = 0; i != num_victims && freed < excess && (i < num_victims / 4 || is_whole); ++i)
+        freed += victims[i].entry.size;
+    num_victims = i;
+    qsort(victims, num_victims, sizeof(*victims), cmp_dir);
+    for (i = 0, freed = 0; i != num_victims; i = j) {
+        for (j = i + 1; j != num_victims && KEY_DIR(victims[j].key) == KEY_DIR(victims[i].key); ++j)
+            ;
+        freed += evict_dir(cache, victims + i, j - i);
+    }
+    free(victims);
+    return freed;
+}
+
+static void *run_evictor(void *_cache)
+{
+    tile_disk_cache_t *cache = _cache;
+    unsigned backoff = EVICT_MIN_BACKOFF;
+
+    build_index(cache);
+
+    pthread_mutex_lock(&cache->mutex);
+    while (1) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += 1;
+        if (cache->total <= cache->capacity)
+            pthread_cond_timedwait(&cache->cond, &cache->mutex, &until);
+        if (cache->total > cache->capacity) {
+            struct timespec pause;
+            pthread_mutex_unlock(&cache->mutex);
+            /* a pass freeing nothing (e.g. every tile sampled has been accessed meanwhile) is not retried right away */
+            backoff = evict(cache) != 0 ? EVICT_MIN_BACKOFF : backoff * 2 < EVICT_MAX_BACKOFF ? backoff * 2 : EVICT_MAX_BACKOFF;
+            pause = (struct timespec){backoff / 1000, backoff % 1000 * 1000000};
+            nanosleep(&pause, NULL);
+            pthread_mutex_lock(&cache->mutex);
+        }
+    }
+    return NULL;
+}
+
+void tile_disk_cache_start(tile_disk_cache_t *cache)
+{
+    pthread_t tid;
+
+    if (!__sync_bool_compare_and_swap(&cache->started, 0, 1))
+        return;
+    if (pthread_create(&tid, NULL, run_evictor, cache) != 0) {
+        perror("[lib/handler/tile-disk-cache.c] pthread_create");
+        return;
+    }
+    pthread_detach(tid);
+}
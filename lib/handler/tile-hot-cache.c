@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "h2o.h"
+#include "tile/tile-hot-cache.h"
+
+#define MAGIC 0x3165686361636874ULL /* "thcache1" */
+#define AVG_TILE_SIZE 4096          /* the slots are twice as many as the tiles of this size fitting the ring */
+#define PROBE_WINDOW 8
+#define OFFSET_BITS 48
+#define OFFSET_MASK (((uint64_t)1 << OFFSET_BITS) - 1)
+#define ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+/* at the head of the file, followed by the slots, then the ring */
+struct st_tile_hot_cache_header_t {
+    uint64_t magic;
+    uint64_t size;
+    uint64_t num_slots; /* a power of 2 */
+    uint64_t ring_size;
+    volatile uint64_t head;        /* bytes ever allocated in the ring; the tail is head - ring_size */
+    volatile uint64_t generations; /* processes attached so far, for the record */
+};
+
+/* a tile in the ring, followed by the content */
+struct st_tile_hot_cache_entry_t {
+    uint64_t ns, key;
+    uint32_t len;
+    uint32_t etag_len;
+    int64_t mtime;
+    int64_t stored_at;
+    char etag[TILE_HOT_CACHE_ETAG_MAXLEN + 1];
+};
+
+struct st_tile_hot_cache_t {
+    struct st_tile_hot_cache_header_t *header;
+    volatile uint64_t *slots; /* tag:16 (non-zero), offset:48; 0 if empty */
+    char *ring;
+};
+
+static uint64_t hash_of(uint64_t ns, uint64_t key)
+{
+    /* the finalizer of splitmix64 */
+    uint64_t h = ns ^ (key * 0x9e3779b97f4a7c15ULL);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+static uint64_t tag_of(uint64_t hash)
+{
+    return (hash >> OFFSET_BITS) | 1;
+}
+
+/* the absolute offset of a slot, or UINT64_MAX if the ring has wrapped over the entry */
+static uint64_t offset_of(tile_hot_cache_t *cache, uint64_t slot, uint64_t head)
+{
+    uint64_t off = head - ((head - (slot & OFFSET_MASK)) & OFFSET_MASK);
+    return head - off <= cache->header->ring_size ? off : UINT64_MAX;
+}
+
+/* copies out of the ring, wrapping around */
+static void ring_read(tile_hot_cache_t *cache, uint64_t off, void *dst, size_t len)
+{
+    uint64_t pos = off % cache->header->ring_size, first = cache->header->ring_size - pos;
+    if (first >= len) {
+        memcpy(dst, cache->ring + pos, len);
+    } else {
+        memcpy(dst, cache->ring + pos, first);
+        memcpy((char *)dst + first, cache->ring, len - first);
+    }
+}
+
+static void ring_write(tile_hot_cache_t *cache, uint64_t off, const void *src, size_t len)
+{
+    uint64_t pos = off % cache->header->ring_size, first = cache->header->ring_size - pos;
+    if (first >= len) {
+        memcpy(cache->ring + pos, src, len);
+    } else {
+        memcpy(cache->ring + pos, src, first);
+        memcpy(cache->ring, (const char *)src + first, len - first);
+    }
+}
+
+static int ring_pread(tile_hot_cache_t *cache, uint64_t off, int fd, size_t len)
+{
+    uint64_t pos = off % cache->header->ring_size, first = cache->header->ring_size - pos;
+    if (first > len)
+        first = len;
+    if (pread(fd, cache->ring + pos, first, 0) != (ssize_t)first)
+        return -1;
+    if (first != len && pread(fd, cache->ring, len - first, first) != (ssize_t)(len - first))
+        return -1;
+    return 0;
+}
+
+tile_hot_cache_t *tile_hot_cache_open(const char *path, uint64_t size)
+{
+    tile_hot_cache_t *cache;
+    struct st_tile_hot_cache_header_t *header;
+    uint64_t num_slots;
+    struct stat st;
+    int fd;
+
+Retry:
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+        fprintf(stderr, "[lib/handler/tile-hot-cache.c] failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    /* serialize the layout among the processes starting at once */
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "[lib/handler/tile-hot-cache.c] failed to lock %s: %s\n", path, strerror(errno));
+        goto Error;
+    }
+    if (st.st_nlink == 0) {
+        /* replaced (see below) while waiting for the lock */
+        close(fd);
+        goto Retry;
+    }
+    if (st.st_size != 0 && (uint64_t)st.st_size != size) {
+        /* resized by the configuration; the processes still attached to the file keep it to themselves */
+        fprintf(stderr, "[lib/handler/tile-hot-cache.c] %s is resized to %" PRIu64 " bytes, thus emptied\n", path, size);
+        unlink(path);
+        close(fd);
+        goto Retry;
+    }
+    if (st.st_size == 0 && ftruncate(fd, size) != 0) {
+        fprintf(stderr, "[lib/handler/tile-hot-cache.c] failed to resize %s: %s\n", path, strerror(errno));
+        goto Error;
+    }
+    if ((header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "[lib/handler/tile-hot-cache.c] failed to map %s: %s\n", path, strerror(errno));
+        goto Error;
+    }
+
+    if (!(header->magic == MAGIC && header->size == size)) {
+        /* lay it out afresh */
+        for (num_slots = 1; num_slots * sizeof(uint64_t) * AVG_TILE_SIZE / 2 < size; num_slots *= 2)
+            ;
+        memset(header, 0, sizeof(*header) + sizeof(uint64_t) * num_slots);
+        header->size = size;
+        header->num_slots = num_slots;
+        header->ring_size = (size - sizeof(*header) - sizeof(uint64_t) * num_slots) & ~(uint64_t)7;
+        __sync_synchronize();
+        header->magic = MAGIC;
+    }
+    __sync_fetch_and_add(&header->generations, 1);
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    cache = h2o_mem_alloc(sizeof(*cache));
+    cache->header = header;
+    cache->slots = (uint64_t *)(header + 1);
+    cache->ring = (char *)(cache->slots + header->num_slots);
+    return cache;
+
+Error:
+    close(fd);
+    return NULL;
+}
+
+int tile_hot_cache_get(tile_hot_cache_t *cache, uint64_t ns, uint64_t key, h2o_mem_pool_t *pool, tile_hot_cache_hit_t *hit)
+{
+    uint64_t hash = hash_of(ns, key), tag = tag_of(hash), i;
+
+    for (i = 0; i != PROBE_WINDOW; ++i) {
+        uint64_t slot = cache->slots[(hash + i) & (cache->header->num_slots - 1)], off;
+        struct st_tile_hot_cache_entry_t entry;
+        if (slot >> OFFSET_BITS != tag)
+            continue;
+        if ((off = offset_of(cache, slot, cache->header->head)) == UINT64_MAX)
+            continue;
+        ring_read(cache, off, &entry, sizeof(entry));
+        __sync_synchronize();
+        if (cache->header->head - off > cache->header->ring_size)
+            continue; /* overwritten while reading */
+        if (!(entry.ns == ns && entry.key == key && entry.len < cache->header->ring_size / 16 &&
+              entry.etag_len <= TILE_HOT_CACHE_ETAG_MAXLEN))
+            continue;
+        hit->content.base = h2o_mem_alloc_pool(pool, entry.len);
+        hit->content.len = entry.len;
+        ring_read(cache, off + sizeof(entry), hit->content.base, entry.len);
+        __sync_synchronize();
+        if (cache->header->head - off > cache->header->ring_size)
+            return -1;
+        hit->mtime = entry.mtime;
+        hit->stored_at = entry.stored_at;
+        memcpy(hit->etag, entry.etag, entry.etag_len);
+        hit->etag[entry.etag_len] = '\0';
+        hit->etag_len = entry.etag_len;
+        return 0;
+    }
+    return -1;
+}
+
+/* allocates the room for an entry of len bytes in the ring; UINT64_MAX if too large */
+static uint64_t allocate_entry(tile_hot_cache_t *cache, uint64_t ns, uint64_t key, size_t len, time_t mtime, const char *etag,
+                               size_t etag_len)
+{
+    struct st_tile_hot_cache_entry_t entry = {ns, key, (uint32_t)len};
+    uint64_t off;
+
+    if (sizeof(entry) + len >= cache->header->ring_size / 16 || etag_len > TILE_HOT_CACHE_ETAG_MAXLEN)
+        return UINT64_MAX;
+    off = __sync_fetch_and_add(&cache->header->head, ALIGN(sizeof(entry) + len));
+    entry.etag_len = (uint32_t)etag_len;
+    entry.mtime = mtime;
+    entry.stored_at = time(NULL);
+    memcpy(entry.etag, etag, etag_len);
+    ring_write(cache, off, &entry, sizeof(entry));
+    return off;
+}
+
+/* points a slot to the entry written at off */
+static void publish_entry(tile_hot_cache_t *cache, uint64_t ns, uint64_t key, uint64_t off)
+{
+    uint64_t hash = hash_of(ns, key), tag = tag_of(hash), head = cache->header->head, i;
+    volatile uint64_t *victim = NULL;
+    uint64_t victim_slot = 0, victim_off = UINT64_MAX;
+
+    /* the same tile (likely), or an empty slot, or a wrapped-over one, or else the oldest in the window */
+    for (i = 0; i != PROBE_WINDOW; ++i) {
+        volatile uint64_t *p = cache->slots + ((hash + i) & (cache->header->num_slots - 1));
+        uint64_t slot = *p, slot_off;
+        if (slot == 0 || slot >> OFFSET_BITS == tag) {
+            victim = p;
+            victim_slot = slot;
+            break;
+        }
+        if ((slot_off = offset_of(cache, slot, head)) == UINT64_MAX)
+            slot_off = 0;
+        if (slot_off < victim_off) {
+            victim = p;
+            victim_slot = slot;
+            victim_off = slot_off;
+        }
+    }
+    __sync_synchronize();
+    /* losing the race, the tile is just not cached */
+    __sync_bool_compare_and_swap(victim, victim_slot, tag << OFFSET_BITS | (off & OFFSET_MASK));
+}
+
+void tile_hot_cache_set(tile_hot_cache_t *cache, uint64_t ns, uint64_t key, const void *content, size_t len, time_t mtime,
+                        const char *etag, size_t etag_len)
+{
+    uint64_t off;
+
+    if ((off = allocate_entry(cache, ns, key, len, mtime, etag, etag_len)) == UINT64_MAX)
+        return;
+    ring_write(cache, off + sizeof(struct st_tile_hot_cache_entry_t), content, len);
+    publish_entry(cache, ns, key, off);
+}
+
+void tile_hot_cache_set_fd(tile_hot_cache_t *cache, uint64_t ns, uint64_t key, int fd, size_t len, time_t mtime,
+                           const char *etag, size_t etag_len)
+{
+    uint64_t off;
+
+    if ((off = allocate_entry(cache, ns, key, len, mtime, etag, etag_len)) == UINT64_MAX)
+        return;
+    if (ring_pread(cache, off + sizeof(struct st_tile_hot_cache_entry_t), fd, len) != 0)
+        return; /* the room is left unindexed */
+    publish_entry(cache, ns, key, off);
+}
@@ -0,0 +1,507 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "tile/tile-png.h"
+
+/* N.B. no dependency on libh2o, as yield-tiles links this file as well */
+
+#define INITIAL_BITS 10
+#define MAX_COLORS 256
+#define HASH(c, shift) (((c)*2654435761u) >> (shift))
+
+struct st_color_t {
+    uint32_t color;
+    uint32_t count; /* 0 if the slot is empty */
+    uint32_t index; /* into the palette, once built */
+};
+
+/* a box of the median cut: the colors in [begin, end) of the items */
+struct st_box_t {
+    size_t begin, end;
+    uint64_t weight;
+    int channel; /* the widest one, in bits to shift */
+    uint32_t range;
+};
+
+struct st_tile_png_encoder_t {
+    struct st_color_t *colors; /* open addressing, linear probing */
+    unsigned bits;             /* log2 of the capacity */
+    size_t num_colors;
+    int built;
+    uint32_t palette[MAX_COLORS];
+    size_t palette_size, num_translucent;
+    /* the palette by channel, for the vectorized scan */
+    int32_t pr[MAX_COLORS], pg[MAX_COLORS], pb[MAX_COLORS], pa[MAX_COLORS];
+    /* per row */
+    uint32_t *normalized, *hashes;
+    unsigned char *indices;
+    size_t row_capacity;
+    /* the filtered scanlines */
+    unsigned char *raw;
+    size_t raw_capacity;
+    z_stream z;
+    int level; /* of z, or -1 if not initialized */
+};
+
+tile_png_encoder_t *tile_png_encoder_create(void)
+{
+    tile_png_encoder_t *enc = calloc(1, sizeof(*enc));
+
+    if (enc == NULL)
+        return NULL;
+    enc->bits = INITIAL_BITS;
+    if ((enc->colors = calloc((size_t)1 << enc->bits, sizeof(*enc->colors))) == NULL) {
+        free(enc);
+        return NULL;
+    }
+    enc->level = -1;
+    return enc;
+}
+
+void tile_png_encoder_destroy(tile_png_encoder_t *enc)
+{
+    if (enc == NULL)
+        return;
+    if (enc->level != -1)
+        deflateEnd(&enc->z);
+    free(enc->colors);
+    free(enc->normalized);
+    free(enc->hashes);
+    free(enc->indices);
+    free(enc->raw);
+    free(enc);
+}
+
+void tile_png_reset(tile_png_encoder_t *enc)
+{
+    /* a table grown by a metatile is not worth clearing for every tile to come */
+    if (enc->bits > INITIAL_BITS + 4) {
+        struct st_color_t *colors = calloc((size_t)1 << INITIAL_BITS, sizeof(*colors));
+        if (colors != NULL) {
+            free(enc->colors);
+            enc->colors = colors;
+            enc->bits = INITIAL_BITS;
+        }
+    }
+    memset(enc->colors, 0, sizeof(*enc->colors) << enc->bits);
+    enc->num_colors = 0;
+    enc->built = 0;
+}
+
+static int reserve_row(tile_png_encoder_t *enc, uint32_t w)
+{
+    uint32_t *normalized, *hashes;
+    unsigned char *indices;
+
+    if (w <= enc->row_capacity)
+        return 0;
+    if ((normalized = realloc(enc->normalized, w * sizeof(*normalized))) == NULL)
+        return -1;
+    enc->normalized = normalized;
+    if ((hashes = realloc(enc->hashes, w * sizeof(*hashes))) == NULL)
+        return -1;
+    enc->hashes = hashes;
+    if ((indices = realloc(enc->indices, w)) == NULL)
+        return -1;
+    enc->indices = indices;
+    enc->row_capacity = w;
+    return 0;
+}
+
+/* keeps the table at most half full with n more colors, so that the hashes of a row stay valid through the row */
+static int reserve_colors(tile_png_encoder_t *enc, size_t n)
+{
+    struct st_color_t *old = enc->colors, *colors;
+    size_t old_capacity = (size_t)1 << enc->bits, i;
+    unsigned bits = enc->bits;
+
+    while ((enc->num_colors + n) * 2 > (size_t)1 << bits)
+        ++bits;
+    if (bits == enc->bits)
+        return 0;
+    if (bits > 31 || (colors = calloc((size_t)1 << bits, sizeof(*colors))) == NULL)
+        return -1;
+    for (i = 0; i != old_capacity; ++i) {
+        if (old[i].count != 0) {
+            size_t mask = ((size_t)1 << bits) - 1, h = HASH(old[i].color, 32 - bits);
+            while (colors[h].count != 0)
+                h = (h + 1) & mask;
+            colors[h] = old[i];
+        }
+    }
+    free(old);
+    enc->colors = colors;
+    enc->bits = bits;
+    return 0;
+}
+
+/*
+The fully transparent pixels are all the same color; then the hashes of the row. Branch-free, without aliasing, thus
+vectorized (e.g. 8 pixels at a time on AVX2).
+*/
+static void hash_row(uint32_t *__restrict normalized, uint32_t *__restrict hashes, const uint32_t *__restrict row, uint32_t w,
+                     unsigned shift)
+{
+    uint32_t i;
+
+    for (i = 0; i < w; ++i) {
+        uint32_t c = row[i] & -(uint32_t)((row[i] >> 24) != 0);
+        normalized[i] = c;
+        hashes[i] = HASH(c, shift);
+    }
+}
+
+static struct st_color_t *find_color(tile_png_encoder_t *enc, uint32_t color, uint32_t h)
+{
+    size_t mask = ((size_t)1 << enc->bits) - 1;
+
+    for (;; h = (h + 1) & mask) {
+        struct st_color_t *e = enc->colors + h;
+        if (e->count == 0 || e->color == color)
+            return e;
+    }
+}
+
+int tile_png_add(tile_png_encoder_t *enc, const uint32_t *pixels, uint32_t w, uint32_t h, size_t stride)
+{
+    uint32_t x, y;
+
+    if (reserve_row(enc, w) != 0)
+        return -1;
+    for (y = 0; y != h; ++y) {
+        if (reserve_colors(enc, w) != 0)
+            return -1;
+        hash_row(enc->normalized, enc->hashes, pixels + y * stride, w, 32 - enc->bits);
+        /* a probe per run */
+        for (x = 0; x != w;) {
+            uint32_t c = enc->normalized[x], run = x + 1;
+            struct st_color_t *e;
+            while (run != w && enc->normalized[run] == c)
+                ++run;
+            if ((e = find_color(enc, c, enc->hashes[x]))->count == 0) {
+                e->color = c;
+                ++enc->num_colors;
+            }
+            e->count += run - x;
+            x = run;
+        }
+    }
+    enc->built = 0;
+    return 0;
+}
+
+static uint32_t channel_of(uint32_t color, int shift)
+{
+    return (color >> shift) & 0xff;
+}
+
+static void measure_box(struct st_color_t **items, struct st_box_t *box)
+{
+    uint32_t lo[4] = {255, 255, 255, 255}, hi[4] = {0, 0, 0, 0};
+    size_t i;
+    int ch;
+
+    box->weight = 0;
+    for (i = box->begin; i != box->end; ++i) {
+        box->weight += items[i]->count;
+        for (ch = 0; ch != 4; ++ch) {
+            uint32_t v = channel_of(items[i]->color, ch * 8);
+            if (v < lo[ch])
+                lo[ch] = v;
+            if (v > hi[ch])
+                hi[ch] = v;
+        }
+    }
+    box->channel = 0;
+    box->range = 0;
+    for (ch = 0; ch != 4; ++ch) {
+        if (hi[ch] - lo[ch] > box->range) {
+            box->channel = ch * 8;
+            box->range = hi[ch] - lo[ch];
+        }
+    }
+}
+
+/* splits the box at the weighted median of its widest channel; the lower half stays in box */
+static void split_box(struct st_color_t **items, struct st_box_t *box, struct st_box_t *upper)
+{
+    uint64_t weights[256] = {0}, half = box->weight / 2, sum = 0;
+    uint32_t lo = 255, hi = 0, median;
+    size_t i, j;
+
+    for (i = box->begin; i != box->end; ++i) {
+        uint32_t v = channel_of(items[i]->color, box->channel);
+        weights[v] += items[i]->count;
+        if (v < lo)
+            lo = v;
+        if (v > hi)
+            hi = v;
+    }
+    for (median = lo; median < hi - 1; ++median) {
+        if ((sum += weights[median]) >= half)
+            break;
+    }
+    /* partition by median (both halves non-empty, as lo <= median < hi) */
+    for (i = box->begin, j = box->end; i != j;) {
+        if (channel_of(items[i]->color, box->channel) <= median) {
+            ++i;
+        } else {
+            struct st_color_t *t = items[--j];
+            items[j] = items[i];
+            items[i] = t;
+        }
+    }
+    upper->begin = i;
+    upper->end = box->end;
+    box->end = i;
+    measure_box(items, box);
+    measure_box(items, upper);
+}
+
+/* the mean color of the box, weighted by the counts */
+static uint32_t mean_of(struct st_color_t **items, const struct st_box_t *box)
+{
+    uint64_t sums[4] = {0, 0, 0, 0};
+    uint32_t color = 0;
+    size_t i;
+    int ch;
+
+    for (i = box->begin; i != box->end; ++i)
+        for (ch = 0; ch != 4; ++ch)
+            sums[ch] += (uint64_t)channel_of(items[i]->color, ch * 8) * items[i]->count;
+    for (ch = 0; ch != 4; ++ch)
+        color |= (uint32_t)((sums[ch] + box->weight / 2) / box->weight) << (ch * 8);
+    return color;
+}
+
+static int build_palette(tile_png_encoder_t *enc)
+{
+    size_t capacity = (size_t)1 << enc->bits, num_items = 0, num_boxes = 1, i, j, k;
+    struct st_color_t **items;
+    struct st_box_t boxes[MAX_COLORS];
+    uint32_t order[MAX_COLORS];
+
+    if ((items = malloc(enc->num_colors * sizeof(*items))) == NULL)
+        return -1;
+    for (i = 0; i != capacity; ++i)
+        if (enc->colors[i].count != 0)
+            items[num_items++] = enc->colors + i;
+
+    /* a color per box if they fit, or the median cut down to 256 of them */
+    if (num_items <= MAX_COLORS) {
+        for (num_boxes = 0; num_boxes != num_items; ++num_boxes) {
+            boxes[num_boxes].begin = num_boxes;
+            boxes[num_boxes].end = num_boxes + 1;
+            boxes[num_boxes].weight = items[num_boxes]->count;
+        }
+    } else {
+        boxes[0].begin = 0;
+        boxes[0].end = num_items;
+        measure_box(items, boxes);
+        while (num_boxes != MAX_COLORS) {
+            /* the box of the most pixels times the widest spread */
+            size_t widest = 0;
+            for (i = 1; i != num_boxes; ++i)
+                if (boxes[i].weight * boxes[i].range > boxes[widest].weight * boxes[widest].range)
+                    widest = i;
+            if (boxes[widest].range == 0)
+                break;
+            split_box(items, boxes + widest, boxes + num_boxes++);
+        }
+    }
+
+    /* the translucent ones first, for a short tRNS */
+    enc->num_translucent = 0;
+    for (i = 0; i != num_boxes; ++i)
+        if ((order[i] = mean_of(items, boxes + i)) >> 24 != 0xff)
+            ++enc->num_translucent;
+    for (i = 0, j = 0, k = enc->num_translucent; i != num_boxes; ++i) {
+        size_t index = order[i] >> 24 != 0xff ? j++ : k++, m;
+        enc->palette[index] = order[i];
+        for (m = boxes[i].begin; m != boxes[i].end; ++m)
+            items[m]->index = (uint32_t)index;
+    }
+    enc->palette_size = num_boxes;
+    for (i = 0; i != num_boxes; ++i) {
+        enc->pr[i] = channel_of(enc->palette[i], 0);
+        enc->pg[i] = channel_of(enc->palette[i], 8);
+        enc->pb[i] = channel_of(enc->palette[i], 16);
+        enc->pa[i] = channel_of(enc->palette[i], 24);
+    }
+    enc->built = 1;
+    free(items);
+    return 0;
+}
+
+/* the entry of the palette nearest to a color not collected; the distances are computed in a vectorized loop */
+static uint32_t nearest_of(tile_png_encoder_t *enc, uint32_t color)
+{
+    int32_t r = channel_of(color, 0), g = channel_of(color, 8), b = channel_of(color, 16), a = channel_of(color, 24);
+    uint32_t distances[MAX_COLORS], best = 0;
+    size_t i;
+
+    for (i = 0; i < enc->palette_size; ++i) {
+        int32_t dr = enc->pr[i] - r, dg = enc->pg[i] - g, db = enc->pb[i] - b, da = enc->pa[i] - a;
+        distances[i] = (uint32_t)(dr * dr + dg * dg + db * db + da * da);
+    }
+    for (i = 1; i < enc->palette_size; ++i)
+        if (distances[i] < distances[best])
+            best = (uint32_t)i;
+    return best;
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* the chunk of len bytes of data already at p + 8 */
+static unsigned char *seal_chunk(unsigned char *p, const char *type, uint32_t len)
+{
+    put_be32(p, len);
+    memcpy(p + 4, type, 4);
+    put_be32(p + 8 + len, (uint32_t)crc32(crc32(0, NULL, 0), p + 4, len + 4));
+    return p + 12 + len;
+}
+
+static int reserve_raw(tile_png_encoder_t *enc, size_t len)
+{
+    unsigned char *raw;
+
+    if (len <= enc->raw_capacity)
+        return 0;
+    if ((raw = realloc(enc->raw, len)) == NULL)
+        return -1;
+    enc->raw = raw;
+    enc->raw_capacity = len;
+    return 0;
+}
+
+static int init_deflate(tile_png_encoder_t *enc, int level)
+{
+    if (level == enc->level)
+        return deflateReset(&enc->z) == Z_OK ? 0 : -1;
+    if (enc->level != -1) {
+        deflateEnd(&enc->z);
+        enc->level = -1;
+    }
+    memset(&enc->z, 0, sizeof(enc->z));
+    if (deflateInit(&enc->z, level) != Z_OK)
+        return -1;
+    enc->level = level;
+    return 0;
+}
+
+int tile_png_encode(tile_png_encoder_t *enc, const uint32_t *pixels, uint32_t w, uint32_t h, size_t stride, int level, char **out,
+                    size_t *len)
+{
+    static const unsigned char signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    unsigned depth;
+    size_t row_len, raw_len, bound, i;
+    unsigned char *buf, *p;
+    uint32_t x, y;
+
+    if (enc->num_colors == 0 && tile_png_add(enc, pixels, w, h, stride) != 0)
+        return -1;
+    if (!enc->built && build_palette(enc) != 0)
+        return -1;
+    depth = enc->palette_size <= 2 ? 1 : enc->palette_size <= 4 ? 2 : enc->palette_size <= 16 ? 4 : 8;
+    row_len = 1 + ((size_t)w * depth + 7) / 8;
+    raw_len = row_len * h;
+    if (reserve_row(enc, w) != 0 || reserve_raw(enc, raw_len) != 0)
+        return -1;
+
+    /* the indices, row by row (filter: none, as is the best for the palettes) */
+    for (y = 0; y != h; ++y) {
+        unsigned char *row = enc->raw + y * row_len;
+        uint32_t last_color = 0, last_index = 0;
+        hash_row(enc->normalized, enc->hashes, pixels + y * stride, w, 32 - enc->bits);
+        for (x = 0; x != w; ++x) {
+            uint32_t c = enc->normalized[x];
+            if (x == 0 || c != last_color) {
+                struct st_color_t *e = find_color(enc, c, enc->hashes[x]);
+                last_color = c;
+                last_index = e->count != 0 ? e->index : nearest_of(enc, c);
+            }
+            enc->indices[x] = (unsigned char)last_index;
+        }
+        row[0] = 0;
+        if (depth == 8) {
+            memcpy(row + 1, enc->indices, w);
+        } else {
+            unsigned per_byte = 8 / depth;
+            memset(row + 1, 0, row_len - 1);
+            for (x = 0; x != w; ++x)
+                row[1 + x / per_byte] |= enc->indices[x] << (8 - depth * (x % per_byte + 1));
+        }
+    }
+
+    if (init_deflate(enc, level) != 0)
+        return -1;
+    bound = deflateBound(&enc->z, raw_len);
+    if ((buf = malloc(sizeof(signature) + (12 + 13) + (12 + 3 * MAX_COLORS) + (12 + MAX_COLORS) + (12 + bound) + 12)) == NULL)
+        return -1;
+    memcpy(buf, signature, sizeof(signature));
+    p = buf + sizeof(signature);
+
+    put_be32(p + 8, w);
+    put_be32(p + 12, h);
+    p[16] = depth;
+    p[17] = 3; /* color type: palette */
+    p[18] = 0; /* compression */
+    p[19] = 0; /* filter */
+    p[20] = 0; /* interlace */
+    p = seal_chunk(p, "IHDR", 13);
+
+    for (i = 0; i != enc->palette_size; ++i) {
+        p[8 + i * 3] = channel_of(enc->palette[i], 0);
+        p[8 + i * 3 + 1] = channel_of(enc->palette[i], 8);
+        p[8 + i * 3 + 2] = channel_of(enc->palette[i], 16);
+    }
+    p = seal_chunk(p, "PLTE", (uint32_t)(enc->palette_size * 3));
+
+    if (enc->num_translucent != 0) {
+        for (i = 0; i != enc->num_translucent; ++i)
+            p[8 + i] = channel_of(enc->palette[i], 24);
+        p = seal_chunk(p, "tRNS", (uint32_t)enc->num_translucent);
+    }
+
+    enc->z.next_in = enc->raw;
+    enc->z.avail_in = (uInt)raw_len;
+    enc->z.next_out = p + 8;
+    enc->z.avail_out = (uInt)bound;
+    if (deflate(&enc->z, Z_FINISH) != Z_STREAM_END) {
+        free(buf);
+        return -1;
+    }
+    p = seal_chunk(p, "IDAT", (uint32_t)enc->z.total_out);
+    p = seal_chunk(p, "IEND", 0);
+
+    *out = (char *)buf;
+    *len = p - buf;
+    return 0;
+}
@@ -3,22 +3,150 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
 
 #include "picohttpparser.h"
 #include "h2o.h"
+#include "h2o/memcached.h"
 #include "tile/tile-rewrite-path.h"
 #include "tile/mkdir-p.h"
+#include "tile/tile-disk-cache.h"
+#include "tile/tile-dirfd-cache.h"
+#include "khash.h"
+
+/*
+The misses are fetched from one of the upstreams, picked per request by the fewest requests in flight (optionally
+weighted by the EWMA of the response time), skipping the ones ejected: an upstream answering max_fails 5xx in a row
+(h2o answers 502/504 by itself on connection failures & timeouts) is left out for fail_timeout. Once back, it is
+ejected again by a single failure until it succeeds once (i.e. half-open).
+The counters are shared by the threads, and updated by atomic ops; races of the EWMA just lose samples.
+*/
+struct st_tile_upstream_t {
+    h2o_url_t url;
+    h2o_socketpool_t *sockpool; /* non-NULL if keepalive is enabled */
+    size_t num_outstanding;
+    double latency_ewma; /* in milliseconds, to the response headers */
+    unsigned num_fails;  /* in a row */
+    uint64_t ejected_until;
+};
+
+/*
+A tile stored longer than the TTL of its zoom (by its mtime, i.e. when fetched or last revalidated) is still served,
+while revalidated in the background by a conditional GET with the validators of the upstream's response, persisted
+with the tile as extended attributes (or by the mtime, lacking them): a 304 just touches the tile (and updates the
+validators), a 200 replaces it. A tile is revalidated once at a time.
+*/
+#define TILE_PROXY_ETAG_XATTR "user.h2o.upstream-etag"
+#define TILE_PROXY_LAST_MODIFIED_XATTR "user.h2o.upstream-last-modified"
+#define TILE_PROXY_VALIDATOR_MAXLEN 128
+
+KHASH_SET_INIT_INT64(tile_keys)
+
+/* a variant of a tile; that of the 1x png equals the key of (zoom, x, y) alone */
+#define TILE_KEY(zoom, x, y, scale, suffix)                                                                                        \
+    (((uint64_t)((scale) == 2) << 58) | ((uint64_t)(suffix) << 56) | ((uint64_t)(zoom) << 48) | ((uint64_t)(x) << 24) | (y))
+
+/*
+The proxies may share a memcached (or yrmcds) as the 2nd level between their disks & the upstreams: a miss on the disk
+is looked up there first (keyed by "<prefix>z/x/y[@2x].ext"), and a hit is sent right from the buffer received (& stored on
+the disk); the tiles fetched from the upstreams are set there with the expiration, so that the other proxies get them.
+The memcached is treated as a miss while unreachable.
+*/
+struct st_tile_proxy_context_t {
+    h2o_http1client_ctx_t *client_ctx; /* NULL to use the one of h2o_context_t */
+    h2o_multithread_receiver_t memcached;
+};
+
+/*
+The proxies may form a group of peers sharing their disks, as a cache of the sum of their capacities: a tile is owned by
+a peer, picked by consistent hashing of (zoom, x, y) over a ring of TILE_PROXY_PEER_VNODES points per peer, and a miss
+of a non-owner is fetched from the owner (which fetches it from the upstreams on its miss) w/o being stored. The requests
+between the peers are marked by TILE_PROXY_PEER_HEADER, so as not to be forwarded again. The owner's response is
+buffered until complete: on a failure (a connection failure, a timeout or a 5xx) the tile is fetched from the upstreams
+instead, and the failure is accounted as an upstream's is, ejecting the owner for fail_timeout after max_fails.
+*/
+#define TILE_PROXY_PEER_VNODES 160
+#define TILE_PROXY_PEER_HEADER "x-h2o-tile-peer"
+
+struct st_tile_peer_point_t {
+    uint64_t hash;
+    size_t peer;
+};
+
+struct st_tile_peer_fetch_t {
+    h2o_tile_proxy_handler_t *handler;
+    struct st_tile_upstream_t *peer;
+    h2o_req_t *req;
+    h2o_http1client_t *client; /* NULL once finished */
+    h2o_iovec_t reqbuf;
+    uint64_t sent_at;
+    int status;
+    const char *reason;
+    h2o_headers_t headers; /* of the response, to be passed through */
+    h2o_buffer_t *body;
+};
+
+struct st_tile_memcached_lookup_t {
+    h2o_tile_proxy_handler_t *handler;
+    h2o_req_t *req;
+    h2o_memcached_req_t *get; /* NULL once answered */
+    uint32_t zoom, x, y, scale;
+    enum TILE_SUFFIX suffix;
+    h2o_iovec_t tile_path;
+};
 
 struct st_h2o_tile_proxy_handler_t {
-    struct rp_handler_t super;
+    struct rp_handler_t super; /* super.upstream is unused */
     h2o_iovec_t local_base_path; /* has "/" appended at last */
-    int (*on_req_delegate)(struct st_h2o_handler_t *self, h2o_req_t *req);
+    h2o_tile_proxy_config_vars_t config;
+    struct st_tile_upstream_t *upstreams;
+    size_t num_upstreams;
+    size_t next_upstream; /* to start looking from; spreads the ties */
+    tile_disk_cache_t *cache; /* NULL if unbounded */
+    h2o_memcached_context_t *memcached; /* NULL unless configured (& until the first context is initialized) */
+    struct {
+        struct st_tile_upstream_t *entries; /* NULL if alone */
+        size_t size;
+        size_t self;
+        struct st_tile_peer_point_t *ring; /* sorted by hash */
+        size_t ring_size;
+    } peers;
+    struct {
+        pthread_mutex_t mutex;
+        khash_t(tile_keys) * keys; /* of the tiles being revalidated */
+    } revalidating;
+};
+
+struct st_tile_revalidation_t {
+    h2o_tile_proxy_handler_t *handler;
+    struct st_tile_upstream_t *upstream;
+    h2o_http1client_t *client;
+    h2o_loop_t *loop;
+    uint32_t zoom, x, y, scale;
+    enum TILE_SUFFIX suffix;
+    char *tile_path, *tmp_path;
+    h2o_iovec_t reqbuf;
+    uint64_t sent_at;
+    int fd;
+    uint64_t size;
+    char etag[TILE_PROXY_VALIDATOR_MAXLEN], last_modified[TILE_PROXY_VALIDATOR_MAXLEN]; /* of the new response */
+};
+
+/* the overrides of a request forwarded, telling its upstream to the filter */
+struct st_tile_upstream_req_t {
+    h2o_req_overrides_t super;
+    h2o_tile_proxy_handler_t *handler;
+    struct st_tile_upstream_t *upstream;
+    uint64_t sent_at;
+    int is_stored; /* 0 if the response is only passed through, not to replace the tile on the disk */
 };
 
 struct st_h2o_tile_store_filter_t {
     h2o_filter_t super;
+    h2o_tile_proxy_handler_t *handler;
     h2o_iovec_t local_base_path; /* has "/" appended at last */
 };
 
@@ -28,15 +156,108 @@ struct st_store_tile_t {
     h2o_iovec_t tmp_tile_path;
     h2o_iovec_t chunked_content_buf;
     int fd;
+    tile_disk_cache_t *cache; /* NULL if unbounded */
+    uint32_t zoom, x, y, scale;
+    enum TILE_SUFFIX suffix;
+    uint64_t size;
+    h2o_iovec_t etag, last_modified; /* of the response, if any */
+    h2o_buffer_t **contents; /* to be set to memcached, or NULL */
+    h2o_tile_proxy_handler_t *handler;
 };
 
+static void set_validator(const char *path, const char *name, const char *value, size_t len)
+{
+    if (len == 0 || len > TILE_PROXY_VALIDATOR_MAXLEN)
+        return;
+    if (setxattr(path, name, value, len, 0) != 0 && errno != ENOTSUP)
+        fprintf(stderr, "[lib/handler/tile-proxy.c] Failed to set %s of %s: %s\n", name, path, strerror(errno));
+}
+
+static h2o_iovec_t get_tile_mime_type(enum TILE_SUFFIX suffix)
+{
+    switch (suffix) {
+    case JPG:
+        return h2o_iovec_init(H2O_STRLIT("image/jpeg"));
+    case WEBP:
+        return h2o_iovec_init(H2O_STRLIT("image/webp"));
+    case PBF:
+        return h2o_iovec_init(H2O_STRLIT("application/x-protobuf"));
+    default:
+        return h2o_iovec_init(H2O_STRLIT("image/png"));
+    }
+}
+
+/* a vector tile may be stored gzip'ed (as tippecanoe writes them); told apart by the magic, as MVT never starts with 0x1f */
+static int is_gzipped(const char *head, size_t len)
+{
+    return len >= 2 && (unsigned char)head[0] == 0x1f && (unsigned char)head[1] == 0x8b;
+}
+
+static int is_gzipped_file(const char *path)
+{
+    char head[2];
+    int fd, ret;
+
+    if ((fd = tile_dirfd_open(path, O_RDONLY | O_CLOEXEC, 0)) == -1)
+        return 0;
+    ret = pread(fd, head, sizeof(head), 0) == sizeof(head) && is_gzipped(head, sizeof(head));
+    close(fd);
+    return ret;
+}
+
+static int accepts_gzip(h2o_req_t *req)
+{
+    return (h2o_get_compressible_types(&req->headers) & H2O_COMPRESSIBLE_GZIP) != 0;
+}
+
+static h2o_iovec_t build_memcached_key(h2o_mem_pool_t *pool, uint32_t zoom, uint32_t x, uint32_t y, uint32_t scale,
+                                       enum TILE_SUFFIX suffix)
+{
+    h2o_iovec_t key;
+    key.base = h2o_mem_alloc_pool(pool, sizeof("20/1048575/1048575@2x.webp"));
+    key.len = sprintf(key.base, "%" PRIu32 "/%" PRIu32 "/%" PRIu32 "%s.%s", zoom, x, y, scale == 2 ? "@2x" : "",
+                      tile_suffix_str(suffix));
+    return key;
+}
+
+/* moves the tmp file in place, and accounts it to the cache; and sets the contents (if any) to memcached */
+static void commit_tile(struct st_store_tile_t *self, h2o_req_t *req, h2o_iovec_t contents)
+{
+    h2o_tile_proxy_handler_t *handler = self->handler;
+    int i;
+
+    if (contents.len != 0 && handler->memcached != NULL) {
+        uint32_t expiration = handler->config.memcached.expiration;
+        if (expiration == 0)
+            expiration = (uint32_t)handler->config.ttl[self->zoom <= TILE_MAX_ZOOM ? self->zoom : TILE_MAX_ZOOM];
+        h2o_memcached_set(handler->memcached,
+                          build_memcached_key(&req->pool, self->zoom, self->x, self->y, self->scale, self->suffix), contents,
+                          expiration, 0);
+    }
+
+    set_validator(self->tmp_tile_path.base, TILE_PROXY_ETAG_XATTR, self->etag.base, self->etag.len);
+    set_validator(self->tmp_tile_path.base, TILE_PROXY_LAST_MODIFIED_XATTR, self->last_modified.base, self->last_modified.len);
+
+    for (i = 0; tile_dirfd_rename(self->tmp_tile_path.base, self->local_tile_path.base) != 0; ++i) {
+        h2o_req_log_error(req, "lib/handler/tile-proxy.c", "Failed to rename the tmp file %s to %s: %s\n", self->tmp_tile_path.base, self->local_tile_path.base, strerror(errno));
+        /* Is this retrial sane? */
+        if (i == 32) {
+            tile_dirfd_unlink(self->tmp_tile_path.base);
+            return;
+        }
+        usleep(10);
+    }
+    if (self->cache != NULL)
+        tile_disk_cache_add(self->cache, self->zoom, self->x, self->y, self->scale, self->suffix, self->size);
+}
+
 static void store_data(h2o_ostream_t *_self, h2o_req_t *req, h2o_iovec_t *inbufs, size_t inbufcnt, int is_final)
 {
     struct st_store_tile_t *self = (void *)_self;
     int i;
 
     if (self->fd < 0) {
-        self->fd = open(self->tmp_tile_path.base, O_WRONLY | O_TRUNC | O_CREAT, 0666);
+        self->fd = tile_dirfd_open(self->tmp_tile_path.base, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0666);
     }
     if (self->fd < 0) {
         h2o_req_log_error(req, "lib/handler/tile-proxy.c", "Could not open file %s: %s\n", self->tmp_tile_path.base, strerror(errno));
@@ -48,23 +269,21 @@ static void store_data(h2o_ostream_t *_self, h2o_req_t *req, h2o_iovec_t *inbufs
         if (v != inbufs[i].len) {
             h2o_req_log_error(req, "lib/handler/tile-proxy.c", "Failed to write to file %s: %s\n", self->tmp_tile_path.base, strerror(errno));
             close(self->fd);
-            unlink(self->tmp_tile_path.base);
+            tile_dirfd_unlink(self->tmp_tile_path.base);
             goto Cont;
         }
+        self->size += v;
+        if (self->contents != NULL) {
+            h2o_iovec_t buf = h2o_buffer_reserve(self->contents, inbufs[i].len);
+            memcpy(buf.base, inbufs[i].base, inbufs[i].len);
+            (*self->contents)->size += inbufs[i].len;
+        }
     }
 
     if (is_final) {
         close(self->fd);
-        if (rename(self->tmp_tile_path.base, self->local_tile_path.base) != 0) {
-            h2o_req_log_error(req, "lib/handler/tile-proxy.c", "Failed to rename the tmp file %s to %s: %s\n", self->tmp_tile_path.base, self->local_tile_path.base, strerror(errno));
-            for (i=0; i<32; ++i) {
-                usleep(10);
-                if (rename(self->tmp_tile_path.base, self->local_tile_path.base) == 0) {
-                    goto Cont;
-                }
-                h2o_req_log_error(req, "lib/handler/tile-proxy.c", "Failed to rename the tmp file %s to %s: %s\n", self->tmp_tile_path.base, self->local_tile_path.base, strerror(errno));
-            }
-        }
+        commit_tile(self, req,
+                    self->contents != NULL ? h2o_iovec_init((*self->contents)->bytes, (*self->contents)->size) : h2o_iovec_init(NULL, 0));
     }
 Cont:
     h2o_ostream_send_next(&self->super, req, inbufs, inbufcnt, is_final);
@@ -77,7 +296,7 @@ static void store_chunked_data(h2o_ostream_t *_self, h2o_req_t *req, h2o_iovec_t
     int i;
 
     if (self->fd < 0) {
-        self->fd = open(self->tmp_tile_path.base, O_WRONLY | O_TRUNC | O_CREAT, 0666);
+        self->fd = tile_dirfd_open(self->tmp_tile_path.base, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0666);
     }
     if (self->fd < 0) {
         h2o_req_log_error(req, "lib/handler/tile-proxy.c", "Could not open file %s: %s\n", self->tmp_tile_path.base, strerror(errno));
@@ -96,7 +315,7 @@ static void store_chunked_data(h2o_ostream_t *_self, h2o_req_t *req, h2o_iovec_t
         case -1: /* error */
             h2o_req_log_error(req, "lib/handler/tile-proxy.c", "Failed to parse chunks for file %s\n", self->tmp_tile_path.base);
             close(self->fd);
-            unlink(self->tmp_tile_path.base);
+            tile_dirfd_unlink(self->tmp_tile_path.base);
             goto Cont;
         case -2: /* incomplete */
 //            assert(!"unreachable");
@@ -107,7 +326,7 @@ static void store_chunked_data(h2o_ostream_t *_self, h2o_req_t *req, h2o_iovec_t
         }
 
         // Verify buf begins with the PNG header
-        if (likely(memcmp(buf, PNG_HEADER, 8) != 0)) {
+        if (self->suffix == PNG && (newsz < 8 || memcmp(buf, PNG_HEADER, 8) != 0)) {
             h2o_req_log_error(req, "lib/handler/tile-proxy.c", "The response is not a correct png\n");
             close(self->fd);
             goto Cont;
@@ -116,22 +335,13 @@ static void store_chunked_data(h2o_ostream_t *_self, h2o_req_t *req, h2o_iovec_t
         if (v != newsz) {
             h2o_req_log_error(req, "lib/handler/tile-proxy.c", "Failed to write to file %s: %s\n", self->tmp_tile_path.base, strerror(errno));
             close(self->fd);
-            unlink(self->tmp_tile_path.base);
+            tile_dirfd_unlink(self->tmp_tile_path.base);
             goto Cont;
         }
 
+        self->size = newsz;
         close(self->fd);
-        if (rename(self->tmp_tile_path.base, self->local_tile_path.base) != 0) {
-            h2o_req_log_error(req, "lib/handler/tile-proxy.c", "Failed to rename the tmp file %s to %s: %s\n", self->tmp_tile_path.base, self->local_tile_path.base, strerror(errno));
-            /* Is this retrial sane? */
-            for (i=0; i<32; ++i) {
-                usleep(10);
-                if (rename(self->tmp_tile_path.base, self->local_tile_path.base) == 0) {
-                    goto Cont;
-                }
-                h2o_req_log_error(req, "lib/handler/tile-proxy.c", "Failed to rename the tmp file %s to %s: %s\n", self->tmp_tile_path.base, self->local_tile_path.base, strerror(errno));
-            }
-        }
+        commit_tile(self, req, h2o_iovec_init(buf, newsz));
     }
 
 Cont:
@@ -139,11 +349,80 @@ Cont:
 }
 
 
+static struct st_tile_upstream_t *select_upstream(h2o_tile_proxy_handler_t *self, uint64_t now)
+{
+    struct st_tile_upstream_t *best = NULL, *earliest = NULL;
+    double best_score = 0;
+    size_t start = __sync_fetch_and_add(&self->next_upstream, 1), i;
+
+    for (i = 0; i != self->num_upstreams; ++i) {
+        struct st_tile_upstream_t *upstream = self->upstreams + (start + i) % self->num_upstreams;
+        double score;
+        if (upstream->ejected_until > now) {
+            if (earliest == NULL || upstream->ejected_until < earliest->ejected_until)
+                earliest = upstream;
+            continue;
+        }
+        score = upstream->num_outstanding;
+        if (self->config.balance == H2O_TILE_PROXY_BALANCE_LATENCY)
+            score = (score + 1) * (upstream->latency_ewma + 1);
+        if (best == NULL || score < best_score) {
+            best = upstream;
+            best_score = score;
+        }
+    }
+    /* all ejected; try the one to be back first, rather than failing */
+    return best != NULL ? best : earliest;
+}
+
+static void on_upstream_req_dispose(void *_ureq)
+{
+    struct st_tile_upstream_req_t *ureq = _ureq;
+    __sync_sub_and_fetch(&ureq->upstream->num_outstanding, 1);
+}
+
+/* accounts a response (or a failure, as a 5xx) of the upstream */
+static void update_upstream(h2o_tile_proxy_handler_t *self, struct st_tile_upstream_t *upstream, int status, uint64_t sent_at,
+                            uint64_t now)
+{
+    if (status >= 500) {
+        if (__sync_add_and_fetch(&upstream->num_fails, 1) >= self->config.max_fails && upstream->ejected_until <= now) {
+            upstream->ejected_until = now + self->config.fail_timeout;
+            fprintf(stderr, "[lib/handler/tile-proxy.c] Ejecting the upstream %.*s for %" PRIu64 " ms\n",
+                    (int)upstream->url.authority.len, upstream->url.authority.base, self->config.fail_timeout);
+        }
+    } else {
+        double elapsed = now - sent_at;
+        upstream->num_fails = 0;
+        upstream->latency_ewma = upstream->latency_ewma == 0 ? elapsed : upstream->latency_ewma * 0.8 + elapsed * 0.2;
+    }
+}
+
+static h2o_iovec_t find_res_header(h2o_req_t *req, const h2o_token_t *token)
+{
+    ssize_t index = h2o_find_header(&req->res.headers, token, -1);
+    return index != -1 ? req->res.headers.entries[index].value : h2o_iovec_init(NULL, 0);
+}
+
+static void dispose_contents(void *_contents)
+{
+    h2o_buffer_dispose((h2o_buffer_t **)_contents);
+}
+
 static void on_setup_ostream(h2o_filter_t *_self, h2o_req_t *req, h2o_ostream_t **slot)
 {
     struct st_h2o_tile_store_filter_t *self = (void *)_self;
-    uint32_t x = 0, y = 0, z = 0;
-    char* physical_tile_path = alloca(28);
+    struct st_tile_upstream_req_t *ureq = (void *)req->overrides;
+    uint32_t x = 0, y = 0, z = 0, scale = 1;
+    enum TILE_SUFFIX suffix = PNG;
+    char* physical_tile_path = alloca(TILE_PHYSPATH_BUFLEN);
+
+    /* only the responses of the upstreams are stored; not the tiles sent from the disk */
+    if (ureq == NULL || ureq->handler != self->handler || !ureq->is_stored) {
+        h2o_setup_next_ostream(req, slot);
+        return;
+    }
+    update_upstream(ureq->handler, ureq->upstream, req->res.status, ureq->sent_at, h2o_now(req->conn->ctx->loop));
 
     if (req->res.status != 200) {
         h2o_req_log_error(req, "lib/handler/tile-proxy.c", "Upstream returned %d: %s\n", req->res.status, req->res.reason);
@@ -153,9 +432,10 @@ static void on_setup_ostream(h2o_filter_t *_self, h2o_req_t *req, h2o_ostream_t
     */
     if ( likely(
             req->res.status == 200 && 
-            tile_rewrite_path(req->path_normalized.base, "/", 1, physical_tile_path, 28, &z, &x, &y)) ) {
+            tile_rewrite_path(h2o_strdup(&req->pool, req->path_normalized.base, req->path_normalized.len).base, "/", 1,
+                              physical_tile_path, TILE_PHYSPATH_BUFLEN, &z, &x, &y, &scale, &suffix)) ) {
         struct st_store_tile_t *store_tile;
-        char thread_id[18];
+        char thread_id[sizeof(".ffffffffffffffff.png")];
         int txfer_enc_idx = -1;
         /*
         Now, physical_path is of the form /z/nnn/nnn/nnn/nnn/nnn.png
@@ -167,7 +447,18 @@ static void on_setup_ostream(h2o_filter_t *_self, h2o_req_t *req, h2o_ostream_t
         h2o_iovec_t full_path = h2o_concat(&req->pool, self->local_base_path, h2o_iovec_init(physical_tile_path, strlen(physical_tile_path)));
         store_tile = (void *)h2o_add_ostream(req, sizeof(struct st_store_tile_t), slot);
         store_tile->fd = -1;
+        store_tile->cache = self->handler->cache;
+        store_tile->zoom = z;
+        store_tile->x = x;
+        store_tile->y = y;
+        store_tile->scale = scale;
+        store_tile->suffix = suffix;
+        store_tile->size = 0;
+        store_tile->etag = find_res_header(req, H2O_TOKEN_ETAG);
+        store_tile->last_modified = find_res_header(req, H2O_TOKEN_LAST_MODIFIED);
         store_tile->local_tile_path = full_path;
+        store_tile->contents = NULL;
+        store_tile->handler = self->handler;
         store_tile->super.do_send = store_data;
         if ((txfer_enc_idx = h2o_find_header(&(req->res.headers), H2O_TOKEN_TRANSFER_ENCODING, SIZE_MAX)) != -1) {
             h2o_iovec_t *txfer_enc = &req->res.headers.entries[txfer_enc_idx].value;
@@ -176,55 +467,661 @@ static void on_setup_ostream(h2o_filter_t *_self, h2o_req_t *req, h2o_ostream_t
                 store_tile->chunked_content_buf = h2o_iovec_init(H2O_STRLIT(""));
             }
         }
-        snprintf(thread_id, 22, ".%x.png", pthread_self());
+        if (store_tile->super.do_send == store_data && self->handler->memcached != NULL) {
+            /* kept to be set to memcached at last (the chunked ones are buffered anyway) */
+            store_tile->contents = h2o_mem_alloc_shared(&req->pool, sizeof(*store_tile->contents), dispose_contents);
+            h2o_buffer_init(store_tile->contents, &h2o_socket_buffer_prototype);
+        }
+        snprintf(thread_id, sizeof thread_id, ".%lx.png", (unsigned long)pthread_self());
         store_tile->tmp_tile_path = h2o_concat(&req->pool, full_path, h2o_iovec_init(thread_id, strlen(thread_id)));
-        mkdir_p_parent(store_tile->tmp_tile_path.base);
     } 
 
     h2o_setup_next_ostream(req, slot);
 }
 
+static void finish_revalidation(struct st_tile_revalidation_t *r, int status)
+{
+    h2o_tile_proxy_handler_t *self = r->handler;
+    khiter_t iter;
+
+    update_upstream(self, r->upstream, status, r->sent_at, h2o_now(r->loop));
+    __sync_sub_and_fetch(&r->upstream->num_outstanding, 1);
+    if (r->fd != -1) {
+        close(r->fd);
+        tile_dirfd_unlink(r->tmp_path);
+    }
+    pthread_mutex_lock(&self->revalidating.mutex);
+    if ((iter = kh_get(tile_keys, self->revalidating.keys, TILE_KEY(r->zoom, r->x, r->y, r->scale, r->suffix))) != kh_end(self->revalidating.keys))
+        kh_del(tile_keys, self->revalidating.keys, iter);
+    pthread_mutex_unlock(&self->revalidating.mutex);
+    free(r->tile_path);
+    free(r->tmp_path);
+    free(r->reqbuf.base);
+    free(r);
+}
+
+static void copy_validator(char *dst, struct phr_header *headers, size_t num_headers, const char *name, size_t name_len)
+{
+    size_t i;
+    for (i = 0; i != num_headers; ++i) {
+        /* the names are lowercased by the client */
+        if (h2o_memis(headers[i].name, headers[i].name_len, name, name_len) && headers[i].value_len < TILE_PROXY_VALIDATOR_MAXLEN) {
+            memcpy(dst, headers[i].value, headers[i].value_len);
+            dst[headers[i].value_len] = '\0';
+            return;
+        }
+    }
+}
+
+static int on_revalidation_body(h2o_http1client_t *client, const char *errstr)
+{
+    struct st_tile_revalidation_t *r = client->data;
+    h2o_buffer_t *inbuf = client->sock->input;
+
+    if (errstr != NULL && errstr != h2o_http1client_error_is_eos) {
+        finish_revalidation(r, 502);
+        return -1;
+    }
+    if (inbuf->size != 0) {
+        if (write(r->fd, inbuf->bytes, inbuf->size) != (ssize_t)inbuf->size) {
+            fprintf(stderr, "[lib/handler/tile-proxy.c] Failed to write to file %s: %s\n", r->tmp_path, strerror(errno));
+            finish_revalidation(r, 200);
+            return -1;
+        }
+        r->size += inbuf->size;
+        h2o_buffer_consume(&client->sock->input, inbuf->size);
+    }
+    if (errstr == h2o_http1client_error_is_eos) {
+        close(r->fd);
+        r->fd = -1;
+        set_validator(r->tmp_path, TILE_PROXY_ETAG_XATTR, r->etag, strlen(r->etag));
+        set_validator(r->tmp_path, TILE_PROXY_LAST_MODIFIED_XATTR, r->last_modified, strlen(r->last_modified));
+        if (tile_dirfd_rename(r->tmp_path, r->tile_path) != 0) {
+            fprintf(stderr, "[lib/handler/tile-proxy.c] Failed to rename the tmp file %s to %s: %s\n", r->tmp_path, r->tile_path, strerror(errno));
+            tile_dirfd_unlink(r->tmp_path);
+        } else if (r->handler->cache != NULL) {
+            tile_disk_cache_add(r->handler->cache, r->zoom, r->x, r->y, r->scale, r->suffix, r->size);
+        }
+        finish_revalidation(r, 200);
+    }
+    return 0;
+}
+
+static h2o_http1client_body_cb on_revalidation_head(h2o_http1client_t *client, const char *errstr, int minor_version, int status,
+                                                    h2o_iovec_t msg, struct phr_header *headers, size_t num_headers)
+{
+    struct st_tile_revalidation_t *r = client->data;
+
+    if (errstr != NULL && errstr != h2o_http1client_error_is_eos) {
+        finish_revalidation(r, 502);
+        return NULL;
+    }
+    copy_validator(r->etag, headers, num_headers, H2O_STRLIT("etag"));
+    copy_validator(r->last_modified, headers, num_headers, H2O_STRLIT("last-modified"));
+
+    switch (status) {
+    case 304:
+        /* still fresh */
+        if (utimensat(AT_FDCWD, r->tile_path, NULL, 0) != 0)
+            fprintf(stderr, "[lib/handler/tile-proxy.c] Failed to touch %s: %s\n", r->tile_path, strerror(errno));
+        set_validator(r->tile_path, TILE_PROXY_ETAG_XATTR, r->etag, strlen(r->etag));
+        set_validator(r->tile_path, TILE_PROXY_LAST_MODIFIED_XATTR, r->last_modified, strlen(r->last_modified));
+        finish_revalidation(r, status);
+        return NULL;
+    case 200:
+        if (errstr == NULL && (r->fd = tile_dirfd_open(r->tmp_path, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0666)) != -1)
+            return on_revalidation_body;
+    /* fallthru */
+    default:
+        /* keep serving the stale one */
+        if (status != 304 && status != 200)
+            fprintf(stderr, "[lib/handler/tile-proxy.c] Upstream returned %d on revalidating %s\n", status, r->tile_path);
+        finish_revalidation(r, status);
+        return NULL;
+    }
+}
+
+static h2o_http1client_head_cb on_revalidation_connect(h2o_http1client_t *client, const char *errstr, h2o_iovec_t **reqbufs,
+                                                       size_t *reqbufcnt, int *method_is_head)
+{
+    struct st_tile_revalidation_t *r = client->data;
+
+    if (errstr != NULL) {
+        finish_revalidation(r, 502);
+        return NULL;
+    }
+    *reqbufs = &r->reqbuf;
+    *reqbufcnt = 1;
+    *method_is_head = 0;
+    return on_revalidation_head;
+}
+
+static void get_validator(const char *path, const char *name, char *buf)
+{
+    ssize_t len = getxattr(path, name, buf, TILE_PROXY_VALIDATOR_MAXLEN - 1);
+    buf[len > 0 ? len : 0] = '\0';
+}
+
+/* revalidates the stale tile against an upstream in the background, unless being done */
+static void start_revalidation(h2o_tile_proxy_handler_t *self, h2o_req_t *req, uint32_t zoom, uint32_t x, uint32_t y,
+                               uint32_t scale, enum TILE_SUFFIX suffix, const char *tile_path, time_t mtime)
+{
+    struct st_tile_revalidation_t *r;
+    h2o_http1client_ctx_t *client_ctx;
+    h2o_iovec_t path;
+    char etag[TILE_PROXY_VALIDATOR_MAXLEN], last_modified[TILE_PROXY_VALIDATOR_MAXLEN];
+    int ret;
+
+    pthread_mutex_lock(&self->revalidating.mutex);
+    kh_put(tile_keys, self->revalidating.keys, TILE_KEY(zoom, x, y, scale, suffix), &ret);
+    pthread_mutex_unlock(&self->revalidating.mutex);
+    if (ret == 0)
+        return;
+
+    get_validator(tile_path, TILE_PROXY_ETAG_XATTR, etag);
+    get_validator(tile_path, TILE_PROXY_LAST_MODIFIED_XATTR, last_modified);
+    if (etag[0] == '\0' && last_modified[0] == '\0') {
+        /* when it was fetched */
+        struct tm gmt;
+        gmtime_r(&mtime, &gmt);
+        h2o_time2str_rfc1123(last_modified, &gmt);
+    }
+
+    r = h2o_mem_alloc(sizeof(*r));
+    *r = (struct st_tile_revalidation_t){self, select_upstream(self, h2o_now(req->conn->ctx->loop)), NULL, req->conn->ctx->loop,
+                                         zoom, x, y, scale, suffix};
+    r->fd = -1;
+    r->sent_at = h2o_now(req->conn->ctx->loop);
+    __sync_add_and_fetch(&r->upstream->num_outstanding, 1);
+    r->tile_path = h2o_strdup(NULL, tile_path, SIZE_MAX).base;
+    r->tmp_path = h2o_mem_alloc(strlen(tile_path) + sizeof(".ffffffffffffffff.reval"));
+    sprintf(r->tmp_path, "%s.%lx.reval", tile_path, (unsigned long)pthread_self());
+    path = h2o_build_destination(req, r->upstream->url.path.base, r->upstream->url.path.len);
+    r->reqbuf.base = h2o_mem_alloc(path.len + r->upstream->url.authority.len + sizeof(etag) + sizeof(last_modified) + 128);
+    r->reqbuf.len = sprintf(r->reqbuf.base, "GET %.*s HTTP/1.1\r\nHost: %.*s\r\n%s%s%s%s%s%s\r\n", (int)path.len, path.base,
+                            (int)r->upstream->url.authority.len, r->upstream->url.authority.base,
+                            etag[0] != '\0' ? "If-None-Match: " : "", etag, etag[0] != '\0' ? "\r\n" : "",
+                            last_modified[0] != '\0' ? "If-Modified-Since: " : "", last_modified,
+                            last_modified[0] != '\0' ? "\r\n" : "");
+
+    if ((client_ctx = ((struct st_tile_proxy_context_t *)h2o_context_get_handler_context(req->conn->ctx, &self->super.super))
+                          ->client_ctx) == NULL)
+        client_ctx = &req->conn->ctx->proxy.client_ctx;
+    if (r->upstream->sockpool != NULL) {
+        h2o_http1client_connect_with_pool(&r->client, r, client_ctx, r->upstream->sockpool, on_revalidation_connect);
+    } else {
+        h2o_http1client_connect(&r->client, r, client_ctx, r->upstream->url.host, h2o_url_get_port(&r->upstream->url),
+                                on_revalidation_connect);
+    }
+}
+
+static uint64_t mix64(uint64_t h)
+{
+    /* the finalizer of MurmurHash3 */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int cmp_peer_points(const void *_x, const void *_y)
+{
+    const struct st_tile_peer_point_t *x = _x, *y = _y;
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+static void build_peer_ring(h2o_tile_proxy_handler_t *self, const char **urls)
+{
+    size_t i, j;
+
+    self->peers.ring_size = self->peers.size * TILE_PROXY_PEER_VNODES;
+    self->peers.ring = h2o_mem_alloc(sizeof(*self->peers.ring) * self->peers.ring_size);
+    for (i = 0; i != self->peers.size; ++i) {
+        /* FNV-1a of the URL, as configured (i.e. the same on every peer) */
+        uint64_t h = 0xcbf29ce484222325ULL;
+        const char *p;
+        for (p = urls[i]; *p != '\0'; ++p)
+            h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+        for (j = 0; j != TILE_PROXY_PEER_VNODES; ++j)
+            self->peers.ring[i * TILE_PROXY_PEER_VNODES + j] = (struct st_tile_peer_point_t){mix64(h + j), i};
+    }
+    qsort(self->peers.ring, self->peers.ring_size, sizeof(*self->peers.ring), cmp_peer_points);
+}
+
+static struct st_tile_upstream_t *find_owner_peer(h2o_tile_proxy_handler_t *self, uint32_t zoom, uint32_t x, uint32_t y)
+{
+    /* the variants of a tile share the owner */
+    uint64_t h = mix64(TILE_KEY(zoom, x, y, 1, PNG));
+    size_t lo = 0, hi = self->peers.ring_size;
+
+    /* the first point at or after h, wrapping around */
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (self->peers.ring[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return self->peers.entries + self->peers.ring[lo != self->peers.ring_size ? lo : 0].peer;
+}
+
+/* forwards the request to an upstream, as the reverse proxy does (cf. on_req() of proxy.c) */
+static void forward_request(h2o_tile_proxy_handler_t *self, h2o_req_t *req, struct st_tile_upstream_t *upstream, int is_stored)
+{
+    struct st_tile_upstream_req_t *ureq;
+    struct st_tile_proxy_context_t *pctx = h2o_context_get_handler_context(req->conn->ctx, &self->super.super);
+
+    __sync_add_and_fetch(&upstream->num_outstanding, 1);
+    ureq = h2o_mem_alloc_shared(&req->pool, sizeof(*ureq), on_upstream_req_dispose);
+    *ureq = (struct st_tile_upstream_req_t){{}, self, upstream, h2o_now(req->conn->ctx->loop), is_stored};
+    ureq->super.socketpool = upstream->sockpool;
+    ureq->super.location_rewrite.match = &upstream->url;
+    ureq->super.location_rewrite.path_prefix = req->pathconf->path;
+    ureq->super.client_ctx = pctx->client_ctx;
+    h2o_reprocess_request(req, req->method, upstream->url.scheme, upstream->url.authority,
+                          h2o_build_destination(req, upstream->url.path.base, upstream->url.path.len), &ureq->super, 0);
+}
+
+static void forward_to_upstream(h2o_tile_proxy_handler_t *self, h2o_req_t *req)
+{
+    forward_request(self, req, select_upstream(self, h2o_now(req->conn->ctx->loop)), 1);
+}
+
+/* accounts the end of the fetch from the peer; falls back to the upstreams on a failure (nothing has been sent yet) */
+static void finish_peer_fetch(struct st_tile_peer_fetch_t *f, int status)
+{
+    f->client = NULL;
+    update_upstream(f->handler, f->peer, status, f->sent_at, h2o_now(f->req->conn->ctx->loop));
+    __sync_sub_and_fetch(&f->peer->num_outstanding, 1);
+    if (status >= 500) {
+        h2o_req_log_error(f->req, "lib/handler/tile-proxy.c", "Peer %.*s failed (%d); fetching from the upstreams\n",
+                          (int)f->peer->url.authority.len, f->peer->url.authority.base, status);
+        forward_to_upstream(f->handler, f->req);
+    }
+}
+
+static void dispose_peer_fetch(void *_f)
+{
+    struct st_tile_peer_fetch_t *f = _f;
+
+    /* the client has gone while fetching */
+    if (f->client != NULL) {
+        h2o_http1client_cancel(f->client);
+        __sync_sub_and_fetch(&f->peer->num_outstanding, 1);
+    }
+    h2o_buffer_dispose(&f->body);
+    free(f->reqbuf.base);
+}
+
+static int on_peer_body(h2o_http1client_t *client, const char *errstr)
+{
+    static h2o_generator_t generator = {NULL, NULL};
+    struct st_tile_peer_fetch_t *f = client->data;
+    h2o_req_t *req = f->req;
+    h2o_iovec_t body;
+
+    if (errstr != NULL && errstr != h2o_http1client_error_is_eos) {
+        finish_peer_fetch(f, 502);
+        return -1;
+    }
+    if (client->sock->input->size != 0) {
+        h2o_iovec_t buf = h2o_buffer_reserve(&f->body, client->sock->input->size);
+        memcpy(buf.base, client->sock->input->bytes, client->sock->input->size);
+        f->body->size += client->sock->input->size;
+        h2o_buffer_consume(&client->sock->input, client->sock->input->size);
+    }
+    if (errstr != h2o_http1client_error_is_eos)
+        return 0;
+
+    finish_peer_fetch(f, f->status);
+    req->res.status = f->status;
+    req->res.reason = f->reason;
+    req->res.headers = f->headers;
+    req->res.content_length = f->body->size;
+    body = h2o_iovec_init(f->body->bytes, f->body->size);
+    h2o_start_response(req, &generator);
+    h2o_send(req, &body, 1, 1);
+    return 0;
+}
+
+static h2o_http1client_body_cb on_peer_head(h2o_http1client_t *client, const char *errstr, int minor_version, int status,
+                                            h2o_iovec_t msg, struct phr_header *headers, size_t num_headers)
+{
+    static const h2o_token_t *passed[] = {H2O_TOKEN_CONTENT_TYPE, H2O_TOKEN_ETAG, H2O_TOKEN_LAST_MODIFIED, H2O_TOKEN_CACHE_CONTROL,
+                                          H2O_TOKEN_EXPIRES};
+    struct st_tile_peer_fetch_t *f = client->data;
+    size_t i, j;
+
+    if (errstr != NULL && errstr != h2o_http1client_error_is_eos) {
+        finish_peer_fetch(f, 502);
+        return NULL;
+    }
+    if (status >= 500) {
+        finish_peer_fetch(f, status);
+        return NULL;
+    }
+    f->status = status;
+    f->reason = h2o_strdup(&f->req->pool, msg.base, msg.len).base;
+    for (i = 0; i != num_headers; ++i) {
+        for (j = 0; j != sizeof(passed) / sizeof(passed[0]); ++j) {
+            if (h2o_lcstris(headers[i].name, headers[i].name_len, passed[j]->buf.base, passed[j]->buf.len)) {
+                h2o_add_header(&f->req->pool, &f->headers, passed[j],
+                               h2o_strdup(&f->req->pool, headers[i].value, headers[i].value_len).base, headers[i].value_len);
+                break;
+            }
+        }
+    }
+    if (errstr == h2o_http1client_error_is_eos) {
+        /* no body */
+        on_peer_body(client, errstr);
+        return NULL;
+    }
+    return on_peer_body;
+}
+
+static h2o_http1client_head_cb on_peer_connect(h2o_http1client_t *client, const char *errstr, h2o_iovec_t **reqbufs,
+                                               size_t *reqbufcnt, int *method_is_head)
+{
+    struct st_tile_peer_fetch_t *f = client->data;
+
+    if (errstr != NULL) {
+        finish_peer_fetch(f, 502);
+        return NULL;
+    }
+    *reqbufs = &f->reqbuf;
+    *reqbufcnt = 1;
+    *method_is_head = 0;
+    return on_peer_head;
+}
+
+/* fetches the tile from the peer owning it, to be sent as is (w/o being stored) */
+static void fetch_from_peer(h2o_tile_proxy_handler_t *self, h2o_req_t *req, struct st_tile_upstream_t *peer)
+{
+    struct st_tile_proxy_context_t *pctx = h2o_context_get_handler_context(req->conn->ctx, &self->super.super);
+    h2o_http1client_ctx_t *client_ctx = pctx->client_ctx != NULL ? pctx->client_ctx : &req->conn->ctx->proxy.client_ctx;
+    struct st_tile_peer_fetch_t *f;
+    h2o_iovec_t path = h2o_build_destination(req, peer->url.path.base, peer->url.path.len);
+
+    __sync_add_and_fetch(&peer->num_outstanding, 1);
+    f = h2o_mem_alloc_shared(&req->pool, sizeof(*f), dispose_peer_fetch);
+    *f = (struct st_tile_peer_fetch_t){self, peer, req, NULL, {}, h2o_now(req->conn->ctx->loop)};
+    h2o_buffer_init(&f->body, &h2o_socket_buffer_prototype);
+    f->reqbuf.base = h2o_mem_alloc(path.len + peer->url.authority.len + sizeof(TILE_PROXY_PEER_HEADER) + 64);
+    f->reqbuf.len = sprintf(f->reqbuf.base, "GET %.*s HTTP/1.1\r\nHost: %.*s\r\n" TILE_PROXY_PEER_HEADER ": 1\r\n\r\n",
+                            (int)path.len, path.base, (int)peer->url.authority.len, peer->url.authority.base);
+    if (peer->sockpool != NULL) {
+        h2o_http1client_connect_with_pool(&f->client, f, client_ctx, peer->sockpool, on_peer_connect);
+    } else {
+        h2o_http1client_connect(&f->client, f, client_ctx, peer->url.host, h2o_url_get_port(&peer->url), on_peer_connect);
+    }
+}
+
+static void dispose_memcached_lookup(void *_lookup)
+{
+    struct st_tile_memcached_lookup_t *lookup = _lookup;
+    /* the client has gone while looking up */
+    if (lookup->get != NULL)
+        h2o_memcached_cancel_get(lookup->handler->memcached, lookup->get);
+}
+
+static void dispose_memcached_value(void *_value)
+{
+    free(*(char **)_value);
+}
+
+static void on_memcached_get(h2o_iovec_t value, void *_lookup)
+{
+    static h2o_generator_t generator = {NULL, NULL};
+    struct st_tile_memcached_lookup_t *lookup = _lookup;
+    h2o_req_t *req = lookup->req;
+    struct st_store_tile_t store = {};
+    h2o_iovec_t mime_type;
+    int fd;
+
+    lookup->get = NULL;
+    if (value.len == 0) {
+        forward_to_upstream(lookup->handler, req);
+        return;
+    }
+    /* owned by the request from now */
+    *(char **)h2o_mem_alloc_shared(&req->pool, sizeof(char *), dispose_memcached_value) = value.base;
+
+    /* store on the disk as well */
+    store.local_tile_path = lookup->tile_path;
+    /* suffixed by the thread, as the other threads may be storing the same tile */
+    store.tmp_tile_path.base = h2o_mem_alloc_pool(&req->pool, lookup->tile_path.len + sizeof(".0123456789abcdef.memcached"));
+    store.tmp_tile_path.len = sprintf(store.tmp_tile_path.base, "%.*s.%lx.memcached", (int)lookup->tile_path.len,
+                                      lookup->tile_path.base, (unsigned long)pthread_self());
+    store.zoom = lookup->zoom;
+    store.x = lookup->x;
+    store.y = lookup->y;
+    store.scale = lookup->scale;
+    store.suffix = lookup->suffix;
+    store.size = value.len;
+    store.cache = lookup->handler->cache;
+    store.handler = lookup->handler;
+    if ((fd = tile_dirfd_open(store.tmp_tile_path.base, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0666)) != -1) {
+        ssize_t wlen = write(fd, value.base, value.len);
+        close(fd);
+        if (wlen == (ssize_t)value.len) {
+            commit_tile(&store, req, h2o_iovec_init(NULL, 0));
+        } else {
+            tile_dirfd_unlink(store.tmp_tile_path.base);
+        }
+    }
+
+    if (lookup->suffix == PBF && is_gzipped(value.base, value.len)) {
+        if (!accepts_gzip(req)) {
+            /* passed through from the upstream, as on a hit on the disk */
+            forward_request(lookup->handler, req, select_upstream(lookup->handler, h2o_now(req->conn->ctx->loop)), 0);
+            return;
+        }
+        h2o_set_header_token(&req->pool, &req->res.headers, H2O_TOKEN_VARY, H2O_STRLIT("accept-encoding"));
+        h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_ENCODING, H2O_STRLIT("gzip"));
+    }
+
+    /* sent right from the buffer */
+    req->res.status = 200;
+    req->res.reason = "OK";
+    req->res.content_length = value.len;
+    mime_type = get_tile_mime_type(lookup->suffix);
+    h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_TYPE, mime_type.base, mime_type.len);
+    h2o_start_response(req, &generator);
+    h2o_send(req, &value, 1, 1);
+}
+
 static int on_req_tile(struct st_h2o_handler_t *_self, h2o_req_t *req) {
     h2o_tile_proxy_handler_t *self = (void*)_self;
-    uint32_t x = 0, y = 0, z = 0;
-    char* physical_tile_path = alloca(28);
-    char* tile_path = req->path_normalized.base + req->pathconf->path.len + 1; /* is of the form z/x/y.png */
+    uint32_t x = 0, y = 0, z = 0, scale = 1;
+    enum TILE_SUFFIX suffix = PNG;
+    char* physical_tile_path = alloca(TILE_PHYSPATH_BUFLEN);
+    /* is of the form z/x/y.png; copied, as path_normalized may be followed by the query instead of a NUL */
+    char* tile_path = h2o_strdup(&req->pool, req->path_normalized.base, req->path_normalized.len).base + req->pathconf->path.len + 1;
 
     /* only accept GET */
     if (h2o_memis(req->method.base, req->method.len, H2O_STRLIT("GET"))) {
 //        h2o_req_log_error(req, "lib/handler/tile-proxy.c", "Tile path: %s\n", tile_path);
-        if (likely(tile_rewrite_path(tile_path, "", 0, physical_tile_path, 28, &z, &x, &y))) {
+        if (likely(tile_rewrite_path(tile_path, "", 0, physical_tile_path, TILE_PHYSPATH_BUFLEN, &z, &x, &y, &scale, &suffix))) {
             h2o_iovec_t full_path = h2o_concat(&req->pool, self->local_base_path, h2o_iovec_init(physical_tile_path, strlen(physical_tile_path)));
 //            h2o_req_log_error(req, "lib/handler/tile-proxy.c", "Full path: %s\n", full_path.base);
-            if (likely(access(full_path.base, F_OK) == 0)) {
-                return h2o_file_send(req, 200, "OK", full_path.base, h2o_iovec_init(H2O_STRLIT("image/png")), 0);
+            struct stat st;
+            if (likely(tile_dirfd_stat(full_path.base, &st) == 0)) {
+                uint64_t ttl = self->config.ttl[z <= TILE_MAX_ZOOM ? z : TILE_MAX_ZOOM];
+                if (ttl != 0 && st.st_mtime + (time_t)ttl < time(NULL))
+                    start_revalidation(self, req, z, x, y, scale, suffix, full_path.base, st.st_mtime);
+                if (self->cache != NULL)
+                    tile_disk_cache_touch(self->cache, z, x, y, scale, suffix);
+                if (suffix == PBF && is_gzipped_file(full_path.base)) {
+                    if (!accepts_gzip(req)) {
+                        /* passed through from the upstream, keeping the gzip'ed one on the disk */
+                        forward_request(self, req, select_upstream(self, h2o_now(req->conn->ctx->loop)), 0);
+                        return 0;
+                    }
+                    h2o_set_header_token(&req->pool, &req->res.headers, H2O_TOKEN_VARY, H2O_STRLIT("accept-encoding"));
+                    h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_ENCODING, H2O_STRLIT("gzip"));
+                }
+                return h2o_file_send(req, 200, "OK", full_path.base, get_tile_mime_type(suffix), 0);
+            }
+            if (self->peers.entries != NULL &&
+                h2o_find_header_by_str(&req->headers, H2O_STRLIT(TILE_PROXY_PEER_HEADER), -1) == -1) {
+                struct st_tile_upstream_t *owner = find_owner_peer(self, z, x, y);
+                if (owner != self->peers.entries + self->peers.self &&
+                    owner->ejected_until <= h2o_now(req->conn->ctx->loop)) {
+                    fetch_from_peer(self, req, owner);
+                    return 0;
+                }
+            }
+            if (self->memcached != NULL) {
+                struct st_tile_proxy_context_t *pctx = h2o_context_get_handler_context(req->conn->ctx, &self->super.super);
+                struct st_tile_memcached_lookup_t *lookup =
+                    h2o_mem_alloc_shared(&req->pool, sizeof(*lookup), dispose_memcached_lookup);
+                *lookup = (struct st_tile_memcached_lookup_t){self, req, NULL, z, x, y, scale, suffix, full_path};
+                lookup->get = h2o_memcached_get(self->memcached, &pctx->memcached,
+                                                build_memcached_key(&req->pool, z, x, y, scale, suffix), on_memcached_get, lookup,
+                                                H2O_MEMCACHED_MOVE_VALUE);
+                return 0;
             }
         }
     }
-    return self->on_req_delegate(_self, req);
+
+    forward_to_upstream(self, req);
+    return 0;
 }
 
-h2o_tile_proxy_handler_t *h2o_tile_proxy_register(h2o_pathconf_t *pathconf, const char *local_base_path, const char *proxy) {
+static void on_context_init_tile_proxy(h2o_handler_t *_self, h2o_context_t *ctx)
+{
+    h2o_tile_proxy_handler_t *self = (void *)_self;
+    struct st_tile_proxy_context_t *pctx;
+    size_t i;
+
+    /* use the loop of first context for handling socketpool timeouts */
+    for (i = 0; i != self->num_upstreams + self->peers.size; ++i) {
+        h2o_socketpool_t *sockpool =
+            i < self->num_upstreams ? self->upstreams[i].sockpool : self->peers.entries[i - self->num_upstreams].sockpool;
+        if (sockpool != NULL && sockpool->timeout == UINT64_MAX)
+            h2o_socketpool_set_timeout(sockpool, ctx->loop, self->config.keepalive_timeout);
+    }
+    if (self->cache != NULL)
+        tile_disk_cache_start(self->cache);
+    on_context_init(_self, ctx);
+
+    pctx = h2o_mem_alloc(sizeof(*pctx));
+    pctx->client_ctx = h2o_context_get_handler_context(ctx, _self);
+    if (self->config.memcached.host != NULL) {
+        /* the client threads are started here (i.e. once daemonized) */
+        static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        pthread_mutex_lock(&mutex);
+        if (self->memcached == NULL)
+            self->memcached = h2o_memcached_create_context(self->config.memcached.host, self->config.memcached.port,
+                                                           self->config.memcached.num_threads, self->config.memcached.prefix);
+        pthread_mutex_unlock(&mutex);
+        h2o_multithread_register_receiver(ctx->queue, &pctx->memcached, h2o_memcached_receiver);
+    }
+    h2o_context_set_handler_context(ctx, _self, pctx);
+}
+
+static void on_context_dispose_tile_proxy(h2o_handler_t *_self, h2o_context_t *ctx)
+{
+    h2o_tile_proxy_handler_t *self = (void *)_self;
+    struct st_tile_proxy_context_t *pctx = h2o_context_get_handler_context(ctx, _self);
+
+    if (self->config.memcached.host != NULL)
+        h2o_multithread_unregister_receiver(ctx->queue, &pctx->memcached);
+    h2o_context_set_handler_context(ctx, _self, pctx->client_ctx);
+    free(pctx);
+    on_context_dispose(_self, ctx);
+}
+
+static void init_upstream(struct st_tile_upstream_t *upstream, const char *url, h2o_tile_proxy_config_vars_t *config)
+{
+    h2o_url_t parsed;
+
+    h2o_url_parse(url, SIZE_MAX, &parsed); /* validated by the configurator */
+    *upstream = (struct st_tile_upstream_t){};
+    h2o_url_copy(NULL, &upstream->url, &parsed);
+    h2o_strtolower(upstream->url.host.base, upstream->url.host.len);
+    if (config->keepalive_timeout != 0) {
+        struct sockaddr_un sa;
+        upstream->sockpool = h2o_mem_alloc(sizeof(*upstream->sockpool));
+        if (h2o_url_host_to_sun(upstream->url.host, &sa) == h2o_url_host_to_sun_err_is_not_unix_socket) {
+            h2o_socketpool_init_by_hostport(upstream->sockpool, upstream->url.host, h2o_url_get_port(&upstream->url), SIZE_MAX);
+        } else {
+            h2o_socketpool_init_by_address(upstream->sockpool, (void *)&sa, sizeof(sa), SIZE_MAX);
+        }
+    }
+}
+
+static void dispose_upstream(struct st_tile_upstream_t *upstream)
+{
+    free(upstream->url.host.base);
+    free(upstream->url.path.base);
+    if (upstream->sockpool != NULL) {
+        h2o_socketpool_dispose(upstream->sockpool);
+        free(upstream->sockpool);
+    }
+}
+
+static void on_tile_proxy_dispose(h2o_handler_t *_self)
+{
+    h2o_tile_proxy_handler_t *self = (void *)_self;
+    size_t i;
+
+    for (i = 0; i != self->num_upstreams; ++i)
+        dispose_upstream(self->upstreams + i);
+    free(self->upstreams);
+    for (i = 0; i != self->peers.size; ++i)
+        dispose_upstream(self->peers.entries + i);
+    free(self->peers.entries);
+    free(self->peers.ring);
+}
+
+h2o_tile_proxy_handler_t *h2o_tile_proxy_register(h2o_pathconf_t *pathconf, const char *local_base_path, const char **upstreams,
+                                                  size_t num_upstreams, h2o_tile_proxy_config_vars_t *config) {
     h2o_iovec_t local_base_path_v = h2o_strdup_slashed(NULL, local_base_path, SIZE_MAX);
     h2o_tile_proxy_handler_t *self;
+    size_t i;
 
     do { /* scoping */
         /* Initialize the handler */
-        h2o_proxy_config_vars_t proxy_config = { 10*1000, 0, 2000 };
-
         self = (void*)h2o_create_handler(pathconf, sizeof(*self));
-        h2o_url_parse(proxy, strlen(proxy), &self->super.upstream);
-
-        self->super = *(h2o_proxy_register_reverse_proxy(pathconf, &self->super.upstream, &proxy_config));
-        self->local_base_path = local_base_path_v;
-        self->on_req_delegate = self->super.super.on_req;
+        self->super.super.on_context_init = on_context_init_tile_proxy;
+        self->super.super.on_context_dispose = on_context_dispose_tile_proxy;
+        self->super.super.dispose = on_tile_proxy_dispose;
         self->super.super.on_req = on_req_tile;
+        self->super.config = (h2o_proxy_config_vars_t){config->io_timeout, 0, config->keepalive_timeout};
+        self->local_base_path = local_base_path_v;
+        self->config = *config;
+        self->memcached = NULL;
+        self->cache = config->cache_size != 0 ? tile_disk_cache_create(local_base_path_v.base, config->cache_size) : NULL;
+        pthread_mutex_init(&self->revalidating.mutex, NULL);
+        self->revalidating.keys = kh_init(tile_keys);
+        self->upstreams = h2o_mem_alloc(sizeof(*self->upstreams) * num_upstreams);
+        self->num_upstreams = num_upstreams;
+        for (i = 0; i != num_upstreams; ++i)
+            init_upstream(self->upstreams + i, upstreams[i], config);
+        self->peers.entries = NULL;
+        self->peers.size = 0;
+        self->peers.ring = NULL;
+        self->peers.ring_size = 0;
+        if (config->peers.urls != NULL) {
+            self->peers.entries = h2o_mem_alloc(sizeof(*self->peers.entries) * config->peers.num_urls);
+            self->peers.size = config->peers.num_urls;
+            for (i = 0; i != config->peers.num_urls; ++i) {
+                init_upstream(self->peers.entries + i, config->peers.urls[i], config);
+                if (strcmp(config->peers.urls[i], config->peers.self) == 0)
+                    self->peers.self = i; /* validated by the configurator to be one */
+            }
+            build_peer_ring(self, config->peers.urls);
+        }
     } while (0);
 
     do { /* scoping */
-        struct st_h2o_tile_store_filter_t *self = (void *)h2o_create_filter(pathconf, sizeof(*self));
-        self->local_base_path = local_base_path_v;
-        self->super.on_setup_ostream = on_setup_ostream;
+        struct st_h2o_tile_store_filter_t *filter = (void *)h2o_create_filter(pathconf, sizeof(*filter));
+        filter->handler = self;
+        filter->local_base_path = local_base_path_v;
+        filter->super.on_setup_ostream = on_setup_ostream;
     } while (0);
 
     return self;
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/xattr.h>
+#include "h2o.h"
+#include "tile/mapnik-bridge.h"
+#include "tile/tile-dirfd-cache.h"
+#include "tile/tile-etag.h"
+
+int save_tile(const char *tile_path, const char *data, size_t len, const char *etag)
+{
+    /*
+    As the rendered image is sent back to the client independently,
+    any errors in saving it to a file will be just error-logged:
+    response to the client is NOT affected: no such thing as "500 Internal Server Error."
+    */
+    size_t tmp_path_len = strlen(tile_path) + 18;
+    char *tmp_tile_path = alloca(tmp_path_len);
+    ssize_t v;
+    int fd;
+
+    snprintf(tmp_tile_path, tmp_path_len, "%s.%lx", tile_path, (unsigned long)pthread_self());
+    /* the missing directories are created as well */
+    if ((fd = tile_dirfd_open(tmp_tile_path, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0666)) < 0) {
+        fprintf(stderr, "[lib/handler/tile-save.c] Could not open file %s: %s\n", tmp_tile_path, strerror(errno));
+        return -1;
+    }
+    v = write(fd, data, len);
+    if (v < 0 || (size_t)v != len) {
+        fprintf(stderr, "[lib/handler/tile-save.c] Failed to write to file %s: %s\n", tmp_tile_path, strerror(errno));
+        close(fd);
+        tile_dirfd_unlink(tmp_tile_path);
+        return -1;
+    }
+    if (etag != NULL && fsetxattr(fd, TILE_ETAG_XATTR, etag, strlen(etag), 0) != 0 && errno != ENOTSUP) {
+        /* Not fatal: the tile is just validated by its mtime instead */
+        fprintf(stderr, "[lib/handler/tile-save.c] Failed to set the etag of %s: %s\n", tmp_tile_path, strerror(errno));
+    }
+    close(fd);
+    if (tile_dirfd_rename(tmp_tile_path, tile_path) != 0) {
+        fprintf(stderr, "[lib/handler/tile-save.c] Failed to rename the tmp file %s to %s: %s\n", tmp_tile_path, tile_path,
+                strerror(errno));
+        tile_dirfd_unlink(tmp_tile_path);
+        return -1;
+    }
+    return 0;
+}
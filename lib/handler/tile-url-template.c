@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "h2o/memory.h"
+#include "tile/tile-url-template.h"
+
+enum en_tile_url_op_type_t {
+    TILE_URL_OP_LITERAL,
+    TILE_URL_OP_ZOOM,
+    TILE_URL_OP_X,
+    TILE_URL_OP_Y,
+    TILE_URL_OP_TMS_Y,
+    TILE_URL_OP_QUADKEY,
+    TILE_URL_OP_STYLE,
+    TILE_URL_OP_SCALE,
+    TILE_URL_OP_EXT,
+    TILE_URL_OP_END
+};
+
+struct st_tile_url_op_t {
+    enum en_tile_url_op_type_t type;
+    const char *literal; /* points into st_tile_url_compiled_t::literals */
+    size_t literal_len;
+};
+
+struct st_tile_url_compiled_t {
+    tile_url_template_t super;
+    char *literals;
+    size_t literals_len;
+    struct st_tile_url_op_t ops[1]; /* terminated by TILE_URL_OP_END */
+};
+
+static const struct {
+    const char *name;
+    enum en_tile_url_op_type_t type;
+} placeholders[] = {{"{z}", TILE_URL_OP_ZOOM},       {"{x}", TILE_URL_OP_X},         {"{y}", TILE_URL_OP_Y},
+                    {"{-y}", TILE_URL_OP_TMS_Y},     {"{q}", TILE_URL_OP_QUADKEY},   {"{style}", TILE_URL_OP_STYLE},
+                    {"@{scale}", TILE_URL_OP_SCALE}, {"{ext}", TILE_URL_OP_EXT}};
+
+/* (\d{1,max_digits}), not followed by another digit */
+static inline int lex_uint(const char **hd, int max_digits, uint32_t *v)
+{
+    const char *p = *hd, *end = p + max_digits;
+
+    if (!isdigit(*p))
+        return 0;
+    *v = 0;
+    do {
+        *v = 10 * *v + (*p++ - '0');
+    } while (p != end && isdigit(*p));
+    if (isdigit(*p))
+        return 0;
+    *hd = p;
+    return 1;
+}
+
+static inline int lex_suffix(const char **hd, enum TILE_SUFFIX *suffix)
+{
+    const char *p = *hd;
+
+    if (likely(p[0] == 'p' && p[1] == 'n' && p[2] == 'g')) {
+        *suffix = PNG;
+    } else if (p[0] == 'j' && p[1] == 'p' && p[2] == 'g') {
+        *suffix = JPG;
+    } else if (p[0] == 'p' && p[1] == 'b' && p[2] == 'f') {
+        *suffix = PBF;
+    } else if (p[0] == 'w' && p[1] == 'e' && p[2] == 'b' && p[3] == 'p') {
+        *suffix = WEBP;
+        *hd += 4;
+        return 1;
+    } else {
+        return 0;
+    }
+    *hd += 3;
+    return 1;
+}
+
+static int match_ops(const tile_url_template_t *_t, const char *hd, tile_url_match_t *m)
+{
+    const struct st_tile_url_compiled_t *t = (void *)_t;
+    const struct st_tile_url_op_t *op;
+    size_t i;
+    int is_tms = 0;
+
+    m->zoom = m->x = m->y = 0;
+    m->scale = 1;
+    m->suffix = PNG;
+    m->style = NULL;
+    m->style_len = 0;
+
+    for (op = t->ops;; ++op) {
+        switch (op->type) {
+        case TILE_URL_OP_LITERAL:
+            /* stops at the NUL of hd, as the literal never contains one */
+            for (i = 0; i != op->literal_len; ++i)
+                if (hd[i] != op->literal[i])
+                    return 0;
+            hd += op->literal_len;
+            break;
+        case TILE_URL_OP_ZOOM:
+            if (!lex_uint(&hd, 2, &m->zoom))
+                return 0;
+            break;
+        case TILE_URL_OP_X:
+            if (!lex_uint(&hd, 9, &m->x))
+                return 0;
+            break;
+        case TILE_URL_OP_TMS_Y:
+            is_tms = 1;
+        /* fallthru */
+        case TILE_URL_OP_Y:
+            if (!lex_uint(&hd, 9, &m->y))
+                return 0;
+            break;
+        case TILE_URL_OP_QUADKEY:
+            /* each digit picks a quadrant: bit 0 for x, bit 1 for y */
+            for (; '0' <= *hd && *hd <= '3'; ++hd) {
+                if (++m->zoom > 31)
+                    return 0;
+                m->x = (m->x << 1) | ((*hd - '0') & 1);
+                m->y = (m->y << 1) | ((*hd - '0') >> 1);
+            }
+            if (m->zoom == 0)
+                return 0;
+            break;
+        case TILE_URL_OP_STYLE:
+            m->style = hd;
+            while (*hd != '/' && *hd != '\0')
+                ++hd;
+            if ((m->style_len = hd - m->style) == 0)
+                return 0;
+            break;
+        case TILE_URL_OP_SCALE:
+            if (*hd == '@') {
+                if (!((hd[1] == '1' || hd[1] == '2') && hd[2] == 'x'))
+                    return 0;
+                m->scale = hd[1] - '0';
+                hd += 3;
+            }
+            break;
+        case TILE_URL_OP_EXT:
+            if (!lex_suffix(&hd, &m->suffix))
+                return 0;
+            break;
+        case TILE_URL_OP_END:
+            if (*hd != '\0')
+                return 0;
+            goto Matched;
+        }
+    }
+
+Matched:
+    if (is_tms) {
+        if (m->zoom > 31 || m->y >= (1u << m->zoom))
+            return 0;
+        m->y = (1u << m->zoom) - 1 - m->y;
+    }
+    return 1;
+}
+
+tile_url_template_t *tile_url_template_compile(const char *tmpl, char *errbuf, size_t errbuf_len)
+{
+    size_t tmpl_len = strlen(tmpl), num_ops = 0, i;
+    unsigned seen = 0;
+    struct st_tile_url_compiled_t *t = h2o_mem_alloc(offsetof(struct st_tile_url_compiled_t, ops) + sizeof(t->ops[0]) * (tmpl_len + 1));
+    const char *p = tmpl;
+
+    t->literals = h2o_mem_alloc(tmpl_len + 1);
+    t->literals_len = 0;
+
+    while (*p != '\0') {
+        struct st_tile_url_op_t *op = t->ops + num_ops++;
+        for (i = 0; i != sizeof(placeholders) / sizeof(placeholders[0]); ++i)
+            if (strncmp(p, placeholders[i].name, strlen(placeholders[i].name)) == 0)
+                break;
+        if (i != sizeof(placeholders) / sizeof(placeholders[0])) {
+            op->type = placeholders[i].type;
+            if ((seen & (1u << op->type)) != 0) {
+                snprintf(errbuf, errbuf_len, "%s appears twice", placeholders[i].name);
+                goto Error;
+            }
+            seen |= 1u << op->type;
+            p += strlen(placeholders[i].name);
+            if (op->type == TILE_URL_OP_STYLE && *p != '/') {
+                snprintf(errbuf, errbuf_len, "{style} must be followed by a '/'");
+                goto Error;
+            }
+        } else if (*p == '{') {
+            snprintf(errbuf, errbuf_len, "unknown placeholder at: %s", p);
+            goto Error;
+        } else {
+            /* a literal lasts until the next placeholder */
+            op->type = TILE_URL_OP_LITERAL;
+            op->literal = t->literals + t->literals_len;
+            op->literal_len = 0;
+            do {
+                t->literals[t->literals_len++] = *p++;
+                ++op->literal_len;
+            } while (*p != '\0' && *p != '{' && !(p[0] == '@' && p[1] == '{'));
+        }
+    }
+    t->ops[num_ops].type = TILE_URL_OP_END;
+
+#define SEEN(type) ((seen & (1u << (type))) != 0)
+    if (SEEN(TILE_URL_OP_QUADKEY) ? (SEEN(TILE_URL_OP_ZOOM) || SEEN(TILE_URL_OP_X) || SEEN(TILE_URL_OP_Y) || SEEN(TILE_URL_OP_TMS_Y))
+                                  : !(SEEN(TILE_URL_OP_ZOOM) && SEEN(TILE_URL_OP_X) && (SEEN(TILE_URL_OP_Y) ^ SEEN(TILE_URL_OP_TMS_Y)))) {
+        snprintf(errbuf, errbuf_len, "a template needs either {z}, {x} and {y} (or {-y}), or {q} alone");
+        goto Error;
+    }
+#undef SEEN
+
+    /* the default scheme is matched by the hand-written tile_parse_path(), the fastest */
+    t->super.match = strcmp(tmpl, TILE_URL_TEMPLATE_DEFAULT) == 0 ? NULL : match_ops;
+    return &t->super;
+
+Error:
+    tile_url_template_destroy(&t->super);
+    return NULL;
+}
+
+void tile_url_template_destroy(tile_url_template_t *_t)
+{
+    struct st_tile_url_compiled_t *t = (void *)_t;
+    free(t->literals);
+    free(t);
+}
+
+size_t tile_url_template_max_len(const tile_url_template_t *_t, size_t style_len)
+{
+    const struct st_tile_url_compiled_t *t = (void *)_t;
+
+    /* the longest of each placeholder: 2 digits of zoom, 10 of x & y (the decimal of UINT32_MAX), 31 of quadkey, "@2x", "webp" */
+    return t->literals_len + 2 + 10 + 10 + 31 + style_len + 3 + 4;
+}
+
+size_t tile_url_template_format(const tile_url_template_t *_t, char *buf, const tile_url_match_t *m)
+{
+    const struct st_tile_url_compiled_t *t = (void *)_t;
+    const struct st_tile_url_op_t *op;
+    char *dst = buf;
+    uint32_t i;
+
+    for (op = t->ops; op->type != TILE_URL_OP_END; ++op) {
+        switch (op->type) {
+        case TILE_URL_OP_LITERAL:
+            memcpy(dst, op->literal, op->literal_len);
+            dst += op->literal_len;
+            break;
+        case TILE_URL_OP_ZOOM:
+            dst += sprintf(dst, "%u", m->zoom % 100);
+            break;
+        case TILE_URL_OP_X:
+            dst += sprintf(dst, "%u", m->x);
+            break;
+        case TILE_URL_OP_Y:
+            dst += sprintf(dst, "%u", m->y);
+            break;
+        case TILE_URL_OP_TMS_Y:
+            dst += sprintf(dst, "%u", m->zoom <= 31 ? (1u << m->zoom) - 1 - m->y : m->y);
+            break;
+        case TILE_URL_OP_QUADKEY:
+            for (i = m->zoom < 31 ? m->zoom : 31; i != 0; --i)
+                *dst++ = '0' + (((m->x >> (i - 1)) & 1) | (((m->y >> (i - 1)) & 1) << 1));
+            break;
+        case TILE_URL_OP_STYLE:
+            memcpy(dst, m->style, m->style_len);
+            dst += m->style_len;
+            break;
+        case TILE_URL_OP_SCALE:
+            if (m->scale == 2) {
+                memcpy(dst, "@2x", 3);
+                dst += 3;
+            }
+            break;
+        case TILE_URL_OP_EXT:
+            dst += sprintf(dst, "%s", tile_suffix_str(m->suffix));
+            break;
+        case TILE_URL_OP_END:
+            break;
+        }
+    }
+    *dst = '\0';
+    return dst - buf;
+}
@@ -3,16 +3,92 @@
 #include <stdio.h>
 #include <errno.h>
 #include <ctype.h>
+#include <inttypes.h>
 #include <strings.h>
+#include <sys/xattr.h>
+#include <zlib.h>
 #include "path-mapper.h"
 #include "tile/tile-rewrite-path.h"
 #include "tile/mapnik-bridge.h"
+#include "tile/render-queue.h"
+#include "tile/tile-coverage.h"
+#include "tile/tile-dirfd-cache.h"
+#include "tile/tile-etag.h"
+#include "tile/tile-hot-cache.h"
+#include "tile/tile-url-template.h"
 #include "tile/tile-proxy.h"
 
+/* how many zooms to look up for an ancestor tile to upscale, when a render is late */
+#define TILE_FALLBACK_MAX_LEVELS 4
+/* the largest vector tile to inflate for the clients not accepting gzip (MVT recommends 500KB at most) */
+#define TILE_MAX_INFLATED_LEN (16 * 1024 * 1024)
+/* the type of the vector tiles, set here rather than in the default mimemap, where .pbf would apply to any file served */
+#define TILE_VECTOR_MIME_TYPE "application/x-protobuf"
+
+/*
+A style served by a handler. The Mapnik's resources (the map, fonts, datasources and their connection pools), as well as
+the render threads are shared with the other styles, i.e. a style costs little more than its map.
+*/
+typedef struct st_h2o_tile_style_t {
+    h2o_tile_handler_t *handler;
+    h2o_iovec_t name;      /* what {style} matches */
+    h2o_iovec_t file_path; /* path to a Mapnik's style file */
+    h2o_iovec_t base_path; /* where the tiles are stored; slashed */
+    MAPNIK_MAP_PTR map;    /* mapnik::Map* related to file_path, shared by the handlers of the same file */
+    tile_render_quota_t quota;
+    tile_coverage_t *coverage; /* NULL if every tile may have data (or, until the map is loaded); set once by the loader */
+    h2o_iovec_t blank_tile[2]; /* pre-encoded pngs (1x, @2x) sent for the tiles out of the coverage */
+    h2o_iovec_t blank_etag[2];
+    uint64_t hot_cache_ns; /* the namespace of the tiles in the hot cache, i.e. the hash of base_path */
+} h2o_tile_style_t;
+
+/* the number of the tiles hit once on the disk, remembered to promote them to the hot cache on the next hit */
+#define TILE_HOT_CANDIDATES 4096
+
 struct st_h2o_tile_handler_t {
     h2o_file_handler_t super;
-    h2o_iovec_t style_file_path;    /* path to a Mapnik's style file */
-    MAPNIK_MAP_PTR map; /* mapnik::Map* related to style_file_path */
+    h2o_tile_style_t *styles;
+    size_t num_styles;
+    tile_url_template_t *url_template;
+    h2o_tile_config_vars_t config;
+    tile_hot_cache_t *hot_cache; /* NULL if disabled */
+    uint64_t hot_candidates[TILE_HOT_CANDIDATES]; /* the hashes of the tiles hit once, by their low bits (0 if none) */
+    int loading; /* whether the maps have started loading */
+};
+
+struct st_h2o_tile_context_t {
+    h2o_multithread_receiver_t render_receiver;
+    h2o_timeout_t render_timeout;
+};
+
+/*
+A filter to overwrite cache-control of fallback responses, AFTER the others (e.g. "expires") have set theirs.
+Fallback responses are marked by the internal header below (just like x-reproxy-url), which is removed here.
+*/
+#define TILE_FALLBACK_HEADER "x-h2o-tile-fallback"
+struct st_h2o_tile_fallback_filter_t {
+    h2o_filter_t super;
+    h2o_iovec_t cache_control; /* max-age=N */
+};
+
+/*
+A request waiting for its tile to be rendered, allocated in req->pool.
+*/
+struct st_tile_render_waiter_t {
+    h2o_req_t *req;
+    h2o_tile_handler_t *handler;
+    h2o_tile_style_t *style;
+    tile_render_job_t *job;      /* NULL once detached */
+    tile_render_job_t *fallback; /* the substitute being built after the deadline, if any */
+    h2o_timeout_entry_t deadline;
+    const char *tile_path;
+    size_t tile_path_len;
+    uint32_t zoom, x, y;
+    uint32_t scale;
+    enum TILE_SUFFIX suffix;
+    h2o_iovec_t mime_type;
+    int is_stale;
+    int is_get;
 };
 
 #if __GNUC__ >= 3
@@ -24,12 +100,10 @@ struct st_h2o_tile_handler_t {
 #endif
 
 
-static void on_tile_rendered(h2o_req_t *req, const char* content, size_t content_length, const char* physical_tile_path, const char* mime_type, size_t mime_type_len, int flags) {
+static void on_tile_rendered(h2o_req_t *req, const char* content, size_t content_length, const char* etag, const char* mime_type, size_t mime_type_len, int flags) {
 
     struct tm last_modified_gmt;
     char last_modified[H2O_TIMESTR_RFC1123_LEN + 1];
-    char etag_buf[sizeof("\"deadbeef-deadbeefdeadbeef\"")];
-    size_t etag_len;
     /* send response */
     req->res.status = 200;
     req->res.reason = "OK";
@@ -40,20 +114,501 @@ static void on_tile_rendered(h2o_req_t *req, const char* content, size_t content
     time(&now);
     gmtime_r(&now, &last_modified_gmt);
     h2o_time2str_rfc1123(last_modified, &last_modified_gmt);
-    if ((flags & H2O_FILE_FLAG_NO_ETAG) != 0) {
-        etag_len = 0;
-    } else {
-        etag_len = sprintf(etag_buf, "\"%08x-%zx\"", (unsigned)now, (size_t)content_length);
-    }
     h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_LAST_MODIFIED, last_modified, H2O_TIMESTR_RFC1123_LEN);
-    if (etag_len != 0) {
-        h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_ETAG, etag_buf, etag_len);
+    if ((flags & H2O_FILE_FLAG_NO_ETAG) == 0) {
+        /* the content hash, i.e. the same as the one to be sent on the later disk hits */
+        h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_ETAG, etag, strlen(etag));
     }
     req->res.content_length = content_length;
     h2o_send_inline(req, content, content_length);
 
 }
 
+/*
+Replaces the mtime-based ETag of a tile on disk (memoized in the filecache) by its content hash persisted by save_tile(),
+if any; tiles saved by older versions or on filesystems without xattrs keep the former.
+*/
+static void load_tile_etag(h2o_filecache_ref_t *ref)
+{
+    ssize_t len;
+
+    if (ref->_etag.len != 0)
+        return;
+    if ((len = fgetxattr(ref->fd, TILE_ETAG_XATTR, ref->_etag.buf, H2O_FILECACHE_ETAG_MAXLEN)) > 0) {
+        ref->_etag.buf[len] = '\0';
+        ref->_etag.len = len;
+    }
+}
+
+/* opens a tile relative to the cached fd of its directory (cf. tile-dirfd-cache.h) */
+static int open_tile(const char *path, int oflag)
+{
+    return tile_dirfd_open(path, oflag, 0);
+}
+
+/* tests if the client takes image/webp, i.e. lists it w/o q=0 */
+static int accepts_webp(h2o_req_t *req)
+{
+    ssize_t header_index = -1;
+
+    while ((header_index = h2o_find_header(&req->headers, H2O_TOKEN_ACCEPT, header_index)) != -1) {
+        h2o_iovec_t iter = req->headers.entries[header_index].value;
+        const char *element;
+        size_t element_len;
+        while ((element = h2o_next_token(&iter, ',', &element_len, NULL)) != NULL) {
+            h2o_iovec_t params = h2o_iovec_init(element, element_len), value;
+            const char *token;
+            size_t token_len, i;
+            if ((token = h2o_next_token(&params, ';', &token_len, NULL)) == NULL ||
+                !h2o_lcstris(token, token_len, H2O_STRLIT("image/webp")))
+                continue;
+            while ((token = h2o_next_token(&params, ';', &token_len, &value)) != NULL) {
+                if (!h2o_lcstris(token, token_len, H2O_STRLIT("q")))
+                    continue;
+                for (i = 0; i != value.len; ++i)
+                    if (value.base[i] != '0' && value.base[i] != '.')
+                        break;
+                if (i == value.len)
+                    return 0;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void send_blank_tile(h2o_tile_handler_t *self, h2o_tile_style_t *style, h2o_req_t *req, uint32_t scale)
+{
+    h2o_iovec_t *blank_tile = &style->blank_tile[scale - 1], *blank_etag = &style->blank_etag[scale - 1];
+    ssize_t if_none_match_header_index;
+
+    if ((if_none_match_header_index = h2o_find_header(&req->headers, H2O_TOKEN_IF_NONE_MATCH, -1)) != -1) {
+        h2o_iovec_t *if_none_match = &req->headers.entries[if_none_match_header_index].value;
+        if (h2o_memis(if_none_match->base, if_none_match->len, blank_etag->base, blank_etag->len)) {
+            req->res.status = 304;
+            req->res.reason = "Not Modified";
+            h2o_send_inline(req, NULL, 0);
+            return;
+        }
+    }
+    req->res.status = 200;
+    req->res.reason = "OK";
+    req->res.content_length = blank_tile->len;
+    h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_TYPE, H2O_STRLIT("image/png"));
+    if ((self->super.flags & H2O_FILE_FLAG_NO_ETAG) == 0)
+        h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_ETAG, blank_etag->base, blank_etag->len);
+    h2o_send_inline(req, blank_tile->base, blank_tile->len);
+}
+
+/*
+Vector tiles are stored either as they are, or gzip'ed as tippecanoe & the like write them; told apart by the magic (a
+tile of MVT never starts with 0x1f, the tag of a layer being 0x1a). The gzip'ed ones are sent as they are with
+Content-Encoding: gzip (which the compress filter leaves alone), or inflated for the clients not accepting gzip, with the
+ETag weakened, as the representations differ (cf. nginx's gunzip).
+*/
+static int is_gzipped(const char *head, size_t len)
+{
+    return len >= 2 && (unsigned char)head[0] == 0x1f && (unsigned char)head[1] == 0x8b;
+}
+
+static int is_gzipped_file(h2o_filecache_ref_t *ref)
+{
+    char head[2];
+    return pread(ref->fd, head, sizeof(head), 0) == sizeof(head) && is_gzipped(head, sizeof(head));
+}
+
+static int accepts_gzip(h2o_req_t *req)
+{
+    return (h2o_get_compressible_types(&req->headers) & H2O_COMPRESSIBLE_GZIP) != 0;
+}
+
+static h2o_iovec_t weaken_etag(h2o_mem_pool_t *pool, const char *etag, size_t etag_len)
+{
+    h2o_iovec_t weak;
+
+    if (etag_len == 0 || (etag_len >= 2 && memcmp(etag, "W/", 2) == 0))
+        return h2o_strdup(pool, etag, etag_len);
+    weak.base = h2o_mem_alloc_pool(pool, etag_len + 3);
+    weak.len = sprintf(weak.base, "W/%.*s", (int)etag_len, etag);
+    return weak;
+}
+
+/* inflates the gzip'ed tile into the pool, sized by its trailer (ISIZE) */
+static int gunzip_tile(h2o_mem_pool_t *pool, h2o_iovec_t src, h2o_iovec_t *dst)
+{
+    const unsigned char *trailer;
+    z_stream z = {};
+    size_t isize;
+    int ret;
+
+    if (src.len < 18)
+        return -1;
+    trailer = (const unsigned char *)src.base + src.len - 4;
+    isize = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((size_t)trailer[3] << 24);
+    if (isize > TILE_MAX_INFLATED_LEN)
+        return -1;
+    if (inflateInit2(&z, 15 + 16) != Z_OK)
+        return -1;
+    dst->base = h2o_mem_alloc_pool(pool, isize + 1);
+    z.next_in = (Bytef *)src.base;
+    z.avail_in = (uInt)src.len;
+    z.next_out = (Bytef *)dst->base;
+    z.avail_out = (uInt)isize + 1;
+    ret = inflate(&z, Z_FINISH);
+    dst->len = z.total_out;
+    inflateEnd(&z);
+    return ret == Z_STREAM_END && dst->len == isize ? 0 : -1;
+}
+
+/* the whole of the tile on the disk, into the pool */
+static int read_tile(h2o_mem_pool_t *pool, h2o_filecache_ref_t *ref, h2o_iovec_t *dst)
+{
+    size_t off = 0;
+    ssize_t r;
+
+    if (ref->st.st_size > TILE_MAX_INFLATED_LEN)
+        return -1;
+    dst->base = h2o_mem_alloc_pool(pool, ref->st.st_size + 1);
+    dst->len = ref->st.st_size;
+    while (off != dst->len) {
+        while ((r = pread(ref->fd, dst->base + off, dst->len - off, off)) == -1 && errno == EINTR)
+            ;
+        if (r <= 0)
+            return -1;
+        off += r;
+    }
+    return 0;
+}
+
+/* sends the tile in memory (allocated from the pool) */
+static void send_tile_content(h2o_tile_handler_t *self, h2o_req_t *req, h2o_iovec_t mime_type, struct tm *last_modified_gmt,
+                              h2o_iovec_t etag, h2o_iovec_t content_encoding, h2o_iovec_t content, int is_get)
+{
+    static h2o_generator_t generator = {NULL, NULL};
+    char *last_modified;
+
+    req->res.status = 200;
+    req->res.reason = "OK";
+    req->res.content_length = content.len;
+    h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_TYPE, mime_type.base, mime_type.len);
+    last_modified = h2o_mem_alloc_pool(&req->pool, H2O_TIMESTR_RFC1123_LEN + 1);
+    h2o_time2str_rfc1123(last_modified, last_modified_gmt);
+    h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_LAST_MODIFIED, last_modified, H2O_TIMESTR_RFC1123_LEN);
+    if ((self->super.flags & H2O_FILE_FLAG_NO_ETAG) == 0 && etag.len != 0)
+        h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_ETAG, etag.base, etag.len);
+    if (content_encoding.base != NULL)
+        h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_ENCODING, content_encoding.base, content_encoding.len);
+    /* sent right from the copy in the pool */
+    h2o_start_response(req, &generator);
+    h2o_send(req, &content, is_get, 1);
+}
+
+/* sends the gzip'ed tile on the disk inflated */
+static void send_gunzipped_tile(h2o_tile_handler_t *self, h2o_req_t *req, h2o_filecache_ref_t *ref, h2o_iovec_t mime_type,
+                                int is_get)
+{
+    h2o_iovec_t gzipped, content, etag;
+    char etag_buf[H2O_FILECACHE_ETAG_MAXLEN + 1];
+
+    if (read_tile(&req->pool, ref, &gzipped) != 0 || gunzip_tile(&req->pool, gzipped, &content) != 0) {
+        fprintf(stderr, "[lib/handler/tile.c] failed to inflate %.*s\n", (int)req->path_normalized.len, req->path_normalized.base);
+        h2o_send_error(req, 500, "Internal Server Error", "failed to inflate the tile", 0);
+        return;
+    }
+    etag = weaken_etag(&req->pool, etag_buf, h2o_filecache_get_etag(ref, etag_buf));
+    send_tile_content(self, req, mime_type, h2o_filecache_get_last_modified(ref, NULL), etag, (h2o_iovec_t){}, content, is_get);
+}
+
+/* the tiles of the style modified at or before this are stale */
+static time_t get_stale_before(h2o_tile_handler_t *self, h2o_tile_style_t *style)
+{
+    time_t style_mtime;
+
+    /* with tile.expire-on-style-change, so are the ones rendered before the style (as loaded) was modified */
+    if (self->config.expire_on_style_change && (style_mtime = get_map_mtime(style->map)) > TILE_STALE_MTIME)
+        return style_mtime;
+    return TILE_STALE_MTIME;
+}
+
+/*
+Sends the tile from the hot cache, unless missing or stale there.
+As the hot cache outlives the processes, a tile re-rendered (or expired) by another one since is served until max-age.
+*/
+static int send_hot_tile(h2o_tile_handler_t *self, h2o_tile_style_t *style, h2o_req_t *req, uint64_t key, enum TILE_SUFFIX suffix,
+                         const char *rpath, size_t rpath_len, int is_get)
+{
+    tile_hot_cache_hit_t hit;
+    struct tm last_modified_gmt;
+    h2o_iovec_t content_type, etag, content_encoding = {};
+    ssize_t header_index;
+    int gunzip = 0;
+
+    if (tile_hot_cache_get(self->hot_cache, style->hot_cache_ns, key, &req->pool, &hit) != 0)
+        return -1;
+    if (!(hit.mtime > get_stale_before(self, style) || suffix == PBF))
+        return -1;
+    if (self->config.hot_cache.max_age != 0 && hit.stored_at + (time_t)self->config.hot_cache.max_age <= time(NULL))
+        return -1;
+    if (suffix == PBF) {
+        content_type = h2o_iovec_init(H2O_STRLIT(TILE_VECTOR_MIME_TYPE));
+    } else {
+        h2o_mimemap_type_t *mime_type = h2o_mimemap_get_type_by_extension(self->super.mimemap, h2o_get_filext(rpath, rpath_len));
+        if (mime_type->type != H2O_MIMEMAP_TYPE_MIMETYPE)
+            return -1;
+        content_type = mime_type->data.mimetype;
+    }
+
+    etag = h2o_strdup(&req->pool, hit.etag, hit.etag_len);
+    if (suffix == PBF && is_gzipped(hit.content.base, hit.content.len)) {
+        h2o_set_header_token(&req->pool, &req->res.headers, H2O_TOKEN_VARY, H2O_STRLIT("accept-encoding"));
+        if (accepts_gzip(req)) {
+            content_encoding = h2o_iovec_init(H2O_STRLIT("gzip"));
+        } else {
+            gunzip = 1;
+            etag = weaken_etag(&req->pool, etag.base, etag.len);
+        }
+    }
+
+    gmtime_r(&hit.mtime, &last_modified_gmt);
+    if ((header_index = h2o_find_header(&req->headers, H2O_TOKEN_IF_NONE_MATCH, -1)) != -1) {
+        h2o_iovec_t *if_none_match = &req->headers.entries[header_index].value;
+        if (h2o_memis(if_none_match->base, if_none_match->len, etag.base, etag.len))
+            goto NotModified;
+    } else if ((header_index = h2o_find_header(&req->headers, H2O_TOKEN_IF_MODIFIED_SINCE, -1)) != -1) {
+        h2o_iovec_t *ims_vec = &req->headers.entries[header_index].value;
+        struct tm ims_tm;
+        if (h2o_time_parse_rfc1123(ims_vec->base, ims_vec->len, &ims_tm) && !tm_is_lessthan(&ims_tm, &last_modified_gmt))
+            goto NotModified;
+    }
+
+    if (gunzip && gunzip_tile(&req->pool, hit.content, &hit.content) != 0)
+        return -1;
+    send_tile_content(self, req, content_type, &last_modified_gmt, etag, content_encoding, hit.content, is_get);
+    return 0;
+
+NotModified:
+    req->res.status = 304;
+    req->res.reason = "Not Modified";
+    h2o_send_inline(req, NULL, 0);
+    return 0;
+}
+
+/*
+keeps the tile opened on the disk in the hot cache, for the next hits by any process; only on its 2nd hit, as copying
+it in on the loop costs a read of the file, which the tiles hit just once (e.g. by a crawler) would pay for nothing.
+The hits are told by a table of the hashes of the tiles, a slot each, where a collision just delays a promotion.
+*/
+static void promote_hot_tile(h2o_tile_handler_t *self, h2o_tile_style_t *style, uint64_t key, h2o_filecache_ref_t *ref)
+{
+    uint64_t hash = tile_xxh64(&key, sizeof(key), style->hot_cache_ns) | 1;
+    uint64_t *slot = self->hot_candidates + (hash >> 1) % TILE_HOT_CANDIDATES;
+    char etag[H2O_FILECACHE_ETAG_MAXLEN + 1];
+    size_t etag_len;
+
+    if (!__sync_bool_compare_and_swap(slot, hash, 0)) {
+        *slot = hash;
+        return;
+    }
+    etag_len = h2o_filecache_get_etag(ref, etag);
+    tile_hot_cache_set_fd(self->hot_cache, style->hot_cache_ns, key, ref->fd, ref->st.st_size, ref->st.st_mtime, etag,
+                          etag_len);
+}
+
+/*
+The neighbors of a tile, in the order of likeliness to be requested next by a panning (or zooming-out) viewport:
+the edges of the ring, the parent, then the corners.
+*/
+static const struct {
+    int dz, dx, dy;
+} tile_neighbors[] = {{0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}, {-1, 0, 0}, {0, 1, 1}, {0, -1, 1}, {0, 1, -1}, {0, -1, -1}};
+
+/*
+Pushes (over HTTP/2) the neighbors of the tile (as requested by tile) that are at hand, i.e. blank or fresh on disk, up
+to config.push_neighbors; never triggers renders. They are listed as Link: rel=preload as well, which is a preload hint
+to the other clients. suffix is the one negotiated, i.e. to be found on disk.
+The casper (http2-casper with track-all-types) keeps the tiles the client already has from being pushed again.
+*/
+static void push_neighbor_tiles(h2o_tile_handler_t *self, h2o_tile_style_t *style, h2o_req_t *req, const tile_url_match_t *tile,
+                                enum TILE_SUFFIX suffix)
+{
+    size_t prefix_len = req->pathconf->path.len, num_pushed = 0, i;
+    char *tile_path = alloca(style->base_path.len + TILE_PHYSPATH_BUFLEN);
+    uint32_t zoom = tile->zoom, x = tile->x, y = tile->y, n;
+
+    if (zoom > TILE_MAX_ZOOM || x >= (n = 1u << zoom) || y >= n)
+        return;
+    memcpy(tile_path, style->base_path.base, style->base_path.len);
+    for (i = 0; i != sizeof(tile_neighbors) / sizeof(tile_neighbors[0]) && num_pushed < self->config.push_neighbors; ++i) {
+        uint32_t nz = zoom, nx, ny;
+        struct stat st;
+        if (tile_neighbors[i].dz < 0) {
+            if (zoom == 0)
+                continue;
+            --nz;
+            nx = x >> 1;
+            ny = y >> 1;
+        } else {
+            /* wraps around the antimeridian, but not the poles */
+            nx = (x + n + tile_neighbors[i].dx) % n;
+            ny = y + tile_neighbors[i].dy;
+            if (ny >= n || (nx == x && tile_neighbors[i].dx != 0))
+                continue;
+        }
+        if (!(tile->suffix == PNG && style->coverage != NULL && !tile_coverage_contains(style->coverage, nz, nx, ny))) {
+            to_physical_path_scaled(tile_path + style->base_path.len, nz, nx, ny, tile->scale, suffix);
+            if (tile_dirfd_stat(tile_path, &st) != 0 || st.st_mtime <= get_stale_before(self, style))
+                continue;
+        }
+        /* <prefix + the URL of the neighbor>; rel=preload */
+        tile_url_match_t neighbor = *tile;
+        neighbor.zoom = nz;
+        neighbor.x = nx;
+        neighbor.y = ny;
+        char *link = h2o_mem_alloc_pool(&req->pool, prefix_len + tile_url_template_max_len(self->url_template, tile->style_len) +
+                                                        sizeof("<>; rel=preload"));
+        size_t link_len = 0;
+        link[link_len++] = '<';
+        memcpy(link + link_len, req->path_normalized.base, prefix_len);
+        link_len += prefix_len;
+        link_len += tile_url_template_format(self->url_template, link + link_len, &neighbor);
+        memcpy(link + link_len, ">; rel=preload", sizeof(">; rel=preload"));
+        link_len += sizeof(">; rel=preload") - 1;
+        h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_LINK, link, link_len);
+        h2o_puth_path_in_link_header(req, link, link_len);
+        ++num_pushed;
+    }
+}
+
+static void detach_render_waiter(struct st_tile_render_waiter_t *waiter, int persist)
+{
+    if (h2o_timeout_is_linked(&waiter->deadline))
+        h2o_timeout_unlink(&waiter->deadline);
+    if (waiter->job != NULL) {
+        tile_render_detach(waiter->job, persist);
+        waiter->job = NULL;
+    }
+    if (waiter->fallback != NULL) {
+        tile_render_detach(waiter->fallback, 0);
+        waiter->fallback = NULL;
+    }
+}
+
+static void on_render_waiter_dispose(void *_waiter)
+{
+    struct st_tile_render_waiter_t *waiter = _waiter;
+    /* the client has gone away before the tile is ready; don't waste the renderer on it unless already running */
+    detach_render_waiter(waiter, 0);
+}
+
+static void on_render_complete(tile_render_job_t *job)
+{
+    struct st_tile_render_waiter_t *waiter = job->data;
+    h2o_req_t *req = waiter->req;
+
+    waiter->job = NULL;
+    detach_render_waiter(waiter, 0);
+
+    if (job->content.base == NULL) {
+        h2o_req_log_error(req, "lib/handler/tile.c", "failed to render %s: %s", waiter->tile_path, job->errstr);
+        h2o_send_error(req, 500, "Internal Server Error", "internal server error", 0);
+        return;
+    }
+    if (waiter->handler->hot_cache != NULL)
+        tile_hot_cache_set(waiter->handler->hot_cache, waiter->style->hot_cache_ns,
+                           tile_hot_cache_key(waiter->zoom, waiter->x, waiter->y, waiter->scale, waiter->suffix), job->content.base,
+                           job->content.len, time(NULL), job->etag, strlen(job->etag));
+    on_tile_rendered(req, job->content.base, job->content.len, job->etag, waiter->mime_type.base, waiter->mime_type.len,
+                     waiter->handler->super.flags);
+}
+
+static void on_fallback_complete(tile_render_job_t *job)
+{
+    struct st_tile_render_waiter_t *waiter = job->data;
+    h2o_req_t *req = waiter->req;
+
+    waiter->fallback = NULL;
+    /* no substitutes; nothing to do but keep waiting for the render */
+    if (job->content.base == NULL)
+        return;
+    detach_render_waiter(waiter, 1);
+    h2o_add_header_by_str(&req->pool, &req->res.headers, H2O_STRLIT(TILE_FALLBACK_HEADER), 0, H2O_STRLIT("upscaled"));
+    req->res.status = 200;
+    req->res.reason = "OK";
+    req->res.content_length = job->content.len;
+    h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CONTENT_TYPE, waiter->mime_type.base, waiter->mime_type.len);
+    h2o_send_inline(req, job->content.base, job->content.len);
+}
+
+static void on_render_deadline(h2o_timeout_entry_t *entry)
+{
+    struct st_tile_render_waiter_t *waiter = H2O_STRUCT_FROM_MEMBER(struct st_tile_render_waiter_t, deadline, entry);
+    h2o_tile_handler_t *self = waiter->handler;
+    h2o_req_t *req = waiter->req;
+    struct st_h2o_tile_context_t *tctx = h2o_context_get_handler_context(req->conn->ctx, &self->super.super);
+
+    /* 1st choice: the stale copy, if any */
+    if (waiter->is_stale) {
+        struct st_h2o_sendfile_generator_t *generator;
+        int is_dir;
+        if ((generator = create_generator_by(req, waiter->tile_path, waiter->tile_path_len, &is_dir, self->super.flags, open_tile)) != NULL) {
+            detach_render_waiter(waiter, 1);
+            load_tile_etag(generator->file.ref);
+            h2o_add_header_by_str(&req->pool, &req->res.headers, H2O_STRLIT(TILE_FALLBACK_HEADER), 0, H2O_STRLIT("stale"));
+            do_send_file(generator, req, 200, "OK", waiter->mime_type, NULL, waiter->is_get);
+            return;
+        }
+    }
+    /* 2nd choice: an upscaled ancestor, built by the render queue (decoding & encoding don't belong to the loop) */
+    waiter->fallback = tile_render_job_create(&tctx->render_receiver, waiter->style->map, waiter->zoom, waiter->x, waiter->y,
+                                              waiter->scale, waiter->suffix, waiter->tile_path, on_fallback_complete, waiter);
+    tile_render_dispatch_fallback(waiter->fallback, waiter->style->base_path.len, TILE_FALLBACK_MAX_LEVELS);
+}
+
+static void start_render(h2o_tile_handler_t *self, h2o_tile_style_t *style, h2o_req_t *req, const char *tile_path,
+                         size_t tile_path_len, uint32_t zoom, uint32_t x, uint32_t y, uint32_t scale, enum TILE_SUFFIX suffix,
+                         h2o_iovec_t mime_type, int is_stale, int is_get)
+{
+    struct st_h2o_tile_context_t *tctx = h2o_context_get_handler_context(req->conn->ctx, &self->super.super);
+    struct st_tile_render_waiter_t *waiter = h2o_mem_alloc_shared(&req->pool, sizeof(*waiter), on_render_waiter_dispose);
+
+    waiter->req = req;
+    waiter->handler = self;
+    waiter->style = style;
+    waiter->fallback = NULL;
+    waiter->deadline = (h2o_timeout_entry_t){0, on_render_deadline};
+    waiter->tile_path = h2o_strdup(&req->pool, tile_path, tile_path_len).base;
+    waiter->tile_path_len = tile_path_len;
+    waiter->zoom = zoom;
+    waiter->x = x;
+    waiter->y = y;
+    waiter->scale = scale;
+    waiter->suffix = suffix;
+    waiter->mime_type = mime_type;
+    waiter->is_stale = is_stale;
+    waiter->is_get = is_get;
+    waiter->job = tile_render_job_create(&tctx->render_receiver, style->map, zoom, x, y, scale, suffix,
+                                         waiter->tile_path, on_render_complete, waiter);
+    waiter->job->quota = &style->quota;
+    waiter->job->stale_before = get_stale_before(self, style);
+
+    tile_render_dispatch(waiter->job, TILE_RENDER_CLASS_INTERACTIVE);
+    if (self->config.render_timeout != 0)
+        h2o_timeout_link(req->conn->ctx->loop, &tctx->render_timeout, &waiter->deadline);
+}
+
+/* the style named by {style}, or the first one if the URL has none; NULL if unknown */
+static h2o_tile_style_t *find_style(h2o_tile_handler_t *self, const tile_url_match_t *tile)
+{
+    size_t i;
+
+    if (tile->style == NULL)
+        return self->styles;
+    for (i = 0; i != self->num_styles; ++i)
+        if (h2o_memis(tile->style, tile->style_len, self->styles[i].name.base, self->styles[i].name.len))
+            return self->styles + i;
+    return NULL;
+}
+
 /*
 FIXME:
 This is nearly identical to do_req(); not DRY, workarounds are expected.
@@ -61,7 +616,7 @@ What we need is:
   + a mechanism to delegate requests to on_req(), with
     - req->path_normalized.base is rewritten to the physical tile path: /base/z/x/y.png => /base/z/nnn/nnn/nnn/nnn/nnn.png, and
     - a custom 404 handler s.t. a non-existent tile is rendered & sent-back with 200, where
-      * rendering respects the style given by h2o_tile_handler_t.style_file_path
+      * rendering respects the style chosen by {style} (or the first one if the URL has none)
 */
 static int on_req_tile(h2o_handler_t *_self, h2o_req_t *req)
 {
@@ -72,7 +627,7 @@ static int on_req_tile(h2o_handler_t *_self, h2o_req_t *req)
     size_t rpath_len, req_path_prefix;
     struct st_h2o_sendfile_generator_t *generator = NULL;
     size_t if_modified_since_header_index, if_none_match_header_index;
-    int is_dir, is_get;
+    int is_dir, is_get, is_stale = 0, is_vector = 0, gunzip = 0;
 
      /* only accept GET and HEAD */
     if (h2o_memis(req->method.base, req->method.len, H2O_STRLIT("GET"))) {
@@ -96,43 +651,79 @@ static int on_req_tile(h2o_handler_t *_self, h2o_req_t *req)
 
     rpath[rpath_len] = '\0';
     do { /* scoping */
-        uint32_t x, y, z;
-        size_t tile_path_buf_len = super->real_path.len + (req->path_normalized.len - req_path_prefix) + 28;
-        char* tile_path = alloca(tile_path_buf_len);
-        /* Try to convert rpath (base/z/x/y.png) to the tiles' scheme: base/z/nnn/nnn/nnn/nnn/nnn.png */
-        if (likely(tile_rewrite_path(rpath, super->real_path.base, super->real_path.len, tile_path, tile_path_buf_len, &z, &x, &y))) {
+        tile_url_match_t tile;
+        uint32_t x, y, z, scale;
+        enum TILE_SUFFIX suffix;
+        h2o_tile_style_t *style;
+        char* tile_path;
+        /* Try to convert rpath (base/z/x/y(@2x)?.png, by default) to the tiles' scheme: base/z/nnn/nnn/nnn/nnn/nnn(@2x)?.png */
+        if (likely(tile_url_template_match(self->url_template, rpath + super->real_path.len, &tile) &&
+                   (style = find_style(self, &tile)) != NULL)) {
+            z = tile.zoom;
+            x = tile.x;
+            y = tile.y;
+            scale = tile.scale;
+            suffix = tile.suffix;
+            is_vector = suffix == PBF;
+            if (suffix == PNG && self->config.negotiate_webp) {
+                /* .png is the canonical URL, whose response varies by Accept */
+                h2o_set_header_token(&req->pool, &req->res.headers, H2O_TOKEN_VARY, H2O_STRLIT("accept"));
+                if (accepts_webp(req))
+                    suffix = WEBP;
+            }
+            if (self->config.push_neighbors != 0)
+                push_neighbor_tiles(self, style, req, &tile, suffix);
+            /* Out of the data, it's blank for sure: no need to look into the disk, nor to render */
+            if (style->coverage != NULL && tile.suffix == PNG && !tile_coverage_contains(style->coverage, z, x, y)) {
+                send_blank_tile(self, style, req, scale);
+                return 0;
+            }
+            tile_path = alloca(style->base_path.len + TILE_PHYSPATH_BUFLEN);
+            memcpy(tile_path, style->base_path.base, style->base_path.len);
+            to_physical_path_scaled(tile_path + style->base_path.len, z, x, y, scale, suffix);
             rpath = tile_path;
             rpath_len = strlen(rpath) + 1;  /* The actual length of rpath */
+            /* The hot ones are in memory shared among the processes */
+            if (self->hot_cache != NULL &&
+                send_hot_tile(self, style, req, tile_hot_cache_key(z, x, y, scale, suffix), suffix, rpath, rpath_len, is_get) == 0)
+                return 0;
             /* If successful, try to send it back as-is */
-            if ((generator = create_generator(req, tile_path, rpath_len, &is_dir, super->flags)) != NULL) {
-                goto Opened;
-            }
-            if (is_dir) {
+            if ((generator = create_generator_by(req, tile_path, rpath_len, &is_dir, super->flags, open_tile)) != NULL) {
+                /* vector tiles can't be re-rendered here; stale or not, the copy at hand is all we have */
+                if (likely(generator->file.ref->st.st_mtime > get_stale_before(self, style) || suffix == PBF)) {
+                    if (self->hot_cache != NULL) {
+                        load_tile_etag(generator->file.ref);
+                        promote_hot_tile(self, style, tile_hot_cache_key(z, x, y, scale, suffix), generator->file.ref);
+                    }
+                    goto Opened;
+                }
+                /* The tile is soft-expired: re-render it, keeping the stale copy as a fallback */
+                do_close(&generator->super, req);
+                is_stale = 1;
+            } else if (is_dir) {
                 /* Tile directories shouldn't have index files. */
                 h2o_send_error(req, 404, "File Not Found", "file not found", 0);
                 return 0;
-            }
-            /* failed to open */
-            if (errno == ENOENT) {
-                 /* If create_generator() failed (i.e. tile_path is non-existent), invoke renderer */
-#ifdef H2O_TILE_PROXY
-                assert(!"unreachable");
-#else
-                /* 
-                This function is already a "custom handler", associating yet another to ".png" files
-                would be highly probably a misconfiguration.
-                */
-                mime_type = h2o_mimemap_get_type_by_extension(self->super.mimemap, h2o_get_filext(rpath, rpath_len));
-                switch (mime_type->type) {
-                case H2O_MIMEMAP_TYPE_MIMETYPE:
-                    render_tile(req, self->map, rpath, z, x, y, mime_type->data.mimetype.base, mime_type->data.mimetype.len, super->flags, on_tile_rendered);
-                    break;
-                case H2O_MIMEMAP_TYPE_DYNAMIC:
-                    h2o_send_error(req, 500, "Internal Server Error", "MIME type for .png is declared as 'dynamic.'", 0);
-                }
-#endif
-            } else {
+            } else if (errno != ENOENT) {
                 h2o_send_error(req, 403, "Access Forbidden", "access forbidden", 0);
+                return 0;
+            } else if (suffix == PBF) {
+                h2o_send_error(req, 404, "File Not Found", "file not found", 0);
+                return 0;
+            }
+            /* If create_generator() failed (i.e. tile_path is non-existent) or the tile is stale, invoke renderer */
+            /* 
+            This function is already a "custom handler", associating yet another to ".png" files
+            would be highly probably a misconfiguration.
+            */
+            mime_type = h2o_mimemap_get_type_by_extension(self->super.mimemap, h2o_get_filext(rpath, rpath_len));
+            switch (mime_type->type) {
+            case H2O_MIMEMAP_TYPE_MIMETYPE:
+                start_render(self, style, req, rpath, rpath_len - 1, z, x, y, scale, suffix, mime_type->data.mimetype, is_stale,
+                             is_get);
+                break;
+            case H2O_MIMEMAP_TYPE_DYNAMIC:
+                h2o_send_error(req, 500, "Internal Server Error", "MIME type for .png is declared as 'dynamic.'", 0);
             }
             return 0;
         } else {
@@ -142,11 +733,22 @@ static int on_req_tile(h2o_handler_t *_self, h2o_req_t *req)
     } while (0);
 
 Opened:
+    load_tile_etag(generator->file.ref);
+    /* a gzip'ed vector tile (unless opened as the .gz variant already) */
+    if (is_vector && generator->content_encoding.base == NULL && is_gzipped_file(generator->file.ref)) {
+        h2o_set_header_token(&req->pool, &req->res.headers, H2O_TOKEN_VARY, H2O_STRLIT("accept-encoding"));
+        if (accepts_gzip(req))
+            generator->content_encoding = h2o_iovec_init(H2O_STRLIT("gzip"));
+        else
+            gunzip = 1;
+    }
     if ((if_none_match_header_index = h2o_find_header(&req->headers, H2O_TOKEN_IF_NONE_MATCH, SIZE_MAX)) != -1) {
         h2o_iovec_t *if_none_match = &req->headers.entries[if_none_match_header_index].value;
-        char etag[H2O_FILECACHE_ETAG_MAXLEN+1];
-        size_t etag_len = h2o_filecache_get_etag(generator->file.ref, etag);
-        if (h2o_memis(if_none_match->base, if_none_match->len, etag, etag_len))
+        char etag_buf[H2O_FILECACHE_ETAG_MAXLEN+1];
+        h2o_iovec_t etag = h2o_iovec_init(etag_buf, h2o_filecache_get_etag(generator->file.ref, etag_buf));
+        if (gunzip)
+            etag = weaken_etag(&req->pool, etag.base, etag.len);
+        if (h2o_memis(if_none_match->base, if_none_match->len, etag.base, etag.len))
             goto NotModified;
     } else if ((if_modified_since_header_index = h2o_find_header(&req->headers, H2O_TOKEN_IF_MODIFIED_SINCE, SIZE_MAX)) != -1) {
         h2o_iovec_t *ims_vec = &req->headers.entries[if_modified_since_header_index].value;
@@ -158,10 +760,21 @@ Opened:
         }
     }
 
+    /* return file */
+    if (is_vector) {
+        h2o_iovec_t content_type = h2o_iovec_init(H2O_STRLIT(TILE_VECTOR_MIME_TYPE));
+        if (gunzip) {
+            send_gunzipped_tile(self, req, generator->file.ref, content_type, is_get);
+            do_close(&generator->super, req);
+            return 0;
+        }
+        do_send_file(generator, req, 200, "OK", content_type, NULL, is_get);
+        return 0;
+    }
+
     /* obtain mime type */
     mime_type = h2o_mimemap_get_type_by_extension(self->super.mimemap, h2o_get_filext(rpath, rpath_len));
 
-    /* return file */
     switch (mime_type->type) {
     case H2O_MIMEMAP_TYPE_MIMETYPE:
         do_send_file(generator, req, 200, "OK", mime_type->data.mimetype, NULL, is_get);
@@ -179,16 +792,173 @@ NotModified:
     return 0;
 }
 
-static void on_dispose_tile_context(h2o_handler_t* _self, h2o_context_t* ctx) {
+static void on_fallback_setup_ostream(h2o_filter_t *_self, h2o_req_t *req, h2o_ostream_t **slot)
+{
+    struct st_h2o_tile_fallback_filter_t *self = (void *)_self;
+    ssize_t cursor;
+
+    /* let the other filters (e.g. "expires") set their headers first */
+    h2o_setup_next_ostream(req, slot);
+
+    if ((cursor = h2o_find_header_by_str(&req->res.headers, H2O_STRLIT(TILE_FALLBACK_HEADER), -1)) == -1)
+        return;
+    h2o_delete_header(&req->res.headers, cursor);
+    /* a substitute must not outlive the real tile in caches */
+    while ((cursor = h2o_find_header(&req->res.headers, H2O_TOKEN_CACHE_CONTROL, -1)) != -1)
+        h2o_delete_header(&req->res.headers, cursor);
+    h2o_add_header(&req->pool, &req->res.headers, H2O_TOKEN_CACHE_CONTROL, self->cache_control.base, self->cache_control.len);
+}
+
+static void free_blank_tiles(h2o_tile_style_t *style)
+{
+    size_t i;
+
+    for (i = 0; i != sizeof(style->blank_tile) / sizeof(style->blank_tile[0]); ++i) {
+        free(style->blank_tile[i].base);
+        free(style->blank_etag[i].base);
+        style->blank_tile[i] = style->blank_etag[i] = (h2o_iovec_t){NULL};
+    }
+}
+
+/* called on the loader thread once the map of the style is parsed */
+static void on_map_loaded(void *data)
+{
+    h2o_tile_style_t *style = data;
+    h2o_tile_config_vars_t *config = &style->handler->config;
+    tile_coverage_t *coverage;
+    char errbuf[256];
+    uint32_t scale;
+
+    if (!(config->coverage.from_style || config->coverage.polygon != NULL))
+        return;
+
+    if (config->coverage.from_style) {
+        double box[4];
+        if (get_map_extent(style->map, box) != 0) {
+            fprintf(stderr, "[lib/handler/tile.c] %s declares no maximum-extent; tile.coverage is ignored\n",
+                    style->file_path.base);
+            return;
+        }
+        double polygon[] = {box[0], box[1], box[2], box[1], box[2], box[3], box[0], box[3]};
+        coverage = tile_coverage_create(polygon, 4);
+    } else {
+        coverage = tile_coverage_create(config->coverage.polygon, config->coverage.num_points);
+    }
+
+    for (scale = 1; scale <= 2; ++scale) {
+        h2o_iovec_t *blank_tile = &style->blank_tile[scale - 1], *blank_etag = &style->blank_etag[scale - 1];
+        if (render_blank_tile(style->map, scale, blank_tile, errbuf, sizeof(errbuf)) != 0) {
+            fprintf(stderr, "[lib/handler/tile.c] failed to render a blank tile of %s: %s; tile.coverage is ignored\n",
+                    style->file_path.base, errbuf);
+            free_blank_tiles(style);
+            tile_coverage_destroy(coverage);
+            return;
+        }
+        blank_etag->base = h2o_mem_alloc(TILE_ETAG_LEN + 1);
+        blank_etag->len = tile_etag(blank_etag->base, blank_tile->base, blank_tile->len);
+    }
+
+    /* publish to the loop threads, which have been serving without the coverage so far */
+    __sync_synchronize();
+    style->coverage = coverage;
+}
+
+static void on_context_init_tile(h2o_handler_t *_self, h2o_context_t *ctx)
+{
+    h2o_tile_handler_t *self = (void *)_self;
+    struct st_h2o_tile_context_t *tctx = h2o_mem_alloc(sizeof(*tctx));
+
+    on_context_init(_self, ctx);
+
+    h2o_multithread_register_receiver(ctx->queue, &tctx->render_receiver, tile_render_receiver);
+    if (self->config.render_timeout != 0)
+        h2o_timeout_init(ctx->loop, &tctx->render_timeout, self->config.render_timeout);
+    h2o_context_set_handler_context(ctx, &self->super.super, tctx);
+
+    /* load the maps in the background (i.e. once the server is up, as the threads don't survive daemonizing);
+       until then, the tiles on disk are served as usual, and renders wait for the map */
+    if (__sync_bool_compare_and_swap(&self->loading, 0, 1)) {
+        size_t i;
+        for (i = 0; i != self->num_styles; ++i)
+            load_mapnik_async(self->styles[i].map, on_map_loaded, self->styles + i);
+    }
+    tile_render_start_prerender();
+}
+
+static void on_context_dispose_tile(h2o_handler_t *_self, h2o_context_t *ctx)
+{
+    h2o_tile_handler_t *self = (void *)_self;
+    struct st_h2o_tile_context_t *tctx = h2o_context_get_handler_context(ctx, &self->super.super);
+
+    if (tctx != NULL) {
+        h2o_multithread_unregister_receiver(ctx->queue, &tctx->render_receiver);
+        if (self->config.render_timeout != 0)
+            h2o_timeout_dispose(ctx->loop, &tctx->render_timeout);
+        free(tctx);
+    }
+    on_context_dispose(_self, ctx);
+}
+
+static void on_dispose_tile(h2o_handler_t *_self)
+{
     h2o_tile_handler_t *self = (void *)_self;
-    dispose_mapnik(self->map);
+    size_t i;
+
+    for (i = 0; i != self->num_styles; ++i) {
+        h2o_tile_style_t *style = self->styles + i;
+        /* the map is shared among the contexts (i.e. threads), thus is disposed only here */
+        dispose_mapnik(style->map);
+        free(style->name.base);
+        free(style->file_path.base);
+        free(style->base_path.base);
+        if (style->coverage != NULL) {
+            tile_coverage_destroy(style->coverage);
+            free_blank_tiles(style);
+        }
+    }
+    free(self->styles);
+    tile_url_template_destroy(self->url_template);
+    on_dispose(_self);
 }
 
+static void setup_style(h2o_tile_handler_t *self, h2o_tile_style_t *style, h2o_tile_style_config_t *style_config,
+                        h2o_tile_config_vars_t *config)
+{
+    const char *file_path = style_config->file_path;
+
+    style->handler = self;
+    style->file_path = h2o_strdup(NULL, file_path, SIZE_MAX);
+    if (style_config->name != NULL) {
+        /* a named style has its own tree under the tile path */
+        style->name = h2o_strdup(NULL, style_config->name, SIZE_MAX);
+        style->base_path.base = h2o_mem_alloc(self->super.real_path.len + style->name.len + 2);
+        style->base_path.len =
+            sprintf(style->base_path.base, "%s%s/", self->super.real_path.base, style->name.base);
+    } else {
+        /* what {style} matches: the basename of the file w/o the extension */
+        const char *name = strrchr(file_path, '/'), *ext;
+        name = name != NULL ? name + 1 : file_path;
+        ext = strrchr(name, '.');
+        style->name = h2o_strdup(NULL, name, ext != NULL ? (size_t)(ext - name) : SIZE_MAX);
+        style->base_path = h2o_strdup(NULL, self->super.real_path.base, self->super.real_path.len);
+    }
+    style->hot_cache_ns = tile_xxh64(style->base_path.base, style->base_path.len, 0);
+    style->map = alloc_mapnik(file_path);
+    style->quota.limit = style_config->max_renders != 0 ? style_config->max_renders : config->max_renders;
+    style->quota.num_running = 0;
 
-#define on_dispose_tile on_dispose;
-h2o_tile_handler_t *h2o_tile_register(h2o_pathconf_t *pathconf, const char *base_path, const char* style_file_path)
+    if (config->prerender.enabled)
+        tile_render_add_prerender(style->map, &style->quota, &style->coverage, style->base_path.base, style->base_path.len,
+                                  config->prerender.min_zoom, config->prerender.max_zoom, config->prerender.bbox[0],
+                                  config->prerender.bbox[1], config->prerender.bbox[2], config->prerender.bbox[3]);
+}
+
+h2o_tile_handler_t *h2o_tile_register(h2o_pathconf_t *pathconf, const char *base_path, h2o_tile_style_config_t *styles,
+                                      size_t num_styles, h2o_tile_config_vars_t *config)
 {
     h2o_tile_handler_t *self;
+    size_t i;
+    int has_named = 0;
 
     self = (void *)h2o_create_handler(pathconf, sizeof(*self));
 
@@ -202,13 +972,40 @@ h2o_tile_handler_t *h2o_tile_register(h2o_pathconf_t *pathconf, const char *base
     /* overload callbacks */
     self->super.super.dispose = on_dispose_tile;
     self->super.super.on_req = on_req_tile;
-    self->super.super.on_context_dispose = on_dispose_tile_context;
+    self->super.super.on_context_init = on_context_init_tile;
+    self->super.super.on_context_dispose = on_context_dispose_tile;
 
     /* setup attributes */
-    self->style_file_path = h2o_strdup(NULL, style_file_path, SIZE_MAX);
-    self->map = alloc_mapnik(style_file_path);
+    self->config = *config;
+    self->hot_cache = config->hot_cache.path != NULL ? tile_hot_cache_open(config->hot_cache.path, config->hot_cache.size) : NULL;
+    memset(self->hot_candidates, 0, sizeof(self->hot_candidates));
+    self->loading = 0;
+    assert(num_styles != 0);
+    self->styles = h2o_mem_alloc(sizeof(*self->styles) * num_styles);
+    memset(self->styles, 0, sizeof(*self->styles) * num_styles);
+    self->num_styles = num_styles;
+    for (i = 0; i != num_styles; ++i) {
+        setup_style(self, self->styles + i, styles + i, config);
+        if (styles[i].name != NULL)
+            has_named = 1;
+    }
+    do { /* scoping; the template has been validated by the configurator */
+        char errbuf[256];
+        const char *tmpl = config->url_template != NULL
+                               ? config->url_template
+                               : has_named ? "{style}/" TILE_URL_TEMPLATE_DEFAULT : TILE_URL_TEMPLATE_DEFAULT;
+        if ((self->url_template = tile_url_template_compile(tmpl, errbuf, sizeof(errbuf))) == NULL) {
+            fprintf(stderr, "[lib/handler/tile.c] invalid url-template %s: %s\n", tmpl, errbuf);
+            abort();
+        }
+    } while (0);
 
+    do { /* scoping */
+        struct st_h2o_tile_fallback_filter_t *filter = (void *)h2o_create_filter(pathconf, sizeof(*filter));
+        filter->super.on_setup_ostream = on_fallback_setup_ostream;
+        filter->cache_control.base = h2o_mem_alloc(sizeof("max-age=18446744073709551615"));
+        filter->cache_control.len = sprintf(filter->cache_control.base, "max-age=%" PRIu64, config->fallback_max_age);
+    } while (0);
 
     return self;
 }
-
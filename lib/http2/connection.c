@@ -1170,6 +1170,9 @@ static void push_path(h2o_req_t *src_req, const char *abspath, size_t abspath_le
 
     if (!conn->peer_settings.enable_push || conn->num_streams.push.open >= conn->peer_settings.max_concurrent_streams)
         return;
+    /* PUSH_PROMISE can only be sent on a stream initiated by the peer (RFC 7540 8.2.1) */
+    if (h2o_http2_stream_is_push(src_stream->stream_id))
+        return;
     if (conn->push_stream_ids.max_open >= 0x7ffffff0)
         return;
     if (!(h2o_linklist_is_empty(&conn->_pending_reqs) && can_run_requests(conn)))
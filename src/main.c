@@ -62,6 +62,9 @@
 /*--------------------*/
 #if H2O_TILE && (!H2O_TILE_PROXY)
 #include "mapnik-bridge.h"
+#include "render-queue.h"
+#include "render-worker.h"
+#include "render-remote.h"
 #endif
 #include "git-revision.h"
 /*--------------------*/
@@ -1078,16 +1081,216 @@ static int on_config_num_name_resolution_threads(h2o_configurator_command_t *cmd
 /*--------------------*/
 #if H2O_TILE && (!H2O_TILE_PROXY)
 int mapnik_datasource_initialized = 0;
+/* what the render workers are initialized with, as well */
+static const char *mapnik_datasource_path = NULL;
+static H2O_VECTOR(const char *) mapnik_font_dirs;
+
 static int on_config_mapnik_datasource(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
 {
     init_mapnik_datasource(node->data.scalar);
     mapnik_datasource_initialized = 1;
+    mapnik_datasource_path = node->data.scalar;
     return 0;
 }
 
 static int on_config_mapnik_fonts(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
 {
     load_fonts(node->data.scalar);
+    h2o_vector_reserve(NULL, &mapnik_font_dirs, mapnik_font_dirs.size + 1);
+    mapnik_font_dirs.entries[mapnik_font_dirs.size++] = node->data.scalar;
+    return 0;
+}
+
+static int on_config_mapnik_render_processes(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    ssize_t ret = h2o_configurator_get_one_of(cmd, node, "OFF,ON");
+    if (ret == -1)
+        return -1;
+    tile_renderer = ret ? &tile_renderer_process : &tile_renderer_mapnik;
+    return 0;
+}
+
+static int on_config_mapnik_render_process_timeout(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    return h2o_configurator_scanf(cmd, node, "%u", &tile_render_worker_timeout);
+}
+
+static int on_config_mapnik_render_process_memory(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    return h2o_configurator_scanf(cmd, node, "%zu", &tile_render_worker_memory_limit);
+}
+
+static int on_config_mapnik_render_daemons(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    size_t i;
+
+    if (node->data.sequence.size == 0) {
+        h2o_configurator_errprintf(cmd, node, "mapnik-render-daemons must not be empty");
+        return -1;
+    }
+    for (i = 0; i != node->data.sequence.size; ++i) {
+        yoml_t *e = node->data.sequence.elements[i];
+        if (e->type != YOML_TYPE_SCALAR || tile_render_remote_add_daemon(e->data.scalar) != 0) {
+            h2o_configurator_errprintf(cmd, e, "address of a render daemon must be either unix:/path or host:port");
+            return -1;
+        }
+    }
+    tile_renderer = &tile_renderer_remote;
+    return 0;
+}
+
+static int on_config_mapnik_render_daemon_timeout(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    return h2o_configurator_scanf(cmd, node, "%u", &tile_render_remote_timeout);
+}
+
+static int on_config_mapnik_style_watch(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    return h2o_configurator_scanf(cmd, node, "%u", &mapnik_style_watch_interval);
+}
+
+static void on_sigusr1(int signo)
+{
+    reload_mapnik_styles();
+    tile_render_worker_kill(SIGUSR1);
+}
+
+static int on_config_mapnik_render_threads(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    if (h2o_configurator_scanf(cmd, node, "%zu", &tile_render_max_threads) != 0)
+        return -1;
+    if (tile_render_max_threads == 0) {
+        h2o_configurator_errprintf(cmd, node, "mapnik-render-threads must be >=1");
+        return -1;
+    }
+    return 0;
+}
+
+static int on_config_mapnik_render_policy(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    switch (h2o_configurator_get_one_of(cmd, node, "strict,weighted")) {
+    case 0:
+        tile_render_scheduler_config.policy = TILE_RENDER_POLICY_STRICT;
+        break;
+    case 1:
+        tile_render_scheduler_config.policy = TILE_RENDER_POLICY_WEIGHTED;
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+static int on_config_mapnik_render_weights(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    size_t i;
+
+    if (node->data.sequence.size != TILE_RENDER_NUM_CLASSES) {
+        h2o_configurator_errprintf(cmd, node, "mapnik-render-weights must be a sequence of 3 weights: [interactive, revalidate, prerender]");
+        return -1;
+    }
+    for (i = 0; i != TILE_RENDER_NUM_CLASSES; ++i) {
+        if (h2o_configurator_scanf(cmd, node->data.sequence.elements[i], "%u", tile_render_scheduler_config.weights + i) != 0)
+            return -1;
+        if (tile_render_scheduler_config.weights[i] == 0) {
+            h2o_configurator_errprintf(cmd, node->data.sequence.elements[i], "weight must be >=1");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int on_config_mapnik_prerender_threads(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    return h2o_configurator_scanf(cmd, node, "%zu", &tile_render_scheduler_config.prerender_threads);
+}
+
+static int on_config_mapnik_render_zoom_limits(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    size_t i;
+
+    /* zoom (or a range of zooms like "0-8") => max. concurrent renders */
+    for (i = 0; i != node->data.mapping.size; ++i) {
+        yoml_t *key = node->data.mapping.elements[i].key, *value = node->data.mapping.elements[i].value;
+        unsigned z1, z2;
+        size_t limit;
+        if (key->type != YOML_TYPE_SCALAR) {
+            h2o_configurator_errprintf(cmd, key, "key must be a zoom or a range of zooms");
+            return -1;
+        }
+        switch (sscanf(key->data.scalar, "%u-%u", &z1, &z2)) {
+        case 1:
+            z2 = z1;
+            break;
+        case 2:
+            break;
+        default:
+            h2o_configurator_errprintf(cmd, key, "key must be a zoom or a range of zooms");
+            return -1;
+        }
+        if (z1 > z2 || z2 > TILE_MAX_ZOOM) {
+            h2o_configurator_errprintf(cmd, key, "zooms must be within [0, %d]", TILE_MAX_ZOOM);
+            return -1;
+        }
+        if (h2o_configurator_scanf(cmd, value, "%zu", &limit) != 0)
+            return -1;
+        for (; z1 <= z2; ++z1)
+            tile_render_scheduler_config.zoom_limits[z1] = limit;
+    }
+    return 0;
+}
+
+static int on_config_mapnik_png_encoder(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    switch (h2o_configurator_get_one_of(cmd, node, "builtin,mapnik")) {
+    case 0:
+        mapnik_png_builtin = 1;
+        break;
+    case 1:
+        mapnik_png_builtin = 0;
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+static int on_config_mapnik_png_compression(h2o_configurator_command_t *cmd, h2o_configurator_context_t *ctx, yoml_t *node)
+{
+    size_t i;
+
+    /* zoom (or a range of zooms like "0-8") => zlib's level */
+    for (i = 0; i != node->data.mapping.size; ++i) {
+        yoml_t *key = node->data.mapping.elements[i].key, *value = node->data.mapping.elements[i].value;
+        unsigned z1, z2;
+        int level;
+        if (key->type != YOML_TYPE_SCALAR) {
+            h2o_configurator_errprintf(cmd, key, "key must be a zoom or a range of zooms");
+            return -1;
+        }
+        switch (sscanf(key->data.scalar, "%u-%u", &z1, &z2)) {
+        case 1:
+            z2 = z1;
+            break;
+        case 2:
+            break;
+        default:
+            h2o_configurator_errprintf(cmd, key, "key must be a zoom or a range of zooms");
+            return -1;
+        }
+        if (z1 > z2 || z2 > TILE_MAX_ZOOM) {
+            h2o_configurator_errprintf(cmd, key, "zooms must be within [0, %d]", TILE_MAX_ZOOM);
+            return -1;
+        }
+        if (h2o_configurator_scanf(cmd, value, "%d", &level) != 0)
+            return -1;
+        if (level < 1 || level > 9) {
+            h2o_configurator_errprintf(cmd, value, "compression level must be within [1, 9]");
+            return -1;
+        }
+        for (; z1 <= z2; ++z1)
+            mapnik_png_compression[z1] = level;
+    }
     return 0;
 }
 
@@ -1195,6 +1398,9 @@ static void setup_signal_handlers(void)
 {
     h2o_set_signal_handler(SIGTERM, on_sigterm);
     h2o_set_signal_handler(SIGPIPE, SIG_IGN);
+#if H2O_TILE && (!H2O_TILE_PROXY)
+    h2o_set_signal_handler(SIGUSR1, on_sigusr1);
+#endif
 #ifdef __GLIBC__
     if ((backtrace_symbols_to_fd = popen_annotate_backtrace_symbols()) == -1)
         backtrace_symbols_to_fd = 2;
@@ -1495,6 +1701,32 @@ static void setup_configurators(void)
                                         on_config_mapnik_datasource);
         h2o_configurator_define_command(c, "mapnik-fonts", H2O_CONFIGURATOR_FLAG_GLOBAL | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR ,
                                         on_config_mapnik_fonts);
+        h2o_configurator_define_command(c, "mapnik-style-watch", H2O_CONFIGURATOR_FLAG_GLOBAL | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR ,
+                                        on_config_mapnik_style_watch);
+        h2o_configurator_define_command(c, "mapnik-render-processes", H2O_CONFIGURATOR_FLAG_GLOBAL | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR ,
+                                        on_config_mapnik_render_processes);
+        h2o_configurator_define_command(c, "mapnik-render-process-timeout", H2O_CONFIGURATOR_FLAG_GLOBAL | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR ,
+                                        on_config_mapnik_render_process_timeout);
+        h2o_configurator_define_command(c, "mapnik-render-process-memory", H2O_CONFIGURATOR_FLAG_GLOBAL | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR ,
+                                        on_config_mapnik_render_process_memory);
+        h2o_configurator_define_command(c, "mapnik-render-daemons", H2O_CONFIGURATOR_FLAG_GLOBAL | H2O_CONFIGURATOR_FLAG_EXPECT_SEQUENCE ,
+                                        on_config_mapnik_render_daemons);
+        h2o_configurator_define_command(c, "mapnik-render-daemon-timeout", H2O_CONFIGURATOR_FLAG_GLOBAL | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR ,
+                                        on_config_mapnik_render_daemon_timeout);
+        h2o_configurator_define_command(c, "mapnik-render-threads", H2O_CONFIGURATOR_FLAG_GLOBAL | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR ,
+                                        on_config_mapnik_render_threads);
+        h2o_configurator_define_command(c, "mapnik-render-policy", H2O_CONFIGURATOR_FLAG_GLOBAL | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR ,
+                                        on_config_mapnik_render_policy);
+        h2o_configurator_define_command(c, "mapnik-render-weights", H2O_CONFIGURATOR_FLAG_GLOBAL | H2O_CONFIGURATOR_FLAG_EXPECT_SEQUENCE ,
+                                        on_config_mapnik_render_weights);
+        h2o_configurator_define_command(c, "mapnik-prerender-threads", H2O_CONFIGURATOR_FLAG_GLOBAL | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR ,
+                                        on_config_mapnik_prerender_threads);
+        h2o_configurator_define_command(c, "mapnik-render-zoom-limits", H2O_CONFIGURATOR_FLAG_GLOBAL | H2O_CONFIGURATOR_FLAG_EXPECT_MAPPING ,
+                                        on_config_mapnik_render_zoom_limits);
+        h2o_configurator_define_command(c, "mapnik-png-encoder", H2O_CONFIGURATOR_FLAG_GLOBAL | H2O_CONFIGURATOR_FLAG_EXPECT_SCALAR ,
+                                        on_config_mapnik_png_encoder);
+        h2o_configurator_define_command(c, "mapnik-png-compression", H2O_CONFIGURATOR_FLAG_GLOBAL | H2O_CONFIGURATOR_FLAG_EXPECT_MAPPING ,
+                                        on_config_mapnik_png_compression);
 #endif
 /*--------------------*/
         h2o_configurator_define_command(c, "tcp-fastopen", H2O_CONFIGURATOR_FLAG_GLOBAL, on_config_tcp_fastopen);
@@ -1536,6 +1768,17 @@ int main(int argc, char **argv)
     conf.launch_time = time(NULL);
 
     h2o_hostinfo_max_threads = H2O_DEFAULT_NUM_NAME_RESOLUTION_THREADS;
+/*--------------------*/
+#if H2O_TILE && (!H2O_TILE_PROXY)
+    /* spawned by a render thread, cf. render-worker.h */
+    if (argc >= 2 && strcmp(argv[1], "--render-worker") == 0)
+        return tile_render_worker_main(argc, argv);
+    /* run as a render daemon, cf. render-remote.h */
+    if (argc >= 2 && strcmp(argv[1], "--render-daemon") == 0)
+        return tile_render_daemon_main(argc - 1, argv + 1);
+    tile_render_max_threads = h2o_numproc();
+#endif
+/*--------------------*/
 
     init_openssl();
     setup_configurators();
@@ -1667,6 +1910,8 @@ int main(int argc, char **argv)
             /* No "mapnik-datasource" entry in the .conf */
             init_mapnik_datasource(NULL); /* passing NULL is equavalent to the hard-coded default: /usr/local/mapnik/input */
         }
+        if (tile_renderer == &tile_renderer_process)
+            tile_render_worker_setup(mapnik_datasource_path, mapnik_font_dirs.entries, mapnik_font_dirs.size);
 #endif
 /*--------------------*/
     }
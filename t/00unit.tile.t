@@ -0,0 +1,6 @@
+use strict;
+use warnings;
+
+use t::Util;
+
+exec_unittest('tile');
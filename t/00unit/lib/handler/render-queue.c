@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <errno.h>
+#include "../../test.h"
+#include "../../../../lib/handler/render-queue.c"
+
+/* the scheduler is tested on the loop side only; nothing is rendered, nor sent back (no thread is started) */
+const tile_renderer_t tile_renderer_mapnik = {NULL, 1, 0};
+
+int save_tile(const char *tile_path, const char *data, size_t len, const char *etag)
+{
+    return 0;
+}
+
+int render_fallback_tile(const char *base_path, size_t base_path_len, uint32_t zoom, uint32_t x, uint32_t y, uint32_t scale,
+                         enum TILE_SUFFIX suffix, uint32_t max_levels, h2o_iovec_t *content)
+{
+    return -1;
+}
+
+int tile_dirfd_stat(const char *path, struct stat *st)
+{
+    errno = ENOENT;
+    return -1;
+}
+
+void h2o_multithread_send_message(h2o_multithread_receiver_t *receiver, h2o_multithread_message_t *message)
+{
+}
+
+static void reset_queue(tile_render_policy_t policy)
+{
+    size_t i;
+
+    for (i = 0; i != TILE_RENDER_NUM_CLASSES; ++i) {
+        h2o_linklist_init_anchor(&queue.classes[i].pending);
+        queue.classes[i].num_running = 0;
+        queue.classes[i].pass = 0;
+    }
+    memset(queue.num_running_by_zoom, 0, sizeof(queue.num_running_by_zoom));
+    queue.vtime = 0;
+    h2o_linklist_init_anchor(&queue.fallbacks);
+    tile_render_scheduler_config = (tile_render_scheduler_config_t){policy, {4, 2, 1}, 1, {}};
+}
+
+static tile_render_job_t *create_job(uint32_t zoom, uint32_t x, tile_render_quota_t *quota, tile_render_class_t cls)
+{
+    tile_render_job_t *job = tile_render_job_create(NULL, NULL, zoom, x, 0, 1, PNG, "/nonexistent/tile.png", NULL, NULL);
+    job->quota = quota;
+    enqueue(job, cls);
+    return job;
+}
+
+/* what a render thread does once the job is rendered (cf. render_thread_main()) */
+static void finish_job(tile_render_job_t *job)
+{
+    --queue.classes[job->_class].num_running;
+    if (job->zoom <= TILE_MAX_ZOOM)
+        --queue.num_running_by_zoom[job->zoom];
+    if (job->quota != NULL)
+        --job->quota->num_running;
+    job->_state = TILE_RENDER_JOB_DONE;
+    free(job);
+}
+
+static void test_strict(void)
+{
+    tile_render_job_t *prerender, *revalidate, *interactive1, *interactive2, *job;
+
+    reset_queue(TILE_RENDER_POLICY_STRICT);
+    prerender = create_job(10, 0, NULL, TILE_RENDER_CLASS_PRERENDER);
+    revalidate = create_job(10, 1, NULL, TILE_RENDER_CLASS_REVALIDATE);
+    interactive1 = create_job(10, 2, NULL, TILE_RENDER_CLASS_INTERACTIVE);
+    interactive2 = create_job(10, 3, NULL, TILE_RENDER_CLASS_INTERACTIVE);
+
+    ok(pop_job() == interactive1);
+    ok(interactive1->_state == TILE_RENDER_JOB_RUNNING);
+    ok(pop_job() == interactive2);
+    /* a class is served while a higher one is running, once the latter has nothing queued */
+    ok(pop_job() == revalidate);
+    ok(pop_job() == prerender);
+    ok(pop_job() == NULL);
+
+    /* a job queued later in a higher class goes ahead of those queued earlier */
+    finish_job(interactive1);
+    finish_job(interactive2);
+    finish_job(revalidate);
+    finish_job(prerender);
+    revalidate = create_job(10, 4, NULL, TILE_RENDER_CLASS_REVALIDATE);
+    interactive1 = create_job(10, 5, NULL, TILE_RENDER_CLASS_INTERACTIVE);
+    ok((job = pop_job()) == interactive1);
+    finish_job(job);
+    ok((job = pop_job()) == revalidate);
+    finish_job(job);
+}
+
+static void test_weighted(void)
+{
+    size_t picks[TILE_RENDER_NUM_CLASSES] = {}, cls, i;
+    tile_render_job_t *job;
+
+    reset_queue(TILE_RENDER_POLICY_WEIGHTED);
+    tile_render_scheduler_config.prerender_threads = 8;
+    for (cls = 0; cls != TILE_RENDER_NUM_CLASSES; ++cls)
+        for (i = 0; i != 70; ++i)
+            create_job(10, i, NULL, cls);
+
+    /* 70 picks out of the classes of the weights 4:2:1 */
+    for (i = 0; i != 70; ++i) {
+        job = pop_job();
+        ++picks[job->_class];
+        finish_job(job);
+    }
+    ok(picks[TILE_RENDER_CLASS_INTERACTIVE] == 40);
+    ok(picks[TILE_RENDER_CLASS_REVALIDATE] == 20);
+    ok(picks[TILE_RENDER_CLASS_PRERENDER] == 10);
+
+    /* the rest, all of a class once the others run out */
+    while ((job = pop_job()) != NULL) {
+        ++picks[job->_class];
+        finish_job(job);
+    }
+    ok(picks[TILE_RENDER_CLASS_INTERACTIVE] == 70 && picks[TILE_RENDER_CLASS_REVALIDATE] == 70 &&
+       picks[TILE_RENDER_CLASS_PRERENDER] == 70);
+
+    /* a class idle meanwhile doesn't claim the time it has missed, i.e. shares from now on */
+    for (i = 0; i != 70; ++i)
+        create_job(10, i, NULL, TILE_RENDER_CLASS_INTERACTIVE);
+    for (i = 0; i != 30; ++i)
+        finish_job(pop_job());
+    for (i = 0; i != 10; ++i)
+        create_job(10, i, NULL, TILE_RENDER_CLASS_PRERENDER);
+    memset(picks, 0, sizeof(picks));
+    for (i = 0; i != 10; ++i) {
+        job = pop_job();
+        ++picks[job->_class];
+        finish_job(job);
+    }
+    ok(picks[TILE_RENDER_CLASS_PRERENDER] <= 2);
+
+    while ((job = pop_job()) != NULL)
+        finish_job(job);
+}
+
+static void test_zoom_limit(void)
+{
+    tile_render_job_t *z15a, *z15b, *z14, *job;
+
+    reset_queue(TILE_RENDER_POLICY_STRICT);
+    tile_render_scheduler_config.zoom_limits[15] = 1;
+    z15a = create_job(15, 0, NULL, TILE_RENDER_CLASS_INTERACTIVE);
+    z15b = create_job(15, 1, NULL, TILE_RENDER_CLASS_INTERACTIVE);
+    z14 = create_job(14, 0, NULL, TILE_RENDER_CLASS_INTERACTIVE);
+
+    ok(pop_job() == z15a);
+    /* skipped over the one blocked by the limit */
+    ok(find_runnable(TILE_RENDER_CLASS_INTERACTIVE) == z14);
+    ok(pop_job() == z14);
+    ok(pop_job() == NULL);
+    ok(z15b->_state == TILE_RENDER_JOB_QUEUED);
+    finish_job(z15a);
+    ok((job = pop_job()) == z15b);
+    finish_job(job);
+    finish_job(z14);
+}
+
+static void test_quota(void)
+{
+    tile_render_quota_t quota = {1, 0};
+    tile_render_job_t *a, *b, *other, *prerender1, *prerender2, *job;
+
+    reset_queue(TILE_RENDER_POLICY_STRICT);
+    a = create_job(10, 0, &quota, TILE_RENDER_CLASS_INTERACTIVE);
+    b = create_job(10, 1, &quota, TILE_RENDER_CLASS_INTERACTIVE);
+    other = create_job(10, 2, NULL, TILE_RENDER_CLASS_INTERACTIVE);
+
+    ok(pop_job() == a);
+    ok(quota.num_running == 1);
+    ok(pop_job() == other);
+    ok(pop_job() == NULL);
+    finish_job(a);
+    ok(quota.num_running == 0);
+    ok((job = pop_job()) == b);
+    finish_job(job);
+    finish_job(other);
+
+    /* the seeding is limited by prerender_threads */
+    prerender1 = create_job(10, 0, NULL, TILE_RENDER_CLASS_PRERENDER);
+    prerender2 = create_job(10, 1, NULL, TILE_RENDER_CLASS_PRERENDER);
+    ok(pop_job() == prerender1);
+    ok(pop_job() == NULL);
+    finish_job(prerender1);
+    ok((job = pop_job()) == prerender2);
+    finish_job(job);
+}
+
+static void test_detach(void)
+{
+    tile_render_job_t *job;
+
+    reset_queue(TILE_RENDER_POLICY_STRICT);
+
+    /* a queued one is dropped */
+    create_job(10, 0, NULL, TILE_RENDER_CLASS_INTERACTIVE);
+    tile_render_detach(find_runnable(TILE_RENDER_CLASS_INTERACTIVE), 0);
+    ok(h2o_linklist_is_empty(&queue.classes[TILE_RENDER_CLASS_INTERACTIVE].pending));
+    ok(pop_job() == NULL);
+
+    /* or moved to revalidate, to be persisted */
+    job = create_job(10, 1, NULL, TILE_RENDER_CLASS_INTERACTIVE);
+    job->cb = (tile_render_job_cb)free;
+    tile_render_detach(job, 1);
+    ok(h2o_linklist_is_empty(&queue.classes[TILE_RENDER_CLASS_INTERACTIVE].pending));
+    ok(job->_class == TILE_RENDER_CLASS_REVALIDATE && job->_persist_only && job->cb == NULL);
+    ok(job->_state == TILE_RENDER_JOB_QUEUED);
+    ok(pop_job() == job);
+    finish_job(job);
+
+    /* a queued fallback job has nothing to persist */
+    job = tile_render_job_create(NULL, NULL, 10, 2, 0, 1, PNG, "/nonexistent/tile.png", NULL, NULL);
+    job->fallback_levels = 3;
+    h2o_linklist_insert(&queue.fallbacks, &job->_pending);
+    tile_render_detach(job, 1);
+    ok(h2o_linklist_is_empty(&queue.fallbacks));
+    ok(h2o_linklist_is_empty(&queue.classes[TILE_RENDER_CLASS_REVALIDATE].pending));
+
+    /* a running one is rendered, just to be persisted */
+    job = create_job(10, 3, NULL, TILE_RENDER_CLASS_INTERACTIVE);
+    ok(pop_job() == job);
+    tile_render_detach(job, 0);
+    ok(job->_state == TILE_RENDER_JOB_RUNNING && job->_persist_only && job->cb == NULL);
+    ok(queue.classes[TILE_RENDER_CLASS_INTERACTIVE].num_running == 1);
+    ok(pop_job() == NULL);
+    finish_job(job);
+
+    /* a done one is on its way to the receiver, which discards it */
+    job = create_job(10, 4, NULL, TILE_RENDER_CLASS_INTERACTIVE);
+    job->cb = (tile_render_job_cb)free;
+    ok(pop_job() == job);
+    --queue.classes[TILE_RENDER_CLASS_INTERACTIVE].num_running;
+    --queue.num_running_by_zoom[10];
+    job->_state = TILE_RENDER_JOB_DONE;
+    tile_render_detach(job, 1);
+    ok(job->_state == TILE_RENDER_JOB_DONE && !job->_persist_only && job->cb == NULL);
+    ok(pop_job() == NULL);
+    free(job);
+}
+
+void test_lib__handler__render_queue_c(void)
+{
+    subtest("strict", test_strict);
+    subtest("weighted", test_weighted);
+    subtest("zoom-limit", test_zoom_limit);
+    subtest("quota", test_quota);
+    subtest("detach", test_detach);
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include "../../test.h"
+#include "../../../../lib/handler/tile-coverage.c"
+
+/* the tile of (lon, lat) at the zoom, cf. lonlat_to_tile() of proj.hpp */
+static void tile_of(double lon, double lat, uint32_t zoom, uint32_t *x, uint32_t *y)
+{
+    double tx, ty;
+    to_tile_coords(lon, lat, &tx, &ty);
+    *x = (uint32_t)(tx * (1u << zoom) / NUM_TILES);
+    *y = (uint32_t)(ty * (1u << zoom) / NUM_TILES);
+}
+
+static int contains_lonlat(const tile_coverage_t *coverage, double lon, double lat, uint32_t zoom)
+{
+    uint32_t x, y;
+    tile_of(lon, lat, zoom, &x, &y);
+    return tile_coverage_contains(coverage, zoom, x, y);
+}
+
+static void test_box(void)
+{
+    static const double box[] = {122, 20, 154, 20, 154, 46, 122, 46};
+    tile_coverage_t *coverage = tile_coverage_create(box, 4);
+
+    ok(tile_coverage_contains(coverage, 0, 0, 0));
+    ok(contains_lonlat(coverage, 139.69, 35.69, 10));
+    ok(contains_lonlat(coverage, 139.69, 35.69, 18));
+    ok(!contains_lonlat(coverage, -74.0, 40.71, 10));
+    ok(!contains_lonlat(coverage, -74.0, 40.71, 18));
+    /* the tile of x = 859 at zoom 10 is of [121.992, 122.344), partially covered, thus covered; but not the next one */
+    ok(contains_lonlat(coverage, 122.01, 30, 10));
+    ok(contains_lonlat(coverage, 121.995, 30, 10));
+    ok(!contains_lonlat(coverage, 121.5, 30, 10));
+    ok(!contains_lonlat(coverage, 138, 47, 10));
+    /* out of range */
+    ok(!tile_coverage_contains(coverage, 5, 32, 0));
+    ok(!tile_coverage_contains(coverage, 15, 0, 1u << 15));
+    ok(!tile_coverage_contains(coverage, 32, 0, 0));
+    ok(!tile_coverage_contains(coverage, 99, 0, 0));
+
+    tile_coverage_destroy(coverage);
+}
+
+static void test_concave(void)
+{
+    /* an L */
+    static const double ell[] = {0, 0, 20, 0, 20, 10, 10, 10, 10, 20, 0, 20};
+    tile_coverage_t *coverage = tile_coverage_create(ell, 6);
+
+    ok(contains_lonlat(coverage, 5, 5, 10));
+    ok(contains_lonlat(coverage, 15, 5, 10));
+    ok(contains_lonlat(coverage, 5, 15, 10));
+    ok(!contains_lonlat(coverage, 15, 15, 10));
+    ok(!contains_lonlat(coverage, 15, 15, 14));
+    ok(contains_lonlat(coverage, 15, 15, 3));
+
+    tile_coverage_destroy(coverage);
+}
+
+/* the even-odd rule at the point, by a ray to the right */
+static int is_inside(const double *pts, size_t n, double x, double y)
+{
+    size_t i, j;
+    int inside = 0;
+
+    for (i = 0, j = n - 1; i != n; j = i++)
+        if ((pts[2 * i + 1] > y) != (pts[2 * j + 1] > y) &&
+            x < pts[2 * i] + (y - pts[2 * i + 1]) * (pts[2 * j] - pts[2 * i]) / (pts[2 * j + 1] - pts[2 * i + 1]))
+            inside = !inside;
+    return inside;
+}
+
+/* the distance from the point to the boundary, in tiles */
+static double distance_to_boundary(const double *pts, size_t n, double x, double y)
+{
+    double min = INFINITY;
+    size_t i;
+
+    for (i = 0; i != n; ++i) {
+        const double *a = pts + 2 * i, *b = pts + 2 * ((i + 1) % n);
+        double dx = b[0] - a[0], dy = b[1] - a[1], t = ((x - a[0]) * dx + (y - a[1]) * dy) / (dx * dx + dy * dy), d;
+        t = t < 0 ? 0 : t > 1 ? 1 : t;
+        d = hypot(a[0] + t * dx - x, a[1] + t * dy - y);
+        if (d < min)
+            min = d;
+    }
+    return min;
+}
+
+static void test_brute_force(void)
+{
+    static const double triangle[] = {-10, -5, 30, 12, 2, 40};
+    tile_coverage_t *coverage = tile_coverage_create(triangle, 3);
+    double pts[6];
+    size_t i, num_wrong = 0, num_covered = 0;
+    uint32_t zoom, x, y;
+
+    for (i = 0; i != 3; ++i)
+        to_tile_coords(triangle[2 * i], triangle[2 * i + 1], pts + 2 * i, pts + 2 * i + 1);
+
+    /* at the finest: the tiles inside are covered, and the ones away from the boundary are as they are */
+    for (y = 0; y != NUM_TILES; ++y) {
+        for (x = 0; x != NUM_TILES; ++x) {
+            double cx = x + 0.5, cy = y + 0.5;
+            int covered = tile_coverage_contains(coverage, TILE_COVERAGE_MAX_ZOOM, x, y);
+            num_covered += covered;
+            if (is_inside(pts, 3, cx, cy) ? !covered : covered && distance_to_boundary(pts, 3, cx, cy) > 1.5)
+                ++num_wrong;
+        }
+    }
+    ok(num_covered != 0);
+    ok(num_wrong == 0);
+
+    /* the lower zooms: covered iff any of the children is */
+    num_wrong = 0;
+    for (zoom = 0; zoom != TILE_COVERAGE_MAX_ZOOM; ++zoom)
+        for (y = 0; y != (1u << zoom); ++y)
+            for (x = 0; x != (1u << zoom); ++x)
+                num_wrong += tile_coverage_contains(coverage, zoom, x, y) !=
+                             (tile_coverage_contains(coverage, zoom + 1, x * 2, y * 2) ||
+                              tile_coverage_contains(coverage, zoom + 1, x * 2 + 1, y * 2) ||
+                              tile_coverage_contains(coverage, zoom + 1, x * 2, y * 2 + 1) ||
+                              tile_coverage_contains(coverage, zoom + 1, x * 2 + 1, y * 2 + 1));
+    ok(num_wrong == 0);
+
+    /* the higher zooms: as the ancestor at the finest is */
+    num_wrong = 0;
+    for (y = 0; y != (1u << 14); y += 7)
+        for (x = 0; x != (1u << 14); x += 13)
+            num_wrong += tile_coverage_contains(coverage, 14, x, y) != tile_coverage_contains(coverage, 10, x >> 4, y >> 4);
+    ok(num_wrong == 0);
+
+    tile_coverage_destroy(coverage);
+}
+
+void test_lib__handler__tile_coverage_c(void)
+{
+    subtest("box", test_box);
+    subtest("concave", test_concave);
+    subtest("brute-force", test_brute_force);
+}
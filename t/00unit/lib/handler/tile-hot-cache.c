@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <pthread.h>
+#include "../../test.h"
+#include "../../../../lib/handler/tile-hot-cache.c"
+
+/* 4 slots (cf. AVG_TILE_SIZE), i.e. all in a probe window */
+#define SMALL_SIZE 65536
+#define LARGE_SIZE (16 * 1024 * 1024)
+#define NUM_THREADS 4
+#define NUM_SETS_PER_THREAD 4000
+
+static char *create_path(void)
+{
+    char *path = strdup("/tmp/h2o-tile-hot-cache.XXXXXX");
+    int fd = mkstemp(path);
+    close(fd);
+    return path;
+}
+
+static void fill(char *buf, size_t len, uint64_t key)
+{
+    size_t i;
+    for (i = 0; i != len; ++i)
+        buf[i] = (char)(key * 31 + i);
+}
+
+static int is_filled(const h2o_iovec_t *content, uint64_t key)
+{
+    size_t i;
+    for (i = 0; i != content->len; ++i)
+        if (content->base[i] != (char)(key * 31 + i))
+            return 0;
+    return 1;
+}
+
+static void test_set_get(void)
+{
+    char *path = create_path(), buf[1000], large[SMALL_SIZE / 16];
+    tile_hot_cache_t *cache, *attached;
+    tile_hot_cache_hit_t hit;
+    h2o_mem_pool_t pool;
+    uint64_t key = tile_hot_cache_key(15, 29102, 12903, 2, PNG);
+
+    h2o_mem_init_pool(&pool);
+    cache = tile_hot_cache_open(path, SMALL_SIZE);
+    ok(cache != NULL);
+    ok(cache->header->num_slots == 4);
+
+    ok(tile_hot_cache_get(cache, 1, key, &pool, &hit) != 0);
+    fill(buf, 500, key);
+    tile_hot_cache_set(cache, 1, key, buf, 500, 12345, H2O_STRLIT("\"abc\""));
+    ok(tile_hot_cache_get(cache, 1, key, &pool, &hit) == 0);
+    ok(hit.content.len == 500 && is_filled(&hit.content, key));
+    ok(hit.mtime == 12345);
+    ok(hit.etag_len == 5 && strcmp(hit.etag, "\"abc\"") == 0);
+    /* of another namespace, or another key */
+    ok(tile_hot_cache_get(cache, 2, key, &pool, &hit) != 0);
+    ok(tile_hot_cache_get(cache, 1, tile_hot_cache_key(15, 29102, 12903, 1, PNG), &pool, &hit) != 0);
+
+    /* replaced */
+    fill(buf, 300, key + 1);
+    tile_hot_cache_set(cache, 1, key, buf, 300, 23456, "", 0);
+    ok(tile_hot_cache_get(cache, 1, key, &pool, &hit) == 0);
+    ok(hit.content.len == 300 && is_filled(&hit.content, key + 1));
+    ok(hit.etag_len == 0);
+
+    /* too large (1/16 of the ring or more) */
+    tile_hot_cache_set(cache, 1, key + 1, buf, 1000, 0, "", 0);
+    ok(tile_hot_cache_get(cache, 1, key + 1, &pool, &hit) == 0);
+    fill(large, sizeof(large), key + 2);
+    tile_hot_cache_set(cache, 1, key + 2, large, sizeof(large), 0, "", 0);
+    ok(tile_hot_cache_get(cache, 1, key + 2, &pool, &hit) != 0);
+
+    /* attached by another process (as is, with the same size) */
+    attached = tile_hot_cache_open(path, SMALL_SIZE);
+    ok(attached != NULL);
+    ok(attached->header->generations == 2);
+    ok(tile_hot_cache_get(attached, 1, key, &pool, &hit) == 0);
+    ok(hit.content.len == 300 && is_filled(&hit.content, key + 1));
+
+    unlink(path);
+    free(path);
+    h2o_mem_clear_pool(&pool);
+}
+
+static void test_eviction(void)
+{
+    char *path = create_path(), buf[1000];
+    tile_hot_cache_t *cache = tile_hot_cache_open(path, SMALL_SIZE);
+    tile_hot_cache_hit_t hit;
+    h2o_mem_pool_t pool;
+    uint64_t key;
+    int num_hits, i;
+
+    h2o_mem_init_pool(&pool);
+
+    /* the oldest in the window makes the room */
+    for (key = 1; key <= 4; ++key) {
+        fill(buf, 100, key);
+        tile_hot_cache_set(cache, 0, key, buf, 100, 0, "", 0);
+    }
+    for (key = 1, num_hits = 0; key <= 4; ++key)
+        num_hits += tile_hot_cache_get(cache, 0, key, &pool, &hit) == 0;
+    ok(num_hits == 4);
+    fill(buf, 100, 5);
+    tile_hot_cache_set(cache, 0, 5, buf, 100, 0, "", 0);
+    ok(tile_hot_cache_get(cache, 0, 1, &pool, &hit) != 0);
+    for (key = 2, num_hits = 0; key <= 5; ++key)
+        num_hits += tile_hot_cache_get(cache, 0, key, &pool, &hit) == 0 && is_filled(&hit.content, key);
+    ok(num_hits == 4);
+
+    /* wrapped over by the ring, while still indexed */
+    fill(buf, sizeof(buf), 5);
+    for (i = 0; i != 200; ++i)
+        tile_hot_cache_set(cache, 0, 5, buf, sizeof(buf), 0, "", 0);
+    for (key = 2, num_hits = 0; key <= 4; ++key)
+        num_hits += tile_hot_cache_get(cache, 0, key, &pool, &hit) == 0;
+    ok(num_hits == 0);
+    ok(tile_hot_cache_get(cache, 0, 5, &pool, &hit) == 0);
+    ok(hit.content.len == sizeof(buf) && is_filled(&hit.content, 5));
+
+    unlink(path);
+    free(path);
+    h2o_mem_clear_pool(&pool);
+}
+
+struct st_setter_t {
+    pthread_t tid;
+    tile_hot_cache_t *cache;
+    uint64_t first_key;
+};
+
+static void *set_concurrently(void *_setter)
+{
+    struct st_setter_t *setter = _setter;
+    uint64_t i;
+    char buf[2000];
+
+    for (i = 0; i != NUM_SETS_PER_THREAD; ++i) {
+        /* half of them collide among the threads */
+        uint64_t k = i % 2 ? setter->first_key + i : i;
+        size_t len = 100 + k % 1900;
+        fill(buf, len, k);
+        tile_hot_cache_set(setter->cache, 0, k, buf, len, 0, "", 0);
+    }
+    return NULL;
+}
+
+static void test_concurrent_set(void)
+{
+    char *path = create_path();
+    tile_hot_cache_t *cache = tile_hot_cache_open(path, LARGE_SIZE);
+    struct st_setter_t setters[NUM_THREADS];
+    tile_hot_cache_hit_t hit;
+    h2o_mem_pool_t pool;
+    uint64_t i, num_slots = 0, num_hits = 0, num_broken = 0;
+
+    h2o_mem_init_pool(&pool);
+    for (i = 0; i != NUM_THREADS; ++i) {
+        setters[i] = (struct st_setter_t){0, cache, (i + 1) * NUM_SETS_PER_THREAD};
+        pthread_create(&setters[i].tid, NULL, set_concurrently, setters + i);
+    }
+    for (i = 0; i != NUM_THREADS; ++i)
+        pthread_join(setters[i].tid, NULL);
+
+    /* whatever survived the races is the content of its key, as the slots are swapped whole */
+    for (i = 0; i != cache->header->num_slots; ++i) {
+        uint64_t slot = cache->slots[i], off;
+        struct st_tile_hot_cache_entry_t entry;
+        if (slot == 0)
+            continue;
+        ++num_slots;
+        if ((off = offset_of(cache, slot, cache->header->head)) == UINT64_MAX)
+            continue;
+        ring_read(cache, off, &entry, sizeof(entry));
+        if (tile_hot_cache_get(cache, entry.ns, entry.key, &pool, &hit) == 0) {
+            ++num_hits;
+            num_broken += !(hit.content.len == 100 + entry.key % 1900 && is_filled(&hit.content, entry.key));
+        }
+    }
+    ok(num_slots != 0);
+    ok(num_hits != 0);
+    ok(num_broken == 0);
+
+    unlink(path);
+    free(path);
+    h2o_mem_clear_pool(&pool);
+}
+
+void test_lib__handler__tile_hot_cache_c(void)
+{
+    subtest("set-get", test_set_get);
+    subtest("eviction", test_eviction);
+    subtest("concurrent-set", test_concurrent_set);
+}
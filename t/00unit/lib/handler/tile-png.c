@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <zlib.h>
+#include "../../test.h"
+#include "../../../../lib/handler/tile-png.c"
+
+#define RGBA(r, g, b, a)                                                                                                           \
+    ((uint32_t)((r)&0xff) | (uint32_t)((g)&0xff) << 8 | (uint32_t)((b)&0xff) << 16 | (uint32_t)((a)&0xff) << 24)
+
+struct st_decoded_t {
+    uint32_t w, h;
+    unsigned depth;
+    size_t palette_size, trns_len;
+    uint32_t palette[256];
+    uint32_t *pixels;
+};
+
+static uint32_t get_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* a decoder of the paletted, non-interlaced, unfiltered PNGs (as tile_png_encode() emits), checking the CRCs */
+static int decode(const char *png, size_t len, struct st_decoded_t *d)
+{
+    const unsigned char *p = (const unsigned char *)png, *end = p + len;
+    unsigned char *idat = NULL, *raw = NULL;
+    size_t idat_len = 0, row_len, i;
+    uLongf raw_len;
+    uint32_t x, y;
+    int ret = -1;
+
+    memset(d, 0, sizeof(*d));
+    if (len < 8 || memcmp(p, "\x89PNG\r\n\x1a\n", 8) != 0)
+        return -1;
+    for (p += 8; p + 12 <= end;) {
+        uint32_t chunk_len = get_be32(p);
+        const unsigned char *type = p + 4, *data = p + 8;
+        if (data + chunk_len + 4 > end || get_be32(data + chunk_len) != crc32(crc32(0, NULL, 0), type, chunk_len + 4))
+            goto Exit;
+        if (memcmp(type, "IHDR", 4) == 0) {
+            d->w = get_be32(data);
+            d->h = get_be32(data + 4);
+            d->depth = data[8];
+            if (data[9] != 3 || data[10] != 0 || data[11] != 0 || data[12] != 0)
+                goto Exit;
+        } else if (memcmp(type, "PLTE", 4) == 0) {
+            d->palette_size = chunk_len / 3;
+            for (i = 0; i != d->palette_size; ++i)
+                d->palette[i] = RGBA(data[i * 3], data[i * 3 + 1], data[i * 3 + 2], 0xff);
+        } else if (memcmp(type, "tRNS", 4) == 0) {
+            d->trns_len = chunk_len;
+            for (i = 0; i != chunk_len && i != d->palette_size; ++i)
+                d->palette[i] = (d->palette[i] & 0xffffff) | (uint32_t)data[i] << 24;
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            idat = realloc(idat, idat_len + chunk_len);
+            memcpy(idat + idat_len, data, chunk_len);
+            idat_len += chunk_len;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            break;
+        }
+        p = data + chunk_len + 4;
+    }
+
+    row_len = 1 + ((size_t)d->w * d->depth + 7) / 8;
+    raw_len = row_len * d->h;
+    raw = malloc(raw_len + 1);
+    if (uncompress(raw, &raw_len, idat, idat_len) != Z_OK || raw_len != row_len * d->h)
+        goto Exit;
+    d->pixels = malloc(sizeof(uint32_t) * d->w * d->h);
+    for (y = 0; y != d->h; ++y) {
+        const unsigned char *row = raw + y * row_len;
+        if (row[0] != 0)
+            goto Exit;
+        for (x = 0; x != d->w; ++x) {
+            unsigned per_byte = 8 / d->depth;
+            unsigned index = (row[1 + x / per_byte] >> (8 - d->depth * (x % per_byte + 1))) & ((1 << d->depth) - 1);
+            if (index >= d->palette_size)
+                goto Exit;
+            d->pixels[y * d->w + x] = d->palette[index];
+        }
+    }
+    ret = 0;
+
+Exit:
+    free(idat);
+    free(raw);
+    return ret;
+}
+
+/* encodes & decodes back; returns the mean squared error per channel (the colors of the transparent pixels don't count) */
+static double round_trip(tile_png_encoder_t *enc, const uint32_t *pixels, uint32_t w, uint32_t h, size_t stride,
+                         struct st_decoded_t *d)
+{
+    char *png;
+    size_t len;
+    uint32_t x, y;
+    double sum = 0;
+    int shift;
+
+    if (tile_png_encode(enc, pixels, w, h, stride, TILE_PNG_DEFAULT_LEVEL, &png, &len) != 0)
+        return -1;
+    if (decode(png, len, d) != 0 || d->w != w || d->h != h) {
+        free(png);
+        return -1;
+    }
+    free(png);
+    for (y = 0; y != h; ++y) {
+        for (x = 0; x != w; ++x) {
+            uint32_t a = pixels[y * stride + x], b = d->pixels[y * w + x];
+            if ((a >> 24) == 0 && (b >> 24) == 0)
+                continue;
+            for (shift = 0; shift < 32; shift += 8) {
+                double diff = (double)((a >> shift) & 0xff) - (double)((b >> shift) & 0xff);
+                sum += diff * diff;
+            }
+        }
+    }
+    return sum / (4.0 * w * h);
+}
+
+/* a raster of w x h (stride w + 3) pixels of num_colors colors, in runs of 3; the padding is of another color */
+static uint32_t *make_raster(uint32_t w, uint32_t h, unsigned num_colors)
+{
+    uint32_t *pixels = malloc(sizeof(uint32_t) * (w + 3) * h), x, y;
+
+    for (y = 0; y != h; ++y) {
+        for (x = 0; x != w + 3; ++x) {
+            unsigned i = ((y * w + x) / 3) % num_colors;
+            pixels[y * (w + 3) + x] = x < w ? RGBA(i * 37, 255 - i, i * 11, 0xff) : RGBA(1, 2, 3, 4);
+        }
+    }
+    return pixels;
+}
+
+static void test_depths(void)
+{
+    static const struct {
+        unsigned num_colors, depth;
+    } cases[] = {{1, 1}, {2, 1}, {3, 2}, {4, 2}, {10, 4}, {16, 4}, {17, 8}, {200, 8}, {256, 8}};
+    tile_png_encoder_t *enc = tile_png_encoder_create();
+    size_t i;
+
+    for (i = 0; i != sizeof(cases) / sizeof(cases[0]); ++i) {
+        /* the width is not a multiple of 8, for the packing of the last byte */
+        uint32_t *pixels = make_raster(93, 11, cases[i].num_colors);
+        struct st_decoded_t d;
+        tile_png_reset(enc);
+        ok(round_trip(enc, pixels, 93, 11, 96, &d) == 0);
+        ok(d.depth == cases[i].depth);
+        ok(d.palette_size == cases[i].num_colors);
+        ok(d.trns_len == 0);
+        free(d.pixels);
+        free(pixels);
+    }
+    tile_png_encoder_destroy(enc);
+}
+
+static void test_translucent(void)
+{
+    tile_png_encoder_t *enc = tile_png_encoder_create();
+    uint32_t pixels[64 * 4], i;
+    struct st_decoded_t d;
+
+    for (i = 0; i != 64 * 4; ++i) {
+        switch (i % 5) {
+        case 0:
+            pixels[i] = RGBA(10, 20, 30, 0xff);
+            break;
+        case 1:
+            pixels[i] = RGBA(10, 20, 30, 0x80);
+            break;
+        case 2:
+            pixels[i] = RGBA(200, 100, 0, 0x40);
+            break;
+        case 3:
+            /* fully transparent, of any color */
+            pixels[i] = RGBA(i, i * 3, i * 7, 0);
+            break;
+        default:
+            pixels[i] = RGBA(255, 255, 255, 0xff);
+            break;
+        }
+    }
+    ok(round_trip(enc, pixels, 64, 4, 64, &d) == 0);
+    /* the transparent ones are the same color; the translucent ones first */
+    ok(d.palette_size == 5);
+    ok(d.trns_len == 3);
+    for (i = 0; i != d.trns_len; ++i)
+        ok(d.palette[i] >> 24 != 0xff);
+    free(d.pixels);
+    tile_png_encoder_destroy(enc);
+}
+
+static void test_quantize(void)
+{
+    tile_png_encoder_t *enc = tile_png_encoder_create();
+    uint32_t pixels[128 * 128], x, y;
+    struct st_decoded_t d;
+    double mse;
+
+    /* 16384 colors */
+    for (y = 0; y != 128; ++y)
+        for (x = 0; x != 128; ++x)
+            pixels[y * 128 + x] = RGBA(x * 2, y * 2, (x + y) & 0xff, 0xff);
+    mse = round_trip(enc, pixels, 128, 128, 128, &d);
+    ok(mse >= 0 && mse < 32);
+    ok(d.depth == 8);
+    ok(d.palette_size == 256);
+    free(d.pixels);
+    tile_png_encoder_destroy(enc);
+}
+
+static void test_shared_palette(void)
+{
+    tile_png_encoder_t *enc = tile_png_encoder_create();
+    uint32_t a[16 * 16], b[16 * 16], c[16 * 16], i;
+    struct st_decoded_t d;
+
+    for (i = 0; i != 16 * 16; ++i) {
+        a[i] = i < 128 ? RGBA(255, 0, 0, 0xff) : RGBA(0, 0, 255, 0xff);
+        b[i] = i % 2 ? RGBA(0, 255, 0, 0xff) : RGBA(0, 0, 255, 0xff);
+        /* not collected; mapped to the nearest */
+        c[i] = RGBA(250, 5, 0, 0xff);
+    }
+    ok(tile_png_add(enc, a, 16, 16, 16) == 0);
+    ok(tile_png_add(enc, b, 16, 16, 16) == 0);
+
+    ok(round_trip(enc, a, 16, 16, 16, &d) == 0);
+    ok(d.palette_size == 3);
+    free(d.pixels);
+    ok(round_trip(enc, b, 16, 16, 16, &d) == 0);
+    ok(d.palette_size == 3);
+    free(d.pixels);
+    ok(round_trip(enc, c, 16, 16, 16, &d) > 0);
+    ok(d.palette_size == 3);
+    ok(d.pixels[0] == RGBA(255, 0, 0, 0xff));
+    free(d.pixels);
+
+    /* starts over */
+    tile_png_reset(enc);
+    ok(round_trip(enc, c, 16, 16, 16, &d) == 0);
+    ok(d.palette_size == 1 && d.depth == 1);
+    free(d.pixels);
+
+    tile_png_encoder_destroy(enc);
+}
+
+void test_lib__handler__tile_png_c(void)
+{
+    subtest("depths", test_depths);
+    subtest("translucent", test_translucent);
+    subtest("quantize", test_quantize);
+    subtest("shared-palette", test_shared_palette);
+}
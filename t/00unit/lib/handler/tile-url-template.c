@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include "../../test.h"
+#include "../../../../lib/handler/tile-url-template.c"
+
+static void test_compile(void)
+{
+    tile_url_template_t *t;
+    char errbuf[256];
+
+    ok((t = tile_url_template_compile(TILE_URL_TEMPLATE_DEFAULT, errbuf, sizeof(errbuf))) != NULL);
+    ok(t->match == NULL);
+    tile_url_template_destroy(t);
+    ok((t = tile_url_template_compile("{style}/{z}/{x}/{-y}.png", errbuf, sizeof(errbuf))) != NULL);
+    ok(t->match == match_ops);
+    tile_url_template_destroy(t);
+    ok((t = tile_url_template_compile("tiles/{q}.{ext}", errbuf, sizeof(errbuf))) != NULL);
+    tile_url_template_destroy(t);
+
+    ok(tile_url_template_compile("{z}/{x}.png", errbuf, sizeof(errbuf)) == NULL);
+    ok(strstr(errbuf, "needs") != NULL);
+    ok(tile_url_template_compile("{z}/{x}/{y}/{-y}.png", errbuf, sizeof(errbuf)) == NULL);
+    ok(tile_url_template_compile("{q}/{z}.png", errbuf, sizeof(errbuf)) == NULL);
+    ok(tile_url_template_compile("{z}/{x}/{y}/{z}.png", errbuf, sizeof(errbuf)) == NULL);
+    ok(strcmp(errbuf, "{z} appears twice") == 0);
+    ok(tile_url_template_compile("{z}/{x}/{y}.{format}", errbuf, sizeof(errbuf)) == NULL);
+    ok(strncmp(errbuf, "unknown placeholder", 19) == 0);
+    ok(tile_url_template_compile("{style}{z}/{x}/{y}.png", errbuf, sizeof(errbuf)) == NULL);
+}
+
+static void test_match(void)
+{
+    tile_url_template_t *t;
+    tile_url_match_t m;
+    char errbuf[256];
+
+    t = tile_url_template_compile("{style}/{z}/{x}/{y}@{scale}.{ext}", errbuf, sizeof(errbuf));
+    ok(tile_url_template_match(t, "osm/3/4/5@2x.webp", &m));
+    ok(m.zoom == 3 && m.x == 4 && m.y == 5 && m.scale == 2 && m.suffix == WEBP);
+    ok(h2o_memis(m.style, m.style_len, H2O_STRLIT("osm")));
+    ok(tile_url_template_match(t, "osm/3/4/5.png", &m));
+    ok(m.scale == 1 && m.suffix == PNG);
+    ok(!tile_url_template_match(t, "/3/4/5.png", &m));
+    ok(!tile_url_template_match(t, "osm/3/4/5@3x.png", &m));
+    ok(!tile_url_template_match(t, "osm/3/4/5.png.bak", &m));
+    tile_url_template_destroy(t);
+
+    t = tile_url_template_compile("{z}/{x}/{-y}.png", errbuf, sizeof(errbuf));
+    ok(tile_url_template_match(t, "3/1/0.png", &m));
+    ok(m.zoom == 3 && m.x == 1 && m.y == 7);
+    ok(!tile_url_template_match(t, "3/1/8.png", &m));
+    tile_url_template_destroy(t);
+
+    t = tile_url_template_compile("{q}.png", errbuf, sizeof(errbuf));
+    ok(tile_url_template_match(t, "0231.png", &m));
+    ok(m.zoom == 4 && m.x == 3 && m.y == 6);
+    ok(!tile_url_template_match(t, ".png", &m));
+    ok(!tile_url_template_match(t, "0241.png", &m));
+    tile_url_template_destroy(t);
+}
+
+static void test_format(void)
+{
+    static const char *templates[] = {"{z}/{x}/{y}@{scale}.{ext}", "{style}/{z}/{x}/{-y}.{ext}", "q/{q}@{scale}.png"};
+    static const tile_url_match_t tiles[] = {
+        {1, 0, 1, 1, PNG}, {5, 17, 30, 2, JPG}, {18, 232837, 103222, 1, WEBP}, {14, 14551, 6451, 2, PBF}};
+    size_t i, j;
+
+    for (i = 0; i != sizeof(templates) / sizeof(templates[0]); ++i) {
+        char errbuf[256];
+        tile_url_template_t *t = tile_url_template_compile(templates[i], errbuf, sizeof(errbuf));
+        char *buf = alloca(tile_url_template_max_len(t, 3) + 1);
+        for (j = 0; j != sizeof(tiles) / sizeof(tiles[0]); ++j) {
+            tile_url_match_t in = tiles[j], out;
+            size_t len;
+            if (strstr(templates[i], "{scale}") == NULL)
+                in.scale = 1;
+            if (strstr(templates[i], "{ext}") == NULL)
+                in.suffix = PNG;
+            in.style = "osm";
+            in.style_len = 3;
+            len = tile_url_template_format(t, buf, &in);
+            ok(len == strlen(buf) && len <= tile_url_template_max_len(t, 3));
+            ok(tile_url_template_match(t, buf, &out));
+            ok(out.zoom == in.zoom && out.x == in.x && out.y == in.y && out.scale == in.scale && out.suffix == in.suffix);
+        }
+        tile_url_template_destroy(t);
+    }
+}
+
+/* the default scheme is matched by tile_parse_path(), which must agree with the ops compiled from it */
+static int agrees(const tile_url_template_t *t, const char *path)
+{
+    tile_url_match_t by_ops;
+    uint32_t zoom, x, y, scale;
+    enum TILE_SUFFIX suffix;
+    int matched = tile_parse_path(path, 0, &zoom, &x, &y, &scale, &suffix);
+
+    if (match_ops(t, path, &by_ops) != matched)
+        return 0;
+    return !matched ||
+           (by_ops.zoom == zoom && by_ops.x == x && by_ops.y == y && by_ops.scale == scale && by_ops.suffix == suffix);
+}
+
+static void test_agreement(void)
+{
+    static const char *paths[] = {"0/0/0.png", "12/3456/7890@2x.jpg", "1/2/3@1x.pbf", "99/123456789/123456789.webp",
+                                  "123/1/1.png", "1/1234567890/1.png", "1/1/1234567890.png", "1/2/3.png?x", "1/2/3.pngx",
+                                  "1/2/3@3x.png", "1/2/3@2x", "1/2/3@2x.", "1/2/3.", "/1/2/3.png", "1//3.png", "a/2/3.png",
+                                  "1/2/3.PNG", "1/2/3.jp", "1/2/3.webpx", "", "1/2/3@2x.png/", "1/2/3@x.png", "1/2/3@@2x.png"};
+    static const char alphabet[] = "0123456789/.@xpngjwebf?\xff";
+    char errbuf[256], path[32];
+    tile_url_template_t *t = tile_url_template_compile(TILE_URL_TEMPLATE_DEFAULT, errbuf, sizeof(errbuf));
+    const char *seed = "12/345/678@2x.png";
+    size_t i, j, len, num_disagreed = 0;
+
+    /* forced to the generic matcher */
+    t->match = match_ops;
+
+    for (i = 0; i != sizeof(paths) / sizeof(paths[0]); ++i) {
+        if (!agrees(t, paths[i])) {
+            fprintf(stderr, "disagreed on: %s\n", paths[i]);
+            ++num_disagreed;
+        }
+    }
+    /* every single-char substitution, deletion & insertion on a tile path, and every truncation of it */
+    len = strlen(seed);
+    for (i = 0; i <= len; ++i) {
+        for (j = 0; j != sizeof(alphabet) - 1; ++j) {
+            if (i != len) {
+                strcpy(path, seed);
+                path[i] = alphabet[j];
+                num_disagreed += !agrees(t, path);
+            }
+            memcpy(path, seed, i);
+            path[i] = alphabet[j];
+            strcpy(path + i + 1, seed + i);
+            num_disagreed += !agrees(t, path);
+        }
+        memcpy(path, seed, i);
+        strcpy(path + i, seed + i + (i != len));
+        num_disagreed += !agrees(t, path);
+        memcpy(path, seed, i);
+        path[i] = '\0';
+        num_disagreed += !agrees(t, path);
+    }
+    ok(num_disagreed == 0);
+
+    tile_url_template_destroy(t);
+}
+
+void test_lib__handler__tile_url_template_c(void)
+{
+    subtest("compile", test_compile);
+    subtest("match", test_match);
+    subtest("format", test_format);
+    subtest("agreement", test_agreement);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include "./test.h"
+
+/* the tests of the modules of h2o-tile, built w/o the rest of h2o (cf. t-00unit-tile.t of CMakeLists.txt) */
+int main(int argc, char **argv)
+{
+    subtest("lib/handler/tile-coverage.c", test_lib__handler__tile_coverage_c);
+    subtest("lib/handler/tile-url-template.c", test_lib__handler__tile_url_template_c);
+    subtest("tile/polygon.hpp", test_tile__polygon_hpp);
+    subtest("lib/handler/tile-hot-cache.c", test_lib__handler__tile_hot_cache_c);
+    subtest("lib/handler/tile-png.c", test_lib__handler__tile_png_c);
+    subtest("lib/handler/render-queue.c", test_lib__handler__render_queue_c);
+
+    return done_testing();
+}
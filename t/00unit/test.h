@@ -70,4 +70,11 @@ void test_lib__http2__casper(void);
 void test_src__ssl_c(void);
 void test_issues293(void);
 
+void test_lib__handler__tile_coverage_c(void);
+void test_lib__handler__tile_url_template_c(void);
+void test_tile__polygon_hpp(void);
+void test_lib__handler__tile_hot_cache_c(void);
+void test_lib__handler__tile_png_c(void);
+void test_lib__handler__render_queue_c(void);
+
 #endif
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) N. Tabuchi (@n_tabee)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <cmath>
+#include <cstdio>
+#include <set>
+#include <utility>
+#include <unistd.h>
+#include "picotest.h"
+#include "../../../tile/polygon.hpp"
+
+namespace {
+
+std::string write_temp(const char* text)
+{
+    char path[] = "/tmp/h2o-tile-polygon.XXXXXX";
+    int fd = mkstemp(path);
+    if (write(fd, text, strlen(text)) != (ssize_t)strlen(text)) {
+        throw std::runtime_error("failed to write a polygon");
+    }
+    close(fd);
+    return path;
+}
+
+polygon_t load_text(const char* text)
+{
+    std::string path = write_temp(text);
+    try {
+        polygon_t poly = load_polygon(path);
+        unlink(path.c_str());
+        return poly;
+    } catch (...) {
+        unlink(path.c_str());
+        throw;
+    }
+}
+
+// Does the segment intersect the box [l, r] x [t, b]? (Liang-Barsky, closed)
+bool clips(const polygon_t::edge_t& e, double l, double t, double r, double b)
+{
+    double t0 = 0, t1 = 1;
+    const double dx = e.x2 - e.x1, dy = e.y2 - e.y1;
+    const double p[4] = { -dx, dx, -dy, dy }, q[4] = { e.x1 - l, r - e.x1, e.y1 - t, b - e.y1 };
+    for (int i = 0; i < 4; ++i) {
+        if (p[i] == 0) {
+            if (q[i] < 0) {
+                return false;
+            }
+        } else if (p[i] < 0) {
+            t0 = std::max(t0, q[i] / p[i]);
+        } else {
+            t1 = std::min(t1, q[i] / p[i]);
+        }
+    }
+    return t0 <= t1;
+}
+
+// The even-odd rule at the point, by a ray to the right
+bool is_inside(const polygon_t& poly, double x, double y)
+{
+    bool inside = false;
+    for (const auto& e : poly.edges) {
+        if ((e.y1 > y) != (e.y2 > y) && x < e.x1 + (y - e.y1) * (e.x2 - e.x1) / (e.y2 - e.y1)) {
+            inside = !inside;
+        }
+    }
+    return inside;
+}
+
+// Every tile at the zoom, by its center & its edges
+std::set<std::pair<uint32_t, uint32_t> > brute_force(const polygon_t& poly, uint32_t zoom)
+{
+    std::set<std::pair<uint32_t, uint32_t> > tiles;
+    const double size = 1.0 / (1U << zoom);
+    for (uint32_t y = 0; y != (1U << zoom); ++y) {
+        for (uint32_t x = 0; x != (1U << zoom); ++x) {
+            bool covered = is_inside(poly, (x + 0.5) * size, (y + 0.5) * size);
+            for (size_t i = 0; !covered && i != poly.edges.size(); ++i) {
+                covered = clips(poly.edges[i], x * size, y * size, (x + 1) * size, (y + 1) * size);
+            }
+            if (covered) {
+                tiles.insert(std::make_pair(y, x));
+            }
+        }
+    }
+    return tiles;
+}
+
+// Are the spans the same tiles as brute force, sorted & merged?
+bool agrees(const polygon_t& poly, uint32_t zoom)
+{
+    std::vector<tile_span_t> spans;
+    std::set<std::pair<uint32_t, uint32_t> > tiles;
+    polygon_to_spans(poly, zoom, spans);
+    for (size_t i = 0; i != spans.size(); ++i) {
+        if (spans[i].x1 > spans[i].x2 ||
+            (i != 0 && !(spans[i-1].y < spans[i].y || (spans[i-1].y == spans[i].y && spans[i-1].x2 + 1 < spans[i].x1)))) {
+            fprintf(stderr, "not sorted or merged at zoom %u: (%u, %u-%u)\n", zoom, spans[i].y, spans[i].x1, spans[i].x2);
+            return false;
+        }
+        for (uint32_t x = spans[i].x1; x <= spans[i].x2; ++x) {
+            tiles.insert(std::make_pair(spans[i].y, x));
+        }
+    }
+    if (tiles != brute_force(poly, zoom)) {
+        fprintf(stderr, "disagreed at zoom %u\n", zoom);
+        return false;
+    }
+    return true;
+}
+
+void test_wkt()
+{
+    polygon_t poly = load_text("POLYGON ((-30.3 -20.1, 60.7 -25.2, 75.1 40.3, 10.9 65.4, -40.2 30.6, -30.3 -20.1),\n"
+                               "         (0.1 0.2, 20.3 5.4, 15.6 25.7, -5.8 20.9, 0.1 0.2))\n");
+    ok(poly.edges.size() == 9);
+    for (uint32_t zoom = 0; zoom <= 8; ++zoom) {
+        ok(agrees(poly, zoom));
+    }
+    // The hole is not covered
+    std::vector<tile_span_t> spans;
+    uint32_t tx, ty;
+    lonlat_to_tile(8.1, 12.3, 8, tx, ty);
+    polygon_to_spans(poly, 8, spans);
+    bool in_hole_covered = false;
+    for (const auto& s : spans) {
+        in_hole_covered |= s.y == ty && s.x1 <= tx && tx <= s.x2;
+    }
+    ok(!in_hole_covered);
+
+    poly = load_text("MULTIPOLYGON (((100.1 10.2, 140.3 -5.4, 150.5 30.6, 120.7 45.8, 100.1 10.2)),\n"
+                     "              ((-120.1 50.2, -80.3 55.4, -95.5 70.6, -120.1 50.2)))");
+    ok(poly.edges.size() == 7);
+    for (uint32_t zoom = 0; zoom <= 8; ++zoom) {
+        ok(agrees(poly, zoom));
+    }
+}
+
+void test_geojson()
+{
+    // A concave star, in a FeatureCollection (w/ the ring closed explicitly)
+    polygon_t poly = load_text("{\"type\": \"FeatureCollection\", \"features\": [{\"type\": \"Feature\", \"properties\": {},\n"
+                               "  \"geometry\": {\"type\": \"Polygon\", \"coordinates\": [[\n"
+                               "    [139.1, 35.2], [139.9, 35.5], [140.8, 35.1], [140.2, 35.9], [140.9, 36.7],\n"
+                               "    [139.9, 36.3], [139.2, 37.1], [139.5, 36.0], [138.7, 35.6], [139.1, 35.2]]]}}]}");
+    ok(poly.edges.size() == 9);
+    for (uint32_t zoom = 0; zoom <= 12; ++zoom) {
+        ok(agrees(poly, zoom));
+    }
+}
+
+void test_errors()
+{
+    const char* texts[] = { "POLYGON ((0 0, 1 1, 0 0))", "POLYGON ((0 0, 1 1, 2 0)", "{\"coordinates\": [0, 1]}", "no polygon" };
+    for (const char* text : texts) {
+        bool thrown = false;
+        try {
+            load_text(text);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        ok(thrown);
+    }
+}
+
+}
+
+extern "C" void test_tile__polygon_hpp(void)
+{
+    subtest("wkt", test_wkt);
+    subtest("geojson", test_geojson);
+    subtest("errors", test_errors);
+}
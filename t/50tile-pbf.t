@@ -0,0 +1,122 @@
+use strict;
+use warnings;
+use File::Path qw(make_path);
+use File::Temp qw(tempdir);
+use IO::Compress::Gzip qw(gzip $GzipError);
+use Net::EmptyPort qw(check_port);
+use Test::More;
+use t::Util;
+
+plan skip_all => 'curl not found'
+    unless prog_exists('curl');
+plan skip_all => 'h2o-tile not found'
+    unless -x bindir() . "/h2o-tile";
+
+my $tempdir = tempdir(CLEANUP => 1);
+# readable by the server, which runs as nobody if started by root
+chmod 0755, $tempdir;
+
+# a vector tile (of MVT, a layer being tagged 0x1a), and the same gzip'ed as tippecanoe writes them
+my $mvt = "\x1a\x2c\x78\x02\x0a\x05water" . ("\x12\x0f\x18\x03\x22\x0b\x09\x80\x40\x80\x40\x1a\x00\x80\x40\x80\x40" x 32);
+gzip \$mvt => \my $gzipped
+    or die "gzip failed:$GzipError";
+
+# the physical path of a tile (cf. to_physical_path_scaled() of tile/path-mapper.h)
+sub tile_path {
+    my ($zoom, $x, $y) = @_;
+    my @hash = map { (($x >> (4 * $_)) & 0x0f) << 4 | (($y >> (4 * $_)) & 0x0f) } 0..4;
+    return join "/", "$tempdir/tiles", $zoom, reverse(@hash[1..4]), "$hash[0].pbf";
+}
+
+sub write_tile {
+    my ($path, $content) = @_;
+    (my $dir = $path) =~ s{/[^/]*$}{};
+    make_path($dir);
+    open my $fh, ">", $path
+        or die "failed to create file:$path:$!";
+    print $fh $content;
+    close $fh;
+}
+
+write_tile(tile_path(14, 14551, 6451), $gzipped);
+write_tile(tile_path(14, 14552, 6451), $mvt);
+
+my ($port, $tls_port) = empty_ports(2);
+open my $fh, ">", "$tempdir/h2o.conf"
+    or die "failed to create file:$tempdir/h2o.conf:$!";
+print $fh <<"EOT";
+hosts:
+  default:
+    paths:
+      /tiles/:
+        tile.dir: $tempdir/tiles
+        tile.style: $tempdir/style.xml
+listen:
+  host: 127.0.0.1
+  port: $port
+listen:
+  host: 127.0.0.1
+  port: $tls_port
+  ssl:
+    key-file: examples/h2o/server.key
+    certificate-file: examples/h2o/server.crt
+EOT
+close $fh;
+
+my $guard = spawn_server(
+    argv     => [ bindir() . "/h2o-tile", "-c", "$tempdir/h2o.conf" ],
+    is_ready => sub {
+        check_port($port) && check_port($tls_port);
+    },
+);
+
+run_with_curl({ port => $port, tls_port => $tls_port }, sub {
+    my ($proto, $port, $curl_cmd) = @_;
+    $curl_cmd .= " --silent --show-error --dump-header /dev/stderr";
+    my $url = "$proto://127.0.0.1:$port/tiles/14";
+
+    my $strong_etag;
+    subtest "gzip'ed, accepting gzip" => sub {
+        my ($headers, $body) = run_prog("$curl_cmd -H 'Accept-Encoding: gzip' $url/14551/6451.pbf");
+        like $headers, qr{^HTTP/[0-9.]+ 200}s, "status";
+        like $headers, qr{^content-type:\s*application/x-protobuf\r$}mi, "content-type";
+        like $headers, qr{^content-encoding:\s*gzip\r$}mi, "content-encoding";
+        like $headers, qr{^vary:\s*accept-encoding\r$}mi, "vary";
+        like $headers, qr{^etag:\s*"[^"]*"\r$}mi, "strong etag";
+        ($strong_etag) = $headers =~ /^etag:\s*("[^"]*")\r$/mi;
+        is $body, $gzipped, "sent as it is";
+    };
+
+    subtest "gzip'ed, not accepting gzip" => sub {
+        my ($headers, $body) = run_prog("$curl_cmd $url/14551/6451.pbf");
+        like $headers, qr{^HTTP/[0-9.]+ 200}s, "status";
+        like $headers, qr{^content-type:\s*application/x-protobuf\r$}mi, "content-type";
+        unlike $headers, qr{^content-encoding:}mi, "no content-encoding";
+        like $headers, qr{^vary:\s*accept-encoding\r$}mi, "vary";
+        like $headers, qr{^content-length:\s*@{[length $mvt]}\r$}mi, "content-length";
+        my ($etag) = $headers =~ /^etag:\s*(\S+)\r$/mi;
+        is $etag, "W/$strong_etag", "weak etag";
+        is $body, $mvt, "inflated";
+        ($headers) = run_prog("$curl_cmd -H 'If-None-Match: $etag' $url/14551/6451.pbf");
+        like $headers, qr{^HTTP/[0-9.]+ 304}s, "not modified by the weak etag";
+        ($headers) = run_prog("$curl_cmd -H 'If-None-Match: $strong_etag' $url/14551/6451.pbf");
+        like $headers, qr{^HTTP/[0-9.]+ 200}s, "modified by the strong etag";
+    };
+
+    subtest "plain" => sub {
+        for my $accept_encoding ("", "-H 'Accept-Encoding: gzip'") {
+            my ($headers, $body) = run_prog("$curl_cmd $accept_encoding $url/14552/6451.pbf");
+            like $headers, qr{^HTTP/[0-9.]+ 200}s, "status";
+            like $headers, qr{^content-type:\s*application/x-protobuf\r$}mi, "content-type";
+            unlike $headers, qr{^content-encoding:}mi, "no content-encoding";
+            is $body, $mvt, "sent as it is";
+        }
+    };
+
+    subtest "missing" => sub {
+        my ($headers) = run_prog("$curl_cmd $url/14553/6451.pbf");
+        like $headers, qr{^HTTP/[0-9.]+ 404}s, "never rendered";
+    };
+});
+
+done_testing;
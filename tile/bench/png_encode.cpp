@@ -0,0 +1,192 @@
+/*
+ * Microbenchmark of the png encoders of the tiles: Mapnik's png256 (as h2o-tile used to encode with) vs. the builtin
+ * one (tile-png.h), a palette per tile, and a palette shared by the tiles of a metatile (as yield-tiles does).
+ *
+ *   $ make bench-png-encode
+ *   $ find /opt/osm/tiles/15 -name '*.png' | head -256 | xargs ./bench-png-encode [-n iterations] [-l level] [-m tiles]
+ *
+ * The tiles given are decoded once, then encoded -n times (default: 10) at the zlib level -l (default: 6) by each;
+ * -m tiles (default: 64) in the order given share a palette. Representative are the tiles rendered by the style to
+ * serve (e.g. openstreetmap-carto), of the zooms busy with renders. Reported are the time & the bytes per tile, and
+ * the mean squared error (per channel) of the tiles decoded back against the originals.
+ */
+#include <mapnik/version.hpp>
+#if MAPNIK_MAJOR_VERSION >= 3
+ #include <mapnik/image.hpp>
+#else
+ #include <mapnik/image_data.hpp>
+#endif
+#include <mapnik/image_reader.hpp>
+#include <mapnik/image_util.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "tile/tile-png.h"
+
+#if MAPNIK_MAJOR_VERSION >= 3
+typedef mapnik::image_rgba8 raster_t;
+#else
+typedef mapnik::image_data_32 raster_t;
+#endif
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double squared_error_of(const raster_t& src, const std::string& png)
+{
+    std::unique_ptr<mapnik::image_reader> reader(mapnik::get_image_reader(png.data(), png.size()));
+    raster_t decoded(src.width(), src.height());
+    double sum = 0;
+
+    reader->read(0, 0, decoded);
+    for (unsigned y = 0; y < src.height(); ++y) {
+        for (unsigned x = 0; x < src.width(); ++x) {
+            uint32_t a = src(x, y), b = decoded(x, y);
+            /* the colors of the transparent pixels don't count */
+            if ((a >> 24) == 0 && (b >> 24) == 0) {
+                continue;
+            }
+            for (int shift = 0; shift < 32; shift += 8) {
+                double d = (double)((a >> shift) & 0xff) - (double)((b >> shift) & 0xff);
+                sum += d * d;
+            }
+        }
+    }
+    return sum / (4.0 * src.width() * src.height());
+}
+
+static void report(const char* name, double elapsed, size_t bytes, double error, size_t num_tiles, unsigned iterations)
+{
+    printf("%-40s %9.1f us/tile %9zu bytes/tile %8.2f mse\n", name, elapsed * 1e6 / (num_tiles * iterations),
+           bytes / num_tiles, error / num_tiles);
+}
+
+static std::string encode_builtin(tile_png_encoder_t* enc, const raster_t& tile, int level)
+{
+    char* buf;
+    size_t len;
+    if (tile_png_encode(enc, &tile(0, 0), tile.width(), tile.height(), tile.width(), level, &buf, &len) != 0) {
+        throw std::bad_alloc();
+    }
+    std::string png(buf, len);
+    free(buf);
+    return png;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned iterations = 10, group = 64;
+    int level = TILE_PNG_DEFAULT_LEVEL, ch;
+
+    while ((ch = getopt(argc, argv, "n:l:m:")) != -1) {
+        switch (ch) {
+        case 'n':
+            iterations = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            level = atoi(optarg);
+            break;
+        case 'm':
+            group = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-l level] [-m tiles] tile.png ...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc || iterations == 0 || group == 0 || level < 1 || level > 9) {
+        fprintf(stderr, "usage: %s [-n iterations] [-l level] [-m tiles] tile.png ...\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<raster_t> > tiles;
+    for (int i = optind; i < argc; ++i) {
+        std::unique_ptr<mapnik::image_reader> reader(mapnik::get_image_reader(argv[i], "png"));
+        if (!reader) {
+            fprintf(stderr, "%s: not a png\n", argv[i]);
+            return 1;
+        }
+        tiles.emplace_back(new raster_t(reader->width(), reader->height()));
+        reader->read(0, 0, *tiles.back());
+    }
+    std::vector<std::string> pngs(tiles.size());
+    size_t bytes;
+    double start, error;
+    char format[64];
+
+    /* Mapnik */
+#if MAPNIK_MAJOR_VERSION >= 3
+    snprintf(format, sizeof(format), "png256:e=miniz:z=%d", level);
+#else
+    snprintf(format, sizeof(format), "png256:z=%d", level);
+#endif
+    start = now();
+    for (unsigned n = 0; n != iterations; ++n) {
+        for (size_t i = 0; i != tiles.size(); ++i) {
+            pngs[i] = mapnik::save_to_string(*tiles[i], format);
+        }
+    }
+    double elapsed = now() - start;
+    bytes = 0, error = 0;
+    for (size_t i = 0; i != tiles.size(); ++i) {
+        bytes += pngs[i].size();
+        error += squared_error_of(*tiles[i], pngs[i]);
+    }
+    report(format, elapsed, bytes, error, tiles.size(), iterations);
+
+    std::unique_ptr<tile_png_encoder_t, void (*)(tile_png_encoder_t*)> enc(tile_png_encoder_create(), tile_png_encoder_destroy);
+
+    /* builtin, a palette per tile */
+    start = now();
+    for (unsigned n = 0; n != iterations; ++n) {
+        for (size_t i = 0; i != tiles.size(); ++i) {
+            tile_png_reset(enc.get());
+            pngs[i] = encode_builtin(enc.get(), *tiles[i], level);
+        }
+    }
+    elapsed = now() - start;
+    bytes = 0, error = 0;
+    for (size_t i = 0; i != tiles.size(); ++i) {
+        bytes += pngs[i].size();
+        error += squared_error_of(*tiles[i], pngs[i]);
+    }
+    report("tile-png, a palette per tile", elapsed, bytes, error, tiles.size(), iterations);
+
+    /* builtin, a palette per group of tiles */
+    start = now();
+    for (unsigned n = 0; n != iterations; ++n) {
+        for (size_t first = 0; first < tiles.size(); first += group) {
+            size_t last = first + group < tiles.size() ? first + group : tiles.size();
+            tile_png_reset(enc.get());
+            for (size_t i = first; i != last; ++i) {
+                const raster_t& tile = *tiles[i];
+                if (tile_png_add(enc.get(), &tile(0, 0), tile.width(), tile.height(), tile.width()) != 0) {
+                    throw std::bad_alloc();
+                }
+            }
+            for (size_t i = first; i != last; ++i) {
+                pngs[i] = encode_builtin(enc.get(), *tiles[i], level);
+            }
+        }
+    }
+    elapsed = now() - start;
+    bytes = 0, error = 0;
+    for (size_t i = 0; i != tiles.size(); ++i) {
+        bytes += pngs[i].size();
+        error += squared_error_of(*tiles[i], pngs[i]);
+    }
+    snprintf(format, sizeof(format), "tile-png, a palette per %u tiles", group);
+    report(format, elapsed, bytes, error, tiles.size(), iterations);
+
+    return 0;
+}
@@ -0,0 +1,395 @@
+/*
+ * Load generator replaying map-viewer-like tile traffic against a tile server, e.g. h2o-tile built with the stub
+ * renderer (-DWITH_MAPNIK=OFF), which needs neither Mapnik nor a database:
+ *
+ *   $ cmake -DWITH_MAPNIK=OFF . && make h2o-tile bench-tile-load
+ *   $ H2O_TILE_STUB_LATENCY_MS=20 H2O_TILE_STUB_CPU_MS=5 ./h2o-tile -c examples/h2o/tiles-stub.conf &
+ *   $ ./bench-tile-load -c 64 -d 30 http://127.0.0.1:8080/
+ *
+ * Each connection plays a viewer: it picks a place (hot ones by a Zipf law over -p places scattered over the world),
+ * a zoom, and fetches the viewport of W x H tiles around it, then pans or zooms in/out a few times before moving on.
+ * The same -s seed replays the same sequence of tiles, so a cold run measures the misses (renders & their coalescing,
+ * the render queue), and a warm run of it the hits.
+ * Reported are the throughput, the latency percentiles and the status codes.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define MAX_STATUS 600
+
+static struct {
+    const char *host, *port, *prefix, *suffix;
+    unsigned connections, duration, places, viewport_w, viewport_h, steps, min_zoom, max_zoom;
+    double zipf_s;
+    uint64_t seed;
+} opts = {NULL, NULL, NULL, ".png", 16, 10, 1000, 4, 3, 8, 3, 18, 1.0, 1};
+
+static double *zipf_cdf;
+static volatile int stopping;
+
+struct st_worker_t {
+    pthread_t tid;
+    uint64_t rng;
+    int fd;
+    char buf[65536];
+    size_t buf_len;
+    /* results */
+    uint64_t num_requests, num_bytes, num_errors, status[MAX_STATUS];
+    uint32_t *latencies_us;
+    size_t num_latencies, cap_latencies;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64* */
+static uint64_t next_rand(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+static double next_unit(uint64_t *s)
+{
+    return (next_rand(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static unsigned pick_place(uint64_t *s)
+{
+    double u = next_unit(s);
+    unsigned lo = 0, hi = opts.places - 1;
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* the place #i at (0..1, 0..1) of the world, in the same spot for the same seed */
+static void place_of(unsigned i, double *px, double *py)
+{
+    uint64_t s = (opts.seed ^ (i + 1) * 0x9e3779b97f4a7c15ULL) | 1;
+    *px = next_unit(&s);
+    /* the places crowd the mid latitudes, as people do */
+    *py = 0.3 + 0.4 * next_unit(&s);
+}
+
+static int connect_server(void)
+{
+    struct addrinfo hints = {}, *res, *ai;
+    int fd = -1, on = 1;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(opts.host, opts.port, &hints, &res) != 0)
+        return -1;
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd != -1)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+/* reads a response to the end of its body; returns the status, or -1 on errors */
+static int read_response(struct st_worker_t *w, uint64_t *num_bytes)
+{
+    char *eoh;
+    size_t header_len, content_length = 0, body_read;
+    int status;
+
+    while (1) {
+        ssize_t r;
+        w->buf[w->buf_len] = '\0';
+        if ((eoh = strstr(w->buf, "\r\n\r\n")) != NULL)
+            break;
+        if (w->buf_len == sizeof(w->buf) - 1)
+            return -1;
+        if ((r = read(w->fd, w->buf + w->buf_len, sizeof(w->buf) - 1 - w->buf_len)) <= 0)
+            return -1;
+        w->buf_len += r;
+    }
+    header_len = eoh + 4 - w->buf;
+    if (sscanf(w->buf, "HTTP/1.%*d %d", &status) != 1)
+        return -1;
+    do {
+        const char *p = w->buf;
+        while ((p = strchr(p, '\n')) != NULL && p < eoh) {
+            ++p;
+            if (strncasecmp(p, "content-length:", 15) == 0) {
+                content_length = strtoul(p + 15, NULL, 10);
+                break;
+            }
+        }
+    } while (0);
+
+    /* skip the body */
+    body_read = w->buf_len - header_len;
+    if (body_read >= content_length) {
+        memmove(w->buf, w->buf + header_len + content_length, body_read - content_length);
+        w->buf_len = body_read - content_length;
+    } else {
+        w->buf_len = 0;
+        while (body_read < content_length) {
+            size_t want = content_length - body_read < sizeof(w->buf) ? content_length - body_read : sizeof(w->buf);
+            ssize_t r = read(w->fd, w->buf, want);
+            if (r <= 0)
+                return -1;
+            body_read += r;
+        }
+    }
+    *num_bytes += header_len + content_length;
+    return status;
+}
+
+static void record_latency(struct st_worker_t *w, double elapsed)
+{
+    if (w->num_latencies == w->cap_latencies) {
+        w->cap_latencies = w->cap_latencies == 0 ? 65536 : w->cap_latencies * 2;
+        w->latencies_us = realloc(w->latencies_us, w->cap_latencies * sizeof(*w->latencies_us));
+    }
+    w->latencies_us[w->num_latencies++] = (uint32_t)(elapsed * 1e6);
+}
+
+static int fetch(struct st_worker_t *w, unsigned z, unsigned x, unsigned y)
+{
+    char req[512];
+    int req_len, status;
+    double start;
+
+    if (w->fd == -1 && (w->fd = connect_server()) == -1)
+        return -1;
+    req_len = snprintf(req, sizeof(req), "GET %s%u/%u/%u%s HTTP/1.1\r\nHost: %s\r\nAccept-Encoding: gzip\r\n\r\n", opts.prefix, z, x,
+                       y, opts.suffix, opts.host);
+    start = now();
+    if (write(w->fd, req, req_len) != req_len || (status = read_response(w, &w->num_bytes)) == -1) {
+        ++w->num_errors;
+        close(w->fd);
+        w->fd = -1;
+        w->buf_len = 0;
+        return -1;
+    }
+    record_latency(w, now() - start);
+    ++w->num_requests;
+    if (status < MAX_STATUS)
+        ++w->status[status];
+    return 0;
+}
+
+static void *run_worker(void *_w)
+{
+    struct st_worker_t *w = _w;
+
+    while (!stopping) {
+        double px, py;
+        unsigned step, z;
+
+        place_of(pick_place(&w->rng), &px, &py);
+        z = opts.min_zoom + (unsigned)(next_unit(&w->rng) * (opts.max_zoom - opts.min_zoom + 1));
+        for (step = 0; step != opts.steps && !stopping; ++step) {
+            unsigned n = 1u << z, cx = (unsigned)(px * n), cy = (unsigned)(py * n), i, j;
+            for (j = 0; j != opts.viewport_h; ++j) {
+                for (i = 0; i != opts.viewport_w; ++i) {
+                    unsigned x = (cx + n - opts.viewport_w / 2 + i) % n, y = cy + j - opts.viewport_h / 2;
+                    if (y >= n) /* off the map */
+                        continue;
+                    if (fetch(w, z, x, y) != 0 && w->fd == -1)
+                        usleep(10000);
+                }
+            }
+            /* pan by half a viewport, or zoom in/out */
+            switch (next_rand(&w->rng) % 4) {
+            case 0:
+                if (z < opts.max_zoom)
+                    ++z;
+                break;
+            case 1:
+                if (z > opts.min_zoom)
+                    --z;
+                break;
+            default: {
+                double d = (double)opts.viewport_w / 2 / n;
+                px += next_unit(&w->rng) < 0.5 ? -d : d;
+                py += next_unit(&w->rng) < 0.5 ? -d : d;
+                px -= floor(px);
+                if (py < 0)
+                    py = 0;
+                if (py >= 1)
+                    py = 0.999999;
+            } break;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int parse_url(const char *url)
+{
+    static char host[256], port[16], prefix[1024];
+    const char *p, *slash, *colon;
+
+    if (strncmp(url, "http://", 7) != 0)
+        return -1;
+    p = url + 7;
+    if ((slash = strchr(p, '/')) == NULL)
+        slash = p + strlen(p);
+    colon = memchr(p, ':', slash - p);
+    snprintf(host, sizeof(host), "%.*s", (int)((colon != NULL ? colon : slash) - p), p);
+    if (colon != NULL)
+        snprintf(port, sizeof(port), "%.*s", (int)(slash - colon - 1), colon + 1);
+    else
+        strcpy(port, "80");
+    p = *slash != '\0' ? slash : "/";
+    snprintf(prefix, sizeof(prefix), "%s%s", p, p[strlen(p) - 1] == '/' ? "" : "/");
+    opts.host = host;
+    opts.port = port;
+    opts.prefix = prefix;
+    return 0;
+}
+
+static void usage(const char *cmd)
+{
+    fprintf(stderr,
+            "usage: %s [options] http://host:port/prefix/\n"
+            "  -c connections   concurrent viewers (default: %u)\n"
+            "  -d seconds       duration (default: %u)\n"
+            "  -p places        number of places to view (default: %u)\n"
+            "  -a exponent      of the Zipf law over the places (default: %.1f)\n"
+            "  -z min-max       zoom range (default: %u-%u)\n"
+            "  -v WxH           viewport in tiles (default: %ux%u)\n"
+            "  -n steps         pans/zooms per place (default: %u)\n"
+            "  -x suffix        of the tiles (default: %s)\n"
+            "  -s seed          (default: %llu)\n",
+            cmd, opts.connections, opts.duration, opts.places, opts.zipf_s, opts.min_zoom, opts.max_zoom, opts.viewport_w,
+            opts.viewport_h, opts.steps, opts.suffix, (unsigned long long)opts.seed);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct st_worker_t *workers;
+    uint64_t num_requests = 0, num_bytes = 0, num_errors = 0, status[MAX_STATUS] = {};
+    uint32_t *latencies;
+    size_t num_latencies = 0, i, j;
+    double norm = 0, start, elapsed;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "c:d:p:a:z:v:n:x:s:h")) != -1) {
+        switch (ch) {
+        case 'c':
+            opts.connections = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            opts.duration = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            opts.places = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            opts.zipf_s = strtod(optarg, NULL);
+            break;
+        case 'z':
+            if (sscanf(optarg, "%u-%u", &opts.min_zoom, &opts.max_zoom) != 2 || opts.min_zoom > opts.max_zoom || opts.max_zoom > 30)
+                usage(argv[0]);
+            break;
+        case 'v':
+            if (sscanf(optarg, "%ux%u", &opts.viewport_w, &opts.viewport_h) != 2)
+                usage(argv[0]);
+            break;
+        case 'n':
+            opts.steps = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'x':
+            opts.suffix = optarg;
+            break;
+        case 's':
+            opts.seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc || parse_url(argv[optind]) != 0 || opts.connections == 0 || opts.places == 0)
+        usage(argv[0]);
+
+    zipf_cdf = malloc(sizeof(*zipf_cdf) * opts.places);
+    for (i = 0; i != opts.places; ++i)
+        norm += 1 / pow(i + 1, opts.zipf_s);
+    for (i = 0; i != opts.places; ++i)
+        zipf_cdf[i] = (i != 0 ? zipf_cdf[i - 1] : 0) + 1 / pow(i + 1, opts.zipf_s) / norm;
+
+    workers = calloc(opts.connections, sizeof(*workers));
+    start = now();
+    for (i = 0; i != opts.connections; ++i) {
+        workers[i].rng = (opts.seed + i + 1) * 0x9e3779b97f4a7c15ULL | 1;
+        workers[i].fd = -1;
+        pthread_create(&workers[i].tid, NULL, run_worker, workers + i);
+    }
+    sleep(opts.duration);
+    stopping = 1;
+    for (i = 0; i != opts.connections; ++i) {
+        pthread_join(workers[i].tid, NULL);
+        if (workers[i].fd != -1)
+            close(workers[i].fd);
+        num_requests += workers[i].num_requests;
+        num_bytes += workers[i].num_bytes;
+        num_errors += workers[i].num_errors;
+        num_latencies += workers[i].num_latencies;
+        for (j = 0; j != MAX_STATUS; ++j)
+            status[j] += workers[i].status[j];
+    }
+    elapsed = now() - start;
+
+    latencies = malloc(sizeof(*latencies) * (num_latencies + 1));
+    for (i = 0, num_latencies = 0; i != opts.connections; ++i) {
+        memcpy(latencies + num_latencies, workers[i].latencies_us, sizeof(*latencies) * workers[i].num_latencies);
+        num_latencies += workers[i].num_latencies;
+    }
+    qsort(latencies, num_latencies, sizeof(*latencies), cmp_u32);
+
+    printf("%llu requests in %.2fs, %.2f MB read, %llu errors\n", (unsigned long long)num_requests, elapsed, num_bytes / 1e6,
+           (unsigned long long)num_errors);
+    printf("Requests/sec: %.2f\n", num_requests / elapsed);
+    if (num_latencies != 0)
+        printf("Latency (ms): p50 %.2f, p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n", latencies[num_latencies / 2] / 1e3,
+               latencies[num_latencies * 9 / 10] / 1e3, latencies[num_latencies * 99 / 100] / 1e3,
+               latencies[num_latencies * 999 / 1000] / 1e3, latencies[num_latencies - 1] / 1e3);
+    for (j = 0; j != MAX_STATUS; ++j)
+        if (status[j] != 0)
+            printf("Status %zu: %llu\n", j, (unsigned long long)status[j]);
+
+    return num_errors != 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Microbenchmark of the tile URL matchers: the hand-written tile_parse_path() vs. the compiled templates.
+ *
+ *   $ make bench-url-template && ./bench-url-template [iterations]
+ *
+ * The default template must stay as fast as tile_parse_path() (it is dispatched to it), and the others show the cost
+ * of the generic op table.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "tile/tile-rewrite-path.h"
+#include "tile/tile-url-template.h"
+
+#define NUM_PATHS 1024
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double elapsed, unsigned long iterations, unsigned long matched)
+{
+    printf("%-32s %8.2f ns/match (%lu matched)\n", name, elapsed * 1e9 / iterations, matched);
+}
+
+static void bench_template(const char *tmpl, char paths[][64], unsigned long iterations)
+{
+    tile_url_template_t *t;
+    tile_url_match_t m;
+    char errbuf[256];
+    unsigned long i, matched = 0;
+    double start;
+
+    if ((t = tile_url_template_compile(tmpl, errbuf, sizeof(errbuf))) == NULL) {
+        fprintf(stderr, "%s: %s\n", tmpl, errbuf);
+        exit(1);
+    }
+    /* the paths in the scheme of the template */
+    for (i = 0; i != NUM_PATHS; ++i) {
+        m = (tile_url_match_t){18, 232837 + i * 7, 103231 + i * 3, 1 + (i & 1), PNG, "osm", 3};
+        tile_url_template_format(t, paths[i], &m);
+    }
+    start = now();
+    for (i = 0; i != iterations; ++i)
+        matched += tile_url_template_match(t, paths[i % NUM_PATHS], &m);
+    report(tmpl, now() - start, iterations, matched);
+    tile_url_template_destroy(t);
+}
+
+int main(int argc, char **argv)
+{
+    static char paths[NUM_PATHS][64];
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000000, i, matched = 0;
+    uint32_t z, x, y, scale;
+    enum TILE_SUFFIX suffix;
+    double start;
+
+    for (i = 0; i != NUM_PATHS; ++i)
+        sprintf(paths[i], "18/%lu/%lu%s.png", 232837 + i * 7, 103231 + i * 3, (i & 1) != 0 ? "@2x" : "");
+    start = now();
+    for (i = 0; i != iterations; ++i)
+        matched += tile_parse_path(paths[i % NUM_PATHS], 0, &z, &x, &y, &scale, &suffix);
+    report("tile_parse_path()", now() - start, iterations, matched);
+
+    bench_template(TILE_URL_TEMPLATE_DEFAULT, paths, iterations);
+    bench_template("{z}/{x}/{y}.png", paths, iterations);
+    bench_template("{z}/{x}/{-y}@{scale}.{ext}", paths, iterations);
+    bench_template("{style}/{z}/{x}/{y}@{scale}.{ext}", paths, iterations);
+    bench_template("q/{q}.{ext}", paths, iterations);
+
+    return 0;
+}
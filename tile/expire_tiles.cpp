@@ -5,6 +5,7 @@
 #include <dirent.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <utime.h>
 #include <sys/stat.h>
 
 #include <cstdio>
@@ -32,6 +33,7 @@
 #include <boost/atomic.hpp>
 #include <boost/timer/timer.hpp>
 #include "proj.hpp"
+#include "polygon.hpp"
 #include "path-mapper.h"
 
 #include "git-revision.h"
@@ -77,15 +79,22 @@ boost::atomic<bool> done (false);
 boost::atomic<uint64_t> removed(0);     // # of tiles removed.
 boost::atomic<uint64_t> skipped(0);     // # of tiles that are non-existent or failed to unlink(), thus skipped.
 bool echo_back = false;                 // If true, print each processed line to stdout, invariant during the execution
+bool soft = false;                      // If true, mark tiles stale (cf. TILE_STALE_MTIME) instead of unlinking, invariant during the execution
 boost::timer::cpu_timer* timer;
 
+// Touches the tile back to TILE_STALE_MTIME, s.t. h2o-tile re-renders it while still serving the stale copy as a fallback
+static inline int expire_softly(const char* tile_path) {
+    struct utimbuf stale = { TILE_STALE_MTIME, TILE_STALE_MTIME };
+    return utime(tile_path, &stale);
+}
+
 void worker(const boost::filesystem::path& base_path) {
 
     const std::string& base_as_string = base_path.string();
     size_t base_len  = base_as_string.length();
 
     // tile_path holds the full path base_path/nnn/.../nnn.png to remove
-    char* tile_path = (char*)alloca(base_len + 28);
+    char* tile_path = (char*)alloca(base_len + TILE_PHYSPATH_BUFLEN);
     strncpy(tile_path, base_as_string.c_str(), base_len);
 
     // tp_head points to the end of base_path in tile_path
@@ -102,7 +111,7 @@ void worker(const boost::filesystem::path& base_path) {
     if (!EXISTS( (boost::filesystem::path(tile_path)) )) { \
         ++skipped; \
     } else { \
-        if ( likely(unlink(tile_path) == 0) ) { \
+        if ( likely((soft ? expire_softly(tile_path) : unlink(tile_path)) == 0) ) { \
             ++removed; \
             if (echo_back) { \
                 printf("%u/%u/%u\n", z, x, y); \
@@ -131,7 +140,7 @@ void dry_worker(const boost::filesystem::path& base_path) {
     size_t base_len  = base_as_string.length();
 
     // tile_path holds the full path base_path/nnn/.../nnn.png to remove
-    char* tile_path = (char*)alloca(base_len + 28);
+    char* tile_path = (char*)alloca(base_len + TILE_PHYSPATH_BUFLEN);
     strncpy(tile_path, base_as_string.c_str(), base_len);
 
     // tp_head points to the end of base_path in tile_path
@@ -165,9 +174,43 @@ void dry_worker(const boost::filesystem::path& base_path) {
     }
 }
 
+namespace argv {
+    // argv parser for --zoom=z1-z2
+    namespace zoom {
+        struct pair_t {
+        public:
+            uint32_t z1, z2;
+        };
+
+        void validate(boost::any& v,
+                      const std::vector<std::string>& values,
+                      pair_t*, int)
+        {
+            namespace po = boost::program_options;
+
+            static boost::regex r("(\\d+)(-|,)(\\d+)");
+
+            // Make sure no previous assignment to 'v' was made.
+            po::validators::check_first_occurrence(v);
+            // Extract the first string from 'values'. If there is more than
+            // one string, it's an error, and exception will be thrown.
+            const std::string& s = po::validators::get_single_string(values);
+
+            // Do regex match and convert the interesting part to 
+            // int.
+            boost::smatch match;
+            if (regex_match(s, match, r)) {
+                v = boost::any(pair_t{ boost::lexical_cast<uint32_t>(match[1]), boost::lexical_cast<uint32_t>(match[3]) });
+            } else {
+                throw po::validation_error(po::validation_error::invalid_option_value);
+            }       
+        }
+    }
+}
+
 /*
-expire-tiles -p base-path [-f expire-list-file] [-t num-threads]
-removes tiles listed in expire-list-file under base-path.
+expire-tiles -p base-path [-f expire-list-file | -g polygon-file [-z z1-z2]] [-t num-threads]
+removes tiles listed in expire-list-file (or, covering the polygon) under base-path.
 Options:
     -p,--prefix base-path: a valid directory name, into which tiles are rendered
     -f,--file expire-list-file: the list of tiles to expire: 
@@ -180,10 +223,17 @@ Options:
                                     15/7540/11128
                                     ...
                                 When this option is omitted, or '-' is given, stdin is used.
+    -g,--polygon polygon-file: a polygon (or multipolygon) in WKT or GeoJSON, in lon/lat
+        + expires the tiles covering the polygon in the zoom levels of -z, instead of those listed
+    -z,--zoom z1-z2: zoom levels in [0, ..., 20] to expire with -g
+        + defaults to 0-20
     -t,--threads n: the number of threads to render
         + defaults to boost::thread::hardware_concurrency()
     -d,--dry-run
         + only echoes the tile paths to be expired, without actual removing
+    -s,--soft
+        + marks tiles stale rather than removing them: h2o-tile re-renders stale tiles on request,
+          and serves the stale copy if the render takes longer than "tile.render-timeout"
     -e,--echo-back
         + prints each successfully processed line to stdout, this is useful when pipelining another process such as re-rendering
     -v,--version
@@ -203,14 +253,16 @@ int main(int ac, char** av) {
     try { 
         std::string base;
         std::string list_file;
+        std::string polygon_file;
+        argv::zoom::pair_t zoom_levels;
         unsigned int nthreads;
         bool dry_run = false;
         /** Define and parse the program options 
         */ 
         namespace po = boost::program_options; 
         po::options_description desc(
-            "expire-tiles -p base-path [-f expire-list-file] [-t num-threads]\n"
-            "removes tiles listed in expire-list-file under base-path.\n\n"
+            "expire-tiles -p base-path [-f expire-list-file | -g polygon-file [-z z1-z2]] [-t num-threads]\n"
+            "removes tiles listed in expire-list-file (or, covering the polygon) under base-path.\n\n"
             "Options"
         ); 
         desc.add_options() 
@@ -218,7 +270,12 @@ int main(int ac, char** av) {
             ("version,v", "Prints version info.")
             ("prefix,p", po::value<std::string>(&base)->value_name("base-path")->required(), "Specifies the base directory into which tile are rendered") 
             ("file,f", po::value<std::string>(&list_file)->value_name("expire-list-file")->default_value("(stdin)"), "Specifies the list of tiles to expire") 
+            ("polygon,g", po::value<std::string>(&polygon_file)->value_name("polygon-file"), "Specifies a polygon in WKT or GeoJSON (in lon/lat) to expire the tiles covering it, instead of the list") 
+            ("zoom,z", 
+                po::value<argv::zoom::pair_t>(&zoom_levels)->value_name("z1-z2")->default_value(argv::zoom::pair_t{0, 20}, "0-20"), 
+                "Specifies zoom levels to expire with --polygon, between 0-20") 
             ("echo-back,e", "prints each successfully processed line to stdout, this is useful when pipelining another process such as re-rendering")
+            ("soft,s", "marks tiles stale (by touching them back to 2000-01-01) rather than removing them")
             ("threads,t", 
                 po::value<unsigned int>(&nthreads)->value_name("n")->default_value(boost::thread::hardware_concurrency()), 
                 "Specifies the number of threas to render\n"
@@ -260,6 +317,11 @@ int main(int ac, char** av) {
                 echo_back = true;
             }
 
+            // --soft
+            if ( vm.count("soft") ) {
+                soft = true;
+            }
+
             po::notify(vm); // throws on error, so do after help in case 
                             // there are any problems 
             if ( !vm.count("expire-list-file") || list_file == "(stdin)") {
@@ -283,9 +345,27 @@ int main(int ac, char** av) {
             return -1;
         }
 
+        // Ensure zoom levels are in the valid range
+        uint32_t z1 = std::min(zoom_levels.z1, zoom_levels.z2), z2 = std::max(zoom_levels.z1, zoom_levels.z2);
+        if (z2 > 20) {
+            std::cerr << "ERROR: zoom levels must be in [0, 20]" << std::endl << std::endl; 
+            return -1;
+        }
+        polygon_t poly;
+        if (!polygon_file.empty()) {
+            try {
+                poly = load_polygon(polygon_file);
+            } catch (std::runtime_error& e) {
+                std::cerr << "ERROR: " << e.what() << std::endl << std::endl; 
+                return -1; 
+            }
+        }
+
         // Open the list file
         std::istream* in;
-        if (list_file == "-") {
+        if (!polygon_file.empty()) {
+            in = NULL;
+        } else if (list_file == "-") {
             in = &std::cin;
         } else {
             try {
@@ -298,8 +378,15 @@ int main(int ac, char** av) {
         std::cout 
             << "Now expiration begins:" << std::endl
             << "  Base path : " << base_path.string() << std::endl
-            << "  List file : " << (base == "-" ? "(stdin)" : list_file) << std::endl
         ;
+        if (polygon_file.empty()) {
+            std::cout << "  List file : " << (base == "-" ? "(stdin)" : list_file) << std::endl;
+        } else {
+            std::cout 
+                << "  Polygon   : " << polygon_file << " (" << poly.edges.size() << " edges)" << std::endl
+                << "  Zoom      : " << (boost::format("%1% - %2%") % z1 % z2) << std::endl
+            ;
+        }
         timer = new boost::timer::cpu_timer;
 
         // Awake renderer threads
@@ -309,11 +396,23 @@ int main(int ac, char** av) {
         }
 
         // Let it run!
+        if (!polygon_file.empty()) {
+            std::vector<tile_span_t> spans;
+            for (uint32_t z = z1; z <= z2; ++z) {
+                polygon_to_spans(poly, z, spans);
+                for (const tile_span_t& span : spans) {
+                    for (uint32_t x = span.x1; x <= span.x2; ++x) {
+                        uint64_t tile_id = pack(z, x, span.y);
+                        while (!queue.push(tile_id)) {}
+                    }
+                }
+            }
+        }
         try {
             std::string line;
             uint64_t lineno = 0;
             uint32_t z, x, y;
-            while (std::getline(*in, line)) {
+            while (in != NULL && std::getline(*in, line)) {
                 ++lineno;
                 std::vector<std::string> tokens;
                 boost::split(tokens, line, boost::is_from_range('/','/'));
@@ -334,7 +433,7 @@ int main(int ac, char** av) {
         done = true;
         consumer_threads.join_all();
 
-        if (in != &std::cin) {
+        if (in != &std::cin && in != NULL) {
             delete in;
         }     
 
@@ -1,18 +1,26 @@
 #ifndef PATH_MAPPER_H
 #define PATH_MAPPER_H
 
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
 enum TILE_SUFFIX {
-    PNG, JPG
+    PNG, JPG, WEBP,
+    PBF /* vector; only served from the disk (as is, or gzip'ed), never rendered */
 };
+#define TILE_NUM_SUFFIXES 3 /* the raster ones, i.e. what Mapnik renders */
 
 /*
-Map a 4-tuple (zoom, x, y, suffix) to the physical path for zoom/x/y.suffix.
+Map a 4-tuple (zoom, x, y, suffix) to the physical path for zoom/x/y.suffix
+(or a 5-tuple (zoom, x, y, scale, suffix) to the one for zoom/x/y@2x.suffix, by to_physical_path_scaled()).
 The mapping is a "DESIGN-DECISION OF NO RETURN", so let me present a verbose sketch:
 
 - The domain is:
     + zoom in [0 ...   20]
     + x, y in [0 ... 2^20 - 1]
-    + suffix in { PNG, JPG }
+    + suffix in { PNG, JPG, WEBP, PBF }
+    + scale in { 1, 2 }
     The "zoom level 20" means the scale of 1/500 where 1 pixel roughly covers 15cm square on the earth.
     It's the finest resolution which "standard" raster tile servers support.
   Violation to these will result in a "garbage" tile path that renders an unexpected place,
@@ -23,40 +31,45 @@ N.B.
 
 - The buffer "buf" for the result must:
     + be caller-alloc'ed, and
-    + guarantee 27-byte length at least (the rationale for this magic number is explained below.)
+    + guarantee TILE_PHYSPATH_BUFLEN (31-byte) length at least (the rationale for this magic number is explained below.)
 
 - The resultant path is of the form:
-    zz/nnn/nnn/nnn/nnn/nnn.(png|jpg)
+    zz/nnn/nnn/nnn/nnn/nnn(@2x)?.(png|jpg|webp|pbf)
       zz:  1 - 2 digits
       nnn: 1 - 3 digits,
         a combination of five such nnn's represents the 40-bit pair (x, y) divided into five 8-bits
-      So, the max len of a path sums-up to 26 bytes; adding the NUL terminator calls for a buffer of at least 27 bytes.
+      So, the max len of a path sums-up to 30 bytes (with "@2x" and "webp"); adding the NUL terminator calls for a buffer of at least 31 bytes.
+      HiDPI tiles thus live side by side with their 1x counterparts.
   The path is relative to "somewhere, defined by the caller" and no "leading slash" is included.
 
   N.B.
     + The path is SLASH-DELIMITED, meaning may NOT work on Windows as expected.
 */
-static inline void to_physical_path(char *buf, uint32_t zoom, uint32_t x, uint32_t y, enum TILE_SUFFIX suffix) {
-/*
-No such a param as "buflen"; malicious/vulnerable codes will anyway pass a wrong value.
-The only rule to follow instead is the magic 27-byte convention.
-*/
-    unsigned char i, hash[5];
+#define TILE_PHYSPATH_BUFLEN 31
 
-    /* Determine the suffix */
-    const char* suffix_str;
+static inline const char* tile_suffix_str(enum TILE_SUFFIX suffix) {
     switch (suffix) {
-    case PNG:
-        suffix_str = "png";
-        break;
     case JPG:
-        suffix_str = "jpg";
-        break;
+        return "jpg";
+    case WEBP:
+        return "webp";
+    case PBF:
+        return "pbf";
     default:
         /* failover */
-        suffix_str = "png";
-        break;
+        return "png";
     }
+}
+
+static inline void to_physical_path_scaled(char *buf, uint32_t zoom, uint32_t x, uint32_t y, uint32_t scale, enum TILE_SUFFIX suffix) {
+/*
+No such a param as "buflen"; malicious/vulnerable codes will anyway pass a wrong value.
+The only rule to follow instead is the magic TILE_PHYSPATH_BUFLEN convention.
+*/
+    unsigned char i, hash[5];
+
+    /* Determine the suffix */
+    const char* suffix_str = tile_suffix_str(suffix);
     /*
     Divide (x, y) into a 5-tuple of bytes.
     We follow mod_tile's "4bit-wise pairing" scheme:
@@ -73,14 +86,42 @@ The only rule to follow instead is the magic 27-byte convention.
     /* Assure "zoom" fits within 2 digits. Valid values (0-20) are not affected */
     zoom = zoom % 100;
 
-#define PHYSPATH_LEN 26
-    snprintf(buf, PHYSPATH_LEN, "%d/%u/%u/%u/%u/%u.%s", zoom, hash[4], hash[3], hash[2], hash[1], hash[0], suffix_str);    
-#undef  PHYSPATH_LEN
+    snprintf(buf, TILE_PHYSPATH_BUFLEN, "%d/%u/%u/%u/%u/%u%s.%s", zoom, hash[4], hash[3], hash[2], hash[1], hash[0], scale == 2 ? "@2x" : "", suffix_str);
 }
+
+static inline void to_physical_path(char *buf, uint32_t zoom, uint32_t x, uint32_t y, enum TILE_SUFFIX suffix) {
+    to_physical_path_scaled(buf, zoom, x, y, 1, suffix);
+}
+
+/*
+Copy a physical path to buf, replacing its scale & suffix; i.e. the path of another variant of the same tile.
+buf must have strlen(path) + 5 bytes at least ("@2x" and "webp" being 1 byte longer than the others.)
+*/
+static inline void tile_variant_path(char *buf, const char *path, uint32_t scale, enum TILE_SUFFIX suffix) {
+    const char *dot = strrchr(path, '.');
+    size_t len = dot != NULL ? (size_t)(dot - path) : strlen(path);
+    if (len >= 3 && memcmp(path + len - 3, "@2x", 3) == 0) {
+        len -= 3;
+    }
+    memcpy(buf, path, len);
+    sprintf(buf + len, "%s.%s", scale == 2 ? "@2x" : "", tile_suffix_str(suffix));
+}
+/*
+The max. zoom of the domain above
+*/
+#define TILE_MAX_ZOOM 20
+
 /*
 A quick trick for callers
 */
-#define ALLOCA_PATH_BUF(x) char x[27]
+#define ALLOCA_PATH_BUF(x) char x[TILE_PHYSPATH_BUFLEN]
+
+/*
+A tile is "stale" (i.e. soft-expired) iff its mtime is at or before 2000-01-01T00:00:00Z.
+This follows mod_tile, which marks dirty tiles by touching them back to the year 2000:
+a stale tile is still a valid substitute while its re-rendering is in progress.
+*/
+#define TILE_STALE_MTIME 946684800
 
 
 #endif
@@ -0,0 +1,333 @@
+#ifndef POLYGON_HPP
+#define POLYGON_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <cctype>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "proj.hpp"
+
+/*
+A region in a polygon, rather than a bbox, for the tools to enumerate the tiles it covers: e.g. a coastal prefecture
+covers a fraction of the tiles in its bbox, most of which are sea.
+
+A polygon is read from a file either in WKT (POLYGON/MULTIPOLYGON) or in GeoJSON (the "coordinates" of Polygon/
+MultiPolygon geometries, bare or in Features/FeatureCollections), in lon/lat. All the rings (outer ones & holes, of all
+the parts) are kept in the world coordinates (cf. lonlat_to_world_n()) & filled by the even-odd rule.
+Rings crossing the antimeridian are not supported, split them at +-180 instead.
+*/
+struct polygon_t {
+    struct edge_t {
+        double x1, y1, x2, y2;
+    };
+    std::vector<edge_t> edges;
+    // The bbox in the world coordinates
+    double left = 1.0, top = 1.0, right = 0.0, bottom = 0.0;
+};
+
+// A run of tiles [x1, x2] in the row y
+struct tile_span_t {
+    uint32_t y, x1, x2;
+};
+
+namespace polygon_detail {
+    typedef std::vector<double> ring_t; // lon, lat, lon, lat, ...
+
+    static inline void add_ring(polygon_t& poly, const ring_t& ring) {
+        // Mercator projection limits the lat value to this, cf. http://wiki.openstreetmap.org/wiki/Slippy_map_tilenames#X_and_Y
+        constexpr double LAT_LIMIT = 85.0511;
+        size_t n = ring.size() / 2;
+        if (n >= 2 && ring[0] == ring[2*n-2] && ring[1] == ring[2*n-1]) {
+            --n;    // closed explicitly
+        }
+        if (n < 3) {
+            throw std::runtime_error("a ring of a polygon must have 3 or more points");
+        }
+        std::vector<double> lon(n), lat(n), wx(n), wy(n);
+        for (size_t i = 0; i < n; ++i) {
+            lon[i] = std::max(-180.0, std::min(ring[2*i], 180.0));
+            lat[i] = std::max(-LAT_LIMIT, std::min(ring[2*i+1], LAT_LIMIT));
+        }
+        lonlat_to_world_n(lon.data(), lat.data(), n, wx.data(), wy.data());
+        for (size_t i = 0; i < n; ++i) {
+            size_t j = (i + 1) % n;
+            poly.edges.push_back(polygon_t::edge_t{ wx[i], wy[i], wx[j], wy[j] });
+            poly.left   = std::min(poly.left, wx[i]);
+            poly.right  = std::max(poly.right, wx[i]);
+            poly.top    = std::min(poly.top, wy[i]);
+            poly.bottom = std::max(poly.bottom, wy[i]);
+        }
+    }
+
+    static inline void skip_spaces(const char*& p) {
+        while (isspace((unsigned char)*p)) {
+            ++p;
+        }
+    }
+
+    static inline double parse_number(const char*& p) {
+        char* end;
+        double v = strtod(p, &end);
+        if (end == p) {
+            throw std::runtime_error(std::string("a number expected at: ") + std::string(p, strnlen(p, 32)));
+        }
+        p = end;
+        return v;
+    }
+
+    static inline void expect(const char*& p, char c) {
+        skip_spaces(p);
+        if (*p != c) {
+            throw std::runtime_error(std::string("'") + c + "' expected at: " + std::string(p, strnlen(p, 32)));
+        }
+        ++p;
+    }
+
+    /*
+    WKT: POLYGON ((x y, x y, ...), (...)) or MULTIPOLYGON (((x y, ...), ...), ((...)))
+    Rings are the innermost parenthesized lists of the coordinates.
+    */
+    static inline void parse_wkt(polygon_t& poly, const char* p) {
+        int depth = 0;
+        for (;;) {
+            skip_spaces(p);
+            if (*p == '\0') {
+                break;
+            } else if (*p == '(') {
+                ++p;
+                ++depth;
+                skip_spaces(p);
+                if (*p != '(') {
+                    ring_t ring;
+                    for (;;) {
+                        ring.push_back(parse_number(p));
+                        skip_spaces(p);
+                        ring.push_back(parse_number(p));
+                        skip_spaces(p);
+                        // Z/M values, if any, are ignored
+                        while (*p != ',' && *p != ')' && *p != '\0') {
+                            parse_number(p);
+                            skip_spaces(p);
+                        }
+                        if (*p != ',') {
+                            break;
+                        }
+                        ++p;
+                        skip_spaces(p);
+                    }
+                    expect(p, ')');
+                    --depth;
+                    add_ring(poly, ring);
+                }
+            } else if (*p == ')') {
+                ++p;
+                --depth;
+            } else {
+                ++p; // keywords, separators
+            }
+        }
+        if (depth != 0) {
+            throw std::runtime_error("unbalanced parentheses in WKT");
+        }
+    }
+
+    // Parses a nested array of numbers; returns its depth, with the arrays of positions appended to rings
+    static inline int parse_json_array(const char*& p, std::vector<ring_t>& rings) {
+        expect(p, '[');
+        skip_spaces(p);
+        if (*p != '[') {
+            // a position: [lon, lat(, alt)]
+            ring_t pos;
+            while (*p != ']') {
+                pos.push_back(parse_number(p));
+                skip_spaces(p);
+                if (*p == ',') {
+                    ++p;
+                    skip_spaces(p);
+                }
+            }
+            ++p;
+            if (pos.size() < 2) {
+                throw std::runtime_error("a position must have lon & lat");
+            }
+            rings.push_back(ring_t{ pos[0], pos[1] });
+            return 1;
+        }
+        size_t first = rings.size();
+        int depth = 0;
+        for (;;) {
+            depth = parse_json_array(p, rings) + 1;
+            skip_spaces(p);
+            if (*p != ',') {
+                break;
+            }
+            ++p;
+            skip_spaces(p);
+        }
+        expect(p, ']');
+        if (depth == 2) {
+            // The array of positions, i.e. a ring
+            ring_t ring;
+            for (size_t i = first; i != rings.size(); ++i) {
+                ring.insert(ring.end(), rings[i].begin(), rings[i].end());
+            }
+            rings.resize(first);
+            rings.push_back(ring);
+        }
+        return depth;
+    }
+
+    // GeoJSON: every "coordinates": [[[lon, lat], ...], ...] (Polygon) or [[[[lon, lat], ...], ...], ...] (MultiPolygon)
+    static inline void parse_geojson(polygon_t& poly, const char* p) {
+        static const char KEY[] = "\"coordinates\"";
+        while ((p = strstr(p, KEY)) != NULL) {
+            p += sizeof(KEY) - 1;
+            expect(p, ':');
+            std::vector<ring_t> rings;
+            int depth = parse_json_array(p, rings);
+            if (depth < 3) {
+                throw std::runtime_error("coordinates of a Polygon or a MultiPolygon expected in GeoJSON");
+            }
+            for (auto& ring : rings) {
+                add_ring(poly, ring);
+            }
+        }
+    }
+
+    // Does the segment intersect the box [l, r] x [t, b] (with t < b)?
+    static inline bool intersects(const polygon_t::edge_t& e, double l, double t, double r, double b) {
+        if (std::max(e.x1, e.x2) < l || std::min(e.x1, e.x2) > r || std::max(e.y1, e.y2) < t || std::min(e.y1, e.y2) > b) {
+            return false;
+        }
+        // ... and the corners are not all on one side of the line
+        const double dx = e.x2 - e.x1, dy = e.y2 - e.y1;
+        const double c1 = dx*(t-e.y1) - dy*(l-e.x1), c2 = dx*(t-e.y1) - dy*(r-e.x1),
+                     c3 = dx*(b-e.y1) - dy*(l-e.x1), c4 = dx*(b-e.y1) - dy*(r-e.x1);
+        return !((c1 > 0 && c2 > 0 && c3 > 0 && c4 > 0) || (c1 < 0 && c2 < 0 && c3 < 0 && c4 < 0));
+    }
+
+    static inline bool side(double ax, double ay, double bx, double by, double px, double py) {
+        // Zeros count as positive, for the vertices exactly on the line to be counted once.
+        return (bx-ax)*(py-ay) - (by-ay)*(px-ax) >= 0;
+    }
+
+    // Does the segment p-q cross the edge? (by the half-open rule, cf. side())
+    static inline bool crosses(const polygon_t::edge_t& e, double px, double py, double qx, double qy) {
+        return side(px, py, qx, qy, e.x1, e.y1) != side(px, py, qx, qy, e.x2, e.y2) &&
+               side(e.x1, e.y1, e.x2, e.y2, px, py) != side(e.x1, e.y1, e.x2, e.y2, qx, qy);
+    }
+
+    struct node_t {
+        uint32_t z, x, y;
+        bool inside;                // whether the center is inside the polygon
+        std::vector<uint32_t> edges; // the edges intersecting the tile
+    };
+
+    static inline void descend(const polygon_t& poly, const node_t& node, uint32_t zoom, std::vector<tile_span_t>& spans) {
+        const double size = 1.0 / (1U << (node.z + 1));
+        const double cx = (node.x*2 + 1) * size, cy = (node.y*2 + 1) * size;
+        for (uint32_t i = 0; i < 4; ++i) {
+            node_t child;
+            child.z = node.z + 1;
+            child.x = node.x*2 + (i & 1);
+            child.y = node.y*2 + (i >> 1);
+            const double l = child.x * size, t = child.y * size, r = l + size, b = t + size;
+            const double ccx = l + size/2, ccy = t + size/2;
+            // The parity of the child's center is the parent's flipped by each edge in between; such edges intersect the parent.
+            child.inside = node.inside;
+            for (uint32_t e : node.edges) {
+                const polygon_t::edge_t& edge = poly.edges[e];
+                if (crosses(edge, cx, cy, ccx, ccy)) {
+                    child.inside = !child.inside;
+                }
+                if (intersects(edge, l, t, r, b)) {
+                    child.edges.push_back(e);
+                }
+            }
+            if (child.edges.empty()) {
+                // Entirely in or out: the rows of its descendants at the zoom are filled, or none.
+                if (child.inside) {
+                    const uint32_t shift = zoom - child.z;
+                    for (uint32_t y = child.y << shift; y != (child.y + 1) << shift; ++y) {
+                        spans.push_back(tile_span_t{ y, child.x << shift, ((child.x + 1) << shift) - 1 });
+                    }
+                }
+            } else if (child.z == zoom) {
+                spans.push_back(tile_span_t{ child.y, child.x, child.x });
+            } else {
+                descend(poly, child, zoom, spans);
+            }
+        }
+    }
+}
+
+static inline polygon_t load_polygon(const std::string& path) {
+    std::ifstream ifs(path);
+    if (!ifs) {
+        throw std::runtime_error("failed to open the polygon file " + path);
+    }
+    std::string text((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    polygon_t poly;
+    size_t head = text.find_first_not_of(" \t\r\n");
+    if (head != std::string::npos && (text[head] == '{' || text[head] == '[')) {
+        polygon_detail::parse_geojson(poly, text.c_str() + head);
+    } else {
+        polygon_detail::parse_wkt(poly, text.c_str());
+    }
+    if (poly.edges.empty()) {
+        throw std::runtime_error("no polygon found in " + path);
+    }
+    return poly;
+}
+
+/*
+Enumerates the tiles at the zoom covered by (i.e. intersecting) the polygon, as spans sorted by y then x.
+A quadtree descends from the planet (zoom 0), carrying down the edges intersecting each tile, and whether its center
+is inside, which a child derives from its parent's by the edges in between. A tile intersecting no edges is entirely
+inside or outside, thus its rows at the zoom are filled at once, or dropped with no further descent. Hence the work
+is proportional to the tiles along the boundary, plus the rows of the area, rather than to the tiles in the bbox.
+*/
+static inline void polygon_to_spans(const polygon_t& poly, uint32_t zoom, std::vector<tile_span_t>& spans) {
+    spans.clear();
+    polygon_detail::node_t root;
+    root.z = root.x = root.y = 0;
+    // Cast a ray from the center of the planet to its right (outside the world) to see if the center is inside.
+    root.inside = false;
+    for (uint32_t e = 0; e != poly.edges.size(); ++e) {
+        if (polygon_detail::crosses(poly.edges[e], 0.5, 0.5, 2.0, 0.5)) {
+            root.inside = !root.inside;
+        }
+        if (polygon_detail::intersects(poly.edges[e], 0.0, 0.0, 1.0, 1.0)) {
+            root.edges.push_back(e);
+        }
+    }
+    if (zoom == 0) {
+        if (!root.edges.empty() || root.inside) {
+            spans.push_back(tile_span_t{ 0, 0, 0 });
+        }
+        return;
+    }
+    polygon_detail::descend(poly, root, zoom, spans);
+
+    // Scanline order, with the adjacent spans merged
+    std::sort(spans.begin(), spans.end(), [](const tile_span_t& a, const tile_span_t& b) {
+        return a.y != b.y ? a.y < b.y : a.x1 < b.x1;
+    });
+    size_t n = 0;
+    for (size_t i = 0; i != spans.size(); ++i) {
+        if (n != 0 && spans[n-1].y == spans[i].y && spans[n-1].x2 + 1 >= spans[i].x1) {
+            spans[n-1].x2 = std::max(spans[n-1].x2, spans[i].x2);
+        } else {
+            spans[n++] = spans[i];
+        }
+    }
+    spans.resize(n);
+}
+
+#endif
@@ -1,7 +1,9 @@
 #ifndef PROJ_HPP
 #define PROJ_HPP
 
+#include <cstddef>
 #include <cstdint>
+#include <cmath>
 
 constexpr int TILE_SIZE = 256;
 
@@ -53,6 +55,17 @@ static inline void tile_to_merc_box(uint32_t zoom, uint32_t x, uint32_t y, doubl
     bot   = -(TILE_SIZE*(y+1)*res - ORIGIN_SHIFT);
 }
 
+/*
+The inverse of the above, i.e. proj_lonlat(mx, my) in the sketch.
+*/
+static inline void merc_to_lonlat(double mx, double my, double& lon, double& lat) {
+    constexpr double ORIGIN_SHIFT = 2*M_PI * 6378137/2.0;
+
+    lon = (mx / ORIGIN_SHIFT) * 180.0;
+    lat = (my / ORIGIN_SHIFT) * 180.0;
+    lat = 180.0 / M_PI * (2.0 * atan(exp(lat * M_PI / 180.0)) - M_PI / 2.0);
+}
+
 /*
 Direct conversion from lon/lat with a zoom level z to its logical tile path z/x/y.png: 
     http://wiki.openstreetmap.org/wiki/Slippy_map_tilenames#Lon..2Flat._to_tile_numbers_4
@@ -83,6 +96,25 @@ static inline void lonlat_to_tile(double lon_x, double lat_y, uint32_t zoom, uin
     const double v = 1.0 - (log_tan_sec / M_PI);
     ty = (uint32_t)( floor(v/2.0 * res) );
 }
+
+/*
+A batched version of the above, to project n coordinates (e.g. the vertices of a polygon) at once.
+
+lonlat_to_world_n() maps lon/lat to the "world" coordinates in [0, 1], i.e. the tile coordinates at zoom 0 (without
+truncation): those at zoom z are just 2^z times them, so a polygon is projected once for all zoom levels.
+Since log(tan(lat) + sec(lat)) == log((1 + sin(lat)) / (1 - sin(lat))) / 2, the loop takes a sin & a log per vertex,
+and has neither branches nor aliasing. As built (w/o -ffast-math, which the vector sin/log of glibc's libmvec need), it
+runs as a scalar loop; what it saves is the cos & the tan of the per-tile version above, and the re-projection per zoom.
+*/
+static inline void lonlat_to_world_n(const double* __restrict lon_x, const double* __restrict lat_y, size_t n,
+                                     double* __restrict wx, double* __restrict wy) {
+#pragma GCC ivdep
+    for (size_t i = 0; i < n; ++i) {
+        const double s = sin(deg2rad(lat_y[i]));
+        wx[i] = (lon_x[i]+180.0) / 360.0;
+        wy[i] = 0.5 - log((1.0 + s) / (1.0 - s)) / (4.0*M_PI);
+    }
+}
 #undef deg2rad
 
 #endif
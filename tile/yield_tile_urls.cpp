@@ -21,6 +21,7 @@
 #include <boost/regex.hpp>
 #include <boost/algorithm/string.hpp>
 #include "proj.hpp"
+#include "polygon.hpp"
 #include "path-mapper.h"
 
 #include "git-revision.h"
@@ -98,7 +99,7 @@ namespace argv {
 
 
 /*
-yield-tile-urls -p base-url [-z z1-z2] [-b x1,y1,x2,y2]
+yield-tile-urls -p base-url [-z z1-z2] [-b x1,y1,x2,y2 | -g polygon-file]
 generates URLs for tiles bounded by the box (x1, y1)-(x2, y2) for zoom levels in [z1, z2], prefixed by base-url.
 Options:
     -p,--prefix base-url: a URL (or, can be a local path), to which paths for tiles are appended
@@ -108,6 +109,9 @@ Options:
     -b,--bbox x1,y1,x2,y2: (x1, y1) and (x2, y2) are two pairs of lon/lat
         + the pairs define the bounding box of URLs
         + defaults to (-180, 90)-(180, -90), i.e. the entire planet
+    -g,--polygon polygon-file: a polygon (or multipolygon) in WKT or GeoJSON, in lon/lat
+        + only the tiles covering the polygon are generated, rather than all in the bbox
+        + overrides -b
     -s,--suffix (png|jpg|...)
         + suffix of the URLs
     -v,--version
@@ -120,13 +124,14 @@ int main(int ac, char** av) {
         std::string suffix;
         argv::zoom::pair_t zoom_levels;
         argv::bbox::box_t  bbox;
+        std::string polygon_file;
         bool emit_physical = false; // If true, print in the physical form: /base/z/nnn/nnn/nnn/nnn/nnn.png
 
         /** Define and parse the program options 
         */ 
         namespace po = boost::program_options; 
         po::options_description desc(
-            "yield-tile-urls -p base-url [-z z1-z2] [-b x1,y1,x2,y2]\n"
+            "yield-tile-urls -p base-url [-z z1-z2] [-b x1,y1,x2,y2 | -g polygon-file]\n"
             "generates URLs for tiles bounded by the box (x1, y1)-(x2, y2) for zoom levels in [z1, z2], prefixed by base-url.\n\n"
             "Options"
         ); 
@@ -145,6 +150,10 @@ int main(int ac, char** av) {
                 po::value<argv::bbox::box_t>(&bbox)->value_name("x1,y1,x2,y2")->default_value(argv::bbox::box_t{-180, 90, 180, -90}, "-180,90,180,-90"), 
                 "Specifies the bounding box of URLs in lon/lat\n"
                 "  + defaults to (-180,90)-(180,-90), i.e. the entire planet.") 
+            ("polygon,g", 
+                po::value<std::string>(&polygon_file)->value_name("polygon-file"), 
+                "Specifies a polygon in WKT or GeoJSON (in lon/lat) to generate URLs of the tiles covering it\n"
+                "  + overrides --bbox") 
         ;   // add_options();
         if (ac <= 1) {
             // No options are given.
@@ -236,10 +245,33 @@ int main(int ac, char** av) {
         if (prefix[base.length()-1] == '/') {
             prefix[base.length()-1] = '\0';
         }
+        // Tiles to emit at each zoom, as spans in rows
+        polygon_t poly;
+        if (!polygon_file.empty()) {
+            try {
+                poly = load_polygon(polygon_file);
+            } catch (std::runtime_error& e) {
+                std::cerr << "ERROR: " << e.what() << std::endl << std::endl; 
+                return -1; 
+            }
+        }
+        std::vector<tile_span_t> spans;
+        auto spans_at = [&](uint32_t z) {
+            if (!polygon_file.empty()) {
+                polygon_to_spans(poly, z, spans);
+                return;
+            }
+            uint32_t tx_left, ty_top, tx_right, ty_bottom;
+            lonlat_to_tile(x1, y1, z, tx_left, ty_top);
+            lonlat_to_tile(x2, y2, z, tx_right, ty_bottom);
+            spans.clear();
+            for (uint32_t y = ty_top; y <= ty_bottom; ++y) {
+                spans.push_back(tile_span_t{ y, tx_left, tx_right });
+            }
+        };
         // Emit!
-        uint32_t tx_left, ty_top, tx_right, ty_bottom;
         if (emit_physical) {
-            char* tile_path = (char*)alloca(base.length() + 28);
+            char* tile_path = (char*)alloca(base.length() + TILE_PHYSPATH_BUFLEN);
             strcpy(tile_path, prefix);
             char* tp_head = tile_path + strlen(prefix);
             *tp_head = '/'; 
@@ -248,22 +280,20 @@ int main(int ac, char** av) {
             TILE_SUFFIX ts = (suffix == "png") ? PNG : JPG;
 
             for (uint32_t z = (uint32_t)z1; z <= (uint32_t)z2; ++z) {
-                lonlat_to_tile(x1, y1, z, tx_left, ty_top);
-                lonlat_to_tile(x2, y2, z, tx_right, ty_bottom);
-                for (uint32_t y = ty_top; y <= ty_bottom; ++y) {
-                    for (uint32_t x = tx_left; x <= tx_right; ++x) {
-                        to_physical_path(tp_head, z, x, y, ts);
+                spans_at(z);
+                for (const tile_span_t& span : spans) {
+                    for (uint32_t x = span.x1; x <= span.x2; ++x) {
+                        to_physical_path(tp_head, z, x, span.y, ts);
                         puts(tile_path);
                     }
                 }
             }
         } else {
             for (uint32_t z = (uint32_t)z1; z <= (uint32_t)z2; ++z) {
-                lonlat_to_tile(x1, y1, z, tx_left, ty_top);
-                lonlat_to_tile(x2, y2, z, tx_right, ty_bottom);
-                for (uint32_t y = ty_top; y <= ty_bottom; ++y) {
-                    for (uint32_t x = tx_left; x <= tx_right; ++x) {
-                        printf("%s/%d/%d/%d.%s\n", prefix, z, x, y, suffix.c_str());
+                spans_at(z);
+                for (const tile_span_t& span : spans) {
+                    for (uint32_t x = span.x1; x <= span.x2; ++x) {
+                        printf("%s/%d/%d/%d.%s\n", prefix, z, x, span.y, suffix.c_str());
                     }
                 }
             }
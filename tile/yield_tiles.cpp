@@ -26,6 +26,7 @@
 #include <dirent.h>
 #include <syslog.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
 
 #include <cstdio>
 #include <cstdlib>
@@ -37,6 +38,7 @@
 #include <exception>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <tuple>
 #include <boost/foreach.hpp>
 #include <boost/filesystem.hpp>
@@ -49,7 +51,10 @@
 #include <boost/atomic.hpp>
 #include <boost/timer/timer.hpp>
 #include "proj.hpp"
+#include "polygon.hpp"
 #include "path-mapper.h"
+#include "tile/tile-etag.h"
+#include "tile/tile-png.h"
 
 #include "git-revision.h"
 #define VERSION "0.0.0"
@@ -62,6 +67,17 @@
 # define unlikely(x) (x)
 #endif
 
+// Writes a tile along with its content-hash ETag, just as h2o-tile does, so that both agree on the validator.
+void save_with_etag(const char* buf, size_t len, const char* tile_path) {
+    std::ofstream ofs(tile_path, std::ios::out | std::ios::binary | std::ios::trunc);
+    ofs.write(buf, len);
+    ofs.close();
+    char etag[TILE_ETAG_LEN + 1];
+    tile_etag(etag, buf, len);
+    // Filesystems w/o xattrs just fall back to the mtime-based ETags
+    setxattr(tile_path, TILE_ETAG_XATTR, etag, strlen(etag), 0);
+}
+
 #define CANVAS_SCALE 8
 #define RENDER_SIZE (TILE_SIZE*(CANVAS_SCALE+1))
 
@@ -108,19 +124,25 @@ boost::atomic<uint64_t> skipped(0);     // # of tiles skipped.
 uint64_t total_tiles;   // # of tiles to render, set in main() and invariant during the execution
 bool skip_existing;     // If true, avoid overwriting existing tiles; set in main() and invariant.
 boost::timer::cpu_timer* timer;
+int png_level = TILE_PNG_DEFAULT_LEVEL;   // zlib's level to deflate the tiles with, set in main() and invariant.
 
 void renderer(const boost::filesystem::path& xml, const boost::filesystem::path& base_path) {
     using namespace mapnik;
 
     // Render CANVAS_SCALE^2 = 64 tiles
     Map m(CANVAS_SCALE*TILE_SIZE, CANVAS_SCALE*TILE_SIZE);
+    // ... and encode them with one palette, of the colors of the whole canvas
+    std::unique_ptr<tile_png_encoder_t, void(*)(tile_png_encoder_t*)> png(tile_png_encoder_create(), tile_png_encoder_destroy);
+    if (!png) {
+        throw std::bad_alloc();
+    }
     mapnik::load_map(m, xml.string());
 
     const std::string& base_as_string = base_path.string();
     size_t base_len  = base_as_string.length();
 
     // tile_path holds the full path base_path/nnn/.../nnn.png to render
-    char* tile_path = (char*)alloca(base_len + 28);
+    char* tile_path = (char*)alloca(base_len + TILE_PHYSPATH_BUFLEN);
     strncpy(tile_path, base_as_string.c_str(), base_len);
 
     // tp_head points to the end of base_path in tile_path
@@ -144,12 +166,25 @@ void renderer(const boost::filesystem::path& xml, const boost::filesystem::path&
 }
 
 #if MAPNIK_MAJOR_VERSION >= 3
- #define VIEW(vw, image) image_view_rgba8 vw(x1*TILE_SIZE, y1*TILE_SIZE, TILE_SIZE, TILE_SIZE, image); 
- #define SAVE(vw, to) { save_to_file(image_view_any(vw), to, "png256:e=miniz"); }
+ #define PIXELS(image, x, y) (&(image)(x, y))
 #else
- #define VIEW(vw, image) image_view<mapnik::image_data_32> vw(x1*TILE_SIZE, y1*TILE_SIZE, TILE_SIZE, TILE_SIZE, image.data()); 
- #define SAVE(vw, to) { save_to_file(vw, to, "png256"); }
+ #define PIXELS(image, x, y) (&(image).data()(x, y))
 #endif
+#define COLLECT(image) { \
+    tile_png_reset(png.get()); \
+    if (tile_png_add(png.get(), PIXELS(image, 0, 0), x2*TILE_SIZE, y2*TILE_SIZE, image.width()) != 0) { \
+        throw std::bad_alloc(); \
+    } \
+}
+#define SAVE(image, to) { \
+    char* buf; \
+    size_t len; \
+    if (tile_png_encode(png.get(), PIXELS(image, x1*TILE_SIZE, y1*TILE_SIZE), TILE_SIZE, TILE_SIZE, image.width(), png_level, &buf, &len) != 0) { \
+        throw std::bad_alloc(); \
+    } \
+    save_with_etag(buf, len, to); \
+    free(buf); \
+}
 
 #define EXISTS(p) boost::filesystem::exists(p)
 #define DO_RENDER(tile_id) { \
@@ -191,6 +226,7 @@ void renderer(const boost::filesystem::path& xml, const boost::filesystem::path&
     m.zoom_to_box(bbox); \
     agg_renderer<image_32> ren(m,image); \
     ren.apply(); \
+    COLLECT(image); \
     /* Each 8x8 tiles are stored as individual files */ \
     for (int x1=0; x1<x2; ++x1) { \
         for (int y1=0; y1<y2; ++y1) { \
@@ -199,9 +235,7 @@ void renderer(const boost::filesystem::path& xml, const boost::filesystem::path&
             if ( likely(!(skip_existing && EXISTS(boost_tile_path))) )  { \
                 mkdir_p(boost_tile_path.parent_path()); \
                                                         \
-                /* Clip the center 256x256 into vw */ \
-                VIEW(vw, image) \
-                SAVE(vw, tile_path); \
+                SAVE(image, tile_path); \
             } else { \
                 ++skipped; \
             } \
@@ -306,13 +340,18 @@ static void load_fonts(const char *font_dir) {
     while ((entry = readdir(fonts))) {
         struct stat b;
         char *p;
+        bool is_dir = entry->d_type == DT_DIR;
 
         if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
             continue;
         snprintf(path, sizeof(path), "%s/%s", font_dir, entry->d_name);
-        if (stat(path, &b))
-            continue;
-        if (S_ISDIR(b.st_mode)) {
+        /* stat(2) only if the filesystem doesn't tell the type, or to follow a symlink */
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            if (stat(path, &b))
+                continue;
+            is_dir = S_ISDIR(b.st_mode);
+        }
+        if (is_dir) {
             load_fonts(path);
             continue;
         }
@@ -327,7 +366,7 @@ static void load_fonts(const char *font_dir) {
 
 
 /*
-yield-tiles -c render-def.xml -p base-path [-z z1-z2] [-b x1,y1,x2,y2] [-t num-threads] [-s]
+yield-tiles -c render-def.xml -p base-path [-z z1-z2] [-b x1,y1,x2,y2 | -g polygon-file] [-t num-threads] [-s] [-l level]
 generates tiles bounded by the box (x1, y1)-(x2, y2) for zoom levels in [z1, z2] into base-path.
 Options:
     -c,--config render-def.xml: a mapnik conf. file, typically of openstreetmap-carto or alike. REQUIRED
@@ -339,12 +378,18 @@ Options:
     -b,--bbox x1,y1,x2,y2: (x1, y1) and (x2, y2) are two pairs of lon/lat
         + the pairs define the bounding box of rendering
         + defaults to (-180, 90)-(180, -90), i.e. the entire planet
+    -g,--polygon polygon-file: a polygon (or multipolygon) in WKT or GeoJSON, in lon/lat
+        + only the metatiles covering the polygon are rendered, rather than all in the bbox
+        + overrides -b
     -t,--threads n: the number of threads to render
         + defaults to boost::thread::hardware_concurrency()
     -s,--skip-existing yes|no: 
         + if yes, existing tiles are not re-rendered; 
         + if no, every tile within the specified region (by -z and -b) is unconditionally overwritten
         + defaults to "no"
+    -l,--png-level level: zlib's compression level (1-9) of the tiles
+        + the tiles of a metatile are encoded with one palette, of the colors of all of them
+        + defaults to 6
     -d,--dry-run
         + only estimates the number of tiles, avoid actual rendering
     -v,--version
@@ -358,13 +403,14 @@ int main(int ac, char** av) {
         std::string font_paths;
         argv::zoom::pair_t zoom_levels;
         argv::bbox::box_t  bbox;
+        std::string polygon_file;
         unsigned int nthreads;
         bool dry_run = false;
         /** Define and parse the program options 
         */ 
         namespace po = boost::program_options; 
         po::options_description desc(
-            "yield-tiles -c render-def.xml -p base-path [-z z1-z2] [-b x1,y1,x2,y2] [-t num-threads] [-s]\n"
+            "yield-tiles -c render-def.xml -p base-path [-z z1-z2] [-b x1,y1,x2,y2 | -g polygon-file] [-t num-threads] [-s] [-l level]\n"
             "generates tiles bounded by the box (x1, y1)-(x2, y2) for zoom levels in [z1, z2] into base-path.\n\n"
             "Options"
         ); 
@@ -384,12 +430,20 @@ int main(int ac, char** av) {
                 po::value<argv::bbox::box_t>(&bbox)->value_name("x1,y1,x2,y2")->default_value(argv::bbox::box_t{-180, 90, 180, -90}, "-180,90,180,-90"), 
                 "Specifies the bounding box of rendering in lon/lat\n"
                 "  + defaults to (-180,90)-(180,-90), i.e. the entire planet.") 
+            ("polygon,g", 
+                po::value<std::string>(&polygon_file)->value_name("polygon-file"), 
+                "Specifies a polygon in WKT or GeoJSON (in lon/lat) to render the tiles covering it\n"
+                "  + overrides --bbox") 
             ("threads,t", 
                 po::value<unsigned int>(&nthreads)->value_name("n")->default_value(boost::thread::hardware_concurrency()), 
                 "Specifies the number of threas to render\n"
                 "  + defaults to boost::thread::hardware_concurrency()") 
             ("skip-existing,s", 
                 "Avoids re-rendering existing tiles") 
+            ("png-level,l", 
+                po::value<int>(&png_level)->value_name("level")->default_value(TILE_PNG_DEFAULT_LEVEL), 
+                "Specifies zlib's compression level (1-9) of the tiles\n"
+                "  + defaults to 6") 
             ("dry-run,d", 
                 "Only estimates the number of tiles, does not actually render\n") 
         ;   // add_options();
@@ -436,6 +490,10 @@ int main(int ac, char** av) {
             std::cerr << "ERROR: " << e.what() << std::endl << std::endl; 
             return -1; 
         }
+        if (png_level < 1 || png_level > 9) {
+            std::cerr << "Error: --png-level must be within 1-9." << std::endl;
+            return -1;
+        }
 
         // Ensure -c XX.xml is a regular file
         const boost::filesystem::path xml(config);
@@ -495,13 +553,26 @@ int main(int ac, char** av) {
         if (y1 < y2) {
             std::swap(y1, y2);
         }
+        polygon_t poly;
+        if (!polygon_file.empty()) {
+            try {
+                poly = load_polygon(polygon_file);
+            } catch (std::runtime_error& e) {
+                std::cerr << "ERROR: " << e.what() << std::endl << std::endl; 
+                return -1; 
+            }
+        }
         std::cout 
             << "Now rendering begins:" << std::endl
             << "  Base path   : " << base_path.string() << std::endl
             << "  Mapnik conf.: " << xml.string() << std::endl
             << "  Zoom levels : " << (boost::format("%1% - %2%") % z1 % z2) << std::endl
-            << "  Bounding box: " << (boost::format("(%1%,%2%)-(%3%,%4%)") % x1 % y1 % x2 % y2) << std::endl
         ;
+        if (polygon_file.empty()) {
+            std::cout << "  Bounding box: " << (boost::format("(%1%,%2%)-(%3%,%4%)") % x1 % y1 % x2 % y2) << std::endl;
+        } else {
+            std::cout << "  Polygon     : " << polygon_file << " (" << poly.edges.size() << " edges)" << std::endl;
+        }
         // Tweak lat/lon values so that they fit in their "actual" range.
         // To be strict, the range of lon. values is [-180, 180), so exact 180.0 should be "shifted just a little"
         x1 = std::min(x1, 180.0 - 0.0000001);
@@ -510,6 +581,34 @@ int main(int ac, char** av) {
         y1 = std::max(-LAT_LIMIT, std::min(y1, LAT_LIMIT));
         y2 = std::max(-LAT_LIMIT, std::min(y2, LAT_LIMIT));
 
+        // The top-left tiles of the metatiles to render at each zoom, i.e. every CANVAS_SCALE-th tile in the bbox,
+        // or the CANVAS_SCALE-aligned ones covering the polygon.
+        std::vector<tile_span_t> spans;
+        std::vector<triplet> metatiles;
+        auto metatiles_at = [&](uint32_t z) {
+            metatiles.clear();
+            if (polygon_file.empty()) {
+                uint32_t tx_left, ty_top, tx_right, ty_bottom;
+                lonlat_to_tile(x1, y1, z, tx_left, ty_top);
+                lonlat_to_tile(x2, y2, z, tx_right, ty_bottom);
+                for (uint32_t y = ty_top; y <= ty_bottom; y+=CANVAS_SCALE) {
+                    for (uint32_t x = tx_left; x <= tx_right; x+=CANVAS_SCALE) {
+                        metatiles.push_back(pack(z, x, y));
+                    }
+                }
+                return;
+            }
+            polygon_to_spans(poly, z, spans);
+            for (const tile_span_t& span : spans) {
+                for (uint32_t mx = span.x1 / CANVAS_SCALE; mx <= span.x2 / CANVAS_SCALE; ++mx) {
+                    metatiles.push_back(pack(z, mx * CANVAS_SCALE, span.y / CANVAS_SCALE * CANVAS_SCALE));
+                }
+            }
+            // The rows in a metatile yield it over again
+            std::sort(metatiles.begin(), metatiles.end());
+            metatiles.erase(std::unique(metatiles.begin(), metatiles.end()), metatiles.end());
+        };
+
         timer = new boost::timer::cpu_timer;
         // Count # of tiles to render
         std::cout 
@@ -517,17 +616,10 @@ int main(int ac, char** av) {
         ;
 
         for (uint32_t z = (uint32_t)z1; z <= (uint32_t)z2; ++z) {
-            uint32_t tx_left, ty_top, tx_right, ty_bottom;
-            lonlat_to_tile(x1, y1, z, tx_left, ty_top);
-            lonlat_to_tile(x2, y2, z, tx_right, ty_bottom);
-            uint64_t tiles = 0;
-            for (uint32_t y = ty_top; y <= ty_bottom; y+=CANVAS_SCALE) {
-                for (uint32_t x = tx_left; x <= tx_right; x+=CANVAS_SCALE) {
-                    uint32_t render_size_tx = std::min(CANVAS_SCALE, (1 << z)); \
-                    uint32_t render_size_ty = std::min(CANVAS_SCALE, (1 << z)); \
-                    tiles += render_size_tx*render_size_ty;
-                }
-            }
+            metatiles_at(z);
+            uint32_t render_size_tx = std::min(CANVAS_SCALE, (1 << z));
+            uint32_t render_size_ty = std::min(CANVAS_SCALE, (1 << z));
+            uint64_t tiles = metatiles.size() * render_size_tx*render_size_ty;
             std::cout 
                 << "    Zoom " << (boost::format("%|2|") % z) << ": " << tiles << std::endl;
 
@@ -570,15 +662,10 @@ int main(int ac, char** av) {
 
         // Emit!
         for (uint32_t z = (uint32_t)z1; z <= (uint32_t)z2; ++z) {
-            uint32_t tx_left, ty_top, tx_right, ty_bottom;
-            lonlat_to_tile(x1, y1, z, tx_left, ty_top);
-            lonlat_to_tile(x2, y2, z, tx_right, ty_bottom);
             // To boost rendering, each queue element requests CANVAS_SCALE^2 = 8*8 = 64 tiles at once.
-            for (uint32_t y = ty_top; y <= ty_bottom; y+=CANVAS_SCALE) {
-                for (uint32_t x = tx_left; x <= tx_right; x+=CANVAS_SCALE) {
-                    uint64_t tile_id = pack(z, x, y);
-                    while (!queue.push(tile_id)) {}
-                }
+            metatiles_at(z);
+            for (triplet tile_id : metatiles) {
+                while (!queue.push(tile_id)) {}
             }
         }
         done = true;